@@ -5,10 +5,14 @@
 #include <string.h>
 #include <stdint.h>
 #include "trie.h"
+#include "trie_int.h"
+#include "trie_compact.h"
 
 // NOTE: Terminology:
 //
-//   A key is a C string, terminated with a 0-byte.
+//   A key is a C string, terminated with a 0-byte, or (for the _n functions) any
+//   non-empty run of bytes given with its length. Inside, every descent works on
+//   a key and its length, so nothing below the entry points looks for a 0-byte.
 //   You should make no assumptions about the valid characters for the string
 //   or should not try to determine that a key is a valid English word.
 //
@@ -22,37 +26,414 @@
 //
 //    (these are all distinct keys)
 
-// The structure representing the trie
-struct trie_data_t {
-    trie_pos_t start;
+#define TRIE_ARENA_MIN_NODES 1024
+#define TRIE_ARENA_MIN_BYTES 4096
+#define TRIE_BURST_DEFAULT 64     // suffixes a bucket of trie_new_burst holds by default
+#define TRIE_BURST_MAX 65536
+
+// A slab of nodes carved out for an arena-backed trie
+struct trie_slab_t {
+    struct trie_slab_t *next;
+    size_t used;
+    size_t cap;
+    struct trie_node_t nodes[];
 };
 
-// A structure representing a trie node
-struct trie_node_t {
-    char key;
-    void *val;
-    char *fullkey;
-    trie_pos_t left;
-    trie_pos_t right;
-    trie_pos_t mid;
-    trie_pos_t parent;
+// A slab of key bytes (trie_kept_t records) for an arena-backed trie
+struct trie_bytes_t {
+    struct trie_bytes_t *next;
+    size_t used;
+    size_t cap;
+    char data[];
 };
 
-/* Helper function to recursively walk each element */
-bool trie_walk_nodes(trie_t trie, trie_pos_t head, trie_walk_t walkfunc, void * priv) {
-    if (head == NULL) { return true; }
+// Bookkeeping for trie_new_arena: slabs grow geometrically, so even a very
+// large trie is released with a handful of free() calls. Removed nodes are
+// chained through their mid link and handed out again before a slab is cut.
+struct trie_arena_t {
+    struct trie_slab_t *slabs;
+    struct trie_bytes_t *bytes;
+    trie_pos_t freelist;
+    size_t hint;
+};
+
+/* Helper function to grab raw node memory, from the arena when there is one */
+trie_pos_t trie_alloc_node(trie_t trie) {
+    struct trie_arena_t *arena = trie->arena;
+    if (arena == NULL) { return (trie_pos_t)malloc(sizeof(struct trie_node_t)); }
+
+    if (arena->freelist != NULL) {
+        trie_pos_t recycled = arena->freelist;
+        arena->freelist = recycled->mid;
+        return recycled;
+    }
+
+    struct trie_slab_t *slab = arena->slabs;
+    if ((slab == NULL) || (slab->used == slab->cap)) {
+        size_t cap = (slab == NULL ? arena->hint : slab->cap * 2);
+        slab = (struct trie_slab_t *)malloc(sizeof(struct trie_slab_t) + cap * sizeof(struct trie_node_t));
+        if (slab == NULL) { return NULL; }
 
-    if (head->val != NULL) {    // we hit a full key!
-        if (!walkfunc(trie, head, head->fullkey, priv)) { return false; }
+        slab->used = 0;
+        slab->cap = cap;
+        slab->next = arena->slabs;
+        arena->slabs = slab;
     }
 
-    if (!trie_walk_nodes(trie, head->mid, walkfunc, priv)) { return false; }
-    if (!trie_walk_nodes(trie, head->left, walkfunc, priv)) { return false; }
-    if (!trie_walk_nodes(trie, head->right, walkfunc, priv)) { return false; }
+    return &slab->nodes[slab->used++];
+}
+
+/* Helper function to hand every slab of from's arena over to trie's arena, so what
+   was carved out of them is trie's from now on (from keeps an empty arena; its free
+   list is dropped, the nodes on it only staying unused) */
+void trie_arena_adopt(trie_t trie, trie_t from) {
+    struct trie_arena_t *to = trie->arena, *arena = from->arena;
+
+    if (arena->slabs != NULL) {
+        struct trie_slab_t *last = arena->slabs;
+        while (last->next != NULL) { last = last->next; }
+        last->next = to->slabs;
+        to->slabs = arena->slabs;
+    }
+    if (arena->bytes != NULL) {
+        struct trie_bytes_t *last = arena->bytes;
+        while (last->next != NULL) { last = last->next; }
+        last->next = to->bytes;
+        to->bytes = arena->bytes;
+    }
+
+    arena->slabs = NULL;
+    arena->bytes = NULL;
+    arena->freelist = NULL;
+}
+
+/* Helper function to drop a node's fragment; arena bytes are only reclaimed by trie_destroy */
+void trie_release_frag(trie_t trie, trie_pos_t node) {
+    if (trie->arena == NULL) { free(node->frag); }
+    node->frag = NULL;
+}
+
+/* Helper function to give node memory back; arena nodes go on the free list */
+void trie_recycle_node(trie_t trie, trie_pos_t node) {
+    trie_release_frag(trie, node);
+    if (trie->arena == NULL) { free(node); return; }
+
+    node->terminal = false;     // keeps trie_destroy's slab scan from seeing it as a key
+    node->val = NULL;
+    node->mid = trie->arena->freelist;
+    trie->arena->freelist = node;
+}
+
+/* Helper function to give back a node that is no longer linked in; with TRIE_EPOCH
+   readers may still be on it, so it waits for them in limbo first */
+void trie_release_node(trie_t trie, trie_pos_t node) {
+    if (trie->epoch != NULL) { trie_epoch_retire(trie, node, true); return; }
+    trie_recycle_node(trie, node);
+}
+
+/* Helper function to get size bytes out of the arena's byte slabs when there is one,
+   from malloc otherwise */
+void *trie_alloc_bytes(trie_t trie, size_t size) {
+    struct trie_arena_t *arena = trie->arena;
+    if (arena == NULL) { return malloc(size); }
+
+    size = (size + sizeof(void *) - 1) & ~(sizeof(void *) - 1);    // keep records aligned
+
+    struct trie_bytes_t *bytes = arena->bytes;
+    if ((bytes == NULL) || (bytes->cap - bytes->used < size)) {
+        size_t cap = (bytes != NULL ? bytes->cap * 2 :
+            (arena->hint < TRIE_ARENA_MIN_BYTES ? TRIE_ARENA_MIN_BYTES : arena->hint));
+        while (cap < size) { cap *= 2; }
+
+        bytes = (struct trie_bytes_t *)malloc(sizeof(struct trie_bytes_t) + cap);
+        if (bytes == NULL) { return NULL; }
+
+        bytes->used = 0;
+        bytes->cap = cap;
+        bytes->next = arena->bytes;
+        arena->bytes = bytes;
+    }
+
+    void *mem = &bytes->data[bytes->used];
+    bytes->used += size;
+    return mem;
+}
+
+/* Helper function to copy the len bytes of a key into a trie_kept_t record */
+struct trie_kept_t *trie_alloc_kept(trie_t trie, const char *key, size_t len) {
+    struct trie_kept_t *kept = (struct trie_kept_t *)trie_alloc_bytes(trie, sizeof(struct trie_kept_t) + len + 1);
+
+    if (kept != NULL) {
+        kept->val = NULL;
+        kept->refs = 1;
+        kept->len = (unsigned int)len;
+        memcpy(kept->key, key, len);
+        kept->key[len] = '\0';
+    }
+    return kept;
+}
+
+/* Helper function to give a node a copy of len characters of src as its fragment.
+   False when out of memory */
+bool trie_set_frag(trie_t trie, trie_pos_t node, const char *src, size_t len) {
+    struct trie_frag_t *frag = (struct trie_frag_t *)trie_alloc_bytes(trie, sizeof(struct trie_frag_t) + len);
+    if (frag == NULL) { return false; }
+
+    frag->len = (unsigned int)len;
+    memcpy(frag->bytes, src, len);
+    trie_release_frag(trie, node);
+    node->frag = frag;
+    return true;
+}
+
+/* Helper functions to count one more or one fewer owner of a node or kept record of a
+   shared trie; trie_unref is true for the last one out, which gives the memory back */
+void trie_ref(unsigned int *refs) {
+    __atomic_fetch_add(refs, 1, __ATOMIC_RELAXED);
+}
+
+bool trie_unref(unsigned int *refs) {
+    return (__atomic_sub_fetch(refs, 1, __ATOMIC_ACQ_REL) == 0);
+}
+
+/* Arena records are only reclaimed as a whole by trie_destroy. Returns false if a
+   snapshot still holds the record, which then stays */
+bool trie_release_kept(trie_t trie, struct trie_kept_t *kept) {
+    if (trie->arena != NULL) { return true; }
+    if (trie->shared && !trie_unref(&kept->refs)) { return false; }
+    if (trie->epoch != NULL) { trie_epoch_retire(trie, kept, false); return true; }
+    free(kept);
+    return true;
+}
+
+/* Helper function to read the value of a key node, whatever the layout */
+void *trie_node_value(const trie_t trie, const trie_pos_t node) {
+    if (TRIE_TAGGED(node)) { return ((struct trie_entry_t *)TRIE_UNTAG(node))->val; }
+    if (trie->flags & TRIE_KEEP_KEYS) {
+        struct trie_kept_t *kept = (struct trie_kept_t *)TRIE_LOAD(trie, node->val);
+        return TRIE_LOAD(trie, kept->val);
+    }
+    return TRIE_LOAD(trie, node->val);
+}
+
+/* Helper function to get the top node of a trie, whatever the layout */
+trie_pos_t trie_root(const trie_t trie) {
+    if (trie->compact != NULL) { return trie_compact_root(trie->compact); }
+    return TRIE_LOAD(trie, trie->start);
+}
+
+/* Helper function to look at a node, whatever the layout */
+void trie_view(const trie_t trie, trie_pos_t pos, struct trie_view_t *view) {
+    if (trie->compact != NULL) { trie_compact_view(trie->compact, pos, view); return; }
+
+    view->left = TRIE_LOAD(trie, pos->left);
+    view->mid = TRIE_LOAD(trie, pos->mid);
+    view->right = TRIE_LOAD(trie, pos->right);
+    view->key = pos->key;
+    view->terminal = TRIE_LOAD(trie, pos->terminal);
+    view->fraglen = trie_fraglen(pos);
+    view->frag = (pos->frag == NULL ? NULL : pos->frag->bytes);
+}
+
+/* Helper function to turn a key node back into a plain node. With TRIE_EPOCH the
+   value is left for readers that found the key just before, until it is reused.
+   Returns false if a snapshot still has the key's value */
+bool trie_clear_key(trie_t trie, trie_pos_t node) {
+    bool last = true;
+    if (trie->flags & TRIE_KEEP_KEYS) { last = trie_release_kept(trie, (struct trie_kept_t *)node->val); }
+    if (trie->epoch == NULL) { node->val = NULL; }
+    TRIE_STORE(trie, node->terminal, false);
+    node->score = 0;
+    return last;
+}
+
+/* Helper function to recompute the cached maxscore of a node from its own score and
+   its children. Returns true if it changed */
+bool trie_fix_max(trie_pos_t node) {
+    trie_score_t max = node->score;
+    if ((node->left != NULL) && (node->left->maxscore > max)) { max = node->left->maxscore; }
+    if ((node->mid != NULL) && !TRIE_TAGGED(node->mid) && (node->mid->maxscore > max)) { max = node->mid->maxscore; }
+    if ((node->right != NULL) && (node->right->maxscore > max)) { max = node->right->maxscore; }
+
+    if (max == node->maxscore) { return false; }
+    node->maxscore = max;
+    return true;
+}
+
+/* Recompute the maxima of the nodes going down the left links from top to bottom,
+   bottom first. The left links are reversed on the way down and put back on the
+   way up, so no stack is needed however long the chain is. */
+void trie_fix_spine(trie_pos_t top, trie_pos_t bottom) {
+    trie_pos_t prev = NULL, node = top;
+    while (node != bottom) {
+        trie_pos_t next = node->left;
+        node->left = prev;
+        prev = node;
+        node = next;
+    }
+
+    while (true) {
+        trie_fix_max(node);
+        if (prev == NULL) { return; }
+
+        trie_pos_t up = prev->left;
+        prev->left = node;
+        node = prev;
+        prev = up;
+    }
+}
+
+/* Helper function to recompute the height of a node within its level */
+void trie_avl_height(trie_pos_t node) {
+    unsigned char l = (node->left == NULL ? 0 : node->left->height);
+    unsigned char r = (node->right == NULL ? 0 : node->right->height);
+    node->height = 1 + (l > r ? l : r);
+}
+
+/* Helper function for the balance factor of a node: left height minus right height */
+int trie_avl_skew(trie_pos_t node) {
+    return (node->left == NULL ? 0 : node->left->height) - (node->right == NULL ? 0 : node->right->height);
+}
+
+/* Rotate the left child of node up into its place; returns the new top */
+trie_pos_t trie_avl_rotate_right(trie_pos_t node) {
+    trie_pos_t up = node->left;
+    node->left = up->right;
+    up->right = node;
+
+    trie_avl_height(node);
+    trie_fix_max(node);
+    trie_avl_height(up);
+    trie_fix_max(up);
+    return up;
+}
+
+/* Rotate the right child of node up into its place; returns the new top */
+trie_pos_t trie_avl_rotate_left(trie_pos_t node) {
+    trie_pos_t up = node->right;
+    node->right = up->left;
+    up->left = node;
+
+    trie_avl_height(node);
+    trie_fix_max(node);
+    trie_avl_height(up);
+    trie_fix_max(up);
+    return up;
+}
+
+/* Restore the balance of the subtree at node, whose children are balanced, with at
+   most two rotations; returns its new top */
+trie_pos_t trie_avl_balance(trie_pos_t node) {
+    int skew = trie_avl_skew(node);
+
+    if (skew > 1) {
+        if (trie_avl_skew(node->left) < 0) { node->left = trie_avl_rotate_left(node->left); }
+        return trie_avl_rotate_right(node);
+    }
+    if (skew < -1) {
+        if (trie_avl_skew(node->right) > 0) { node->right = trie_avl_rotate_right(node->right); }
+        return trie_avl_rotate_left(node);
+    }
+
+    trie_avl_height(node);
+    trie_fix_max(node);
+    return node;
+}
+
+/* Helper function to rebalance the nodes at links[0..count), deepest first */
+void trie_avl_fix_links(trie_pos_t **links, size_t count) {
+    while (count > 0) {
+        trie_pos_t *link = links[--count];
+        if ((*link) != NULL) { (*link) = trie_avl_balance(*link); }
+    }
+}
+
+#define TRIE_STACK_MIN 64
+
+/* Helper function to push a frame; NULL nodes are skipped. False when out of memory */
+bool trie_stack_push(struct trie_stack_t *stack, trie_pos_t node, size_t depth) {
+    if (node == NULL) { return true; }
+
+    if (stack->top == stack->cap) {
+        size_t cap = (stack->cap == 0 ? TRIE_STACK_MIN : stack->cap * 2);
+        struct trie_frame_t *frames = (struct trie_frame_t *)realloc(stack->frames, cap * sizeof(struct trie_frame_t));
+        if (frames == NULL) { return false; }
+        stack->frames = frames;
+        stack->cap = cap;
+    }
+
+    stack->frames[stack->top].node = node;
+    stack->frames[stack->top++].depth = depth;
+    return true;
+}
+
+/* Helper function to make room for need bytes in a growable key buffer */
+bool trie_reserve_key(char **buf, size_t *cap, size_t need) {
+    if (need <= (*cap)) { return true; }
+
+    size_t ncap = ((*cap) == 0 ? TRIE_STACK_MIN : (*cap));
+    while (ncap < need) { ncap *= 2; }
 
+    char *nbuf = (char *)realloc(*buf, ncap);
+    if (nbuf == NULL) { return false; }
+    (*buf) = nbuf;
+    (*cap) = ncap;
     return true;
 }
 
+// The links a descent went through, for the loop-based mutations; mid marks
+// the links that enter a new character level (the root link included)
+struct trie_path_t {
+    trie_pos_t **links;
+    bool *mid;
+    size_t depth;
+    size_t cap;
+};
+
+/* Helper function to record one more link of a descent. False when out of memory */
+bool trie_path_push(struct trie_path_t *path, trie_pos_t *link, bool mid) {
+    if (path->depth == path->cap) {
+        size_t cap = (path->cap == 0 ? TRIE_STACK_MIN : path->cap * 2);
+        trie_pos_t **links = (trie_pos_t **)realloc(path->links, cap * sizeof(trie_pos_t *));
+        if (links == NULL) { return false; }
+        path->links = links;
+
+        bool *mids = (bool *)realloc(path->mid, cap * sizeof(bool));
+        if (mids == NULL) { return false; }
+        path->mid = mids;
+        path->cap = cap;
+    }
+
+    path->links[path->depth] = link;
+    path->mid[path->depth++] = mid;
+    return true;
+}
+
+void trie_path_free(struct trie_path_t *path) {
+    free(path->links);
+    free(path->mid);
+}
+
+/* Helper function for trie_walk and trie_walk_n: the pre-order walk itself */
+static bool trie_walk_visit(trie_t trie, const struct trie_visit_t *visit) {
+    if (trie->compact != NULL) { return trie_compact_walk(trie, trie->compact, visit); }
+    trie_pos_t root = trie_root(trie);
+    if (root == NULL) { return true; }
+
+    struct trie_stack_t stack = { NULL, 0, 0 };
+    char *buf = NULL;
+    size_t cap = 0;
+    bool ret = trie_stack_push(&stack, root, 0);
+
+    while (ret && (stack.top > 0)) {
+        ret = trie_walk_frame(trie, &stack, &buf, &cap, visit);
+    }
+
+    free(stack.frames);
+    free(buf);
+    return ret;
+}
+
 /// Visit every key in the trie
 ///   Calls walkfunc for every key
 ///   - If walkfunc returns true, the tree walking continues;
@@ -66,170 +447,845 @@ bool trie_walk_nodes(trie_t trie, trie_pos_t head, trie_walk_t walkfunc, void *
 /// Returns false if the walkfunc returned false.
 ///
 bool trie_walk (trie_t trie, trie_walk_t walkfunc, void * priv) {
-    if (trie->start == NULL) { return true; }
-    return trie_walk_nodes(trie, trie->start, walkfunc, priv);
+    struct trie_visit_t visit = { walkfunc, NULL, priv };
+    return trie_walk_visit(trie, &visit);
 }
 
-void trie_free_node(trie_pos_t node, trie_free_t freefunc) {
-    if (node == NULL) { return; }
+/// Visit every key in the trie, with its length
+bool trie_walk_n (trie_t trie, trie_walk_n_t walkfunc, void * priv) {
+    struct trie_visit_t visit = { NULL, walkfunc, priv };
+    return trie_walk_visit(trie, &visit);
+}
 
-    trie_free_node(node->mid, freefunc);
-    trie_free_node(node->left, freefunc);
-    trie_free_node(node->right, freefunc);
+/* Helper function for the pre-order walks: visit the node of the top frame of stack
+   and push its children. The key of a node is rebuilt in *buf as the walk descends:
+   the characters above a frame are there already and stay put while it is on the
+   stack. False when the walk function says to stop or when out of memory */
+bool trie_walk_frame(trie_t trie, struct trie_stack_t *stack, char **buf, size_t *cap,
+        const struct trie_visit_t *visit) {
+    trie_pos_t head = stack->frames[--stack->top].node;
+    size_t depth = stack->frames[stack->top].depth;
+    struct trie_view_t view;
+    trie_view(trie, head, &view);
+
+    // room for this character, its fragment and the terminator
+    size_t end = depth + 1 + view.fraglen;
+    if (!trie_reserve_key(buf, cap, end + 1)) { return false; }
+    (*buf)[depth] = view.key;
+    if (view.fraglen > 0) { memcpy((*buf) + depth + 1, view.frag, view.fraglen); }
+
+    if (view.terminal) {    // we hit a full key!
+        const char *key = (*buf);
+        if (trie->flags & TRIE_KEEP_KEYS) {
+            key = ((struct trie_kept_t *)TRIE_LOAD(trie, head->val))->key;
+        } else {
+            (*buf)[end] = '\0';
+        }
+        if (!trie_visit(visit, trie, head, key, end)) { return false; }
+    }
 
-    if ((node->val != NULL) && (freefunc != NULL)) {
-        freefunc(node->val);
+    // the keys of a bucket below come right after, as a level of nodes there would
+    if ((trie->burst != 0) && TRIE_TAGGED(view.mid)) {
+        if (!trie_bucket_walk(trie, view.mid, buf, cap, end, visit)) { return false; }
+        view.mid = NULL;
     }
 
-    free(node->fullkey);
-    node->val = NULL;
-    node->mid = NULL;
-    node->left = NULL;
-    node->right = NULL;
-    node->parent = NULL;
-    free(node);
-    return;
+    // pushed in reverse so they pop as mid, left, right
+    return trie_stack_push(stack, view.right, depth)
+        && trie_stack_push(stack, view.left, depth)
+        && trie_stack_push(stack, view.mid, end);
+}
+
+/* Helper function to take over a node reached while freeing a shared trie: true if it
+   is ours to free, false if a snapshot still has it (then only our link to it goes).
+   Nodes taken over are left with no owners, which is how they are told apart later */
+bool trie_claim(trie_t trie, trie_pos_t node) {
+    if (!trie->shared) { return true; }
+    return (__atomic_load_n(&node->refs, __ATOMIC_ACQUIRE) == 0) || trie_unref(&node->refs);
+}
+
+/* Free a whole subtree without recursion or a stack: left children are rotated up
+   onto a right-leaning spine (and a mid child takes the empty left slot), so the
+   node at the top can always be freed once it has no left or mid link left. In a
+   shared trie this drops one link to node, and whatever a snapshot still holds stays:
+   freefunc only gets the values no snapshot has anymore. With a pool, a mid level is
+   handed over as a task of its own whenever another worker is out of work. */
+void trie_free_node(trie_t trie, trie_pos_t node, trie_free_t freefunc,
+        struct trie_pool_t *pool, unsigned int worker) {
+    if ((node != NULL) && !trie_claim(trie, node)) { return; }
+
+    while (node != NULL) {
+        if (TRIE_TAGGED(node->mid)) {
+            trie_bucket_free(node->mid, freefunc);
+            node->mid = NULL;
+        }
+        if ((pool != NULL) && (node->mid != NULL) && trie_pool_hungry(pool) &&
+            trie_pool_push(pool, worker, &node->mid)) {
+            node->mid = NULL;
+        }
+
+        if (node->left != NULL) {
+            trie_pos_t left = node->left;
+            if (!trie_claim(trie, left)) { node->left = NULL; continue; }
+            node->left = left->right;
+            left->right = node;
+            node = left;
+        } else if (node->mid != NULL) {
+            if (trie_claim(trie, node->mid)) { node->left = node->mid; }
+            node->mid = NULL;
+        } else {
+            trie_pos_t next = node->right;
+            if ((next != NULL) && !trie_claim(trie, next)) { next = NULL; }
+
+            if (node->terminal) {
+                void *val = trie_node_value(trie, node);
+                if (trie_clear_key(trie, node) && (freefunc != NULL)) { freefunc(val); }
+            }
+
+            trie_release_node(trie, node);
+            node = next;
+        }
+    }
+}
+
+/* Helper function to make the node at *link this trie's own before it is changed. One
+   a snapshot still has is replaced by a copy, its children and key record counting
+   the copy as one more owner, so the snapshot keeps seeing the original. Returns the
+   node now at *link, or NULL when out of memory */
+trie_pos_t trie_own(trie_t trie, trie_pos_t *link) {
+    trie_pos_t node = (*link);
+    if (!trie->shared || (node == NULL) || (__atomic_load_n(&node->refs, __ATOMIC_ACQUIRE) == 1)) { return node; }
+
+    trie_pos_t copy = trie_new_node(trie, (char)node->key, node->val);
+    if (copy == NULL) { return NULL; }
+    if ((node->frag != NULL) && !trie_set_frag(trie, copy, node->frag->bytes, node->frag->len)) {
+        trie_recycle_node(trie, copy);
+        return NULL;
+    }
+
+    copy->terminal = node->terminal;
+    copy->height = node->height;
+    copy->score = node->score;
+    copy->maxscore = node->maxscore;
+    copy->left = node->left;
+    copy->mid = node->mid;
+    copy->right = node->right;
+    if (copy->left != NULL) { trie_ref(&copy->left->refs); }
+    if (copy->mid != NULL) { trie_ref(&copy->mid->refs); }
+    if (copy->right != NULL) { trie_ref(&copy->right->refs); }
+    if (copy->terminal) { trie_ref(&((struct trie_kept_t *)copy->val)->refs); }
+
+    (*link) = copy;
+    trie_free_node(trie, node, NULL, NULL, 0);  // only frees it if the snapshot went away meanwhile
+    return copy;
+}
+
+/* Helper function to make every node of a trie its own, before a change that may touch
+   any of them. False when out of memory, in which case only part of it was copied */
+bool trie_own_all(trie_t trie) {
+    if (!trie->shared || (trie->start == NULL)) { return true; }
+
+    trie_pos_t root = trie_own(trie, &trie->start);
+    if (root == NULL) { return false; }
+
+    struct trie_stack_t stack = { NULL, 0, 0 };
+    bool ok = trie_stack_push(&stack, root, 0);
+    while (ok && (stack.top > 0)) {
+        trie_pos_t node = stack.frames[--stack.top].node;
+        trie_pos_t *links[3] = { &node->left, &node->mid, &node->right };
+        for (size_t i = 0; ok && (i < 3); ++i) {
+            if ((*links[i]) == NULL) { continue; }
+            trie_pos_t child = trie_own(trie, links[i]);
+            ok = (child != NULL) && trie_stack_push(&stack, child, 0);
+        }
+    }
+
+    free(stack.frames);
+    return ok;
+}
+
+/* Bulk teardown for arena tries: values are found by scanning the slabs
+   (recycled nodes are never terminal), then every slab goes in one free() */
+void trie_free_arena(trie_t trie, struct trie_arena_t *arena, trie_free_t freefunc) {
+    while (arena->slabs != NULL) {
+        struct trie_slab_t *slab = arena->slabs;
+        if (freefunc != NULL) {
+            for (size_t i = 0; i < slab->used; ++i) {
+                if (slab->nodes[i].terminal) { freefunc(trie_node_value(trie, &slab->nodes[i])); }
+            }
+        }
+        arena->slabs = slab->next;
+        free(slab);
+    }
+
+    while (arena->bytes != NULL) {
+        struct trie_bytes_t *bytes = arena->bytes;
+        arena->bytes = bytes->next;
+        free(bytes);
+    }
+
+    free(arena);
 }
 
 /// Free trie
 /// If freefunc is not NULL, calls freefunc for every void * value
 /// associated with a key.
 void trie_destroy (trie_t trie, trie_free_t freefunc) {
-    trie_free_node(trie->start, freefunc);
+    if (trie->log != NULL) { trie_log_close(trie->log); }
+    if (trie->epoch != NULL) { trie_epoch_free(trie); }
+    if (trie->wides != NULL) { trie_wides_free(trie->wides); }
+    if (trie->compact != NULL) {
+        trie_compact_free(trie->compact, freefunc);
+    } else if (trie->arena != NULL) {
+        trie_free_arena(trie, trie->arena, freefunc);
+    } else {
+        trie_free_node(trie, trie->start, freefunc, NULL, 0);
+    }
+    free(trie->roots);
     free(trie);
 }
 
 /// Get value associated with a key
 /// NOTE: the pos was obtained by a call to trie_insert or trie_find
 void * trie_get_value (const trie_t trie, trie_pos_t pos) {
-    return pos->val;
+    if (trie->compact != NULL) { return trie_compact_get_value(trie->compact, pos); }
+    return trie_node_value(trie, pos);
+}
+
+/* Helper function to store the value of a key node this trie owns. A key record a
+   snapshot still shares is copied first. False when out of memory for that, the value
+   then staying as it was */
+bool trie_put_value(trie_t trie, trie_pos_t node, void *value) {
+    if (trie->compact != NULL) { trie_compact_set_value(trie->compact, node, value); return true; }
+    if (TRIE_TAGGED(node)) { ((struct trie_entry_t *)TRIE_UNTAG(node))->val = value; return true; }
+    if (trie->flags & TRIE_KEEP_KEYS) {
+        struct trie_kept_t *kept = (struct trie_kept_t *)node->val;
+        if (trie->shared && (__atomic_load_n(&kept->refs, __ATOMIC_ACQUIRE) > 1)) {
+            struct trie_kept_t *copy = trie_alloc_kept(trie, kept->key, kept->len);
+            if (copy == NULL) { return false; }
+            node->val = copy;
+            trie_release_kept(trie, kept);
+            kept = copy;
+        }
+        TRIE_STORE(trie, kept->val, value);
+        if (trie->log != NULL) { trie_log_put(trie->log, kept->key, kept->len, value); }
+        return true;
+    }
+    TRIE_STORE(trie, node->val, value);
+    return true;
+}
+
+/* Helper function to make the nodes down to the node of the len bytes of key this
+   trie's own, copying those a snapshot still has. Returns the node, or NULL when out
+   of memory */
+trie_pos_t trie_own_key(trie_t trie, const char *key, size_t len) {
+    const char *last = key + len - 1;
+    trie_pos_t *link = &trie->start;
+    while (true) {
+        trie_pos_t head = trie_own(trie, link);
+        if (head == NULL) { return NULL; }
+
+        if ((unsigned char)*key < head->key) {
+            link = &head->left;
+        } else if ((unsigned char)*key > head->key) {
+            link = &head->right;
+        } else {
+            key += trie_fraglen(head);  // the key is in the trie, so it matches the fragment
+            if (key == last) { return head; }
+            link = &head->mid;
+            ++key;
+        }
+    }
 }
 
 /// Set value associated with a key
 /// NOTE: the pos was obtained by a call to trie_insert or trie_find.
 void trie_set_value (trie_t trie, trie_pos_t pos, void * value) {
-    pos->val = value;
+    // pos may be a node a snapshot shares, so the path to it is made ours first
+    if (trie->shared) {
+        struct trie_kept_t *kept = (struct trie_kept_t *)pos->val;
+        pos = trie_own_key(trie, kept->key, kept->len);
+        if (pos == NULL) { return; }
+    }
+    trie_put_value(trie, pos, value);
 }
 
-/* Does the node in question have any children? */
-bool trie_check_children(trie_pos_t head) {
-    return (head->left || head->right || head->mid ? true : false);
+/* Helper function to hang an arena off a freshly created trie */
+bool trie_attach_arena(trie_t trie, size_t size_hint) {
+    trie->arena = (struct trie_arena_t *)malloc(sizeof(struct trie_arena_t));
+    if (trie->arena == NULL) { return false; }
+
+    trie->arena->slabs = NULL;
+    trie->arena->bytes = NULL;
+    trie->arena->freelist = NULL;
+    trie->arena->hint = (size_hint < TRIE_ARENA_MIN_NODES ? TRIE_ARENA_MIN_NODES : size_hint);
+    return true;
 }
 
-/// Create a new empty trie
-trie_t trie_new() {
+/// Create a new empty trie with the given TRIE_* flags
+trie_t trie_new_flags(unsigned int flags) {
     trie_t new = (trie_t)malloc(sizeof(struct trie_data_t));
     if (new == NULL) { return TRIE_INVALID; }
 
     new->start = NULL;      // initialize to empty trie
+    new->size = 0;
+    new->arena = NULL;
+    new->compact = NULL;
+    new->flags = flags;
+    new->roots = NULL;
+    new->log = NULL;
+    new->epoch = NULL;
+    new->shared = false;
+    new->wides = NULL;
+    new->burst = 0;
+    new->buckets = 0;
+
+    // readers can only follow links that change one store at a time
+    if ((flags & TRIE_EPOCH) && (flags & (TRIE_BALANCED | TRIE_ROOT256 | TRIE_ROOT65536 | TRIE_COMPRESS | TRIE_WIDE))) {
+        free(new);
+        return TRIE_INVALID;
+    }
+    if ((flags & TRIE_EPOCH) && ((new->epoch = trie_epoch_new()) == NULL)) { free(new); return TRIE_INVALID; }
+    if ((flags & TRIE_WIDE) && ((new->wides = trie_wides_new()) == NULL)) { free(new); return TRIE_INVALID; }
+
+    if (flags & (TRIE_ROOT256 | TRIE_ROOT65536)) {
+        size_t slots = TRIE_ROOTS_2 + ((flags & TRIE_ROOT65536) ? 65536 : 0);
+        new->roots = (trie_pos_t *)calloc(slots, sizeof(trie_pos_t));
+        if (new->roots == NULL) {
+            if (new->wides != NULL) { trie_wides_free(new->wides); }
+            free(new);
+            return TRIE_INVALID;
+        }
+    }
+
+    if ((flags & TRIE_ARENA) && !trie_attach_arena(new, 0)) {
+        if (new->epoch != NULL) { trie_epoch_free(new); }
+        if (new->wides != NULL) { trie_wides_free(new->wides); }
+        free(new->roots);
+        free(new);
+        return TRIE_INVALID;
+    }
+    return new;
+}
+
+/// Create a new empty trie
+trie_t trie_new() {
+    return trie_new_flags(0);
+}
+
+/// Create a new empty trie backed by an arena
+/// Nodes and key copies are carved out of large slabs instead of being
+/// allocated one by one; removed nodes are recycled through a free list
+/// and trie_destroy releases everything with a few free() calls.
+///   size_hint is the expected number of nodes (about the total number of
+///   key characters); 0 picks a small default and the slabs grow as needed.
+trie_t trie_new_arena(size_t size_hint) {
+    trie_t new = trie_new_flags(0);
+    if (new == NULL) { return TRIE_INVALID; }
+
+    if (!trie_attach_arena(new, size_hint)) { free(new); return TRIE_INVALID; }
+    new->flags |= TRIE_ARENA;
+    return new;
+}
+
+/// Create a new empty trie using the compact node layout
+/// Nodes sit in one contiguous array and link to each other through 32-bit
+/// indices, values are kept in a separate array and there is no parent link,
+/// so a node takes 16 bytes instead of 56. The whole trie.h API works on it.
+///   size_hint is the expected number of nodes; the array grows as needed.
+trie_t trie_new_compact(size_t size_hint) {
+    trie_t new = trie_new();
+    if (new == NULL) { return TRIE_INVALID; }
+
+    new->compact = trie_compact_new(size_hint);
+    if (new->compact == NULL) { free(new); return TRIE_INVALID; }
     return new;
 }
 
+/// Create a new empty burst trie
+/// The keys below a node are kept as one bucket of suffixes until there are
+/// more than threshold of them, when the bucket bursts into a level of nodes
+/// with buckets below; 0 picks a default.
+trie_t trie_new_burst(size_t threshold) {
+    trie_t new = trie_new();
+    if (new == NULL) { return TRIE_INVALID; }
+
+    new->burst = (threshold == 0 ? TRIE_BURST_DEFAULT : (threshold > TRIE_BURST_MAX ? TRIE_BURST_MAX : (unsigned int)threshold));
+    return new;
+}
+
+/// Take a snapshot of a trie
+/// Returns a trie holding the keys, values and scores trie has right now, in
+/// constant time: the two share every node, and from then on each one copies
+/// a node another still has before changing it, so neither ever sees the
+/// other's changes. Only for tries created with TRIE_KEEP_KEYS, on its own or
+/// with TRIE_BALANCED and TRIE_COMPRESS.
+trie_t trie_snapshot (trie_t trie) {
+    // the copies are made on the way down; see trie.h for the modes that change nodes elsewhere
+    if ((trie->compact != NULL) || !(trie->flags & TRIE_KEEP_KEYS) ||
+        (trie->flags & ~(TRIE_KEEP_KEYS | TRIE_BALANCED | TRIE_COMPRESS))) { return TRIE_INVALID; }
+
+    trie_t snap = trie_new_flags(trie->flags);
+    if (snap == NULL) { return TRIE_INVALID; }
+
+    snap->start = trie->start;
+    snap->size = trie->size;
+    snap->shared = true;
+    trie->shared = true;
+    if (snap->start != NULL) { trie_ref(&snap->start->refs); }
+    return snap;
+}
+
 /* Helper functin to generate a new node instance */
-trie_pos_t trie_new_node(const char src, void *newval) {
-    trie_pos_t newbie = (trie_pos_t)malloc(sizeof(struct trie_node_t));
+trie_pos_t trie_new_node(trie_t trie, const char src, void *newval) {
+    trie_pos_t newbie = trie_alloc_node(trie);
     if (newbie == NULL) { return NULL; }
 
     newbie->left = NULL;
     newbie->right = NULL;
     newbie->mid = NULL;
-    newbie->parent = NULL;
-    newbie->fullkey = NULL;
 
     newbie->key = src;
+    newbie->terminal = false;
     newbie->val = newval;
+    newbie->height = 1;
+    newbie->score = 0;          // scores are never negative, so a new leaf
+    newbie->maxscore = 0;       // leaves every maximum above it as it was
+    newbie->frag = NULL;
+    if (trie->wides != NULL) {   // the two share a field; see struct trie_node_t
+        newbie->wide = 0;
+    } else {
+        newbie->refs = 1;
+    }
 
     return newbie;
 }
 
-/* Recursive count of full strings (keys) in our trie. We check for the
-   presence of a 'val', and if there increment */
-unsigned int trie_size_nodes(trie_pos_t head) {
-    unsigned int count = 0;
+/* Helper function to count how many of the len characters of a fragment src starts with
+   (src having at least len bytes; callers cut len down to what is left of their key) */
+size_t trie_frag_common(const char *frag, size_t len, const char *src) {
+    size_t i = 0;
+    while ((i < len) && (src[i] == frag[i])) { ++i; }
+    return i;
+}
+
+/* Split a node's fragment after its first at characters: the character there becomes
+   a new node below it, taking the rest of the fragment along with the key, value,
+   score and mid level of the old node. The node itself stays where it is, so the
+   links to it and the dispatch table are still good. False when out of memory */
+bool trie_split_node(trie_t trie, trie_pos_t node, size_t at) {
+    trie_pos_t child = trie_new_node(trie, node->frag->bytes[at], node->val);
+    if (child == NULL) { return false; }
+
+    size_t rest = node->frag->len - at - 1;
+    if ((rest > 0) && !trie_set_frag(trie, child, node->frag->bytes + at + 1, rest)) {
+        trie_release_node(trie, child);
+        return false;
+    }
+
+    child->terminal = node->terminal;
+    child->score = node->score;
+    child->mid = node->mid;
+    if (trie->wides != NULL) { child->wide = node->wide; }
+    trie_fix_max(child);
 
-    if (head == NULL) { return count; }
-    if (head->val != NULL) { ++count; }
-    count += trie_size_nodes(head->mid);
-    count += trie_size_nodes(head->right);
-    count += trie_size_nodes(head->left);
-    return count;
+    if (at == 0) {
+        trie_release_frag(trie, node);
+    } else {
+        node->frag->len = (unsigned int)at;     // the buffer is simply kept, shorter
+    }
+    node->terminal = false;
+    node->val = NULL;
+    node->score = 0;
+    node->mid = child;
+    if (trie->wides != NULL) { node->wide = 0; }
+    return true;
+}
+
+/* Helper function to fold the only node of node's mid level back into node once node
+   holds no key: its fragment, the character of that node and the node's own fragment
+   become one. Nodes indexed by TRIE_ROOT65536 keep their second level as it is. Returns
+   whether it merged; when out of memory it does not, which only costs the space of the chain. */
+bool trie_merge_node(trie_t trie, trie_pos_t node) {
+    trie_pos_t child = node->mid;
+    if (node->terminal || (child == NULL) || (child->left != NULL) || (child->right != NULL)) { return false; }
+    if ((trie->flags & TRIE_ROOT65536) && (trie->roots[node->key] == node)) { return false; }
+    // the child's links and key record go over to node, so a child a snapshot has is copied first
+    if (trie->shared && ((child = trie_own(trie, &node->mid)) == NULL)) { return false; }
+
+    size_t at = trie_fraglen(node), len = at + 1 + trie_fraglen(child);
+    struct trie_frag_t *frag = (struct trie_frag_t *)trie_alloc_bytes(trie, sizeof(struct trie_frag_t) + len);
+    if (frag == NULL) { return false; }
+
+    frag->len = (unsigned int)len;
+    if (at > 0) { memcpy(frag->bytes, node->frag->bytes, at); }
+    frag->bytes[at] = (char)child->key;
+    if (child->frag != NULL) { memcpy(frag->bytes + at + 1, child->frag->bytes, child->frag->len); }
+
+    trie_release_frag(trie, node);
+    node->frag = frag;
+    node->terminal = child->terminal;
+    node->val = child->val;
+    node->score = child->score;
+    node->mid = child->mid;
+    if (trie->wides != NULL) { node->wide = child->wide; }
+    trie_release_node(trie, child);
+    return true;
 }
 
 /// Return the number of keys in the trie
+/// The count is maintained by insert/remove, so this is constant time.
 unsigned int trie_size (const trie_t trie) {
-    if (trie->start == NULL) { return 0; }
-    return trie_size_nodes(trie->start);
+    return TRIE_LOAD(trie, trie->size);
 }
 
-/* Helper function to recursively find a specific node */
-trie_pos_t trie_find_node(trie_pos_t head, const char *src) {
-    if (head == NULL) { return TRIE_INVALID_POS; }
-    if ((*(src+1) == '\0') && (*src == head->key) && (head->val != NULL)) {
-        return head; // we found it?!
+/* Helper function for one step of a lookup: compare *src with head and return the next
+   node to look at, moving *src on past what head matched (last being the last byte of
+   the key). NULL once the lookup is over, *found then being the node of the key if it
+   is there */
+static inline trie_pos_t trie_find_step(const trie_t trie, trie_pos_t head, const char **src, const char *last,
+        trie_pos_t *found) {
+    if ((unsigned char)**src < head->key) { return TRIE_LOAD(trie, head->left); }
+    if ((unsigned char)**src > head->key) { return TRIE_LOAD(trie, head->right); }
+
+    // a fragment is matched in one compare rather than one node per character
+    if (head->frag != NULL) {
+        size_t fraglen = head->frag->len;
+        if (((size_t)(last - (*src)) < fraglen) || (memcmp((*src) + 1, head->frag->bytes, fraglen) != 0)) { return NULL; }
+        (*src) += fraglen;
+    }
+    if ((*src) == last) {
+        if (TRIE_LOAD(trie, head->terminal)) { (*found) = head; }     // we found it?!
+        return NULL;
+    }
+    ++(*src);
+    if ((trie->wides != NULL) && (head->wide != 0)) { return trie_wide_level(trie, head, (unsigned char)**src); }
+
+    trie_pos_t mid = TRIE_LOAD(trie, head->mid);
+    if (TRIE_TAGGED(mid)) {     // the rest of the key is in a bucket, if anywhere
+        (*found) = trie_bucket_find(mid, *src, (size_t)(last - (*src)) + 1);
+        return NULL;
     }
+    return mid;
+}
 
-    if (*src < head->key) { return trie_find_node(head->left, src); }
-    if (*src == head->key) { return trie_find_node(head->mid, src+1); }
-    if (*src > head->key) { return trie_find_node(head->right, src); }
+/* Helper function to find the node holding the last of the len characters of src */
+trie_pos_t trie_find_node(const trie_t trie, trie_pos_t head, const char *src, size_t len) {
+    if ((src == NULL) || (len == 0)) { return TRIE_INVALID_POS; }
+
+    const char *last = src + len - 1;
+    trie_pos_t found = TRIE_INVALID_POS;
+    while (head != NULL) { head = trie_find_step(trie, head, &src, last, &found); }
+    return found;
+}
+
+/* Helper function to find the node of character c within one level */
+trie_pos_t trie_level_find(trie_pos_t head, unsigned char c) {
+    while ((head != NULL) && (head->key != c)) {
+        head = (c < head->key ? head->left : head->right);
+    }
     return head;
 }
 
+/* The dispatch table (TRIE_ROOT*) is an index over the top one or two levels: every
+   node there has its entry, so a missing entry means no key starts that way. Nodes
+   never move once allocated (rotations and successor splices relink them), so the
+   entries only have to change when a key adds or drops one of those nodes. */
+
+/* Helper function to find the deepest indexed node on the path of key (last being its
+   last byte): the node of its first character, or of its second with TRIE_ROOT65536.
+   *rest is set to the part of key from that node's character on. NULL if key is not
+   there at all */
+trie_pos_t trie_dispatch(const trie_t trie, const char *key, const char *last, const char **rest) {
+    unsigned char c0 = (unsigned char)key[0];
+    if ((trie->flags & TRIE_ROOT65536) && (key < last)) {
+        (*rest) = key + 1;
+        return trie->roots[TRIE_ROOTS_2 + (c0 << 8) + (unsigned char)key[1]];
+    }
+
+    (*rest) = key;
+    return trie->roots[c0];
+}
+
+/* Helper function to point the entries for the first characters of key back at the
+   nodes holding them, after an insert or remove may have added or freed them */
+void trie_dispatch_refresh(trie_t trie, const char *key, const char *last) {
+    unsigned char c0 = (unsigned char)key[0];
+    trie_pos_t node = trie_level_find(trie->start, c0);
+    trie->roots[c0] = node;
+
+    if ((trie->flags & TRIE_ROOT65536) && (key < last)) {
+        trie->roots[TRIE_ROOTS_2 + (c0 << 8) + (unsigned char)key[1]] =
+            (node == NULL ? NULL : trie_level_find(node->mid, (unsigned char)key[1]));
+    }
+}
+
+/* Helper function to find the node the lookup of a non-empty key starts from: the one
+   the dispatch table or the top wide node has for it (which holds rest[0], so the
+   search matches it straight away), else the top of the trie. NULL if the key is not
+   there at all */
+static trie_pos_t trie_find_start(const trie_t trie, const char *key, const char *last, const char **rest) {
+    (*rest) = key;
+    if (trie->roots != NULL) { return trie_dispatch(trie, key, last, rest); }
+    if (trie->wides != NULL) { return trie_wide_level(trie, NULL, (unsigned char)*key); }
+    return trie_root(trie);
+}
+
+/* Helper function for the string entry points: the length of a key, 0 for NULL */
+static size_t trie_key_len(const char *key) {
+    return (key == NULL ? 0 : strlen(key));
+}
+
 /// Find a key in a trie
 /// Returns the position or TRIE_INVALID_POS if the key could not be found.
 trie_pos_t trie_find (const trie_t trie, const char * key) {
-    if (trie->start == NULL) { return TRIE_INVALID_POS; }
-    return trie_find_node(trie->start, key);
+    return trie_find_n(trie, key, trie_key_len(key));
 }
 
-/* using ternary search tree (TST) after reading CH 15: Radix Search in Algorithms in C (Sedgewick) */
-trie_pos_t trie_insert_node(trie_pos_t head, const char *src, const char *fullkey, void *theval, trie_pos_t *newpos) {
-    if (*src == '\0') { return head; }
+/// Find the len bytes at key in a trie
+trie_pos_t trie_find_n (const trie_t trie, const char * key, size_t len) {
+    if (trie->compact != NULL) { return trie_compact_find(trie->compact, key, len); }
+    if ((key == NULL) || (len == 0)) { return TRIE_INVALID_POS; }
 
-    if (fullkey == NULL) { return TRIE_INVALID_POS; }
+    const char *rest = NULL, *last = key + len - 1;
+    trie_pos_t node = trie_find_start(trie, key, last, &rest);
+    if (node == NULL) { return TRIE_INVALID_POS; }
+    return trie_find_node(trie, node, rest, (size_t)(last - rest) + 1);
+}
 
-    if (head == NULL) { head = trie_new_node(*src, NULL); }  // we know our node is blank, so insert!
+/* Batched lookups keep TRIE_BATCH_WIDTH of them going at once, AMAC style: each round
+   takes every lookup one node further and prefetches the node it goes to next, which is
+   only looked at a round later, by when it is in cache. One lookup then waits on memory
+   while the others run, instead of every miss adding up. A lookup that ends hands its
+   slot over to the next key. */
+#define TRIE_BATCH_WIDTH 16
+
+// One lookup of a batch: the node it looks at next and what is left of its key
+struct trie_lookup_t {
+    trie_pos_t node;
+    const char *src;
+    const char *last;
+    size_t index;
+};
 
-    if (*src < head->key) {
-        head->left = trie_insert_node(head->left, src, fullkey, theval, newpos);
-        if (head->left != NULL) { head->left->parent = head; }
-        return head;
+/* Helper function to start the lookup of keys[index] in slot, prefetching its first
+   node. False if it is over already (then out[index] is set) */
+static bool trie_batch_start(const trie_t trie, const char *key, size_t index, struct trie_lookup_t *slot,
+        trie_pos_t *out) {
+    trie_pos_t node = NULL;
+    size_t len = trie_key_len(key);
+    const char *rest = key, *last = NULL;
+
+    if (len > 0) {
+        last = key + len - 1;
+        node = trie_find_start(trie, key, last, &rest);
+    }
+    if (node == NULL) {
+        out[index] = TRIE_INVALID_POS;
+        return false;
     }
 
-    if (*src == head->key) {
-        head->mid = trie_insert_node(head->mid, src+1, fullkey, theval, newpos);
-        if (head->mid != NULL) { head->mid->parent = head; }
+    __builtin_prefetch(node);
+    slot->node = node;
+    slot->src = rest;
+    slot->last = last;
+    slot->index = index;
+    return true;
+}
+
+/// Find n keys in a trie at once
+/// out_pos[i] is what trie_find(trie, keys[i]) returns.
+size_t trie_find_batch (const trie_t trie, const char * const * keys, size_t n, trie_pos_t * out_pos) {
+    size_t found = 0;
+    if (trie->compact != NULL) {
+        for (size_t i = 0; i < n; ++i) {
+            out_pos[i] = trie_compact_find(trie->compact, keys[i], trie_key_len(keys[i]));
+            found += (out_pos[i] != TRIE_INVALID_POS);
+        }
+        return found;
     }
 
-    if (*src > head->key) {
-        head->right = trie_insert_node(head->right, src, fullkey, theval, newpos);
-        if (head->right != NULL) { head->right->parent = head; }
-        return head;
+    struct trie_lookup_t slots[TRIE_BATCH_WIDTH];
+    size_t active = 0, next = 0;
+    for (; (active < TRIE_BATCH_WIDTH) && (next < n); ++next) {
+        if (trie_batch_start(trie, keys[next], next, &slots[active], out_pos)) { ++active; }
     }
 
-    if ((*(src+1) == '\0') && (head->val == NULL)) {
-        head->val = theval;
-        head->fullkey = (char *)calloc(strlen(fullkey)+1, sizeof(char));
-        if (head->fullkey == NULL) { return TRIE_INVALID_POS; }
-        strcpy(head->fullkey, fullkey);
+    while (active > 0) {
+        for (size_t s = 0; s < active; ) {
+            struct trie_lookup_t *l = &slots[s];
+            trie_pos_t pos = TRIE_INVALID_POS;
+            l->node = trie_find_step(trie, l->node, &l->src, l->last, &pos);
+            if (l->node != NULL) {
+                __builtin_prefetch(l->node);
+                ++s;
+                continue;
+            }
 
-        if ((head->key == *src) && (newpos != NULL)) { (*newpos) = head; }
+            out_pos[l->index] = pos;
+            found += (pos != TRIE_INVALID_POS);
+
+            // the slot goes to the next key, or to the last lookup, which has yet to move this round
+            bool started = false;
+            while (!started && (next < n)) { started = trie_batch_start(trie, keys[next], next, l, out_pos); ++next; }
+            if (started) {
+                ++s;
+            } else {
+                (*l) = slots[--active];
+            }
+        }
     }
 
-    return head;
+    return found;
 }
 
-/* Helper function to find the spot we'd inserted a rotated node! */
-/* When we're handling removes, we usually have to 'shake out the trie' to put the links
-   back into their proper order. The beauty of using a TST is that we know anything
-   to the left of a node is less than the root, anything to the right is greater than the root.
-   Using those principles, we just need to find where the 're-sorted' node falls into place */
-trie_pos_t trie_find_spot(trie_pos_t head, const char key) {
-    trie_pos_t tester;
-    if ((key == '\0') || (head == NULL)) { return head; }
-    if (key < head->key) { tester->left = trie_find_spot(head->left, key); if (tester->left == NULL) { return head; } else { return tester->left; } }
-    if (key > head->key) { tester->right = trie_find_spot(head->right, key); if (tester->right == NULL) { return head; } else {  return tester->right; } }
+/* using ternary search tree (TST) after reading CH 15: Radix Search in Algorithms in C (Sedgewick) */
+/* Single top-down descent from *link: follows (and creates, when missing) the links for src and returns the node
+   holding its last character. *created tells the caller whether that node was just turned into a key,
+   so insert/upsert never need a separate find or a size walk. On allocation failure any nodes added
+   by this call are unlinked again and TRIE_INVALID_POS is returned (a fragment it split stays split).
+   With TRIE_COMPRESS the first new node takes the whole rest of the key as its fragment, except for a
+   first-character node under TRIE_ROOT65536, which the table needs to branch on the second one.
+   Unless *link is trie->start, the key must go through the node there (as it does from the dispatch
+   table), so that new nodes only ever go into the levels below it. The key is fullkey up to last, its
+   last byte, src being somewhere in it. A new key gets newval, stored before the key is marked
+   present, so a TRIE_EPOCH reader that finds it also finds its value. */
+trie_pos_t trie_insert_node(trie_t trie, trie_pos_t *link, const char *src, const char *last, const char *fullkey,
+        void *newval, bool *created) {
+    trie_pos_t *firstlink = NULL;
+    trie_pos_t head = NULL, next = NULL;
+
+    // with TRIE_WIDE, the node owning the level the descent is in (NULL for the top one)
+    // and the one the first new node went into, whose index is told about it
+    trie_pos_t owner = NULL, firstowner = NULL, first = NULL, jump = NULL;
+
+    // with TRIE_BALANCED, the links through the level the first new node goes into
+    trie_pos_t *level[TRIE_AVL_MAX];
+    size_t depth = 0;
+    bool balanced = (trie->flags & TRIE_BALANCED);
+    bool compress = (trie->flags & TRIE_COMPRESS);
+
+    (*created) = false;
+    if (src == NULL) { return TRIE_INVALID_POS; }
+
+    while (true) {
+        if (balanced && (firstlink == NULL)) { level[depth++] = link; }
+
+        head = (*link);
+        if ((head != NULL) && trie->shared && ((head = trie_own(trie, link)) == NULL)) { break; }
+        if (head == NULL) {     // we know our node is blank, so insert!
+            head = trie_new_node(trie, *src, NULL);
+            if (head == NULL) { break; }
+            TRIE_STORE(trie, *link, head);
+            if (firstlink == NULL) { firstlink = link; firstowner = owner; first = head; }
+
+            bool pinned = (src == fullkey) && (trie->flags & TRIE_ROOT65536);
+            if (compress && !pinned && (src < last) && !trie_set_frag(trie, head, src + 1, (size_t)(last - src))) { break; }
+        }
 
-    return head;
+        if ((unsigned char)*src < head->key) { link = &head->left; continue; }
+        if ((unsigned char)*src > head->key) { link = &head->right; continue; }
+
+        // the key goes through this node: split its fragment where the key leaves it
+        if (head->frag != NULL) {
+            size_t left = (size_t)(last - src), fraglen = head->frag->len;
+            size_t common = trie_frag_common(head->frag->bytes, (fraglen < left ? fraglen : left), src + 1);
+            if ((common < fraglen) && !trie_split_node(trie, head, common)) { break; }
+            src += common;
+        }
+
+        if (src == last) {
+            if (head->terminal) { return head; }  // already there, nothing to add
+
+            if (trie->flags & TRIE_KEEP_KEYS) {
+                struct trie_kept_t *kept = trie_alloc_kept(trie, fullkey, (size_t)(last - fullkey) + 1);
+                if (kept == NULL) { break; }
+                kept->val = newval;
+                TRIE_STORE(trie, head->val, (void *)kept);
+            } else {
+                TRIE_STORE(trie, head->val, newval);
+            }
+
+            TRIE_STORE(trie, head->terminal, true);
+            (*created) = true;
+            if (firstlink != NULL) { trie_avl_fix_links(level, depth); }  // nothing to do unless balanced
+            if ((first != NULL) && (trie->wides != NULL)) { trie_wide_add(trie, firstowner, first); }
+            return head;
+        } else {
+            link = &head->mid;
+            if (firstlink == NULL) { depth = 0; }
+            ++src;
+
+            // a burst trie keeps the rest of the key in the bucket there, unless it
+            // bursts into a level of nodes, which the descent then goes on into
+            if ((trie->burst != 0) && (((*link) == NULL) || TRIE_TAGGED(*link))) {
+                trie_pos_t entry = trie_bucket_insert(trie, link, src, (size_t)(last - src) + 1, created);
+                if (entry != TRIE_INVALID_POS) {
+                    if (*created) { ((struct trie_entry_t *)TRIE_UNTAG(entry))->val = newval; }
+                    return entry;
+                }
+                if (((*link) == NULL) || TRIE_TAGGED(*link)) { break; }
+            }
+
+            // a character the level's wide node has is gone to straight away; the descent
+            // goes on through that node, so a local copy of the link will do
+            if ((trie->wides != NULL) && (head->wide != 0) && (firstlink == NULL) &&
+                ((jump = trie_wide_level(trie, head, (unsigned char)*src)) != NULL) && (jump->key == (unsigned char)*src)) {
+                link = &jump;
+            }
+            owner = head;
+        }
+    }
+
+    // out of memory; new nodes only ever hang off each other's mid link, so drop the chain
+    if (firstlink != NULL) {
+        head = (*firstlink);
+        TRIE_STORE(trie, *firstlink, NULL);
+        while (head != NULL) {
+            next = head->mid;
+            trie_release_node(trie, head);
+            head = next;
+        }
+    }
+    return TRIE_INVALID_POS;
+}
+
+/* Helper function to run the insert descent of whichever layout the trie uses for the
+   len bytes of str, keeping the key count current. A new key gets newval and is logged */
+trie_pos_t trie_insert_key(trie_t trie, const char *str, size_t len, void *newval, bool *created) {
+    trie_pos_t found = TRIE_INVALID_POS;
+
+    (*created) = false;
+    if (trie->compact != NULL) {
+        found = trie_compact_insert(trie->compact, str, len, created);
+        if (*created) { trie_compact_set_value(trie->compact, found, newval); }
+    } else if ((str == NULL) || (len == 0)) {
+        return TRIE_INVALID_POS;
+    } else if ((trie->log != NULL) && (memchr(str, 0, len) != NULL)) {
+        return TRIE_INVALID_POS;    // trie_save could not keep it, so nor could trie_log_compact
+    } else if (trie->roots == NULL) {
+        found = trie_insert_node(trie, &trie->start, str, str + len - 1, str, newval, created);
+    } else {
+        // start below the table when it has the node already; the descent only ever
+        // writes to links it finds empty, so a local copy of the pointer will do
+        const char *rest = NULL, *last = str + len - 1;
+        trie_pos_t node = trie_dispatch(trie, str, last, &rest);
+        if (node != NULL) {
+            found = trie_insert_node(trie, &node, rest, last, str, newval, created);
+        } else if ((rest != str) && ((node = trie->roots[(unsigned char)*str]) != NULL)) {
+            found = trie_insert_node(trie, &node, str, last, str, newval, created);
+            if (found != TRIE_INVALID_POS) { trie_dispatch_refresh(trie, str, last); }
+        } else {
+            found = trie_insert_node(trie, &trie->start, str, last, str, newval, created);
+            if (found != TRIE_INVALID_POS) { trie_dispatch_refresh(trie, str, last); }
+        }
+    }
+
+    if (*created) {
+        TRIE_STORE(trie, trie->size, trie->size + 1);
+        if (trie->log != NULL) { trie_log_put(trie->log, str, len, newval); }
+    }
+    return found;
 }
 
 /// Insert a key in the trie;
@@ -249,242 +1305,250 @@ trie_pos_t trie_find_spot(trie_pos_t head, const char key) {
 ///
 bool trie_insert (trie_t trie, const char * str, void * newval,
       trie_pos_t * newpos) {
-    bool ret = false;
-    size_t count = 0, after = 0;
-
-    trie_pos_t random = trie_find(trie, str);
-    if (random != TRIE_INVALID_POS) {
-        if (newpos != NULL) {
-            newpos = &random;
-            return false;
-        }
-    }
+    return trie_insert_n(trie, str, trie_key_len(str), newval, newpos);
+}
 
-    count = trie_size(trie);
-    trie->start = trie_insert_node(trie->start, str, str, newval, newpos);
-    after = trie_size(trie);
-    if ((count < after)) { ret = true; } else { ret = false; }
+/// Insert the len bytes at key in the trie
+bool trie_insert_n (trie_t trie, const char * key, size_t len, void * newval,
+      trie_pos_t * newpos) {
+    bool created = false;
 
-    return ret;
+    trie_pos_t found = trie_insert_key(trie, key, len, newval, &created);
+    if (found == TRIE_INVALID_POS) { return false; }
+
+    if (newpos != NULL) { (*newpos) = found; }
+
+    return created;
+}
+
+/// Insert or update a key in the trie;
+///
+///  Same as trie_insert, except that an existing key has its data value
+///  replaced by newval. The previous value is stored in *oldval (when oldval
+///  is not NULL) so the caller can dispose of it; for a new key *oldval is
+///  set to NULL.
+///
+///  Returns true if a new key was inserted, false if an existing key was
+///  updated (or the key could not be inserted, in which case newpos is
+///  left untouched).
+///
+bool trie_upsert (trie_t trie, const char * str, void * newval,
+      void ** oldval, trie_pos_t * newpos) {
+    return trie_upsert_n(trie, str, trie_key_len(str), newval, oldval, newpos);
 }
 
-/* Very large, inefficient function to handle the actual key removal. Our data structure is amazingly fast
-   for insertion and searching, but sucks for removal given the complexity of the links. The beauty of the TST is
-   that we know anything to the left of a node is < node, anything to the right is > node, and everything in the
-   middle is the rest of the key.
-
-   With that logic, we basically try to 're-sort' the affected keys after removing one. There is a lot of nested
-   logic here and with more time a refactor would be ideal.
-
-   The general algorithm passes the current node (found) and its parent into this function. Based on the location
-   of both found + parent, we have to deduce whether it's a simple update or a complex update. Handling the root
-   node was difficult, but the lower-level changes are by far the most intricate. If you have something like
-
-                                    t
-                                    |
-                                    e
-                                    |
-                                    s
-                                  / | \
-                                 d  t  t
-
-    ...any you wnat to remove 'test', you have to handle who gets moved up and who gets re-sorted! In our
-    implementation, d would be rotated into place of s, t would stay where it is and we'd remove 'st' as long as
-    no substr existed (like tes). If that exists, all this is simplified and only the last 't' is removed under
-    's' since the other keys are intact.
-
-    It's overly complex, but works for most cases. Please see the README.txt for more information
-
-*/
-trie_pos_t trie_remove_key(trie_t thetrie, trie_pos_t parent, trie_pos_t found, const char *src, size_t count) {
-    /* if we're on a branch that's less than parent, make the swap */
-    if (parent->left == found) {
-        if (found->right != NULL) {
-            parent->left = found->right;
-            found->right->parent = parent;
-            if (found->left != NULL) { found->right->left = found->left; }
-            found->left = NULL;
-            found->right = NULL;
-        } else if (found->left != NULL) {
-            parent->left = found->left;
-            found->left->parent = parent;
-            found->left = NULL;
-        } else { parent->left = NULL; }
+/// Insert or update the len bytes at key in the trie
+bool trie_upsert_n (trie_t trie, const char * key, size_t len, void * newval,
+      void ** oldval, trie_pos_t * newpos) {
+    bool created = false;
 
-        return found;
-    }
+    if (oldval != NULL) { (*oldval) = NULL; }
 
-    /* if we're on a branch that's greater than parent, make the swap */
-    if (parent->right == found) {
-        if (found->left != NULL) {
-            parent->right = found->left;
-            found->left->parent = parent;
-            if (found->right != NULL) { found->left->right = found->right; }
-            found->left = NULL;
-            found->right = NULL;
-        } else if (found->right != NULL) {
-            parent->right = found->right;
-            found->right->parent = parent;
-            found->right = NULL;
-        } else { parent->right = NULL; }
+    trie_pos_t found = trie_insert_key(trie, key, len, newval, &created);
+    if (found == TRIE_INVALID_POS) { return false; }
 
-        return found;
+    if (!created) {
+        // the old value is only handed back once it is really replaced
+        void *old = trie_get_value(trie, found);
+        if (!trie_put_value(trie, found, newval)) { return false; }
+        if (oldval != NULL) { (*oldval) = old; }
     }
+    if (newpos != NULL) { (*newpos) = found; }
 
-    // the root node, yikes! This one requires more logic, particularly with multiple links
-    if (parent->parent == NULL) {
-        if (parent->val != NULL) {
-            parent->val = NULL;
-            free(parent->fullkey);
-            parent->fullkey = NULL;
-            return TRIE_INVALID_POS;
-        }
+    return created;
+}
 
-        if (parent->right != NULL) {
-            if (parent->left != NULL) {
-                parent->left->parent = trie_find_spot(parent->right, parent->left->key);
-                if (parent->left->key < parent->left->parent->key) { parent->left->parent->left = parent->left; }
-                else if (parent->left->key > parent->left->parent->key) { parent->left->parent->right = parent->left; }
-            }
-            thetrie->start = parent->right;
-            parent->right->parent = NULL;   // new root
-            parent->left = NULL;
-            parent->right = NULL;
+/* Unlink node (reached through *link) from its character-level BST, splicing in its
+   in-order successor when it has two children, and give the node back. The maxima of
+   the nodes the successor was taken from are fixed here; those above link are not.
+   False, with nothing unlinked, when out of memory to copy the way down to the
+   successor away from a snapshot */
+bool trie_unlink_node(trie_t trie, trie_pos_t *link, trie_pos_t node) {
+    if (node->left == NULL) {
+        TRIE_STORE(trie, *link, node->right);
+    } else if (node->right == NULL) {
+        TRIE_STORE(trie, *link, node->left);
+    } else {
+        // the splice relinks the nodes down to the successor, so they must be ours
+        trie_pos_t *slink = &node->right, sparent = NULL;
+        for (trie_pos_t *l = slink; (*l) != NULL; l = &(*l)->left) {
+            if (trie_own(trie, l) == NULL) { return false; }
         }
-
-        if (parent->left != NULL) {
-            thetrie->start = parent->left;
-            parent->left->parent = NULL;    // new root
-            parent->left = NULL;
-            parent->right = NULL;
+        while ((*slink)->left != NULL) {
+            sparent = (*slink);
+            slink = &(*slink)->left;
         }
 
-        return parent;
-    }
-
-    /* most complex case, both left and right have links. we have to be careful here to take into account
-       the re-sorted order for nodes. */
-    if (parent->right != NULL) {
-        if (parent->left != NULL) {                     // move these to a function somehow
-            if (parent->parent->left == parent) {       // update the left side of parent
-                parent->right->parent = parent->parent;
-                parent->parent->left = parent->right;
-                parent->left->parent = trie_find_spot(parent->right, parent->left->key);
-                if (parent->left->key < parent->left->parent->key) { parent->left->parent->left = parent->left; }
-                else if (parent->left->key > parent->left->parent->key) { parent->left->parent->right = parent->left; }
-                parent->left = NULL;
-                parent->right = NULL;
-            } else if (parent->parent->right == parent) {       // update the left side of parent
-                parent->left->parent = parent->parent;
-                parent->parent->right = parent->left;
-                parent->right->parent = trie_find_spot(parent->left, parent->right->key);
-                if (parent->right->key < parent->right->parent->key) { parent->right->parent->left = parent->right; }
-                else if (parent->right->key > parent->right->parent->key) { parent->right->parent->right = parent->right; }
-                parent->left = NULL;
-                parent->right = NULL;
-            } else {
-                parent->left->parent = parent->parent;
-                parent->parent->mid = parent->left;
-                parent->right->parent = trie_find_spot(parent->left, parent->right->key);
-                if (parent->right->key < parent->right->parent->key) { parent->right->parent->left = parent->right; }
-                else if (parent->right->key > parent->right->parent->key) { parent->right->parent->right = parent->right; }
-                parent->left = NULL;
-                parent->right = NULL;
-            }
-        } else {
-            if (count == 0) {   // end of string
-                if (parent->val != NULL) {
-                    parent->val = NULL;
-                    free(parent->fullkey);
-                    parent->fullkey = NULL;
-                    if (parent->mid == NULL) {
-                        if (parent->parent->mid == found) {
-                            parent->parent->mid = parent->right;
-                        } else {
-                            parent->parent->right = parent->right;
-                        }
-                        parent->right->parent = parent->parent;
-                        parent->right = NULL;
-                        return parent;
-                    } else { return TRIE_INVALID_POS; }
-                }
-            } else if (strlen(src) - count - 1 > 0) {      // found a str with similar parent
-                if (parent->val == NULL) {
-                    parent->parent->mid = parent->right;
-                    parent->right->parent = parent->parent;
-                }
-            } else {
-                if (parent->val == NULL) {
-                    parent->right->parent = parent->parent;
-                    if (parent->parent->left == parent) { parent->parent->left = parent->right; }
-                    else if (parent->parent->right == parent) { parent->parent->right = parent->right; }
-                }
-            }
+        trie_pos_t succ = (*slink);
+        (*slink) = succ->right;
+        succ->left = node->left;
+        succ->right = node->right;
+        (*link) = succ;
+
+        if (sparent != NULL) { trie_fix_spine(succ->right, sparent); }
+        trie_fix_max(succ);
+    }
+
+    trie_release_node(trie, node);
+    return true;
+}
+
+/* Helper function to make the nodes a rebalance of the level path links[0..count) may
+   rotate this trie's own: on top of the path itself, the children of the nodes on it
+   and the grandchildren a double rotation lifts. False when out of memory */
+bool trie_avl_own(trie_t trie, trie_pos_t **links, size_t count) {
+    for (size_t i = 0; i < count; ++i) {
+        trie_pos_t node = (*links[i]);
+        if (node == NULL) { continue; }
+
+        trie_pos_t left = trie_own(trie, &node->left), right = trie_own(trie, &node->right);
+        if (((left == NULL) && (node->left != NULL)) || ((right == NULL) && (node->right != NULL))) { return false; }
+        if ((left != NULL) && (left->right != NULL) && (trie_own(trie, &left->right) == NULL)) { return false; }
+        if ((right != NULL) && (right->left != NULL) && (trie_own(trie, &right->left) == NULL)) { return false; }
+    }
+    return true;
+}
+
+/* Balanced mode version of trie_unlink_node: unlink the node at the end of the level
+   path links[0..count) and rebalance what is left of the level on the way back up.
+   The successor, if one is spliced in, is found within TRIE_AVL_MAX steps. False,
+   with nothing unlinked, when out of memory to copy what that changes away from a
+   snapshot */
+bool trie_avl_unlink(trie_t trie, trie_pos_t **links, size_t count) {
+    trie_pos_t *path[2 * TRIE_AVL_MAX];
+    memcpy(path, links, count * sizeof(trie_pos_t *));
+
+    trie_pos_t node = *path[count-1];
+    if ((node->left == NULL) || (node->right == NULL)) {
+        if (trie->shared && !trie_avl_own(trie, path, count)) { return false; }
+        (*path[count-1]) = (node->left != NULL ? node->left : node->right);
+    } else {
+        // the links down to the successor join the path, the first one now hanging off it
+        trie_pos_t *spine[TRIE_AVL_MAX];
+        trie_pos_t *slink = &node->right;
+        size_t steps = 0;
+        if (trie->shared && !trie_avl_own(trie, path, count)) { return false; }
+        for (trie_pos_t *l = slink; (*l) != NULL; l = &(*l)->left) {
+            if (trie->shared && !trie_avl_own(trie, &l, 1)) { return false; }
         }
-        if (parent->val != NULL) { parent->mid = NULL; return found; }
-        parent->right = NULL;
-        return parent;
-    }
-
-    /* simplified case, only the left exists (because we would have caught the right side above) */
-    if (parent->left != NULL) {
-        if (count == 0) {   // end of string
-            if (parent->val != NULL) {
-                parent->val = NULL;
-                free(parent->fullkey);
-                parent->fullkey = NULL;
-                if (parent->mid == NULL) {
-                    if (parent->parent->mid == found) {
-                        parent->parent->mid = parent->left;
-                    } else {
-                        parent->parent->left = parent->left;
-                    }
-                    parent->left->parent = parent->parent;
-                    parent->left = NULL;
-                    return parent;
-                } else { return TRIE_INVALID_POS; }
-            }
-        } else if (strlen(src) - count - 1 > 0) {      // found a str with similar parent
-            if (parent->val == NULL) {
-                parent->parent->mid = parent->left;
-                parent->left->parent = parent->parent;
-            }
-        } else {
-            if (parent->val == NULL) {
-                parent->left->parent = parent->parent;
-                if (parent->parent->left == parent) { parent->parent->left = parent->left; }
-                else if (parent->parent->right == parent) { parent->parent->right = parent->left; }
-            }
+        while ((*slink)->left != NULL) {
+            spine[steps++] = slink;
+            slink = &(*slink)->left;
         }
-        if (parent->val != NULL) { parent->mid = NULL; return found; }
-        parent->left = NULL;
-        return parent;
+
+        trie_pos_t succ = (*slink);
+        (*slink) = succ->right;
+        succ->left = node->left;
+        succ->right = node->right;
+        (*path[count-1]) = succ;
+
+        if (steps > 0) { path[count++] = &succ->right; }
+        for (size_t i = 1; i < steps; ++i) { path[count++] = spine[i]; }
     }
 
-    /* if only the middle exists and the parent points to current node, then we're inside a substr */
-    if (parent->mid == found) {
-        if (parent->val == NULL) {
-            found = trie_remove_key(thetrie, parent->parent, parent, src, ++count);
-            return found;
-        } else {
-            parent->mid = NULL;
-            return found;
-        }
+    trie_avl_fix_links(path, count);
+    trie_release_node(trie, node);
+    return true;
+}
+
+/* After a key was cleared at the end of path, drop the nodes that no longer lead to
+   any key. Whenever that empties a character level, the node owning the level (one
+   mid link up) is checked next, so a removal only ever touches its own path.
+   Returns how many links at the start of the path still sit in live nodes. */
+size_t trie_prune_path(trie_t trie, struct trie_path_t *path) {
+    size_t depth = path->depth;
+
+    while (depth > 0) {
+        trie_pos_t node = *path->links[depth-1];
+        if (node->terminal || (node->mid != NULL)) { return depth; }
+
+        unsigned char key = node->key;
+        size_t level = depth - 1;
+        while (!path->mid[level]) { --level; }
+        bool unlinked = ((trie->flags & TRIE_BALANCED) ? trie_avl_unlink(trie, &path->links[level], depth - level)
+                                                        : trie_unlink_node(trie, path->links[depth-1], node));
+        if (!unlinked) { return depth; }    // it stays, as a plain branch of its level
+        if (trie->wides != NULL) { trie_wide_del(trie, (level == 0 ? NULL : *path->links[level-1]), key); }
+        size_t live = depth;
+        while ((depth > 0) && !path->mid[depth-1]) { --depth; }
+        if ((depth == 0) || (*path->links[depth-1] != NULL)) { return live; }
+        --depth;    // the level is gone; its owner may be prunable too
     }
 
-    /* otherwise, we're actually a full string without any depedencies */
-    if (parent->mid != NULL) {
-        if (parent->val == NULL) {
-            found = trie_remove_key(thetrie, parent->parent, parent, src, ++count);
-            return found;
+    return 0;
+}
+
+/* TRIE_EPOCH version of trie_prune_path. Readers may be anywhere in the trie, so a
+   node is only ever unlinked by pointing the link to it at its one child (or at
+   nothing), which a reader sees either before or after but never halfway. A node
+   left without a key but with two children stays as a plain branch of its level
+   until a later removal takes one of them away; whether the node just pruned was a
+   BST child or the only node of a level, the next one up is checked the same way. */
+size_t trie_prune_epoch(trie_t trie, struct trie_path_t *path) {
+    size_t depth = path->depth;
+
+    while (depth > 0) {
+        trie_pos_t node = *path->links[depth-1];
+        if (node->terminal || (node->mid != NULL) || ((node->left != NULL) && (node->right != NULL))) { return depth; }
+
+        trie_unlink_node(trie, path->links[depth-1], node);
+        --depth;
+    }
+
+    return 0;
+}
+
+/* Helper function to bring the maxima of the first live links of path up to date,
+   bottom first. With stop set it ends at the first node that did not change. */
+void trie_fix_path(struct trie_path_t *path, size_t live, bool stop) {
+    while (live > 0) {
+        trie_pos_t node = *path->links[--live];
+        if ((node != NULL) && !trie_fix_max(node) && stop) { return; }
+    }
+}
+
+/* Helper function to record the links down to the node of the len bytes at key (mid
+   marks the links that enter a new character level), making the nodes on them this
+   trie's own. Returns the node, or NULL if key is not in the trie or when out of memory */
+trie_pos_t trie_find_path(trie_t trie, const char *key, size_t len, struct trie_path_t *path) {
+    if ((key == NULL) || (len == 0)) { return NULL; }
+    // the nodes on the way are made ours as it goes, which is wasted on a missing key
+    if (trie->shared && (trie_find_node(trie, trie->start, key, len) == TRIE_INVALID_POS)) { return NULL; }
+
+    const char *last = key + len - 1;
+    trie_pos_t *link = &trie->start;
+    bool mid = true;
+    while ((*link) != NULL) {
+        if (!trie_path_push(path, link, mid)) { return NULL; }
+
+        trie_pos_t head = trie_own(trie, link);
+        if (head == NULL) { return NULL; }
+        mid = false;
+        if ((unsigned char)*key < head->key) {
+            link = &head->left;
+        } else if ((unsigned char)*key > head->key) {
+            link = &head->right;
         } else {
-            parent->val = NULL;
-            free(parent->fullkey);
-            parent->fullkey = NULL;
+            size_t fraglen = trie_fraglen(head);
+            if ((fraglen > 0) && (((size_t)(last - key) < fraglen)
+                    || (memcmp(key + 1, head->frag->bytes, fraglen) != 0))) { return NULL; }
+            key += fraglen;
+            if (key == last) {
+                return (head->terminal ? head : NULL);    // a node without value is only a substr of the key
+            }
+            link = &head->mid;
+            mid = true;
+            ++key;
+
+            // the link to a bucket ends the path, for the bucket to be pruned too once empty
+            if (TRIE_TAGGED(*link)) {
+                if (!trie_path_push(path, link, mid)) { return NULL; }
+                return trie_bucket_find(*link, key, (size_t)(last - key) + 1);
+            }
         }
     }
 
-    return TRIE_INVALID_POS;
+    return NULL;
 }
 
 /// Remove a key from a trie
@@ -494,26 +1558,90 @@ trie_pos_t trie_remove_key(trie_t thetrie, trie_pos_t parent, trie_pos_t found,
 /// associated with the key (so it can be properly disposed of by the user,
 /// if needed).
 bool trie_remove (trie_t trie, const char * key, void ** data) {
-    if (trie->start == NULL) { return false; }
-    if ((strcmp(key, "") == 0) || (key == NULL)) { return false; }
+    return trie_remove_n(trie, key, trie_key_len(key), data);
+}
+
+/// Remove the len bytes at key from a trie
+bool trie_remove_n (trie_t trie, const char * key, size_t len, void ** data) {
+    if (trie->compact != NULL) {
+        if (!trie_compact_remove(trie->compact, key, len, data)) { return false; }
+        --trie->size;
+        return true;
+    }
 
-    trie_pos_t found = trie_find(trie, key);
-    if (found == NULL) { return false; }    // key not found
+    struct trie_path_t path = { NULL, NULL, 0, 0 };
+    trie_pos_t head = trie_find_path(trie, key, len, &path);
 
-    if (found->val != NULL) {
-        if (data != NULL) { (*data) = found->val; }
-    } else { return false; }    // found a substr of the key, not the key itself
+    if (head != NULL) {
+        if (data != NULL) { (*data) = trie_node_value(trie, head); }
 
-    if (!trie_check_children(found)) {
-        found = trie_remove_key(trie, found->parent, found, key, 1);    // bubble up
-    } else {
-        found = trie_remove_key(trie, found, found, key, 0);
+        bool bucket = TRIE_TAGGED(head);
+        if (bucket) {
+            trie_bucket_remove(trie, path.links[--path.depth], head);
+        } else {
+            trie_clear_key(trie, head);
+        }
+        TRIE_STORE(trie, trie->size, trie->size - 1);
+        if (trie->log != NULL) { trie_log_del(trie->log, key, len); }
+
+        if (trie->epoch != NULL) {
+            trie_fix_path(&path, trie_prune_epoch(trie, &path), false);
+            trie_path_free(&path);
+            return true;
+        }
+
+        // a node left with just one way on is folded back into a fragment: the node
+        // itself when it still leads to longer keys, else the owner of the level the
+        // pruning stopped in (the levels below that one are gone)
+        bool alive = (!bucket && (head->mid != NULL));
+        size_t live = trie_prune_path(trie, &path);
+        if ((trie->flags & TRIE_COMPRESS) && alive) {
+            trie_merge_node(trie, head);
+        } else if ((trie->flags & TRIE_COMPRESS) && (live > 0)) {
+            size_t level = live - 1;
+            while ((level > 0) && !path.mid[level]) { --level; }
+            // the links past the owner sit in its level, whose last node may be merged away
+            if ((level > 0) && trie_merge_node(trie, *path.links[level-1])) { live = level; }
+        }
+
+        trie_fix_path(&path, live, false);
+        if (trie->roots != NULL) { trie_dispatch_refresh(trie, key, key + len - 1); }
     }
 
-    if (found != TRIE_INVALID_POS) {
-        if (trie->start == found) { trie->start = NULL; }
-        trie_free_node(found, NULL);
-    } else { free(found); }
+    trie_path_free(&path);
+    return (head != NULL);
+}
 
-    return true;
+/// Set the score of a key, for trie_topk
+bool trie_set_score (trie_t trie, const char * key, trie_score_t score) {
+    return trie_set_score_n(trie, key, trie_key_len(key), score);
+}
+
+/// Set the score of the len bytes at key, for trie_topk
+bool trie_set_score_n (trie_t trie, const char * key, size_t len, trie_score_t score) {
+    if ((trie->compact != NULL) || !(score >= 0)) { return false; }   // also catches NaN
+
+    // scores live in nodes: a key in a bucket is burst out of it, a level at a time
+    struct trie_path_t blank = { NULL, NULL, 0, 0 }, path = blank;
+    trie_pos_t node = trie_find_path(trie, key, len, &path);
+    while ((node != NULL) && TRIE_TAGGED(node)) {
+        bool burst = trie_bucket_burst(trie, path.links[path.depth-1]);
+        trie_path_free(&path);
+        if (!burst) { return false; }
+        path = blank;
+        node = trie_find_path(trie, key, len, &path);
+    }
+    if (node != NULL) {
+        node->score = score;
+        trie_fix_path(&path, path.depth, true);
+    }
+
+    trie_path_free(&path);
+    return (node != NULL);
+}
+
+/// Get the score of a key
+trie_score_t trie_get_score (const trie_t trie, trie_pos_t pos) {
+    if ((trie->compact != NULL) || TRIE_TAGGED(pos)) { return 0; }
+    return pos->score;
 }
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <stdbool.h>
+#include <stddef.h>
 
 // NOTE: Terminology:
 //
@@ -17,6 +18,14 @@
 //       "te st"
 //
 //    (these are all distinct keys)
+//
+//   The _n functions (trie_find_n, trie_insert_n, ...) take a key as a
+//   pointer and a length instead, and treat it as arbitrary bytes: it need
+//   not be terminated and may hold 0-bytes. "te\0st" of length 5 is then yet
+//   another key, which the string functions cannot reach (they stop at its
+//   0-byte); every other key is the same key either way. Keys handed back
+//   come with their length too: see trie_walk_n, trie_cursor_key_len and the
+//   len of a trie_match_t.
 
 // The structure representing the trie
 struct trie_data_t;
@@ -37,9 +46,16 @@ typedef void (*trie_free_t) (void * data);
 /// Function which gets called when traversing the trie
 /// The function should return true
 /// priv (the priv argument to trie_walk) is passed to trie_walk_t
+/// key is only valid until the function returns (see TRIE_KEEP_KEYS)
 typedef bool (*trie_walk_t) (trie_t trie,
        trie_pos_t pos, const char * key, void * priv);
 
+/// Function which gets called when traversing the trie with trie_walk_n
+/// Same as trie_walk_t, with the length of the key in len, so keys holding
+/// 0-bytes come through whole (a 0-byte still follows the len bytes).
+typedef bool (*trie_walk_n_t) (trie_t trie,
+       trie_pos_t pos, const char * key, size_t len, void * priv);
+
 /// Visit every key in the trie
 ///   Calls walkfunc for every key
 ///   - If walkfunc returns true, the tree walking continues;
@@ -54,6 +70,10 @@ typedef bool (*trie_walk_t) (trie_t trie,
 ///
 bool trie_walk (trie_t trie, trie_walk_t walkfunc, void * priv);
 
+/// Visit every key in the trie, with its length
+/// Same as trie_walk, for keys that may hold 0-bytes.
+bool trie_walk_n (trie_t trie, trie_walk_n_t walkfunc, void * priv);
+
 /// Free trie
 /// If freefunc is not NULL, calls freefunc for every void * value
 /// associated with a key.
@@ -65,12 +85,217 @@ void * trie_get_value (const trie_t trie, trie_pos_t pos);
 
 /// Set value associated with a key
 /// NOTE: the pos was obtained by a call to trie_insert or trie_find.
+/// On a trie sharing nodes with a snapshot (see trie_snapshot) the value
+/// stays as it was when out of memory to copy them; trie_upsert, which only
+/// hands back the old value once it is replaced, tells when that happened.
 void trie_set_value (trie_t trie, trie_pos_t pos, void * value);
 
 /// Create a new empty trie
 trie_t trie_new ();
 
+/// Flags for trie_new_flags; combine with |
+///
+///   TRIE_ARENA      allocate from an arena, as trie_new_arena(0) does.
+///
+///   TRIE_KEEP_KEYS  keep a copy of every key next to its value. By default
+///                   the key handed to a trie_walk_t is rebuilt in a buffer
+///                   owned by the walk and is only valid during the callback;
+///                   with this flag it stays valid until the key is removed.
+///
+///   TRIE_BALANCED   keep the BST of every character level (the left/right
+///                   links) AVL-balanced on insert and remove, so sequential
+///                   or otherwise skewed keys cannot turn a level into a
+///                   chain: at most about 1.44 * log2(256) nodes per character.
+///
+///   TRIE_ROOT256    index the nodes of the first character in a 256-entry
+///                   table, so lookups and inserts jump straight past the
+///                   first level instead of searching its BST.
+///
+///   TRIE_ROOT65536  same, and also index the nodes of the second character
+///                   by the first two bytes of the key (a 512 KiB table), so
+///                   keys of two or more characters skip the top two levels.
+///
+///   TRIE_COMPRESS   fold chains of single-child nodes (the unique tail of a
+///                   key, or a long prefix shared by a whole subtree) into
+///                   one node holding the whole string fragment, compared
+///                   in one go. A fragment is split where an insert branches
+///                   off inside it and merged back when a remove leaves a
+///                   chain again, so long keys with unique suffixes (URLs,
+///                   file paths) take a few nodes instead of one per byte.
+///
+///   TRIE_EPOCH      let readers run alongside one writer without any lock
+///                   (see trie_reader_new). The writer changes every link
+///                   with a single atomic store and removed nodes are only
+///                   given back once no reader can be on them. Cannot be
+///                   combined with TRIE_BALANCED, TRIE_ROOT*, TRIE_COMPRESS or
+///                   TRIE_WIDE, which rearrange several links at a time.
+///
+///   TRIE_WIDE       give every character level of 4 to 32 nodes a wide node
+///                   next to its BST, as adaptive radix trees do: its sorted
+///                   characters in one 32-byte block, searched with a single
+///                   SSE2 or AVX2 compare (whichever the CPU has; a plain loop
+///                   off x86), and the nodes holding them. A lookup enters such
+///                   a level in one step instead of hopping down its BST. The
+///                   wide node grows from 16 slots to 32 and shrinks back as
+///                   the level changes, and goes when it gets too small or too
+///                   big. Costs some time on insert and remove.
+#define TRIE_ARENA      0x1
+#define TRIE_KEEP_KEYS  0x2
+#define TRIE_BALANCED   0x4
+#define TRIE_ROOT256    0x8
+#define TRIE_ROOT65536  0x10
+#define TRIE_COMPRESS   0x20
+#define TRIE_EPOCH      0x40
+#define TRIE_WIDE       0x80
+
+/// Create a new empty trie with the given TRIE_* flags
+trie_t trie_new_flags (unsigned int flags);
+
+/// Create a new empty trie backed by an arena
+/// Nodes and key copies are carved out of large slabs instead of being
+/// allocated one by one; removed nodes are recycled through a free list
+/// and trie_destroy releases everything with a few free() calls.
+///   size_hint is the expected number of nodes (about the total number of
+///   key characters); 0 picks a small default and the slabs grow as needed.
+trie_t trie_new_arena (size_t size_hint);
+
+/// Create a new empty trie using the compact node layout
+/// Nodes sit in one contiguous array and link to each other through 32-bit
+/// indices, values are kept in a separate array and there is no parent link,
+/// so a node takes 16 bytes instead of 56. The whole trie.h API works on it.
+///   size_hint is the expected number of nodes; the array grows as needed.
+trie_t trie_new_compact (size_t size_hint);
+
+/// Create a new empty burst trie
+/// Below the top level, the keys sharing a prefix are kept as one bucket
+/// holding their suffixes and values back to back instead of a node per
+/// character, and a lookup that reaches it scans it in one go. A bucket
+/// that would hold more than threshold suffixes bursts into a level of
+/// nodes, one per first character, with a bucket of the rests below each
+/// of them; 0 picks a default of 64. The long tail of rare keys then takes
+/// a few bytes per character instead of a 56-byte node, and finds, inserts,
+/// removes and walks touch far fewer cache lines. Key positions in a bucket
+/// move as the bucket changes, so they are only good until the next change
+/// (as for every trie) and have score 0 until trie_set_score gives them
+/// one, which bursts the buckets on the way to the key (a change, which can
+/// fail when out of memory). The cursors and the queries built on them and
+/// trie_topk sort the keys of a bucket as they reach it and leave the trie
+/// as it is; trie_freeze freezes a copy made of nodes only, taking the
+/// memory for it while it runs. Takes no TRIE_* flags.
+trie_t trie_new_burst (size_t threshold);
+
+/// Take a snapshot of a trie
+/// Returns a trie holding the keys, values and scores trie has right now, in
+/// constant time: the two share every node, and from then on each one copies
+/// a node another still has before changing it (the nodes on the way down to
+/// the key an insert, remove or score change is for), so neither ever sees
+/// the other's changes. The snapshot is an ordinary trie for the whole API.
+/// Taking it counts as a change of trie; after that the two may be used from
+/// different threads (one writer each) and destroyed in either order. A node
+/// or key record goes once the last trie holding it is destroyed, and
+/// trie_destroy only hands freefunc the values no other trie still has; a
+/// value replaced or removed in one may still be in the other.
+/// Returns TRIE_INVALID when out of memory, or unless trie was created with
+/// TRIE_KEEP_KEYS, which TRIE_BALANCED and TRIE_COMPRESS may go with (their
+/// rotations and fragment merges copy what they touch off that path too).
+/// The other modes cannot share nodes:
+///   - without TRIE_KEEP_KEYS a value sits in the node itself, so two copies
+///     of a node could not tell which one hands it to freefunc, and
+///     trie_set_value could not find the way down to a node to copy it;
+///   - the TRIE_ROOT256 and TRIE_ROOT65536 tables and the TRIE_WIDE indexes
+///     point straight at nodes, which a copy would leave behind;
+///   - TRIE_EPOCH readers follow links with no lock, while a copy is only
+///     safe to free once the other trie let go of it;
+///   - arena tries (TRIE_ARENA, trie_new_arena) and compact and burst tries
+///     cannot give single nodes back or have no nodes to share.
+trie_t trie_snapshot (trie_t trie);
+
+/// Build a new trie from n keys sorted in strcmp order
+/// vals[i] becomes the value of keys[i]; vals may be NULL for no values.
+/// The keys are laid out median first, so every character level is a
+/// balanced BST (inserting sorted keys one by one makes each level a chain),
+/// and the whole build is linear in the total key length, with no lookups.
+/// The trie is arena-backed (see trie_new_arena), sized for exactly the
+/// nodes the keys need; after that it is an ordinary trie.
+/// Returns TRIE_INVALID if a key is empty, the keys are not strictly
+/// increasing, or when out of memory.
+trie_t trie_build_sorted (const char * const * keys, void * const * vals,
+      size_t n);
+
+/// Function which hands trie_build_stream its next key
+/// Stores the key (only needed until the next call) and its value, and
+/// returns true; returns false once there are no more keys.
+typedef bool (*trie_next_t) (void * priv, const char ** key, void ** val);
+
+/// Build a new trie from a stream of keys sorted in strcmp order
+/// Same result as trie_build_sorted without needing all keys at once: each
+/// key is appended on the right edge of the trie, then every level is
+/// balanced in place in one last linear pass. The trie is arena-backed.
+/// Returns TRIE_INVALID if a key is empty, the keys are not strictly
+/// increasing, or when out of memory.
+trie_t trie_build_stream (trie_next_t next, void * priv);
+
+/// Build a new trie from n keys, in any order, on nthreads threads
+/// vals[i] becomes the value of keys[i]; vals may be NULL for no values. A
+/// key given more than once keeps its first value, as with trie_insert.
+/// The keys are split by their first character, those groups by the next
+/// one and so on, and every split of enough keys is built on its own by a
+/// pool of workers that steal work from each other, so skewed keys (all
+/// starting with "http", say) still spread over every thread. Every level
+/// comes out a balanced BST, sorted input or not (sorted input skips the
+/// regrouping). The trie is arena-backed, each worker carving nodes out of
+/// slabs of its own that the trie takes over at the end.
+///   nthreads counts the calling thread; 0 or 1 builds on it alone. Takes
+///   two size_t per key of scratch space.
+/// Returns TRIE_INVALID if a key is empty, or when out of memory.
+trie_t trie_build_parallel (const char * const * keys, void * const * vals, size_t n,
+      unsigned int nthreads);
+
+/// Visit every key in the trie on nthreads threads
+/// Same contract as trie_walk, except that walkfunc is called from several
+/// threads at once (so it must be thread-safe, priv included) and in no
+/// particular order. The walk starts on one thread and a worker hands part
+/// of what it has left to any other worker that runs out, so a lopsided
+/// trie still keeps every thread busy. Once walkfunc returns false the
+/// other workers stop soon after, but may still make a few calls.
+///   nthreads counts the calling thread; 0 or 1 is a plain trie_walk. The
+///   trie must not be changed during the walk.
+/// Returns false if walkfunc returned false or when out of memory.
+bool trie_walk_parallel (trie_t trie, trie_walk_t walkfunc, void * priv,
+      unsigned int nthreads);
+
+/// Free trie on nthreads threads
+/// Same as trie_destroy, with the nodes freed by a pool of workers that
+/// split the trie between them as they go; freefunc is called from several
+/// threads at once. Compact and arena-backed tries take a few free() calls
+/// anyway and are freed on the calling thread.
+void trie_destroy_parallel (trie_t trie, trie_free_t freefunc, unsigned int nthreads);
+
+/// Free trie in the background
+/// Returns at once and leaves the freeing to a thread of its own, as
+/// trie_destroy_parallel does with nthreads. The trie must not be used
+/// anymore; its log (see trie_log_open) is closed before this returns.
+/// freefunc runs on the background threads.
+/// Returns false if no thread could be started: the trie was then freed
+/// before returning.
+bool trie_destroy_background (trie_t trie, trie_free_t freefunc, unsigned int nthreads);
+
+/// Wait until every trie handed to trie_destroy_background is freed
+void trie_destroy_wait (void);
+
+/// Rebalance every character level of the trie in place
+/// Each level is flattened and rebuilt as a complete BST (Day-Stout-Warren),
+/// in O(N) for the whole trie and without allocating per node, so a level
+/// of m characters is at most ceil(log2(m+1)) deep afterwards. Useful after
+/// bulk loading skewed keys into a trie without TRIE_BALANCED.
+/// Returns false when out of memory (every level is still a valid BST, but
+/// some may not have been rebalanced) or for a trie_new_compact trie.
+/// On a TRIE_EPOCH trie no reader may be inside a read section meanwhile.
+/// A trie sharing nodes with a snapshot (see trie_snapshot) copies them all.
+bool trie_rebalance (trie_t trie);
+
 /// Return the number of keys in the trie
+/// The count is maintained by insert/remove, so this is constant time.
 unsigned int trie_size (const trie_t trie);
 
 /// Insert a key in the trie; 
@@ -91,11 +316,49 @@ unsigned int trie_size (const trie_t trie);
 bool trie_insert (trie_t trie, const char * str, void * newval,
       trie_pos_t * newpos);
 
+/// Insert the len bytes at key in the trie; see trie_insert
+/// A key of length 0 is never inserted, nor one holding a 0-byte while the
+/// trie has a log (see trie_log_compact).
+bool trie_insert_n (trie_t trie, const char * key, size_t len, void * newval,
+      trie_pos_t * newpos);
+
+/// Insert or update a key in the trie;
+///
+///  Same as trie_insert, except that an existing key has its data value
+///  replaced by newval. The previous value is stored in *oldval (when oldval
+///  is not NULL) so the caller can dispose of it; for a new key *oldval is
+///  set to NULL.
+///
+///  Returns true if a new key was inserted, false if an existing key was
+///  updated (or the key could not be inserted or updated, in which case
+///  newpos is left untouched, *oldval stays NULL and the old value stays
+///  in place).
+///
+bool trie_upsert (trie_t trie, const char * str, void * newval,
+      void ** oldval, trie_pos_t * newpos);
+
+/// Insert or update the len bytes at key in the trie; see trie_upsert
+bool trie_upsert_n (trie_t trie, const char * key, size_t len, void * newval,
+      void ** oldval, trie_pos_t * newpos);
+
 
 /// Find a key in a trie
 /// Returns the position or TRIE_INVALID_POS if the key could not be found.
 trie_pos_t trie_find (const trie_t trie, const char * key);
 
+/// Find the len bytes at key in a trie; see trie_find
+trie_pos_t trie_find_n (const trie_t trie, const char * key, size_t len);
+
+/// Find n keys in a trie at once
+/// out_pos[i] is set to what trie_find(trie, keys[i]) would return. The
+/// lookups are interleaved, each one taking a node at a time and
+/// prefetching the next, so cache misses of different keys overlap instead
+/// of adding up: worth it for batches of tens of keys or more in a trie
+/// bigger than the cache. Same rules as trie_find otherwise (in a read
+/// section with TRIE_EPOCH).
+/// Returns how many of the keys were found.
+size_t trie_find_batch (const trie_t trie, const char * const * keys, size_t n, trie_pos_t * out_pos);
+
 /// Remove a key from a trie
 /// Returns false if the key could not be found
 ///
@@ -104,3 +367,431 @@ trie_pos_t trie_find (const trie_t trie, const char * key);
 /// if needed).
 bool trie_remove (trie_t trie, const char * key, void ** data);
 
+/// Remove the len bytes at key from a trie; see trie_remove
+bool trie_remove_n (trie_t trie, const char * key, size_t len, void ** data);
+
+
+// A cursor over the keys of a trie, in lexicographic order (bytes compare
+// as unsigned, like strcmp). Unlike trie_walk it can be paused, moved both
+// ways and repositioned, and stepping it does not allocate.
+//
+// Like a position, a cursor only remains valid until the next change
+// (insertion or removal) in the trie; seek again after changing it.
+struct trie_cursor_data_t;
+typedef struct trie_cursor_data_t * trie_cursor_t;
+
+/// Create a cursor over the keys of a trie, in lexicographic order
+/// The new cursor is unpositioned. Returns NULL when out of memory.
+trie_cursor_t trie_cursor_new (trie_t trie);
+
+/// Free a cursor
+void trie_cursor_free (trie_cursor_t cursor);
+
+/// Move the cursor to the first key >= key (lower bound)
+/// An empty key seeks to the first key.
+/// Returns false, leaving the cursor unpositioned, if there is no such key.
+bool trie_cursor_seek (trie_cursor_t cursor, const char * key);
+
+/// Move the cursor to the first key >= the len bytes at key; see trie_cursor_seek
+bool trie_cursor_seek_n (trie_cursor_t cursor, const char * key, size_t len);
+
+/// Move the cursor to the next key
+/// An unpositioned cursor moves to the first key.
+/// Returns false, leaving the cursor unpositioned, past the last key.
+bool trie_cursor_next (trie_cursor_t cursor);
+
+/// Move the cursor to the previous key
+/// An unpositioned cursor moves to the last key.
+/// Returns false, leaving the cursor unpositioned, before the first key.
+bool trie_cursor_prev (trie_cursor_t cursor);
+
+/// Key under the cursor, or NULL if the cursor is unpositioned
+/// The string belongs to the cursor and changes when the cursor moves. It is
+/// 0-terminated, but a key inserted with trie_insert_n may hold 0-bytes too:
+/// trie_cursor_key_len tells how long it really is.
+const char * trie_cursor_key (const trie_cursor_t cursor);
+
+/// Length of the key under the cursor, or 0 if the cursor is unpositioned
+size_t trie_cursor_key_len (const trie_cursor_t cursor);
+
+/// Position of the key under the cursor, or TRIE_INVALID_POS if unpositioned
+trie_pos_t trie_cursor_pos (const trie_cursor_t cursor);
+
+/// Visit every key starting with prefix, in lexicographic order
+/// Same contract as trie_walk, but the walk first goes down to the node of
+/// the last prefix character (O(|prefix| + log N)) and then only visits the
+/// keys below it, so its cost does not depend on the size of the trie.
+/// A NULL (or empty) prefix visits every key.
+bool trie_walk_prefix (trie_t trie, const char * prefix,
+      trie_walk_t walkfunc, void * priv);
+
+/// Visit every key starting with the len bytes at prefix, in lexicographic
+/// order, with its length; see trie_walk_prefix
+bool trie_walk_prefix_n (trie_t trie, const char * prefix, size_t len,
+      trie_walk_n_t walkfunc, void * priv);
+
+/// Visit every key in [lo, hi), in lexicographic order
+/// Same contract as trie_walk. The walk seeks straight to the first key >= lo,
+/// skipping every subtree before it, and stops at the first key >= hi, so it
+/// costs O(|lo| + log N) plus the keys in the range, not the size of the trie.
+/// A NULL (or empty) lo starts at the first key; a NULL hi runs to the end.
+bool trie_walk_range (trie_t trie, const char * lo, const char * hi,
+      trie_walk_t walkfunc, void * priv);
+
+/// Count the keys in [lo, hi); see trie_walk_range
+/// Returns 0 when out of memory.
+size_t trie_count_range (trie_t trie, const char * lo, const char * hi);
+
+/// Visit every key in [lo, hi), lo and hi being lolen and hilen bytes, in
+/// lexicographic order, with its length; see trie_walk_range
+bool trie_walk_range_n (trie_t trie, const char * lo, size_t lolen,
+      const char * hi, size_t hilen, trie_walk_n_t walkfunc, void * priv);
+
+/// Count the keys in [lo, hi), lo and hi being lolen and hilen bytes; see
+/// trie_walk_range_n
+size_t trie_count_range_n (trie_t trie, const char * lo, size_t lolen,
+      const char * hi, size_t hilen);
+
+// One result of trie_complete
+struct trie_match_t {
+    trie_pos_t pos;         // position of the key, for trie_get_value
+    char * key;             // copy of the key, freed by trie_complete_free
+    size_t len;             // length of the key, which may hold 0-bytes
+};
+
+/// Return up to max keys starting with prefix, in lexicographic order
+/// The first max matches are stored in out[0..max); the walk stops there,
+/// so asking for a few completions of a short prefix stays cheap.
+/// Returns the number of matches stored (fewer than max when there are no
+/// more keys, or when running out of memory).
+size_t trie_complete (trie_t trie, const char * prefix,
+      struct trie_match_t * out, size_t max);
+
+/// Return up to max keys starting with the len bytes at prefix, in
+/// lexicographic order; see trie_complete
+size_t trie_complete_n (trie_t trie, const char * prefix, size_t len,
+      struct trie_match_t * out, size_t max);
+
+/// Free the keys of the count matches returned by trie_complete
+void trie_complete_free (struct trie_match_t * out, size_t count);
+
+// Scores, for ranked completion. Every key has a score (0 until set) and
+// every node caches the highest score below it, so trie_topk can go straight
+// for the best keys. Scores are only kept by the pointer layout: on a
+// trie_new_compact trie trie_set_score fails and trie_topk finds nothing.
+typedef float trie_score_t;
+
+/// Set the score of a key
+/// Returns false if the key is not in the trie or score is negative (or NaN).
+/// Costs one descent plus fixing the cached maxima on the way back up.
+bool trie_set_score (trie_t trie, const char * key, trie_score_t score);
+
+/// Set the score of the len bytes at key; see trie_set_score
+bool trie_set_score_n (trie_t trie, const char * key, size_t len, trie_score_t score);
+
+/// Get the score of a key
+/// NOTE: the pos was obtained by a call to trie_insert or trie_find.
+trie_score_t trie_get_score (const trie_t trie, trie_pos_t pos);
+
+/// Return the k highest-scoring keys starting with prefix
+/// Matches are stored in out[0..k) by decreasing score (ties in no particular
+/// order) and freed with trie_complete_free. The search is best-first over
+/// the cached maxima, so it only looks at the subtrees that can still hold
+/// one of the k best keys, however many keys match the prefix.
+/// Returns the number of matches stored (fewer than k when there are no more
+/// keys, or when running out of memory).
+size_t trie_topk (trie_t trie, const char * prefix, size_t k,
+      struct trie_match_t * out);
+
+/// Return the k highest-scoring keys starting with the len bytes at prefix;
+/// see trie_topk
+size_t trie_topk_n (trie_t trie, const char * prefix, size_t len, size_t k,
+      struct trie_match_t * out);
+
+// A frozen trie: an immutable copy of a trie in one contiguous block, with
+// no pointers inside. Nodes are packed into 16 bytes, link to each other by
+// index and refer to their values and key fragments by offset. Every
+// character level is one run of nodes, searched as an implicit binary tree
+// (Eytzinger order, no left/right links), and the levels are laid out
+// breadth first, so lookups touch fewer and closer cache lines than in the
+// pointer layout. Chains of single-child nodes are folded into fragments
+// whether or not the trie uses TRIE_COMPRESS. Values are kept as integers
+// as wide as a pointer.
+struct trie_frozen_data_t;
+typedef struct trie_frozen_data_t * trie_frozen_t;
+
+/// Function which gets called when traversing a frozen trie
+/// Same contract as trie_walk_t, with the value of the key in place of
+/// its position (a frozen trie has no positions).
+typedef bool (*trie_frozen_walk_t) (const char * key, void * val,
+      void * priv);
+
+/// Freeze a trie into one contiguous read-only block
+/// The trie is left as it is and later changes to it do not show in the
+/// frozen copy. Works on every layout. Returns NULL when out of memory (or
+/// past 4G nodes), or when a key holds a 0-byte (see trie_insert_n): frozen
+/// tries only take and give back keys as strings.
+trie_frozen_t trie_freeze (const trie_t trie);
+
+/// Free a frozen trie (the values are left alone)
+void trie_frozen_free (trie_frozen_t frozen);
+
+/// Return the number of keys in a frozen trie
+size_t trie_frozen_size (const trie_frozen_t frozen);
+
+/// Return the size of the block holding a frozen trie, in bytes
+size_t trie_frozen_bytes (const trie_frozen_t frozen);
+
+/// Find a key in a frozen trie
+/// Returns true if the key is there, storing its value in *val when val
+/// is not NULL.
+bool trie_frozen_find (const trie_frozen_t frozen, const char * key,
+      void ** val);
+
+/// Visit every key of a frozen trie, in lexicographic order
+/// Same contract as trie_walk.
+bool trie_frozen_walk (const trie_frozen_t frozen,
+      trie_frozen_walk_t walkfunc, void * priv);
+
+/// Visit every key of a frozen trie starting with prefix, in lexicographic
+/// order; see trie_walk_prefix. An empty prefix visits every key.
+bool trie_frozen_walk_prefix (const trie_frozen_t frozen, const char * prefix,
+      trie_frozen_walk_t walkfunc, void * priv);
+
+/// Save a trie to a file, for trie_open_mmap
+/// The file is the frozen copy of the trie (see trie_freeze) as it is, with a
+/// version and a checksum in front. It is written under path.tmp, synced and
+/// then renamed to path, whose directory is synced last: a crash never leaves
+/// a partial file at path, and once this returns true the new file stays.
+/// Values are saved as plain integers, so only values that mean something
+/// to another process (ids, offsets) survive a save and reopen.
+/// Returns false when out of memory or if the file could not be written.
+bool trie_save (const trie_t trie, const char * path);
+
+/// Open a file written by trie_save as a frozen trie
+/// The file is mapped read-only and shared, and lookups and walks run
+/// straight on the mapped pages: nothing is read in, parsed or copied, so
+/// opening takes the same time for any size, and every process opening the
+/// same file shares one copy in the page cache. Only the header is checked;
+/// use trie_frozen_verify on files that may be damaged. Free the result with
+/// trie_frozen_free. Returns NULL if the file cannot be mapped or is not a
+/// trie_save file of this version (and byte order).
+trie_frozen_t trie_open_mmap (const char * path);
+
+/// Check the checksum of a frozen trie
+/// Reads the whole block, so it costs a pass over the file when mapped.
+/// Returns false if the contents do not match the checksum saved with them.
+bool trie_frozen_verify (const trie_frozen_t frozen);
+
+// A redo log: once attached to a trie, every successful trie_insert,
+// trie_upsert, trie_set_value and trie_remove (and their _n forms) appends a
+// small binary record (the key, and its new value unless removed) right after
+// making the change in memory. The log follows the trie rather than going
+// ahead of it: a change is durable once its batch is committed, not when the
+// call returns, so call trie_log_flush where that matters. Records are
+// group-committed:
+// they collect in memory and are written and synced a batch at a time, each
+// batch with its own checksum, so a crash loses at most the batch in flight
+// and never leaves a half-applied one. Together with trie_save snapshots this
+// makes a mutable trie durable: trie_recover rebuilds it from the last
+// snapshot plus the log, and trie_log_compact folds the log into a new
+// snapshot. Values are logged as plain integers, as trie_save keeps them;
+// scores are not logged.
+struct trie_log_data_t;
+typedef struct trie_log_data_t * trie_log_t;
+
+/// Attach a redo log at path to a trie
+/// The file is created if needed; an existing log is kept and appended to
+/// (recover the trie from it first), after cutting off a batch left torn by
+/// a crash. Records are written and synced every batch records (1 syncs every
+/// change). The trie has to keep its keys (TRIE_KEEP_KEYS), since
+/// trie_set_value only gets a position. Keys holding a 0-byte cannot be
+/// logged (see trie_log_compact). Returns NULL if the trie cannot be logged
+/// (or already holds such a key), already has a log, or the file cannot be
+/// opened.
+trie_log_t trie_log_open (trie_t trie, const char * path, size_t batch);
+
+/// Write and sync the records not committed yet
+/// Returns false if a record was lost since the log was opened (out of
+/// memory, or a failed write); the log stays failed from then on.
+bool trie_log_flush (trie_log_t log);
+
+/// Fold the log into a snapshot
+/// Commits the records still pending, saves the trie to snapshot with
+/// trie_save and then empties the log. A crash in between leaves a log that
+/// trie_recover replays over the new snapshot to the same result. A failed
+/// log (see trie_log_flush) cannot commit, so its pending records are dropped
+/// and it starts afresh once the snapshot holds them; a crash before it is
+/// emptied then replays its older records over the snapshot. Returns false
+/// if the snapshot could not be saved (the log is then left as it was, its
+/// pending records committed) or the log could not be emptied.
+/// trie_save cannot store a key holding a 0-byte, so a logged trie never
+/// has one: trie_insert_n and trie_upsert_n refuse such keys (as if out of
+/// memory) while a log is attached, and trie_log_open refuses a trie that
+/// already holds one.
+bool trie_log_compact (trie_log_t log, const char * snapshot);
+
+/// Flush the log, detach it from its trie and close it
+/// trie_destroy does this for a trie that still has a log attached.
+/// Returns what trie_log_flush returned.
+bool trie_log_close (trie_log_t log);
+
+/// Rebuild a trie from a trie_save snapshot and the log written since
+/// Either path may be NULL, and a missing file counts as empty. The trie
+/// gets the flags of the trie that wrote the log (TRIE_KEEP_KEYS alone
+/// without one), its levels are balanced, and the log is replayed up to its
+/// last whole batch. No log is attached to the result. Returns TRIE_INVALID
+/// when out of memory, or if the snapshot or the start of the log is not
+/// readable or damaged.
+trie_t trie_recover (const char * snapshot, const char * log);
+
+// A sharded trie, safe to use from many threads at once. Keys are spread over
+// independent tries (shards) by their first two bytes, and every shard has its
+// own reader/writer lock: lookups of any shard run side by side, and a change
+// only holds up the keys of its own shard. Positions and cursors do not outlive
+// a shard's lock, so the API goes by key, values included. Walks visit keys in
+// lexicographic order across all shards, but are not a snapshot: every shard is
+// seen as it is when the walk reaches it.
+struct trie_sharded_data_t;
+typedef struct trie_sharded_data_t * trie_sharded_t;
+
+/// Create a new empty sharded trie with nshards shards
+/// Returns NULL when out of memory or if nshards is 0.
+trie_sharded_t trie_sharded_new (unsigned int nshards);
+
+/// Create a new empty sharded trie whose shards use the given TRIE_* flags
+trie_sharded_t trie_sharded_new_flags (unsigned int nshards, unsigned int flags);
+
+/// Free a sharded trie
+/// Like trie_destroy, calls freefunc (when not NULL) for every value. No other
+/// thread may be using the trie anymore.
+void trie_sharded_destroy (trie_sharded_t sharded, trie_free_t freefunc);
+
+/// Return the number of keys in a sharded trie
+/// Adds up the shards one at a time, so it takes a read lock per shard.
+size_t trie_sharded_size (const trie_sharded_t sharded);
+
+/// Insert a key in a sharded trie; see trie_insert
+/// Returns true if the key was new (and now has newval), false if it was
+/// there already (its value is left as it was) or could not be inserted.
+bool trie_sharded_insert (trie_sharded_t sharded, const char * key, void * newval);
+
+/// Insert the len bytes at key in a sharded trie; see trie_sharded_insert
+bool trie_sharded_insert_n (trie_sharded_t sharded, const char * key, size_t len, void * newval);
+
+/// Insert or update a key in a sharded trie; see trie_upsert
+bool trie_sharded_upsert (trie_sharded_t sharded, const char * key, void * newval,
+      void ** oldval);
+
+/// Insert or update the len bytes at key in a sharded trie; see trie_upsert
+bool trie_sharded_upsert_n (trie_sharded_t sharded, const char * key, size_t len, void * newval,
+      void ** oldval);
+
+/// Find a key in a sharded trie
+/// Returns true if the key is there, storing its value in *val when val
+/// is not NULL.
+bool trie_sharded_find (const trie_sharded_t sharded, const char * key, void ** val);
+
+/// Find the len bytes at key in a sharded trie; see trie_sharded_find
+bool trie_sharded_find_n (const trie_sharded_t sharded, const char * key, size_t len, void ** val);
+
+/// Remove a key from a sharded trie; see trie_remove
+bool trie_sharded_remove (trie_sharded_t sharded, const char * key, void ** data);
+
+/// Remove the len bytes at key from a sharded trie; see trie_remove
+bool trie_sharded_remove_n (trie_sharded_t sharded, const char * key, size_t len, void ** data);
+
+/// Set the score of a key in a sharded trie; see trie_set_score
+bool trie_sharded_set_score (trie_sharded_t sharded, const char * key, trie_score_t score);
+
+/// Set the score of the len bytes at key in a sharded trie; see trie_set_score
+bool trie_sharded_set_score_n (trie_sharded_t sharded, const char * key, size_t len,
+      trie_score_t score);
+
+/// Visit every key of a sharded trie, in lexicographic order
+/// Same contract as trie_walk. walkfunc gets the trie of the key's shard and a
+/// position in it (for trie_get_value and trie_get_score) and runs under that
+/// shard's read lock, so it must not change the sharded trie.
+bool trie_sharded_walk (const trie_sharded_t sharded, trie_walk_t walkfunc, void * priv);
+
+/// Visit every key of a sharded trie, in lexicographic order, with its length;
+/// see trie_sharded_walk
+bool trie_sharded_walk_n (const trie_sharded_t sharded, trie_walk_n_t walkfunc, void * priv);
+
+/// Visit every key of a sharded trie starting with prefix, in lexicographic
+/// order; see trie_walk_prefix and trie_sharded_walk. A prefix of two
+/// characters or more only takes one shard's lock.
+bool trie_sharded_walk_prefix (const trie_sharded_t sharded, const char * prefix,
+      trie_walk_t walkfunc, void * priv);
+
+/// Visit every key of a sharded trie starting with the len bytes at prefix, in
+/// lexicographic order, with its length; see trie_sharded_walk_prefix
+bool trie_sharded_walk_prefix_n (const trie_sharded_t sharded, const char * prefix, size_t len,
+      trie_walk_n_t walkfunc, void * priv);
+
+/// Visit every key of a sharded trie in [lo, hi), in lexicographic order;
+/// see trie_walk_range and trie_sharded_walk
+bool trie_sharded_walk_range (const trie_sharded_t sharded, const char * lo, const char * hi,
+      trie_walk_t walkfunc, void * priv);
+
+/// Visit every key of a sharded trie in [lo, hi), lo and hi being lolen and
+/// hilen bytes, in lexicographic order, with its length; see trie_walk_range_n
+bool trie_sharded_walk_range_n (const trie_sharded_t sharded, const char * lo, size_t lolen,
+      const char * hi, size_t hilen, trie_walk_n_t walkfunc, void * priv);
+
+/// Count the keys of a sharded trie in [lo, hi); see trie_count_range
+size_t trie_sharded_count_range (const trie_sharded_t sharded, const char * lo, const char * hi);
+
+/// Count the keys of a sharded trie in [lo, hi), lo and hi being lolen and
+/// hilen bytes; see trie_count_range_n
+size_t trie_sharded_count_range_n (const trie_sharded_t sharded, const char * lo, size_t lolen,
+      const char * hi, size_t hilen);
+
+/// Return up to max keys of a sharded trie starting with prefix, in
+/// lexicographic order; see trie_complete. The pos of every match is
+/// TRIE_INVALID_POS; look the key up again for its value.
+size_t trie_sharded_complete (const trie_sharded_t sharded, const char * prefix,
+      struct trie_match_t * out, size_t max);
+
+/// Return up to max keys of a sharded trie starting with the len bytes at
+/// prefix, in lexicographic order; see trie_sharded_complete
+size_t trie_sharded_complete_n (const trie_sharded_t sharded, const char * prefix, size_t len,
+      struct trie_match_t * out, size_t max);
+
+/// Return the k highest-scoring keys of a sharded trie starting with prefix;
+/// see trie_topk. Each shard that can hold matches gives its k best, and
+/// those are merged. The pos of every match is TRIE_INVALID_POS.
+size_t trie_sharded_topk (const trie_sharded_t sharded, const char * prefix, size_t k,
+      struct trie_match_t * out);
+
+/// Return the k highest-scoring keys of a sharded trie starting with the len
+/// bytes at prefix; see trie_sharded_topk
+size_t trie_sharded_topk_n (const trie_sharded_t sharded, const char * prefix, size_t len, size_t k,
+      struct trie_match_t * out);
+
+// Readers of a TRIE_EPOCH trie. One thread at a time may change the trie (the
+// writer), while any number of others read it without taking a lock and without
+// ever waiting on the writer: trie_find, trie_get_value, trie_size, trie_walk,
+// trie_walk_prefix, trie_walk_range, trie_count_range, trie_complete and the
+// cursor calls are safe from a read section. Every change is seen either whole
+// or not at all, and positions, cursors and kept keys found in a read section stay
+// valid until it ends, even if the writer removes their key meanwhile (the value
+// of a removed key may still show). Scores and trie_topk are for the writer only.
+struct trie_reader_data_t;
+typedef struct trie_reader_data_t * trie_reader_t;
+
+/// Register a reader of a TRIE_EPOCH trie, one per reading thread
+/// Returns NULL when out of memory or if the trie is not a TRIE_EPOCH one.
+trie_reader_t trie_reader_new (trie_t trie);
+
+/// Give a reader back; its thread must be outside any read section
+void trie_reader_free (trie_reader_t reader);
+
+/// Start a read section
+/// A few atomic operations on the reader's own cache line; read sections do
+/// not nest. A reader that stays in one for long holds back the memory of
+/// whatever is removed meanwhile, not the writer.
+void trie_read_begin (trie_reader_t reader);
+
+/// End a read section
+void trie_read_end (trie_reader_t reader);
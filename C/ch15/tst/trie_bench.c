@@ -0,0 +1,1481 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "trie.h"
+#include "trie_int.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <malloc.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#define MAX_STRING 24
+
+static double now_sec ()
+{
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Keys are drawn from a small alphabet so the trie shares plenty of prefixes
+static char ** generate_keys (unsigned int count, unsigned int seed)
+{
+   char ** keys = malloc(count * sizeof(char *));
+   if (!keys)
+      return NULL;
+
+   srand(seed);
+   for (unsigned int i=0; i<count; ++i)
+   {
+      unsigned int len = 4 + (rand() % (MAX_STRING-4));
+      keys[i] = malloc(len+1);
+      for (unsigned int j=0; j<len; ++j)
+      {
+         keys[i][j] = 'a' + (rand() % 26);
+      }
+      keys[i][len] = 0;
+   }
+   return keys;
+}
+
+static void free_keys (char ** keys, unsigned int count)
+{
+   for (unsigned int i=0; i<count; ++i)
+      free(keys[i]);
+   free(keys);
+}
+
+static trie_t new_plain (unsigned int count)
+{
+   return trie_new();
+}
+
+static trie_t new_keep_keys (unsigned int count)
+{
+   return trie_new_flags(TRIE_KEEP_KEYS);
+}
+
+static trie_t new_arena (unsigned int count)
+{
+   // roughly one node per key byte is the worst case for random keys
+   return trie_new_arena((size_t) count * 4);
+}
+
+static trie_t new_compact (unsigned int count)
+{
+   // let the node array grow on its own so bytes/key reflects real usage
+   return trie_new_compact(0);
+}
+
+static trie_t new_burst (unsigned int count)
+{
+   return trie_new_burst(0);
+}
+
+// Bytes currently handed out by malloc, to get memory per key
+static size_t heap_in_use ()
+{
+   struct mallinfo2 mi = mallinfo2();
+   return mi.uordblks + mi.hblkhd;
+}
+
+// Build time should grow linearly with the key count: ns/key stays flat
+static void bench_build (const char * label, trie_t (*make) (unsigned int))
+{
+   printf("%-12s %10s %12s %10s %10s %12s %10s\n", label, "keys", "build (ms)",
+         "ns/insert", "ns/find", "destroy (ms)", "bytes/key");
+
+   for (unsigned int count = 1u << 14; count <= 1u << 20; count <<= 2)
+   {
+      char ** keys = generate_keys(count, count);
+
+      size_t heap = heap_in_use();
+      trie_t t = make(count);
+      double start = now_sec();
+      for (unsigned int i=0; i<count; ++i)
+      {
+         trie_insert(t, keys[i], (void*) (uintptr_t) (i+1), NULL);
+      }
+      double elapsed = now_sec() - start;
+      unsigned int size = trie_size(t);
+      size_t bytes = heap_in_use() - heap;
+
+      uintptr_t found = 0;
+      start = now_sec();
+      for (unsigned int i=0; i<count; ++i)
+      {
+         found += (trie_find(t, keys[i]) != TRIE_INVALID_POS);
+      }
+      double lookup = now_sec() - start;
+      if (found != count)
+         printf("warning: only %lu of %u keys found\n", (unsigned long) found, count);
+
+      start = now_sec();
+      trie_destroy(t, NULL);
+      double teardown = now_sec() - start;
+
+      printf("%-12s %10u %12.2f %10.1f %10.1f %12.2f %10.1f\n", "trie_insert", size,
+            elapsed * 1e3, elapsed * 1e9 / count, lookup * 1e9 / count,
+            teardown * 1e3, (double) bytes / size);
+
+      free_keys(keys, count);
+   }
+}
+
+// Recursive versions of find/walk/free as trie.c had them before they became
+// loops; only here to compare against on deep tries
+static trie_pos_t rec_find (trie_pos_t head, const char * src)
+{
+   if (head == NULL)
+      return TRIE_INVALID_POS;
+   if (*src < head->key)
+      return rec_find(head->left, src);
+   if (*src > head->key)
+      return rec_find(head->right, src);
+   if (*(src+1) == '\0')
+      return (head->terminal ? head : TRIE_INVALID_POS);
+   return rec_find(head->mid, src+1);
+}
+
+static bool rec_walk (trie_t t, trie_pos_t head, char * buf, size_t depth,
+      trie_walk_t walkfunc, void * priv)
+{
+   if (head == NULL)
+      return true;
+
+   buf[depth] = head->key;
+   if (head->terminal)
+   {
+      buf[depth+1] = '\0';
+      if (!walkfunc(t, head, buf, priv))
+         return false;
+   }
+
+   return rec_walk(t, head->mid, buf, depth+1, walkfunc, priv)
+      && rec_walk(t, head->left, buf, depth, walkfunc, priv)
+      && rec_walk(t, head->right, buf, depth, walkfunc, priv);
+}
+
+static void rec_free (trie_pos_t node)
+{
+   if (node == NULL)
+      return;
+
+   rec_free(node->mid);
+   rec_free(node->left);
+   rec_free(node->right);
+   free(node);
+}
+
+static bool count_walker (trie_t t, trie_pos_t pos, const char * key, void * priv)
+{
+   ++*(unsigned int *) priv;
+   return true;
+}
+
+// Long keys over a two-letter alphabet: mid chains as deep as the keys are long
+static char ** generate_deep_keys (unsigned int count, unsigned int len)
+{
+   char ** keys = malloc(count * sizeof(char *));
+   for (unsigned int i=0; i<count; ++i)
+   {
+      keys[i] = malloc(len+1);
+      for (unsigned int j=0; j<len; ++j)
+      {
+         keys[i][j] = 'a' + (rand() % 2);
+      }
+      keys[i][len] = 0;
+   }
+   return keys;
+}
+
+static trie_t build_deep (char ** keys, unsigned int count)
+{
+   trie_t t = trie_new();
+   for (unsigned int i=0; i<count; ++i)
+   {
+      trie_insert(t, keys[i], (void*) (uintptr_t) (i+1), NULL);
+   }
+   return t;
+}
+
+struct small_stack_job
+{
+   trie_t trie;
+   unsigned int seen;
+};
+
+static void * small_stack_walk (void * arg)
+{
+   struct small_stack_job * job = arg;
+   trie_walk(job->trie, count_walker, &job->seen);
+   return NULL;
+}
+
+// Loop-based vs recursive find/walk/destroy as the tries get deeper
+static void bench_deep ()
+{
+   enum { KEYS = 64 };
+   printf("%-12s %10s %12s %12s %12s %12s %12s %12s\n", "deep", "key len",
+         "find (us)", "rec find", "walk (us)", "rec walk", "free (us)", "rec free");
+
+   for (unsigned int len = 1000; len <= 100000; len *= 10)
+   {
+      char ** keys = generate_deep_keys(KEYS, len);
+      char * buf = malloc(len+1);
+      unsigned int seen = 0, rseen = 0;
+      double times[6];
+
+      trie_t t = build_deep(keys, KEYS);
+      double start = now_sec();
+      for (unsigned int i=0; i<KEYS; ++i)
+         seen += (trie_find(t, keys[i]) != TRIE_INVALID_POS);
+      times[0] = now_sec() - start;
+
+      start = now_sec();
+      for (unsigned int i=0; i<KEYS; ++i)
+         rseen += (rec_find(t->start, keys[i]) != TRIE_INVALID_POS);
+      times[1] = now_sec() - start;
+
+      start = now_sec();
+      trie_walk(t, count_walker, &seen);
+      times[2] = now_sec() - start;
+
+      start = now_sec();
+      rec_walk(t, t->start, buf, 0, count_walker, &rseen);
+      times[3] = now_sec() - start;
+
+      start = now_sec();
+      trie_destroy(t, NULL);
+      times[4] = now_sec() - start;
+
+      t = build_deep(keys, KEYS);
+      start = now_sec();
+      rec_free(t->start);
+      free(t);
+      times[5] = now_sec() - start;
+
+      if (seen != rseen)
+         printf("warning: loop and recursive versions disagree\n");
+
+      printf("%-12s %10u", "", len);
+      for (unsigned int i=0; i<6; ++i)
+         printf(" %12.1f", times[i] * 1e6);
+      printf("\n");
+
+      free(buf);
+      free_keys(keys, KEYS);
+   }
+
+   // A worker thread with a 64 KiB stack can still walk the deepest trie
+   char ** keys = generate_deep_keys(KEYS, 100000);
+   struct small_stack_job job = { build_deep(keys, KEYS), 0 };
+   pthread_attr_t attr;
+   pthread_t thread;
+   pthread_attr_init(&attr);
+   pthread_attr_setstacksize(&attr, 64 * 1024);
+   if (pthread_create(&thread, &attr, small_stack_walk, &job) == 0)
+   {
+      pthread_join(thread, NULL);
+      printf("64 KiB stack: walked %u keys of length 100000\n", job.seen);
+   }
+   pthread_attr_destroy(&attr);
+   trie_destroy(job.trie, NULL);
+   free_keys(keys, KEYS);
+}
+
+struct filter_job
+{
+   const char * prefix;
+   size_t len;
+   unsigned int found;
+};
+
+// What autocomplete cost before trie_complete: a whole-trie walk and a filter
+static bool filter_walker (trie_t t, trie_pos_t pos, const char * key, void * priv)
+{
+   struct filter_job * job = priv;
+   if (strncmp(key, job->prefix, job->len) == 0)
+      ++job->found;
+   return job->found < 10;
+}
+
+// Top-10 completions of short prefixes: latency should stay flat as the trie grows
+static void bench_complete ()
+{
+   enum { QUERIES = 1000 };
+   printf("%-12s %10s %12s %12s\n", "complete", "keys", "us/query", "walk+filter");
+
+   for (unsigned int count = 1u << 14; count <= 1u << 20; count <<= 2)
+   {
+      char ** keys = generate_keys(count, count);
+      trie_t t = trie_new();
+      for (unsigned int i=0; i<count; ++i)
+         trie_insert(t, keys[i], NULL, NULL);
+
+      char prefixes[QUERIES][4];
+      for (unsigned int q=0; q<QUERIES; ++q)
+      {
+         unsigned int len = 1 + (q % 3);
+         memcpy(prefixes[q], keys[rand() % count], len);
+         prefixes[q][len] = 0;
+      }
+
+      struct trie_match_t out[10];
+      double start = now_sec();
+      for (unsigned int q=0; q<QUERIES; ++q)
+         trie_complete_free(out, trie_complete(t, prefixes[q], out, 10));
+      double complete = now_sec() - start;
+
+      // the filtered walk is much slower, so only a few queries of it
+      start = now_sec();
+      for (unsigned int q=0; q<10; ++q)
+      {
+         struct filter_job job = { prefixes[q], strlen(prefixes[q]), 0 };
+         trie_walk(t, filter_walker, &job);
+      }
+      double filter = now_sec() - start;
+
+      printf("%-12s %10u %12.2f %12.2f\n", "", count, complete * 1e6 / QUERIES, filter * 1e6 / 10);
+
+      trie_destroy(t, NULL);
+      free_keys(keys, count);
+   }
+}
+
+// Narrow ranges over a growing trie: the time per query should follow the number
+// of keys in the range, not the number in the trie
+static void bench_range ()
+{
+   enum { QUERIES = 1000 };
+   printf("%-12s %10s %12s %12s\n", "range", "keys", "us/query", "keys/query");
+
+   for (unsigned int count = 1u << 14; count <= 1u << 20; count <<= 2)
+   {
+      char ** keys = generate_keys(count, count);
+      trie_t t = trie_new();
+      for (unsigned int i=0; i<count; ++i)
+         trie_insert(t, keys[i], NULL, NULL);
+
+      // ["abc", "abd"): one 3-character bucket, which fills up as the trie grows
+      size_t seen = 0;
+      double start = now_sec();
+      for (unsigned int q=0; q<QUERIES; ++q)
+      {
+         char lo[MAX_STRING+1], hi[MAX_STRING+1];
+         strcpy(lo, keys[rand() % count]);
+         lo[3] = 0;
+         strcpy(hi, lo);
+         ++hi[2];
+         seen += trie_count_range(t, lo, hi);
+      }
+      double range = now_sec() - start;
+
+      printf("%-12s %10u %12.2f %12.1f\n", "", count, range * 1e6 / QUERIES, (double) seen / QUERIES);
+
+      trie_destroy(t, NULL);
+      free_keys(keys, count);
+   }
+}
+
+static int compare_keys (const void * a, const void * b)
+{
+   return strcmp(*(const char * const *) a, *(const char * const *) b);
+}
+
+// Nodes a find goes through, to compare how deep the character levels are
+static size_t find_depth (trie_pos_t head, const char * src)
+{
+   size_t visited = 0;
+   while (head != NULL)
+   {
+      ++visited;
+      if ((unsigned char) *src < head->key)
+         head = head->left;
+      else if ((unsigned char) *src > head->key)
+         head = head->right;
+      else if (*(src+1) == '\0')
+         break;
+      else
+      {
+         head = head->mid;
+         ++src;
+      }
+   }
+   return visited;
+}
+
+struct array_stream
+{
+   char ** keys;
+   unsigned int next;
+   unsigned int count;
+};
+
+static bool array_next (void * priv, const char ** key, void ** val)
+{
+   struct array_stream * s = priv;
+   if (s->next == s->count)
+      return false;
+   *key = s->keys[s->next++];
+   *val = NULL;
+   return true;
+}
+
+// Sorted keys put in one at a time vs the bulk builders: build time, nodes
+// visited per find and find time (looked up in random order)
+static void bench_sorted ()
+{
+   printf("%-12s %10s %12s %12s %10s\n", "sorted", "keys", "build (ms)", "nodes/find", "ns/find");
+
+   for (unsigned int count = 1u << 14; count <= 1u << 20; count <<= 2)
+   {
+      char ** keys = generate_keys(count, count);
+      char ** sorted = malloc(count * sizeof(char *));
+      memcpy(sorted, keys, count * sizeof(char *));
+      qsort(sorted, count, sizeof(char *), compare_keys);
+      unsigned int n = 0;
+      for (unsigned int i=0; i<count; ++i)
+      {
+         if ((n == 0) || (strcmp(sorted[n-1], sorted[i]) != 0))
+            sorted[n++] = sorted[i];
+      }
+
+      for (unsigned int how=0; how<3; ++how)
+      {
+         const char * label[] = { "insert", "build_sorted", "build_stream" };
+         struct array_stream stream = { sorted, 0, n };
+         trie_t t = TRIE_INVALID;
+
+         double start = now_sec();
+         if (how == 0)
+         {
+            t = trie_new();
+            for (unsigned int i=0; i<n; ++i)
+               trie_insert(t, sorted[i], NULL, NULL);
+         }
+         else if (how == 1)
+            t = trie_build_sorted((const char * const *) sorted, NULL, n);
+         else
+            t = trie_build_stream(array_next, &stream);
+         double build = now_sec() - start;
+
+         size_t visited = 0;
+         for (unsigned int i=0; i<count; ++i)
+            visited += find_depth(t->start, keys[i]);
+
+         unsigned int found = 0;
+         start = now_sec();
+         for (unsigned int i=0; i<count; ++i)
+            found += (trie_find(t, keys[i]) != TRIE_INVALID_POS);
+         double lookup = now_sec() - start;
+         if (found != count)
+            printf("warning: only %u of %u keys found\n", found, count);
+
+         printf("%-12s %10u %12.2f %12.1f %10.1f\n", label[how], n, build * 1e3,
+               (double) visited / count, lookup * 1e9 / count);
+         trie_destroy(t, NULL);
+         malloc_trim(0);    // so no builder gets the pages of the one before for free
+      }
+
+      free(sorted);
+      free_keys(keys, count);
+   }
+}
+
+// Sequential ids in base 62, fixed width: every level sees its characters in order
+static char ** generate_ids (unsigned int count)
+{
+   static const char digits[] = "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz";
+   char ** keys = malloc(count * sizeof(char *));
+   for (unsigned int i=0; i<count; ++i)
+   {
+      keys[i] = malloc(6);
+      unsigned int id = i;
+      for (int j=4; j>=0; --j)
+      {
+         keys[i][j] = digits[id % 62];
+         id /= 62;
+      }
+      keys[i][5] = 0;
+   }
+   return keys;
+}
+
+// Sequential ids into a plain trie, a TRIE_BALANCED one, and a plain one
+// rebalanced afterwards: insert time, nodes visited per find, find time
+static void bench_balanced ()
+{
+   printf("%-12s %10s %12s %12s %10s\n", "sequential", "keys", "build (ms)", "nodes/find", "ns/find");
+
+   for (unsigned int count = 1u << 14; count <= 1u << 20; count <<= 2)
+   {
+      char ** keys = generate_ids(count);
+      char ** probes = generate_ids(count);
+      for (unsigned int i=count-1; i>0; --i)     // look them up in random order
+      {
+         unsigned int j = rand() % (i+1);
+         char * swap = probes[i];
+         probes[i] = probes[j];
+         probes[j] = swap;
+      }
+
+      for (unsigned int how=0; how<3; ++how)
+      {
+         const char * label[] = { "plain", "balanced", "rebalance" };
+         double start = now_sec();
+         trie_t t = trie_new_flags(how == 1 ? TRIE_BALANCED : 0);
+         for (unsigned int i=0; i<count; ++i)
+            trie_insert(t, keys[i], NULL, NULL);
+         if (how == 2)
+            trie_rebalance(t);
+         double build = now_sec() - start;
+
+         size_t visited = 0;
+         for (unsigned int i=0; i<count; ++i)
+            visited += find_depth(t->start, probes[i]);
+
+         start = now_sec();
+         unsigned int found = 0;
+         for (unsigned int i=0; i<count; ++i)
+            found += (trie_find(t, probes[i]) != TRIE_INVALID_POS);
+         double lookup = now_sec() - start;
+         if (found != count)
+            printf("warning: only %u of %u keys found\n", found, count);
+
+         printf("%-12s %10u %12.2f %12.1f %10.1f\n", label[how], count, build * 1e3,
+               (double) visited / count, lookup * 1e9 / count);
+         trie_destroy(t, NULL);
+      }
+
+      free_keys(probes, count);
+      free_keys(keys, count);
+   }
+}
+
+// Short keys over a 62 character alphabet: most of a lookup is spent in the top levels
+static char ** generate_short_keys (unsigned int count)
+{
+   static const char digits[] = "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz";
+   char ** keys = malloc(count * sizeof(char *));
+   for (unsigned int i=0; i<count; ++i)
+   {
+      unsigned int len = 3 + (rand() % 6);
+      keys[i] = malloc(len+1);
+      for (unsigned int j=0; j<len; ++j)
+         keys[i][j] = digits[rand() % 62];
+      keys[i][len] = 0;
+   }
+   return keys;
+}
+
+// The same short keys with no dispatch table, one level of it and two
+static void bench_dispatch ()
+{
+   printf("%-12s %10s %12s %10s\n", "dispatch", "keys", "ns/insert", "ns/find");
+
+   for (unsigned int count = 1u << 14; count <= 1u << 20; count <<= 2)
+   {
+      char ** keys = generate_short_keys(count);
+
+      for (unsigned int how=0; how<3; ++how)
+      {
+         const char * label[] = { "none", "root256", "root65536" };
+         const unsigned int flags[] = { 0, TRIE_ROOT256, TRIE_ROOT65536 };
+
+         double start = now_sec();
+         trie_t t = trie_new_flags(flags[how]);
+         for (unsigned int i=0; i<count; ++i)
+            trie_insert(t, keys[i], NULL, NULL);
+         double build = now_sec() - start;
+
+         start = now_sec();
+         unsigned int found = 0;
+         for (unsigned int i=0; i<count; ++i)
+            found += (trie_find(t, keys[i]) != TRIE_INVALID_POS);
+         double lookup = now_sec() - start;
+         if (found != count)
+            printf("warning: only %u of %u keys found\n", found, count);
+
+         printf("%-12s %10u %12.1f %10.1f\n", label[how], count, build * 1e9 / count, lookup * 1e9 / count);
+         trie_destroy(t, NULL);
+         malloc_trim(0);
+      }
+
+      free_keys(keys, count);
+   }
+}
+
+// URL-like keys: a handful of hosts and directories shared by many keys, then a
+// unique tail, the shape that leaves most nodes in single-child chains
+static char ** generate_urls (unsigned int count)
+{
+   static const char * dirs[] = { "/static/img/", "/api/v2/users/", "/docs/", "/blog/2019/",
+      "/shop/items/", "/search?q=" };
+   char ** keys = malloc(count * sizeof(char *));
+   for (unsigned int i=0; i<count; ++i)
+   {
+      char buf[128];
+      snprintf(buf, sizeof(buf), "https://www.host%u.example.com%s%08x%04x", rand() % 64,
+            dirs[rand() % 6], (unsigned int) rand(), i & 0xffff);
+      keys[i] = malloc(strlen(buf)+1);
+      strcpy(keys[i], buf);
+   }
+   return keys;
+}
+
+static size_t count_nodes (trie_pos_t node)
+{
+   size_t count = 0;
+   for (; node != NULL; node = node->right)
+      count += 1 + count_nodes(node->left) + count_nodes(node->mid);
+   return count;
+}
+
+// The same URLs with one node per character and with path compression
+static void bench_compress ()
+{
+   printf("%-12s %10s %12s %12s %10s\n", "compress", "keys", "nodes/key", "ns/insert", "ns/find");
+
+   for (unsigned int count = 1u << 14; count <= 1u << 20; count <<= 2)
+   {
+      char ** keys = generate_urls(count);
+
+      for (unsigned int how=0; how<2; ++how)
+      {
+         const char * label[] = { "none", "compress" };
+
+         double start = now_sec();
+         trie_t t = trie_new_flags(how == 0 ? 0 : TRIE_COMPRESS);
+         for (unsigned int i=0; i<count; ++i)
+            trie_insert(t, keys[i], NULL, NULL);
+         double build = now_sec() - start;
+
+         start = now_sec();
+         unsigned int found = 0;
+         for (unsigned int i=0; i<count; ++i)
+            found += (trie_find(t, keys[i]) != TRIE_INVALID_POS);
+         double lookup = now_sec() - start;
+         if (found != count)
+            printf("warning: only %u of %u keys found\n", found, count);
+
+         printf("%-12s %10u %12.1f %12.1f %10.1f\n", label[how], count,
+               (double) count_nodes(t->start) / count, build * 1e9 / count, lookup * 1e9 / count);
+         trie_destroy(t, NULL);
+         malloc_trim(0);
+      }
+
+      free_keys(keys, count);
+   }
+}
+
+// Lookups in the pointer layout against the frozen copy of the same trie, for
+// plain and path-compressed tries over the URL keys
+static void bench_frozen ()
+{
+   printf("%-12s %10s %10s %10s %12s %10s\n", "frozen", "keys", "node MB", "frozen MB", "ns/find", "frozen");
+
+   for (unsigned int count = 1u << 14; count <= 1u << 20; count <<= 2)
+   {
+      char ** keys = generate_urls(count);
+
+      for (unsigned int how=0; how<2; ++how)
+      {
+         const char * label[] = { "none", "compress" };
+         trie_t t = trie_new_flags(how == 0 ? 0 : TRIE_COMPRESS);
+         for (unsigned int i=0; i<count; ++i)
+            trie_insert(t, keys[i], NULL, NULL);
+         trie_frozen_t f = trie_freeze(t);
+
+         double start = now_sec();
+         unsigned int found = 0;
+         for (unsigned int i=0; i<count; ++i)
+            found += (trie_find(t, keys[i]) != TRIE_INVALID_POS);
+         double lookup = now_sec() - start;
+
+         start = now_sec();
+         for (unsigned int i=0; i<count; ++i)
+            found += trie_frozen_find(f, keys[i], NULL);
+         double frozen = now_sec() - start;
+         if (found != 2 * count)
+            printf("warning: only %u of %u keys found\n", found, 2 * count);
+
+         printf("%-12s %10u %10.1f %10.1f %12.1f %10.1f\n", label[how], count,
+               count_nodes(t->start) * sizeof(struct trie_node_t) / 1e6, trie_frozen_bytes(f) / 1e6,
+               lookup * 1e9 / count, frozen * 1e9 / count);
+         trie_frozen_free(f);
+         trie_destroy(t, NULL);
+         malloc_trim(0);
+      }
+
+      free_keys(keys, count);
+   }
+}
+
+// Getting a dictionary back after a restart: inserting every key again against
+// opening the file trie_save wrote (and checking it, which reads it all)
+static void bench_save ()
+{
+   const char * path = "trie_bench.snapshot";
+   printf("%-12s %10s %10s %10s %10s %10s %10s\n", "save", "keys", "insert ms", "save ms", "open ms", "verify ms",
+         "ns/find");
+
+   for (unsigned int count = 1u << 14; count <= 1u << 20; count <<= 2)
+   {
+      char ** keys = generate_urls(count);
+
+      double start = now_sec();
+      trie_t t = trie_new_flags(TRIE_COMPRESS);
+      for (unsigned int i=0; i<count; ++i)
+         trie_insert(t, keys[i], NULL, NULL);
+      double build = now_sec() - start;
+
+      start = now_sec();
+      bool saved = trie_save(t, path);
+      double save = now_sec() - start;
+      trie_destroy(t, NULL);
+
+      start = now_sec();
+      trie_frozen_t f = (saved ? trie_open_mmap(path) : NULL);
+      double open = now_sec() - start;
+      if (f == NULL)
+      {
+         printf("warning: could not save to %s\n", path);
+         free_keys(keys, count);
+         break;
+      }
+
+      start = now_sec();
+      unsigned int found = 0;
+      for (unsigned int i=0; i<count; ++i)
+         found += trie_frozen_find(f, keys[i], NULL);
+      double lookup = now_sec() - start;
+      if (found != count)
+         printf("warning: only %u of %u keys found\n", found, count);
+
+      start = now_sec();
+      bool good = trie_frozen_verify(f);
+      double verify = now_sec() - start;
+      if (!good)
+         printf("warning: checksum mismatch\n");
+
+      printf("%-12s %10u %10.2f %10.2f %10.3f %10.2f %10.1f\n", "", count, build * 1e3, save * 1e3, open * 1e3,
+            verify * 1e3, lookup * 1e9 / count);
+      trie_frozen_free(f);
+      remove(path);
+      free_keys(keys, count);
+   }
+}
+
+static long file_bytes (const char * path)
+{
+   FILE * file = fopen(path, "rb");
+   if (file == NULL)
+      return 0;
+   fseek(file, 0, SEEK_END);
+   long size = ftell(file);
+   fclose(file);
+   return size;
+}
+
+static void bench_log ()
+{
+   const char * snapshot = "trie_bench.snapshot";
+   const char * logpath = "trie_bench.log";
+   const unsigned int count = 1u << 18;
+   const size_t batches[] = { 0, 1, 64, 4096 };
+   char ** keys = generate_urls(count);
+   printf("%-12s %10s %10s %10s %10s\n", "log", "batch", "inserts", "ns/insert", "log bytes");
+
+   for (unsigned int how=0; how<sizeof(batches)/sizeof(batches[0]); ++how)
+   {
+      // a sync per change is slow enough that a few thousand tell the story
+      unsigned int inserts = (batches[how] == 1 ? 4096 : count);
+      remove(logpath);
+      trie_t t = trie_new_flags(TRIE_KEEP_KEYS);
+      trie_log_t log = (batches[how] == 0 ? NULL : trie_log_open(t, logpath, batches[how]));
+      if ((batches[how] != 0) && (log == NULL))
+      {
+         printf("warning: could not open %s\n", logpath);
+         trie_destroy(t, NULL);
+         break;
+      }
+
+      double start = now_sec();
+      for (unsigned int i=0; i<inserts; ++i)
+         trie_insert(t, keys[i], (void*) (uintptr_t) i, NULL);
+      if (log != NULL)
+         trie_log_flush(log);
+      double insert = now_sec() - start;
+
+      printf("%-12s %10zu %10u %10.1f %10ld\n", "", batches[how], inserts, insert * 1e9 / inserts,
+            (log == NULL ? 0L : file_bytes(logpath)));
+      trie_destroy(t, NULL);
+      malloc_trim(0);
+   }
+
+   // half the keys in a snapshot, the other half in the log
+   printf("%-12s %10s %10s %10s %10s\n", "recover", "snapshot", "log", "recover ms", "compact ms");
+   remove(logpath);
+   trie_t t = trie_new_flags(TRIE_KEEP_KEYS);
+   trie_log_t log = trie_log_open(t, logpath, 4096);
+   if (log != NULL)
+   {
+      for (unsigned int i=0; i<count/2; ++i)
+         trie_insert(t, keys[i], (void*) (uintptr_t) i, NULL);
+      trie_log_compact(log, snapshot);
+      for (unsigned int i=count/2; i<count; ++i)
+         trie_insert(t, keys[i], (void*) (uintptr_t) i, NULL);
+      trie_log_close(log);
+      trie_destroy(t, NULL);
+
+      double start = now_sec();
+      t = trie_recover(snapshot, logpath);
+      double recover = now_sec() - start;
+      if ((t == NULL) || (trie_size(t) != count))
+         printf("warning: recovered %u of %u keys\n", (t == NULL ? 0 : trie_size(t)), count);
+
+      start = now_sec();
+      log = (t == NULL ? NULL : trie_log_open(t, logpath, 4096));
+      bool compacted = (log != NULL) && trie_log_compact(log, snapshot);
+      double compact = now_sec() - start;
+      if (!compacted)
+         printf("warning: could not compact\n");
+
+      printf("%-12s %10u %10u %10.2f %10.2f\n", "", count/2, count - count/2, recover * 1e3, compact * 1e3);
+   }
+   if (t != NULL)
+      trie_destroy(t, NULL);
+   remove(snapshot);
+   remove(logpath);
+   free_keys(keys, count);
+   malloc_trim(0);
+}
+
+// Keeps the ten best scores seen by a prefix walk, as a top-10 without the cache would
+struct best_job
+{
+   trie_score_t best[10];
+};
+
+static bool best_walker (trie_t t, trie_pos_t pos, const char * key, void * priv)
+{
+   struct best_job * job = priv;
+   trie_score_t score = trie_get_score(t, pos);
+   for (unsigned int i=0; i<10; ++i)
+   {
+      if (score > job->best[i])
+      {
+         trie_score_t swap = job->best[i];
+         job->best[i] = score;
+         score = swap;
+      }
+   }
+   return true;
+}
+
+// Top-10 by score for one- and two-character prefixes, which match a large
+// share of the keys; the scan has to visit every match, trie_topk should not
+static void bench_topk ()
+{
+   enum { QUERIES = 1000 };
+   printf("%-12s %10s %12s %12s\n", "topk", "keys", "us/query", "prefix scan");
+
+   for (unsigned int count = 1u << 14; count <= 1u << 20; count <<= 2)
+   {
+      char ** keys = generate_keys(count, count);
+      trie_t t = trie_new();
+      for (unsigned int i=0; i<count; ++i)
+         trie_insert(t, keys[i], NULL, NULL);
+      for (unsigned int i=0; i<count; ++i)
+         trie_set_score(t, keys[i], 1e6f / (1 + rand() % count));   // a long tail
+
+      char prefixes[QUERIES][4];
+      for (unsigned int q=0; q<QUERIES; ++q)
+      {
+         unsigned int len = 1 + (q % 2);
+         memcpy(prefixes[q], keys[rand() % count], len);
+         prefixes[q][len] = 0;
+      }
+
+      struct trie_match_t out[10];
+      double start = now_sec();
+      for (unsigned int q=0; q<QUERIES; ++q)
+         trie_complete_free(out, trie_topk(t, prefixes[q], 10, out));
+      double topk = now_sec() - start;
+
+      start = now_sec();
+      for (unsigned int q=0; q<10; ++q)
+      {
+         struct best_job job = { { 0 } };
+         trie_walk_prefix(t, prefixes[q], best_walker, &job);
+      }
+      double scan = now_sec() - start;
+
+      printf("%-12s %10u %12.2f %12.2f\n", "", count, topk * 1e6 / QUERIES, scan * 1e6 / 10);
+
+      trie_destroy(t, NULL);
+      free_keys(keys, count);
+   }
+}
+
+// One reader thread of bench_sharded: mostly lookups, one write in 64
+struct sharded_job
+{
+   trie_t trie;                 // behind lock, when sharded is NULL
+   pthread_mutex_t * lock;
+   trie_sharded_t sharded;
+   char ** keys;
+   unsigned int count;
+   unsigned int ops;
+   unsigned int seed;
+   unsigned int found;
+};
+
+static void * sharded_reader (void * arg)
+{
+   struct sharded_job * job = arg;
+   unsigned int seed = job->seed;
+   for (unsigned int i=0; i<job->ops; ++i)
+   {
+      seed = seed * 1103515245u + 12345u;
+      const char * key = job->keys[(seed >> 8) % job->count];
+      bool write = ((seed & 63) == 0);
+      if (job->sharded != NULL)
+      {
+         if (write)
+            trie_sharded_upsert(job->sharded, key, (void*) (uintptr_t) i, NULL);
+         else
+            job->found += trie_sharded_find(job->sharded, key, NULL);
+      }
+      else
+      {
+         pthread_mutex_lock(job->lock);
+         if (write)
+            trie_upsert(job->trie, key, (void*) (uintptr_t) i, NULL, NULL);
+         else
+            job->found += (trie_find(job->trie, key) != TRIE_INVALID_POS);
+         pthread_mutex_unlock(job->lock);
+      }
+   }
+   return NULL;
+}
+
+// Read-heavy throughput as threads are added: one trie behind one mutex (what
+// callers had to do before) against a sharded trie with a lock per shard
+static void bench_sharded ()
+{
+   enum { OPS = 1 << 20, SHARDS = 64 };
+   const unsigned int count = 1u << 20;
+   long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+   char ** keys = generate_keys(count, 17);
+   printf("%-12s %10s %12s %12s\n", "sharded", "threads", "mutex Mop/s", "shard Mop/s");
+
+   trie_t t = trie_new();
+   trie_sharded_t s = trie_sharded_new(SHARDS);
+   pthread_mutex_t lock;
+   pthread_mutex_init(&lock, NULL);
+   for (unsigned int i=0; i<count; ++i)
+   {
+      trie_insert(t, keys[i], NULL, NULL);
+      trie_sharded_insert(s, keys[i], NULL);
+   }
+
+   for (unsigned int threads = 1; threads <= (cpus < 1 ? 1 : cpus); threads *= 2)
+   {
+      double rate[2];
+      for (unsigned int how=0; how<2; ++how)
+      {
+         pthread_t tids[threads];
+         struct sharded_job jobs[threads];
+         double start = now_sec();
+         for (unsigned int j=0; j<threads; ++j)
+         {
+            jobs[j] = (struct sharded_job) { t, &lock, (how == 0 ? NULL : s), keys, count, OPS / threads, j + 1, 0 };
+            pthread_create(&tids[j], NULL, sharded_reader, &jobs[j]);
+         }
+         for (unsigned int j=0; j<threads; ++j)
+            pthread_join(tids[j], NULL);
+         rate[how] = (double) (OPS / threads) * threads / (now_sec() - start) / 1e6;
+      }
+      printf("%-12s %10u %12.2f %12.2f\n", "", threads, rate[0], rate[1]);
+   }
+
+   pthread_mutex_destroy(&lock);
+   trie_sharded_destroy(s, NULL);
+   trie_destroy(t, NULL);
+   free_keys(keys, count);
+   malloc_trim(0);
+}
+
+// The reader of bench_epoch: times every lookup until it has done its share
+struct epoch_job
+{
+   trie_t trie;
+   pthread_rwlock_t * lock;     // NULL for the TRIE_EPOCH trie
+   char ** keys;
+   unsigned int count;
+   double * lat;
+   unsigned int lookups;
+   volatile bool done;
+};
+
+static void * epoch_lookups (void * arg)
+{
+   struct epoch_job * job = arg;
+   trie_reader_t reader = (job->lock == NULL ? trie_reader_new(job->trie) : NULL);
+   for (unsigned int i=0; i<job->lookups; ++i)
+   {
+      const char * key = job->keys[(i * 2654435761u) % job->count];
+      double start = now_sec();
+      if (job->lock != NULL)
+      {
+         pthread_rwlock_rdlock(job->lock);
+         trie_find(job->trie, key);
+         pthread_rwlock_unlock(job->lock);
+      }
+      else
+      {
+         trie_read_begin(reader);
+         trie_find(job->trie, key);
+         trie_read_end(reader);
+      }
+      job->lat[i] = now_sec() - start;
+   }
+   if (reader != NULL)
+      trie_reader_free(reader);
+   __atomic_store_n(&job->done, true, __ATOMIC_RELEASE);
+   return NULL;
+}
+
+static int compare_doubles (const void * a, const void * b)
+{
+   double x = *(const double *) a, y = *(const double *) b;
+   return (x > y) - (x < y);
+}
+
+// Lookup latency while a writer removes and re-inserts keys in bursts: behind a
+// reader/writer lock every burst shows up in the tail, with TRIE_EPOCH it should not
+static void bench_epoch ()
+{
+   enum { LOOKUPS = 1 << 18, BURST = 4096 };
+   const unsigned int count = 1u << 18;
+   char ** keys = generate_keys(count, 23);
+   double * lat = malloc(LOOKUPS * sizeof(double));
+   printf("%-12s %10s %10s %10s %10s\n", "epoch", "lock", "p50 ns", "p99 ns", "p99.9 ns");
+
+   for (unsigned int how=0; how<2; ++how)
+   {
+      trie_t t = (how == 0 ? trie_new() : trie_new_flags(TRIE_EPOCH));
+      pthread_rwlock_t lock;
+      pthread_rwlock_init(&lock, NULL);
+      for (unsigned int i=0; i<count; ++i)
+         trie_insert(t, keys[i], NULL, NULL);
+
+      struct epoch_job job = { t, (how == 0 ? &lock : NULL), keys, count, lat, LOOKUPS, false };
+      pthread_t tid;
+      pthread_create(&tid, NULL, epoch_lookups, &job);
+
+      // bursts of writes, each under one write lock, until the reader is done
+      for (unsigned int round=0; !__atomic_load_n(&job.done, __ATOMIC_ACQUIRE); ++round)
+      {
+         unsigned int base = (round * BURST) % count;
+         if (how == 0)
+            pthread_rwlock_wrlock(&lock);
+         for (unsigned int i=base; i<base+BURST && i<count; ++i)
+            trie_remove(t, keys[i], NULL);
+         for (unsigned int i=base; i<base+BURST && i<count; ++i)
+            trie_insert(t, keys[i], NULL, NULL);
+         if (how == 0)
+            pthread_rwlock_unlock(&lock);
+      }
+      pthread_join(tid, NULL);
+
+      qsort(lat, LOOKUPS, sizeof(double), compare_doubles);
+      printf("%-12s %10s %10.0f %10.0f %10.0f\n", "", (how == 0 ? "rwlock" : "epoch"),
+            lat[LOOKUPS/2] * 1e9, lat[LOOKUPS/100*99] * 1e9, lat[LOOKUPS/1000*999] * 1e9);
+
+      pthread_rwlock_destroy(&lock);
+      trie_destroy(t, NULL);
+   }
+
+   free(lat);
+   free_keys(keys, count);
+   malloc_trim(0);
+}
+
+struct snapshot_job {
+   trie_t t;
+   pthread_mutex_t * lock;
+   bool snapshot;
+   unsigned int walks;
+   bool done;
+};
+
+// Export walks: over the whole trie under its lock, or over a snapshot taken under it
+static void * snapshot_exporter (void * arg)
+{
+   struct snapshot_job * job = arg;
+   for (unsigned int w=0; w<job->walks; ++w)
+   {
+      unsigned int count = 0;
+      pthread_mutex_lock(job->lock);
+      if (job->snapshot)
+      {
+         trie_t snap = trie_snapshot(job->t);
+         pthread_mutex_unlock(job->lock);
+         trie_walk(snap, count_walker, &count);
+         trie_destroy(snap, NULL);
+      }
+      else
+      {
+         trie_walk(job->t, count_walker, &count);
+         pthread_mutex_unlock(job->lock);
+      }
+   }
+   __atomic_store_n(&job->done, true, __ATOMIC_RELEASE);
+   return NULL;
+}
+
+static void bench_snapshot ()
+{
+   enum { MAXLAT = 1 << 22, WALKS = 4 };
+   const unsigned int count = 1u << 18;
+   char ** keys = generate_keys(count, 29);
+   double * lat = malloc(MAXLAT * sizeof(double));
+   printf("%-12s %10s %10s %10s %10s %10s\n", "snapshot", "export", "Mupd/s", "p50 ns", "p99.9 ns", "max ms");
+
+   for (unsigned int how=0; how<2; ++how)
+   {
+      trie_t t = trie_new_flags(TRIE_KEEP_KEYS);
+      pthread_mutex_t lock;
+      pthread_mutex_init(&lock, NULL);
+      for (unsigned int i=0; i<count; ++i)
+         trie_insert(t, keys[i], NULL, NULL);
+
+      struct snapshot_job job = { t, &lock, (how == 1), WALKS, false };
+      pthread_t tid;
+      pthread_create(&tid, NULL, snapshot_exporter, &job);
+
+      // single updates, each under the lock, for as long as the exports run
+      size_t n = 0;
+      double start = now_sec();
+      for (unsigned int i=0; !__atomic_load_n(&job.done, __ATOMIC_ACQUIRE); ++i)
+      {
+         double t0 = now_sec();
+         pthread_mutex_lock(&lock);
+         trie_upsert(t, keys[(i * 7919u) % count], (void *)(uintptr_t)i, NULL, NULL);
+         pthread_mutex_unlock(&lock);
+         lat[n] = now_sec() - t0;
+         n = (n + 1) % MAXLAT;
+      }
+      double secs = now_sec() - start;
+      pthread_join(tid, NULL);
+
+      qsort(lat, n, sizeof(double), compare_doubles);
+      printf("%-12s %10s %10.2f %10.0f %10.0f %10.2f\n", "", (how == 0 ? "locked" : "snapshot"),
+            n / secs / 1e6, lat[n/2] * 1e9, lat[n/1000*999] * 1e9, lat[n-1] * 1e3);
+
+      pthread_mutex_destroy(&lock);
+      trie_destroy(t, NULL);
+   }
+
+   free(lat);
+   free_keys(keys, count);
+   malloc_trim(0);
+}
+
+static void bench_parallel ()
+{
+   const unsigned int count = 1u << 20;
+   char ** keys = generate_keys(count, 31);
+   char ** sorted = malloc(count * sizeof(char *));
+   memcpy(sorted, keys, count * sizeof(char *));
+   qsort(sorted, count, sizeof(char *), compare_keys);
+   long cores = sysconf(_SC_NPROCESSORS_ONLN);
+   printf("%-12s %10s %10s %12s %12s   (%ld cores)\n", "parallel", "input", "threads", "build (ms)", "ns/find", cores);
+
+   for (unsigned int input=0; input<2; ++input)
+   {
+      char ** in = (input == 0 ? keys : sorted);
+      for (unsigned int threads=0; threads<=16; threads = (threads == 0 ? 1 : threads * 2))
+      {
+         double start = now_sec();
+         trie_t t = TRIE_INVALID;
+         if (threads == 0)
+         {
+            t = trie_new_arena(0);
+            for (unsigned int i=0; i<count; ++i)
+               trie_insert(t, in[i], NULL, NULL);
+         }
+         else
+            t = trie_build_parallel((const char * const *) in, NULL, count, threads);
+         double build = now_sec() - start;
+
+         unsigned int found = 0;
+         start = now_sec();
+         for (unsigned int i=0; i<count; ++i)
+            found += (trie_find(t, keys[i]) != TRIE_INVALID_POS);
+         double lookup = now_sec() - start;
+         if (found != count)
+            printf("warning: only %u of %u keys found\n", found, count);
+
+         char label[16];
+         snprintf(label, sizeof(label), "%u", threads);
+         printf("%-12s %10s %10s %12.2f %12.1f\n", "", (input == 0 ? "random" : "sorted"),
+               (threads == 0 ? "insert" : label), build * 1e3, lookup * 1e9 / count);
+         trie_destroy(t, NULL);
+         malloc_trim(0);
+      }
+   }
+
+   free(sorted);
+   free_keys(keys, count);
+}
+
+static bool atomic_count_walker (trie_t t, trie_pos_t pos, const char * key, void * priv)
+{
+   __atomic_add_fetch((unsigned int *) priv, 1, __ATOMIC_RELAXED);
+   return true;
+}
+
+static void bench_walk_parallel ()
+{
+   const unsigned int count = 1u << 20;
+   char ** keys = generate_keys(count, 31);
+   long cores = sysconf(_SC_NPROCESSORS_ONLN);
+   printf("%-12s %10s %12s %12s %14s   (%ld cores)\n", "par-walk", "threads", "walk (ms)", "free (ms)",
+         "bg return (us)", cores);
+
+   for (unsigned int threads=1; threads<=16; threads *= 2)
+   {
+      double times[3];
+      unsigned int seen = 0;
+      trie_t t = trie_new();
+      for (unsigned int i=0; i<count; ++i)
+         trie_insert(t, keys[i], NULL, NULL);
+
+      unsigned int size = trie_size(t);
+
+      double start = now_sec();
+      trie_walk_parallel(t, atomic_count_walker, &seen, threads);
+      times[0] = now_sec() - start;
+      if (seen != size)
+         printf("warning: walked %u of %u keys\n", seen, size);
+
+      start = now_sec();
+      trie_destroy_parallel(t, NULL, threads);
+      times[1] = now_sec() - start;
+
+      // the same again, only timing how long the caller waits
+      t = trie_new();
+      for (unsigned int i=0; i<count; ++i)
+         trie_insert(t, keys[i], NULL, NULL);
+      start = now_sec();
+      trie_destroy_background(t, NULL, threads);
+      times[2] = now_sec() - start;
+      trie_destroy_wait();
+
+      printf("%-12s %10u %12.2f %12.2f %14.1f\n", "", threads, times[0] * 1e3, times[1] * 1e3, times[2] * 1e6);
+      malloc_trim(0);
+   }
+
+   free_keys(keys, count);
+}
+
+static void bench_find_batch ()
+{
+   const unsigned int count = 1u << 20;
+   char ** keys = generate_keys(count, 37);
+   trie_pos_t * out = malloc(count * sizeof(trie_pos_t));
+   printf("%-12s %10s %10s %12s %10s\n", "find-batch", "layout", "batch", "ns/find", "speedup");
+
+   // looked up in another order than inserted, so consecutive lookups share no nodes
+   char ** order = malloc(count * sizeof(char *));
+   for (unsigned int i=0; i<count; ++i)
+      order[i] = keys[(i * 2654435761u) % count];
+
+   for (unsigned int layout=0; layout<2; ++layout)
+   {
+      trie_t t = (layout == 0 ? trie_new() : trie_new_flags(TRIE_ROOT65536 | TRIE_COMPRESS));
+      for (unsigned int i=0; i<count; ++i)
+         trie_insert(t, keys[i], NULL, NULL);
+
+      double base = 0;
+      for (unsigned int batch=1; batch<=4096; batch *= 4)
+      {
+         unsigned int found = 0;
+         double start = now_sec();
+         if (batch == 1)
+         {
+            for (unsigned int i=0; i<count; ++i)
+               found += (trie_find(t, order[i]) != TRIE_INVALID_POS);
+         }
+         else
+         {
+            for (unsigned int i=0; i<count; i+=batch)
+               found += trie_find_batch(t, (const char * const *) order + i, batch, out + i);
+         }
+         double ns = (now_sec() - start) * 1e9 / count;
+         if (found != count)
+            printf("warning: only %u of %u keys found\n", found, count);
+         if (batch == 1)
+            base = ns;
+
+         char label[16];
+         snprintf(label, sizeof(label), "%u", batch);
+         printf("%-12s %10s %10s %12.1f %9.2fx\n", "", (layout == 0 ? "plain" : "root+comp"),
+               (batch == 1 ? "trie_find" : label), ns, base / ns);
+      }
+      trie_destroy(t, NULL);
+      malloc_trim(0);
+   }
+
+   free(order);
+   free(out);
+   free_keys(keys, count);
+}
+
+// Short keys over 26 letters, so every level down to the fourth is full of siblings
+static void bench_wide ()
+{
+   const unsigned int count = 1u << 20;
+   char ** keys = malloc(count * sizeof(char *));
+   srand(41);
+   for (unsigned int i=0; i<count; ++i)
+   {
+      unsigned int len = 4 + (rand() % 5);
+      keys[i] = malloc(len+1);
+      for (unsigned int j=0; j<len; ++j)
+         keys[i][j] = 'a' + (rand() % 26);
+      keys[i][len] = 0;
+   }
+   char ** order = malloc(count * sizeof(char *));
+   for (unsigned int i=0; i<count; ++i)
+      order[i] = keys[(i * 2654435761u) % count];
+   printf("%-12s %12s %12s %10s %12s\n", "wide", "flags", "ns/insert", "ns/find", "ns/remove");
+
+   const unsigned int flags[] = { 0, TRIE_BALANCED, TRIE_WIDE, TRIE_WIDE | TRIE_BALANCED };
+   const char * label[] = { "plain", "balanced", "wide", "wide+bal" };
+   for (unsigned int how=0; how<4; ++how)
+   {
+      double start = now_sec();
+      trie_t t = trie_new_flags(flags[how]);
+      for (unsigned int i=0; i<count; ++i)
+         trie_insert(t, keys[i], NULL, NULL);
+      double insert = now_sec() - start;
+
+      start = now_sec();
+      unsigned int found = 0;
+      for (unsigned int i=0; i<count; ++i)
+         found += (trie_find(t, order[i]) != TRIE_INVALID_POS);
+      double lookup = now_sec() - start;
+      if (found != count)
+         printf("warning: only %u of %u keys found\n", found, count);
+
+      start = now_sec();
+      for (unsigned int i=0; i<count; ++i)
+         trie_remove(t, order[i], NULL);
+      double removal = now_sec() - start;
+
+      printf("%-12s %12s %12.1f %10.1f %12.1f\n", "", label[how], insert * 1e9 / count,
+            lookup * 1e9 / count, removal * 1e9 / count);
+      trie_destroy(t, NULL);
+      malloc_trim(0);
+   }
+
+   free(order);
+   free_keys(keys, count);
+}
+
+// Burst tries by threshold against plain nodes: bytes/key, and how long it takes to
+// insert, find (in another order than inserted) and walk everything
+static void bench_burst ()
+{
+   const unsigned int count = 1u << 20;
+   char ** keys = generate_keys(count, 43);
+   char ** order = malloc(count * sizeof(char *));
+   for (unsigned int i=0; i<count; ++i)
+      order[i] = keys[(i * 2654435761u) % count];
+   printf("%-12s %12s %10s %12s %10s %10s %10s\n", "burst", "threshold", "bytes/key",
+         "ns/insert", "ns/find", "walk (ms)", "ns/remove");
+
+   const size_t thresholds[] = { 0, 8, 16, 32, 64, 128 };
+   for (unsigned int how=0; how<sizeof(thresholds)/sizeof(thresholds[0]); ++how)
+   {
+      size_t heap = heap_in_use();
+      double start = now_sec();
+      trie_t t = (thresholds[how] == 0 ? trie_new() : trie_new_burst(thresholds[how]));
+      for (unsigned int i=0; i<count; ++i)
+         trie_insert(t, keys[i], NULL, NULL);
+      double insert = now_sec() - start;
+      unsigned int size = trie_size(t);
+      size_t bytes = heap_in_use() - heap;
+
+      start = now_sec();
+      unsigned int found = 0;
+      for (unsigned int i=0; i<count; ++i)
+         found += (trie_find(t, order[i]) != TRIE_INVALID_POS);
+      double lookup = now_sec() - start;
+      if (found != count)
+         printf("warning: only %u of %u keys found\n", found, count);
+
+      unsigned int walked = 0;
+      start = now_sec();
+      trie_walk(t, count_walker, &walked);
+      double walk = now_sec() - start;
+      if (walked != size)
+         printf("warning: walked %u of %u keys\n", walked, size);
+
+      start = now_sec();
+      for (unsigned int i=0; i<count; ++i)
+         trie_remove(t, order[i], NULL);
+      double removal = now_sec() - start;
+
+      char label[24];
+      if (thresholds[how] == 0)
+         snprintf(label, sizeof(label), "nodes");
+      else
+         snprintf(label, sizeof(label), "%zu", thresholds[how]);
+      printf("%-12s %12s %10.1f %12.1f %10.1f %10.1f %10.1f\n", "", label, (double) bytes / size,
+            insert * 1e9 / count, lookup * 1e9 / count, walk * 1e3, removal * 1e9 / count);
+      trie_destroy(t, NULL);
+      malloc_trim(0);
+   }
+
+   free(order);
+   free_keys(keys, count);
+}
+
+int main ()
+{
+   bench_build("malloc", new_plain);
+   bench_build("keep-keys", new_keep_keys);
+   bench_build("arena", new_arena);
+   bench_build("compact", new_compact);
+   bench_build("burst", new_burst);
+   bench_deep();
+   bench_complete();
+   bench_range();
+   bench_topk();
+   bench_sorted();
+   bench_balanced();
+   bench_dispatch();
+   bench_compress();
+   bench_frozen();
+   bench_save();
+   bench_log();
+   bench_sharded();
+   bench_epoch();
+   bench_snapshot();
+   bench_parallel();
+   bench_walk_parallel();
+   bench_find_batch();
+   bench_wide();
+   bench_burst();
+   return 0;
+}
@@ -0,0 +1,471 @@
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include "trie.h"
+#include "trie_int.h"
+
+// Bulk construction from keys that are already sorted. Neither builder ever
+// searches the trie: the sorted order tells them where every node goes, and
+// each character level comes out as a balanced BST instead of the chain that
+// trie_insert makes out of sorted input.
+
+// A range of sorted keys that all share their first depth characters and all
+// go on past them, waiting to be hung off *link as one character level
+struct trie_build_item_t {
+    trie_pos_t *link;
+    size_t lo;
+    size_t hi;
+    size_t depth;
+};
+
+// The pending ranges of trie_build_sorted, so long keys do not recurse
+struct trie_build_t {
+    trie_t trie;
+    const char * const *keys;
+    void * const *vals;
+    size_t *common;             // common[i]: characters keys[i] shares with keys[i-1]
+    struct trie_build_item_t *items;
+    size_t top;
+    size_t cap;
+};
+
+/* Helper function to queue a range of keys as a character level */
+static bool trie_build_push(struct trie_build_t *b, trie_pos_t *link, size_t lo, size_t hi, size_t depth) {
+    if (b->top == b->cap) {
+        size_t cap = (b->cap == 0 ? 64 : b->cap * 2);
+        struct trie_build_item_t *items = (struct trie_build_item_t *)realloc(b->items, cap * sizeof(struct trie_build_item_t));
+        if (items == NULL) { return false; }
+        b->items = items;
+        b->cap = cap;
+    }
+
+    struct trie_build_item_t item = { link, lo, hi, depth };
+    b->items[b->top++] = item;
+    return true;
+}
+
+/* Build the level for groups [glo, ghi) of starts (group g holds keys starts[g] up to
+   starts[g+1]), median group first, and hang it off *link. A level has at most 256
+   groups, so this recursion is never more than 9 deep; the levels below each group
+   are queued instead. */
+static bool trie_build_groups(struct trie_build_t *b, trie_pos_t *link, const size_t *starts,
+        size_t glo, size_t ghi, size_t depth) {
+    if (glo >= ghi) { return true; }
+
+    size_t g = glo + (ghi - glo) / 2;
+    size_t lo = starts[g], hi = starts[g+1];
+    const char *key = b->keys[lo];
+
+    trie_pos_t node = trie_new_node(b->trie, key[depth], NULL);
+    if (node == NULL) { return false; }
+    (*link) = node;
+
+    if (key[depth+1] == '\0') {     // the shortest key of the group ends right here
+        node->terminal = true;
+        node->val = (b->vals != NULL ? b->vals[lo] : NULL);
+        ++b->trie->size;
+        ++lo;
+    }
+
+    return ((lo == hi) || trie_build_push(b, &node->mid, lo, hi, depth + 1))
+        && trie_build_groups(b, &node->left, starts, glo, g, depth)
+        && trie_build_groups(b, &node->right, starts, g + 1, ghi, depth);
+}
+
+/* Helper function to check that keys are non-empty and strictly increasing, noting
+   how long a prefix each key shares with the one before it. Returns the number of
+   nodes the trie will need (every key adds one per character past that prefix),
+   or 0 if the keys are not fit for trie_build_sorted */
+static size_t trie_build_common(const char * const *keys, size_t n, size_t *common) {
+    size_t nodes = 0;
+    for (size_t i = 0; i < n; ++i) {
+        if ((keys[i] == NULL) || (keys[i][0] == '\0')) { return 0; }
+
+        size_t c = 0;
+        if (i > 0) {
+            const unsigned char *prev = (const unsigned char *)keys[i-1], *key = (const unsigned char *)keys[i];
+            while ((prev[c] != '\0') && (prev[c] == key[c])) { ++c; }
+            if (prev[c] >= key[c]) { return 0; }    // equal, or smaller than the key before
+        }
+        common[i] = c;
+        nodes += strlen(keys[i] + c);
+    }
+    return nodes;
+}
+
+/// Build a trie from n sorted keys in one pass
+trie_t trie_build_sorted (const char * const * keys, void * const * vals, size_t n) {
+    size_t *common = (size_t *)malloc((n == 0 ? 1 : n) * sizeof(size_t));
+    if (common == NULL) { return TRIE_INVALID; }
+
+    // the node count is known up front, so they all come out of one arena slab
+    trie_t trie = TRIE_INVALID;
+    size_t nodes = trie_build_common(keys, n, common);
+    if ((nodes > 0) || (n == 0)) { trie = trie_new_arena(nodes); }
+    if (trie == NULL) {
+        free(common);
+        return TRIE_INVALID;
+    }
+
+    struct trie_build_t b = { trie, keys, vals, common, NULL, 0, 0 };
+    bool ok = (n == 0) || trie_build_push(&b, &trie->start, 0, n, 0);
+
+    while (ok && (b.top > 0)) {
+        struct trie_build_item_t item = b.items[--b.top];
+
+        // split the range by the character at depth: all keys in it share the first
+        // depth characters, so a new character starts wherever that is all they share
+        size_t starts[257], groups = 0;
+        starts[groups++] = item.lo;
+        for (size_t i = item.lo + 1; i < item.hi; ++i) {
+            if (common[i] == item.depth) { starts[groups++] = i; }
+        }
+        starts[groups] = item.hi;
+
+        ok = trie_build_groups(&b, item.link, starts, 0, groups, item.depth);
+    }
+
+    free(b.items);
+    free(common);
+    if (!ok) {
+        trie_destroy(trie, NULL);
+        return TRIE_INVALID;
+    }
+    return trie;
+}
+
+/* Rotate every other node of the right-linked chain at *link up to the left of its
+   right neighbour, count times: one Day-Stout-Warren compression pass */
+static void trie_compress_vine(trie_pos_t *link, size_t count) {
+    for (size_t i = 0; i < count; ++i) {
+        trie_pos_t child = (*link);
+        trie_pos_t up = child->right;
+        child->right = up->left;
+        up->left = child;
+        (*link) = up;
+        link = &up->right;
+    }
+}
+
+/* Helper function to redo the heights and cached maxima of a balanced level, children
+   first (a level has at most 256 nodes, so once balanced it is at most 9 high) */
+static void trie_fix_level(trie_pos_t node) {
+    if (node == NULL) { return; }
+    trie_fix_level(node->left);
+    trie_fix_level(node->right);
+    trie_avl_height(node);
+    trie_fix_max(node);
+}
+
+/* Turn the count nodes chained in key order through their right links at *link (a
+   vine) into a complete BST in place: Day-Stout-Warren, no stack and no allocation */
+static void trie_balance_vine(trie_pos_t *link, size_t count) {
+    size_t full = 1;
+    while (full * 2 <= count + 1) { full *= 2; }
+
+    // first fill the partial bottom row, then halve the vine until it is a tree
+    size_t leaves = count + 1 - full;
+    trie_compress_vine(link, leaves);
+    for (size_t size = count - leaves; size > 1; size /= 2) {
+        trie_compress_vine(link, size / 2);
+    }
+
+    trie_fix_level(*link);
+}
+
+/* Flatten the level at *link into a vine by rotating every left child up, the first
+   half of Day-Stout-Warren. Returns the number of nodes in the level */
+static size_t trie_flatten_level(trie_pos_t *link) {
+    size_t count = 0;
+    while ((*link) != NULL) {
+        trie_pos_t node = (*link);
+        if (node->left != NULL) {
+            trie_pos_t up = node->left;
+            node->left = up->right;
+            up->right = node;
+            (*link) = up;
+        } else {
+            ++count;
+            link = &node->right;
+        }
+    }
+    return count;
+}
+
+/* Rebuild every level of a trie as a complete BST, one level at a time: flatten it,
+   note the levels below it, then balance it. False when out of memory, in which
+   case the levels not reached yet are left as they were */
+static bool trie_balance_levels(trie_t trie) {
+    struct trie_stack_t stack = { NULL, 0, 0 };
+    trie_pos_t *link = &trie->start;
+    bool ok = true;
+
+    while (true) {
+        size_t count = trie_flatten_level(link);
+        for (trie_pos_t node = (*link); ok && (node != NULL); node = node->right) {
+            if ((node->mid != NULL) && !TRIE_TAGGED(node->mid)) { ok = trie_stack_push(&stack, node, 0); }   // buckets have no levels
+        }
+        trie_balance_vine(link, count);
+
+        if (!ok || (stack.top == 0)) { break; }
+        link = &stack.frames[stack.top-1].node->mid;
+        --stack.top;
+    }
+
+    free(stack.frames);
+    return ok;
+}
+
+/// Rebalance every character level of the trie in place
+bool trie_rebalance (trie_t trie) {
+    if (trie->compact != NULL) { return false; }
+    // every level is rebuilt, so a trie sharing nodes with a snapshot copies them all first
+    if (!trie_own_all(trie)) { return false; }
+    return trie_balance_levels(trie);
+}
+
+/// Build a trie from a stream of sorted keys
+trie_t trie_build_stream (trie_next_t next, void * priv) {
+    trie_t trie = trie_new_arena(0);
+    if (trie == NULL) { return TRIE_INVALID; }
+
+    // path[d] is the node of character d of the previous key; being the largest
+    // key so far, every node on it is the rightmost of its level
+    trie_pos_t *path = NULL;
+    size_t depth = 0, cap = 0;
+    const char *key = NULL;
+    void *val = NULL;
+    bool ok = true;
+
+    while (ok && next(priv, &key, &val)) {
+        size_t len = ((key == NULL) ? 0 : strlen(key));
+        size_t common = 0;
+        while ((common < len) && (common < depth) && ((unsigned char)key[common] == path[common]->key)) { ++common; }
+
+        // strictly increasing: the new key has to branch off to the right or go on deeper
+        if ((len == 0) || (common == len)
+            || ((common < depth) && ((unsigned char)key[common] < path[common]->key))) { ok = false; break; }
+
+        if (len > cap) {
+            size_t ncap = (cap == 0 ? 64 : cap);
+            while (ncap < len) { ncap *= 2; }
+            trie_pos_t *npath = (trie_pos_t *)realloc(path, ncap * sizeof(trie_pos_t));
+            if (npath == NULL) { ok = false; break; }
+            path = npath;
+            cap = ncap;
+        }
+
+        trie_pos_t *link = (common == 0 ? &trie->start : &path[common-1]->mid);
+        if (common < depth) { link = &path[common]->right; }
+
+        for (size_t d = common; d < len; ++d) {
+            trie_pos_t node = trie_new_node(trie, key[d], NULL);
+            if (node == NULL) { ok = false; break; }
+            (*link) = node;
+            path[d] = node;
+            link = &node->mid;
+        }
+        if (!ok) { break; }
+
+        path[len-1]->terminal = true;
+        path[len-1]->val = val;
+        ++trie->size;
+        depth = len;
+    }
+
+    free(path);
+    // every level is a vine already, so this is just the balancing half
+    if (!ok || !trie_balance_levels(trie)) {
+        trie_destroy(trie, NULL);
+        return TRIE_INVALID;
+    }
+    return trie;
+}
+
+// trie_build_parallel sorts the keys into character levels MSD-radix style: a range
+// of keys sharing their first depth characters is grouped by the character at depth
+// (stable, so a duplicate key keeps its first value as trie_insert would), one node
+// per group becomes the level, median first, and each group's keys that go on make
+// the range of the level below. Ranges are independent of each other, so the big ones
+// go to the work-stealing pool and the rest are finished by the worker that made them.
+
+#define TRIE_PAR_SPLIT 4096     // ranges of at least this many keys are shared with the pool
+#define TRIE_PAR_SMALL 32       // ranges up to this size are grouped by insertion sort
+#define TRIE_PAR_BUCKETS 512    // two per character: the keys ending there, then the rest
+
+// What one worker of trie_build_parallel works with: nodes come out of its own arena
+// (build.trie) and its ranges wait on build's stack. On a cache line of its own
+struct trie_par_worker_t {
+    _Alignas(64) struct trie_build_t build;
+};
+
+struct trie_par_t {
+    const char * const *keys;
+    void * const *vals;
+    size_t *idx;                // key numbers, grouped a bit more at every level
+    size_t *tmp;                // tmp[lo, hi) is scratch space for regrouping idx[lo, hi)
+    struct trie_par_worker_t *workers;
+};
+
+/* Helper function for the bucket of a key at depth: its character, and whether it
+   goes on past it, so the keys ending at a character come first in its group */
+static size_t trie_par_bucket(const char *key, size_t depth) {
+    return ((size_t)(unsigned char)key[depth] << 1) | (key[depth+1] != '\0');
+}
+
+/* Helper function to group the keys of idx[lo, hi) by their buckets at depth, keeping
+   the order within a bucket */
+static void trie_par_group(struct trie_par_t *par, size_t lo, size_t hi, size_t depth) {
+    const char * const *keys = par->keys;
+    size_t *idx = par->idx;
+
+    if (hi - lo <= TRIE_PAR_SMALL) {
+        for (size_t i = lo + 1; i < hi; ++i) {
+            size_t k = idx[i], b = trie_par_bucket(keys[k], depth), j = i;
+            while ((j > lo) && (trie_par_bucket(keys[idx[j-1]], depth) > b)) {
+                idx[j] = idx[j-1];
+                --j;
+            }
+            idx[j] = k;
+        }
+        return;
+    }
+
+    // counting sort, which sorted input (already grouped) gets away without
+    size_t count[TRIE_PAR_BUCKETS] = { 0 };
+    size_t prev = 0;
+    bool grouped = true;
+    for (size_t i = lo; i < hi; ++i) {
+        size_t b = trie_par_bucket(keys[idx[i]], depth);
+        ++count[b];
+        if (b < prev) { grouped = false; }
+        prev = b;
+    }
+    if (grouped) { return; }
+
+    size_t at = lo;
+    for (size_t b = 0; b < TRIE_PAR_BUCKETS; ++b) {
+        size_t c = count[b];
+        count[b] = at;
+        at += c;
+    }
+    for (size_t i = lo; i < hi; ++i) {
+        par->tmp[count[trie_par_bucket(keys[idx[i]], depth)]++] = idx[i];
+    }
+    memcpy(idx + lo, par->tmp + lo, (hi - lo) * sizeof(size_t));
+}
+
+/* Build the level for groups [glo, ghi) of starts (group g holds idx[starts[g] up to
+   starts[g+1]), median group first, and hang it off *link. As with trie_build_groups
+   this recursion is at most 9 deep, and the ranges below are handed on: to the pool
+   when they are big enough, else to the worker's own stack */
+static bool trie_par_groups(struct trie_par_t *par, struct trie_pool_t *pool, unsigned int worker,
+        trie_pos_t *link, const size_t *starts, size_t glo, size_t ghi, size_t depth) {
+    if (glo >= ghi) { return true; }
+
+    struct trie_build_t *b = &par->workers[worker].build;
+    size_t g = glo + (ghi - glo) / 2;
+    size_t lo = starts[g], hi = starts[g+1];
+
+    trie_pos_t node = trie_new_node(b->trie, par->keys[par->idx[lo]][depth], NULL);
+    if (node == NULL) { return false; }
+    (*link) = node;
+
+    if (par->keys[par->idx[lo]][depth+1] == '\0') {     // the first of them wins
+        node->terminal = true;
+        node->val = (par->vals != NULL ? par->vals[par->idx[lo]] : NULL);
+        ++b->trie->size;
+        while ((lo < hi) && (par->keys[par->idx[lo]][depth+1] == '\0')) { ++lo; }
+    }
+
+    bool ok = true;
+    if (hi - lo >= TRIE_PAR_SPLIT) {
+        struct trie_build_item_t item = { &node->mid, lo, hi, depth + 1 };
+        ok = trie_pool_push(pool, worker, &item);
+    } else if (lo < hi) {
+        ok = trie_build_push(b, &node->mid, lo, hi, depth + 1);
+    }
+
+    return ok
+        && trie_par_groups(par, pool, worker, &node->left, starts, glo, g, depth)
+        && trie_par_groups(par, pool, worker, &node->right, starts, g + 1, ghi, depth);
+}
+
+/* Pool task of trie_build_parallel: build the levels of one range of keys, and those
+   below it that are not big enough to share */
+static bool trie_par_task(struct trie_pool_t *pool, unsigned int worker, void *task, void *priv) {
+    struct trie_par_t *par = (struct trie_par_t *)priv;
+    struct trie_build_t *b = &par->workers[worker].build;
+    struct trie_build_item_t *first = (struct trie_build_item_t *)task;
+
+    bool ok = trie_build_push(b, first->link, first->lo, first->hi, first->depth);
+    while (ok && (b->top > 0)) {
+        struct trie_build_item_t item = b->items[--b->top];
+        trie_par_group(par, item.lo, item.hi, item.depth);
+
+        size_t starts[257], groups = 0;
+        starts[groups++] = item.lo;
+        for (size_t i = item.lo + 1; i < item.hi; ++i) {
+            if (par->keys[par->idx[i]][item.depth] != par->keys[par->idx[i-1]][item.depth]) { starts[groups++] = i; }
+        }
+        starts[groups] = item.hi;
+
+        ok = trie_par_groups(par, pool, worker, item.link, starts, 0, groups, item.depth);
+    }
+
+    b->top = 0;
+    return ok;
+}
+
+/// Build a trie from n keys on nthreads threads
+trie_t trie_build_parallel (const char * const * keys, void * const * vals, size_t n,
+      unsigned int nthreads) {
+    for (size_t i = 0; i < n; ++i) {
+        if ((keys[i] == NULL) || (keys[i][0] == '\0')) { return TRIE_INVALID; }
+    }
+
+    trie_t trie = trie_new_arena(0);
+    struct trie_par_t par = { keys, vals, NULL, NULL, NULL };
+    struct trie_pool_t *pool = trie_pool_new(nthreads, sizeof(struct trie_build_item_t), trie_par_task, &par);
+    unsigned int nworkers = (pool != NULL ? trie_pool_workers(pool) : 0), ready = 0;
+    bool ok = (trie != NULL) && (pool != NULL);
+
+    if (ok) {
+        par.idx = (size_t *)malloc((n == 0 ? 1 : n) * sizeof(size_t));
+        par.tmp = (size_t *)malloc((n == 0 ? 1 : n) * sizeof(size_t));
+        par.workers = (struct trie_par_worker_t *)aligned_alloc(64, nworkers * sizeof(struct trie_par_worker_t));
+        ok = (par.idx != NULL) && (par.tmp != NULL) && (par.workers != NULL);
+    }
+    for (; ok && (ready < nworkers); ++ready) {
+        struct trie_build_t b = { trie_new_arena(0), keys, vals, NULL, NULL, 0, 0 };
+        if (b.trie == NULL) { ok = false; break; }
+        par.workers[ready].build = b;
+    }
+
+    if (ok && (n > 0)) {
+        for (size_t i = 0; i < n; ++i) { par.idx[i] = i; }
+        struct trie_build_item_t root = { &trie->start, 0, n, 0 };
+        ok = trie_pool_push(pool, 0, &root) && trie_pool_run(pool);
+    }
+
+    // every node and key count goes over to the trie, whether it is kept or not
+    for (unsigned int w = 0; w < ready; ++w) {
+        struct trie_build_t *b = &par.workers[w].build;
+        if (trie != NULL) {
+            trie->size += b->trie->size;
+            trie_arena_adopt(trie, b->trie);
+        }
+        trie_destroy(b->trie, NULL);
+        free(b->items);
+    }
+
+    free(par.workers);
+    free(par.tmp);
+    free(par.idx);
+    if (pool != NULL) { trie_pool_free(pool); }
+    if (!ok && (trie != NULL)) {
+        trie_destroy(trie, NULL);
+        return TRIE_INVALID;
+    }
+    return trie;
+}
@@ -0,0 +1,293 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <string.h>
+#include "trie.h"
+#include "trie_int.h"
+
+// Buckets for trie_new_burst, after the burst tries of Heinz, Zobel and Williams.
+// Below a node, the keys that share its prefix can be kept as a bucket instead of
+// a level of nodes: one block holding an entry per key (its value and where its
+// suffix is) followed by the suffix bytes, back to back. A lookup that reaches a
+// bucket scans its entries in one go, comparing lengths first, so the long tail of
+// rare keys costs a few bytes per character and a cache line or two per lookup
+// instead of a 56-byte node per character. A bucket about to take more than the
+// trie's threshold of suffixes bursts: it becomes a level of nodes, one per first
+// character of its suffixes, each with a bucket of the rests below it.
+//
+// A bucket only ever hangs off a mid link, and the top level is always nodes. The
+// ordered queries (cursors, top-k) step through a bucket by way of its keys sorted
+// on the spot, leaving it as it is; only a key given a score is burst out of its
+// bucket, scores living in nodes.
+
+#define TRIE_BUCKET_MIN 4           // entries a new bucket has room for
+#define TRIE_BUCKET_BYTES 32        // suffix bytes a new bucket has room for, at least
+
+struct trie_bucket_t {
+    uint32_t count;                 // entries in use
+    uint32_t cap;                   // room for entries; the suffix bytes follow them
+    uint32_t end;                   // suffix bytes used, those of removed entries included
+    uint32_t room;                  // room for suffix bytes
+    struct trie_entry_t entries[];
+};
+
+/* Helper function to get at the suffix bytes of a bucket */
+static char *trie_bucket_bytes(const struct trie_bucket_t *b) {
+    return (char *)(b->entries + b->cap);
+}
+
+/* Helper function to allocate a bucket with room for cap entries and room suffix bytes */
+static struct trie_bucket_t *trie_bucket_alloc(uint32_t cap, uint32_t room) {
+    struct trie_bucket_t *b = (struct trie_bucket_t *)malloc(sizeof(struct trie_bucket_t)
+        + cap * sizeof(struct trie_entry_t) + room);
+    if (b == NULL) { return NULL; }
+
+    b->count = 0;
+    b->cap = cap;
+    b->end = 0;
+    b->room = room;
+    return b;
+}
+
+/* Helper function to add an entry for the len bytes of suffix to a bucket with room for it */
+static struct trie_entry_t *trie_bucket_append(struct trie_bucket_t *b, const char *suffix, size_t len, void *val) {
+    struct trie_entry_t *e = &b->entries[b->count++];
+    e->val = val;
+    e->off = b->end;
+    e->len = (uint32_t)len;
+    memcpy(trie_bucket_bytes(b) + b->end, suffix, len);
+    b->end += (uint32_t)len;
+    return e;
+}
+
+/* Helper function to move a bucket into a new block with room for one more entry of
+   len bytes, leaving out the bytes of removed entries. NULL when out of memory, b
+   then staying as it was */
+static struct trie_bucket_t *trie_bucket_grow(trie_t trie, struct trie_bucket_t *b, size_t len) {
+    uint32_t count = (b == NULL ? 0 : b->count);
+    size_t live = len;
+    for (uint32_t i = 0; i < count; ++i) { live += b->entries[i].len; }
+
+    // entries double up to the threshold, past which the bucket only grows when it
+    // could not burst
+    uint32_t cap = (b != NULL ? b->cap : (trie->burst < TRIE_BUCKET_MIN ? trie->burst : TRIE_BUCKET_MIN));
+    if (count == cap) {
+        cap = (cap * 2 > trie->burst ? trie->burst : cap * 2);
+        if (cap <= count) { cap = count + 1; }
+    }
+    if (live > UINT32_MAX / 2) { return NULL; }
+    size_t room = (live * 2 < TRIE_BUCKET_BYTES ? TRIE_BUCKET_BYTES : live * 2);
+
+    struct trie_bucket_t *nb = trie_bucket_alloc(cap, (uint32_t)room);
+    if (nb == NULL) { return NULL; }
+
+    const char *bytes = (b == NULL ? NULL : trie_bucket_bytes(b));
+    for (uint32_t i = 0; i < count; ++i) {
+        trie_bucket_append(nb, bytes + b->entries[i].off, b->entries[i].len, b->entries[i].val);
+    }
+    free(b);
+    return nb;
+}
+
+/* Helper function to find the entry of the len bytes of suffix in a bucket */
+trie_pos_t trie_bucket_find(trie_pos_t bucket, const char *suffix, size_t len) {
+    const struct trie_bucket_t *b = (const struct trie_bucket_t *)TRIE_UNTAG(bucket);
+    const char *bytes = trie_bucket_bytes(b);
+
+    for (uint32_t i = 0; i < b->count; ++i) {
+        const struct trie_entry_t *e = &b->entries[i];
+        if ((e->len == len) && (memcmp(bytes + e->off, suffix, len) == 0)) { return TRIE_TAG(e); }
+    }
+    return TRIE_INVALID_POS;
+}
+
+/* Helper function to link the nodes of a level, sorted by character, into a BST
+   median first. At most 256 of them, so this recurses 9 deep at most */
+static trie_pos_t trie_burst_link(trie_pos_t *nodes, size_t lo, size_t hi) {
+    if (lo == hi) { return NULL; }
+
+    size_t mid = lo + (hi - lo) / 2;
+    nodes[mid]->left = trie_burst_link(nodes, lo, mid);
+    nodes[mid]->right = trie_burst_link(nodes, mid + 1, hi);
+    return nodes[mid];
+}
+
+/* Helper function to burst the bucket at *link into a level of nodes: a node per first
+   character of its suffixes, holding the key of the one-character suffix if there is
+   one, with a bucket of the rests of the others below it. False when out of memory,
+   the bucket then staying as it was */
+bool trie_bucket_burst(trie_t trie, trie_pos_t *link) {
+    struct trie_bucket_t *b = (struct trie_bucket_t *)TRIE_UNTAG(*link);
+    const char *bytes = trie_bucket_bytes(b);
+
+    // the rests that go below each character, and their bytes
+    uint32_t rests[256] = { 0 };
+    size_t room[256] = { 0 };
+    bool present[256] = { false };
+    for (uint32_t i = 0; i < b->count; ++i) {
+        unsigned char c = (unsigned char)bytes[b->entries[i].off];
+        present[c] = true;
+        if (b->entries[i].len > 1) {
+            ++rests[c];
+            room[c] += b->entries[i].len - 1;
+        }
+    }
+
+    trie_pos_t nodes[256] = { NULL };
+    trie_pos_t level[256];
+    struct trie_bucket_t *below[256] = { NULL };
+    size_t count = 0, made = 0;
+    bool ok = true;
+    for (unsigned int c = 0; ok && (c < 256); ++c) {
+        if (!present[c]) { continue; }
+
+        nodes[c] = level[count++] = trie_new_node(trie, (char)c, NULL);
+        ok = (nodes[c] != NULL);
+        if (ok && (rests[c] > 0)) {
+            below[c] = trie_bucket_alloc(rests[c], (uint32_t)room[c]);
+            ok = (below[c] != NULL);
+            ++made;
+        }
+    }
+
+    if (!ok) {
+        for (unsigned int c = 0; c < 256; ++c) {
+            if (nodes[c] != NULL) { trie_recycle_node(trie, nodes[c]); }
+            free(below[c]);
+        }
+        return false;
+    }
+
+    for (uint32_t i = 0; i < b->count; ++i) {
+        const struct trie_entry_t *e = &b->entries[i];
+        unsigned char c = (unsigned char)bytes[e->off];
+        if (e->len == 1) {
+            nodes[c]->terminal = true;
+            nodes[c]->val = e->val;
+        } else {
+            trie_bucket_append(below[c], bytes + e->off + 1, e->len - 1, e->val);
+        }
+    }
+    for (size_t i = 0; i < count; ++i) {
+        unsigned char c = level[i]->key;
+        if (below[c] != NULL) { level[i]->mid = TRIE_TAG(below[c]); }
+    }
+
+    (*link) = trie_burst_link(level, 0, count);
+    trie->buckets += made - 1;
+    free(b);
+    return true;
+}
+
+/* Helper function to add the len bytes of suffix to the bucket at *link, making one
+   if *link is NULL. Returns its entry, *created telling whether it is new; or
+   TRIE_INVALID_POS once the bucket burst into a level of nodes for the descent to go
+   on into, or when out of memory (*link then being a bucket or NULL still). A bucket
+   that cannot burst for lack of memory takes the suffix anyway */
+trie_pos_t trie_bucket_insert(trie_t trie, trie_pos_t *link, const char *suffix, size_t len, bool *created) {
+    struct trie_bucket_t *b = NULL;
+    if ((*link) != NULL) {
+        trie_pos_t found = trie_bucket_find(*link, suffix, len);
+        if (found != TRIE_INVALID_POS) { return found; }
+
+        if ((((struct trie_bucket_t *)TRIE_UNTAG(*link))->count >= trie->burst) && trie_bucket_burst(trie, link)) {
+            return TRIE_INVALID_POS;
+        }
+        b = (struct trie_bucket_t *)TRIE_UNTAG(*link);
+    }
+
+    if ((b == NULL) || (b->count == b->cap) || (b->room - b->end < len)) {
+        struct trie_bucket_t *nb = trie_bucket_grow(trie, b, len);
+        if (nb == NULL) { return TRIE_INVALID_POS; }
+        if (b == NULL) { ++trie->buckets; }
+        b = nb;
+        (*link) = TRIE_TAG(b);
+    }
+
+    (*created) = true;
+    return TRIE_TAG(trie_bucket_append(b, suffix, len, NULL));
+}
+
+/* Helper function to remove the entry at pos from the bucket at *link; the last entry
+   takes its place. An empty bucket is freed and *link cleared */
+void trie_bucket_remove(trie_t trie, trie_pos_t *link, trie_pos_t pos) {
+    struct trie_bucket_t *b = (struct trie_bucket_t *)TRIE_UNTAG(*link);
+    struct trie_entry_t *e = (struct trie_entry_t *)TRIE_UNTAG(pos);
+
+    (*e) = b->entries[--b->count];
+    if (b->count == 0) {
+        free(b);
+        (*link) = NULL;
+        --trie->buckets;
+    }
+}
+
+/* Helper function to visit the keys of a bucket, the key above it being the first depth
+   bytes of *buf. False when the callback says to stop or when out of memory */
+bool trie_bucket_walk(trie_t trie, trie_pos_t bucket, char **buf, size_t *cap, size_t depth,
+        const struct trie_visit_t *visit) {
+    const struct trie_bucket_t *b = (const struct trie_bucket_t *)TRIE_UNTAG(bucket);
+    const char *bytes = trie_bucket_bytes(b);
+
+    for (uint32_t i = 0; i < b->count; ++i) {
+        const struct trie_entry_t *e = &b->entries[i];
+        if (!trie_reserve_key(buf, cap, depth + e->len + 1)) { return false; }
+        memcpy((*buf) + depth, bytes + e->off, e->len);
+        (*buf)[depth + e->len] = '\0';
+        if (!trie_visit(visit, trie, TRIE_TAG(e), *buf, depth + e->len)) { return false; }
+    }
+    return true;
+}
+
+/* Helper function to free a bucket, calling freefunc (if not NULL) for its values */
+void trie_bucket_free(trie_pos_t bucket, trie_free_t freefunc) {
+    struct trie_bucket_t *b = (struct trie_bucket_t *)TRIE_UNTAG(bucket);
+    if (freefunc != NULL) {
+        for (uint32_t i = 0; i < b->count; ++i) { freefunc(b->entries[i].val); }
+    }
+    free(b);
+}
+
+/* Helper function to order two bucket keys as bytes, for qsort */
+static int trie_bucket_order(const void *a, const void *b) {
+    const struct trie_bucket_key_t *x = (const struct trie_bucket_key_t *)a;
+    const struct trie_bucket_key_t *y = (const struct trie_bucket_key_t *)b;
+    return trie_key_cmp(x->suffix, x->len, y->suffix, y->len);
+}
+
+/* Helper function to list the keys of a bucket in key order into *keys, grown to fit
+   (it has room for *cap of them). Returns how many there are, or (size_t)-1 when out
+   of memory */
+size_t trie_bucket_keys(trie_pos_t bucket, struct trie_bucket_key_t **keys, size_t *cap) {
+    const struct trie_bucket_t *b = (const struct trie_bucket_t *)TRIE_UNTAG(bucket);
+    const char *bytes = trie_bucket_bytes(b);
+
+    if (b->count > (*cap)) {
+        struct trie_bucket_key_t *grown = (struct trie_bucket_key_t *)realloc(*keys, b->count * sizeof(struct trie_bucket_key_t));
+        if (grown == NULL) { return (size_t)-1; }
+        (*keys) = grown;
+        (*cap) = b->count;
+    }
+
+    for (uint32_t i = 0; i < b->count; ++i) {
+        const struct trie_entry_t *e = &b->entries[i];
+        (*keys)[i].suffix = bytes + e->off;
+        (*keys)[i].len = e->len;
+        (*keys)[i].pos = TRIE_TAG(e);
+    }
+    if (b->count > 1) { qsort(*keys, b->count, sizeof(struct trie_bucket_key_t), trie_bucket_order); }
+    return b->count;
+}
+
+/* Helper function to find the first of count sorted bucket keys that is not below the
+   len bytes at key (count if there is none) */
+size_t trie_bucket_lower(const struct trie_bucket_key_t *keys, size_t count, const char *key, size_t len) {
+    size_t lo = 0, hi = count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (trie_key_cmp(keys[mid].suffix, keys[mid].len, key, len) < 0) { lo = mid + 1; } else { hi = mid; }
+    }
+    return lo;
+}
@@ -0,0 +1,364 @@
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdint.h>
+#include "trie_compact.h"
+
+#define TRIE_COMPACT_NIL 0
+#define TRIE_COMPACT_MIN_NODES 64
+
+// A compact node: the same TST links as struct trie_node_t, but as 32-bit
+// indices into trie_compact_t.nodes. There is no parent link and no fullkey
+// copy; mutations keep an explicit path and walks rebuild the key, so a node
+// is 16 bytes instead of 56.
+struct trie_cnode_t {
+    uint32_t left;
+    uint32_t mid;
+    uint32_t right;
+    unsigned char key;
+    bool terminal;
+};
+
+_Static_assert(sizeof(struct trie_cnode_t) <= 16, "compact trie nodes must stay within 16 bytes");
+
+// The compact trie; vals[i] belongs to nodes[i], slot 0 is the null link.
+// Removed nodes are chained through their mid link for reuse.
+struct trie_compact_t {
+    struct trie_cnode_t *nodes;
+    void **vals;
+    uint32_t used;
+    uint32_t cap;
+    uint32_t root;
+    uint32_t freelist;
+};
+
+// Which link of a node a descent came through; lets insert re-derive the
+// link after the node array has been reallocated underneath it.
+enum trie_compact_dir_t { TRIE_COMPACT_ROOT, TRIE_COMPACT_LEFT, TRIE_COMPACT_MID, TRIE_COMPACT_RIGHT };
+
+/* Helper function to get the address of a link, given its owner and direction */
+static uint32_t *trie_compact_link(struct trie_compact_t *c, uint32_t owner, enum trie_compact_dir_t dir) {
+    switch (dir) {
+        case TRIE_COMPACT_LEFT: return &c->nodes[owner].left;
+        case TRIE_COMPACT_MID: return &c->nodes[owner].mid;
+        case TRIE_COMPACT_RIGHT: return &c->nodes[owner].right;
+        default: return &c->root;
+    }
+}
+
+/* Helper function to grow both arrays; returns false when out of memory (or indices) */
+static bool trie_compact_grow(struct trie_compact_t *c, uint32_t cap) {
+    struct trie_cnode_t *nodes = (struct trie_cnode_t *)realloc(c->nodes, cap * sizeof(struct trie_cnode_t));
+    if (nodes == NULL) { return false; }
+    c->nodes = nodes;
+
+    void **vals = (void **)realloc(c->vals, cap * sizeof(void *));
+    if (vals == NULL) { return false; }
+    c->vals = vals;
+
+    c->cap = cap;
+    return true;
+}
+
+struct trie_compact_t *trie_compact_new(size_t size_hint) {
+    struct trie_compact_t *c = (struct trie_compact_t *)malloc(sizeof(struct trie_compact_t));
+    if (c == NULL) { return NULL; }
+
+    c->nodes = NULL;
+    c->vals = NULL;
+    c->used = 1;        // slot 0 is the null link
+    c->cap = 0;
+    c->root = TRIE_COMPACT_NIL;
+    c->freelist = TRIE_COMPACT_NIL;
+
+    if (size_hint < TRIE_COMPACT_MIN_NODES) { size_hint = TRIE_COMPACT_MIN_NODES; }
+    if (size_hint > UINT32_MAX) { size_hint = UINT32_MAX; }
+    if (!trie_compact_grow(c, (uint32_t)size_hint)) {
+        trie_compact_free(c, NULL);
+        return NULL;
+    }
+
+    return c;
+}
+
+void trie_compact_free(struct trie_compact_t *c, trie_free_t freefunc) {
+    if (freefunc != NULL) {
+        for (uint32_t i = 1; i < c->used; ++i) {
+            if (c->nodes[i].terminal) { freefunc(c->vals[i]); }
+        }
+    }
+
+    free(c->nodes);
+    free(c->vals);
+    free(c);
+}
+
+/* Helper function to generate a new node; returns TRIE_COMPACT_NIL when out of memory */
+static uint32_t trie_compact_new_node(struct trie_compact_t *c, const char src) {
+    uint32_t idx = c->freelist;
+
+    if (idx != TRIE_COMPACT_NIL) {
+        c->freelist = c->nodes[idx].mid;
+    } else {
+        if (c->used == c->cap) {
+            if (c->cap == UINT32_MAX) { return TRIE_COMPACT_NIL; }
+            uint32_t cap = (c->cap > UINT32_MAX / 2 ? UINT32_MAX : c->cap * 2);
+            if (!trie_compact_grow(c, cap)) { return TRIE_COMPACT_NIL; }
+        }
+        idx = c->used++;
+    }
+
+    c->nodes[idx].left = TRIE_COMPACT_NIL;
+    c->nodes[idx].mid = TRIE_COMPACT_NIL;
+    c->nodes[idx].right = TRIE_COMPACT_NIL;
+    c->nodes[idx].key = src;
+    c->nodes[idx].terminal = false;
+    c->vals[idx] = NULL;
+    return idx;
+}
+
+/* Helper function to put a node on the free list */
+static void trie_compact_release_node(struct trie_compact_t *c, uint32_t idx) {
+    c->nodes[idx].terminal = false;
+    c->vals[idx] = NULL;
+    c->nodes[idx].mid = c->freelist;
+    c->freelist = idx;
+}
+
+trie_pos_t trie_compact_find(const struct trie_compact_t *c, const char *key, size_t len) {
+    if ((key == NULL) || (len == 0)) { return TRIE_INVALID_POS; }
+    const char *last = key + len - 1;
+
+    uint32_t cur = c->root;
+    while (cur != TRIE_COMPACT_NIL) {
+        const struct trie_cnode_t *node = &c->nodes[cur];
+        if ((unsigned char)*key < node->key) {
+            cur = node->left;
+        } else if ((unsigned char)*key > node->key) {
+            cur = node->right;
+        } else if (key == last) {
+            return (node->terminal ? trie_compact_pos(cur) : TRIE_INVALID_POS);
+        } else {
+            cur = node->mid;
+            ++key;
+        }
+    }
+
+    return TRIE_INVALID_POS;
+}
+
+trie_pos_t trie_compact_insert(struct trie_compact_t *c, const char *key, size_t len, bool *created) {
+    uint32_t owner = TRIE_COMPACT_NIL, first = TRIE_COMPACT_NIL;
+    enum trie_compact_dir_t dir = TRIE_COMPACT_ROOT, firstdir = TRIE_COMPACT_ROOT;
+    uint32_t firstowner = TRIE_COMPACT_NIL;
+
+    (*created) = false;
+    if ((key == NULL) || (len == 0)) { return TRIE_INVALID_POS; }
+    const char *last = key + len - 1;
+
+    uint32_t cur = c->root;
+    while (true) {
+        if (cur == TRIE_COMPACT_NIL) {
+            cur = trie_compact_new_node(c, *key);
+            if (cur == TRIE_COMPACT_NIL) { break; }
+            *trie_compact_link(c, owner, dir) = cur;
+            if (first == TRIE_COMPACT_NIL) { first = cur; firstowner = owner; firstdir = dir; }
+        }
+
+        struct trie_cnode_t *node = &c->nodes[cur];
+        owner = cur;
+        if ((unsigned char)*key < node->key) {
+            dir = TRIE_COMPACT_LEFT;
+            cur = node->left;
+        } else if ((unsigned char)*key > node->key) {
+            dir = TRIE_COMPACT_RIGHT;
+            cur = node->right;
+        } else if (key == last) {
+            if (!node->terminal) {
+                node->terminal = true;
+                (*created) = true;
+            }
+            return trie_compact_pos(cur);
+        } else {
+            dir = TRIE_COMPACT_MID;
+            cur = node->mid;
+            ++key;
+        }
+    }
+
+    // out of memory; the nodes added by this call form a single mid chain
+    if (first != TRIE_COMPACT_NIL) {
+        *trie_compact_link(c, firstowner, firstdir) = TRIE_COMPACT_NIL;
+        while (first != TRIE_COMPACT_NIL) {
+            uint32_t next = c->nodes[first].mid;
+            trie_compact_release_node(c, first);
+            first = next;
+        }
+    }
+    return TRIE_INVALID_POS;
+}
+
+/* Unlink node idx (reached through *link) from its character-level BST,
+   splicing in its in-order successor when it has two children */
+static void trie_compact_unlink(struct trie_compact_t *c, uint32_t *link, uint32_t idx) {
+    struct trie_cnode_t *node = &c->nodes[idx];
+
+    if (node->left == TRIE_COMPACT_NIL) {
+        (*link) = node->right;
+    } else if (node->right == TRIE_COMPACT_NIL) {
+        (*link) = node->left;
+    } else {
+        uint32_t *slink = &node->right;
+        while (c->nodes[*slink].left != TRIE_COMPACT_NIL) { slink = &c->nodes[*slink].left; }
+
+        uint32_t succ = (*slink);
+        (*slink) = c->nodes[succ].right;
+        c->nodes[succ].left = node->left;
+        c->nodes[succ].right = node->right;
+        (*link) = succ;
+    }
+
+    trie_compact_release_node(c, idx);
+}
+
+bool trie_compact_remove(struct trie_compact_t *c, const char *key, size_t len, void **data) {
+    if ((key == NULL) || (len == 0)) { return false; }
+    const char *last = key + len - 1;
+
+    // every link taken on the way down; mid[] marks the ones that start a new level
+    size_t depth = 0, cap = len * 2 + 8;
+    uint32_t **path = (uint32_t **)malloc(cap * sizeof(uint32_t *));
+    bool *mid = (bool *)malloc(cap * sizeof(bool));
+    bool found = false;
+    if ((path == NULL) || (mid == NULL)) { free(path); free(mid); return false; }
+
+    uint32_t *link = &c->root;
+    bool down = true;
+    while ((*link) != TRIE_COMPACT_NIL) {
+        if (depth == cap) {
+            cap *= 2;
+            uint32_t **npath = (uint32_t **)realloc(path, cap * sizeof(uint32_t *));
+            if (npath != NULL) { path = npath; }
+            bool *nmid = (bool *)realloc(mid, cap * sizeof(bool));
+            if (nmid != NULL) { mid = nmid; }
+            if ((npath == NULL) || (nmid == NULL)) { break; }
+        }
+        path[depth] = link;
+        mid[depth++] = down;
+
+        struct trie_cnode_t *node = &c->nodes[*link];
+        down = false;
+        if ((unsigned char)*key < node->key) {
+            link = &node->left;
+        } else if ((unsigned char)*key > node->key) {
+            link = &node->right;
+        } else if (key == last) {
+            found = node->terminal;
+            break;
+        } else {
+            link = &node->mid;
+            down = true;
+            ++key;
+        }
+    }
+
+    if (found) {
+        uint32_t idx = *path[depth-1];
+        if (data != NULL) { (*data) = c->vals[idx]; }
+        c->nodes[idx].terminal = false;
+        c->vals[idx] = NULL;
+
+        // prune nodes that no longer lead to a key, climbing a level each
+        // time the BST we removed from becomes empty
+        while (depth > 0) {
+            idx = *path[depth-1];
+            if (c->nodes[idx].terminal || (c->nodes[idx].mid != TRIE_COMPACT_NIL)) { break; }
+
+            trie_compact_unlink(c, path[depth-1], idx);
+            while ((depth > 0) && !mid[depth-1]) { --depth; }
+            if ((depth == 0) || (*path[depth-1] != TRIE_COMPACT_NIL)) { break; }
+            --depth;    // the level is gone; its owner may be prunable too
+        }
+    }
+
+    free(path);
+    free(mid);
+    return found;
+}
+
+bool trie_compact_walk(trie_t trie, const struct trie_compact_t *c, const struct trie_visit_t *visit) {
+    if (c->root == TRIE_COMPACT_NIL) { return true; }
+
+    // explicit stack of (node, depth) plus one key buffer shared by every callback
+    size_t scap = 64, kcap = 64, top = 0;
+    uint32_t *stack = (uint32_t *)malloc(scap * sizeof(uint32_t));
+    size_t *depths = (size_t *)malloc(scap * sizeof(size_t));
+    char *buf = (char *)malloc(kcap);
+    bool ret = true;
+    if ((stack == NULL) || (depths == NULL) || (buf == NULL)) { ret = false; goto out; }
+
+    stack[top] = c->root;
+    depths[top++] = 0;
+    while (top > 0) {
+        uint32_t idx = stack[--top];
+        size_t depth = depths[top];
+        const struct trie_cnode_t *node = &c->nodes[idx];
+
+        if (depth + 2 > kcap) {
+            char *nbuf = (char *)realloc(buf, kcap * 2);
+            if (nbuf == NULL) { ret = false; goto out; }
+            buf = nbuf;
+            kcap *= 2;
+        }
+        buf[depth] = node->key;
+
+        if (node->terminal) {   // we hit a full key!
+            buf[depth+1] = '\0';
+            if (!trie_visit(visit, trie, trie_compact_pos(idx), buf, depth + 1)) { ret = false; goto out; }
+        }
+
+        if (top + 3 > scap) {
+            uint32_t *nstack = (uint32_t *)realloc(stack, scap * 2 * sizeof(uint32_t));
+            if (nstack != NULL) { stack = nstack; }
+            size_t *ndepths = (size_t *)realloc(depths, scap * 2 * sizeof(size_t));
+            if (ndepths != NULL) { depths = ndepths; }
+            if ((nstack == NULL) || (ndepths == NULL)) { ret = false; goto out; }
+            scap *= 2;
+        }
+
+        // popped in the same order the pointer trie visits: mid, left, right
+        if (node->right != TRIE_COMPACT_NIL) { stack[top] = node->right; depths[top++] = depth; }
+        if (node->left != TRIE_COMPACT_NIL) { stack[top] = node->left; depths[top++] = depth; }
+        if (node->mid != TRIE_COMPACT_NIL) { stack[top] = node->mid; depths[top++] = depth + 1; }
+    }
+
+out:
+    free(stack);
+    free(depths);
+    free(buf);
+    return ret;
+}
+
+trie_pos_t trie_compact_root(const struct trie_compact_t *c) {
+    return trie_compact_pos(c->root);
+}
+
+void trie_compact_view(const struct trie_compact_t *c, trie_pos_t pos, struct trie_view_t *view) {
+    const struct trie_cnode_t *node = &c->nodes[trie_compact_idx(pos)];
+
+    view->left = trie_compact_pos(node->left);
+    view->mid = trie_compact_pos(node->mid);
+    view->right = trie_compact_pos(node->right);
+    view->key = node->key;
+    view->terminal = node->terminal;
+    view->fraglen = 0;
+    view->frag = NULL;
+}
+
+void *trie_compact_get_value(const struct trie_compact_t *c, trie_pos_t pos) {
+    return c->vals[trie_compact_idx(pos)];
+}
+
+void trie_compact_set_value(struct trie_compact_t *c, trie_pos_t pos, void *value) {
+    c->vals[trie_compact_idx(pos)] = value;
+}
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "trie.h"
+#include "trie_int.h"
+
+// Internal interface of the compact trie representation used by trie.c for
+// tries created with trie_new_compact. Not part of the public API.
+//
+// Nodes live in one contiguous array and link to each other by 32-bit
+// indices (0 is the null link); values live in a separate array indexed the
+// same way. A position handed out through trie.h is the node index cast to
+// trie_pos_t, so it survives the array being grown.
+
+struct trie_compact_t;
+
+/* Helpers to turn a node index into a position and back */
+static inline trie_pos_t trie_compact_pos(uint32_t idx) {
+    return (trie_pos_t)(uintptr_t)idx;
+}
+
+static inline uint32_t trie_compact_idx(trie_pos_t pos) {
+    return (uint32_t)(uintptr_t)pos;
+}
+
+struct trie_compact_t *trie_compact_new(size_t size_hint);
+void trie_compact_free(struct trie_compact_t *c, trie_free_t freefunc);
+
+trie_pos_t trie_compact_find(const struct trie_compact_t *c, const char *key, size_t len);
+trie_pos_t trie_compact_insert(struct trie_compact_t *c, const char *key, size_t len, bool *created);
+bool trie_compact_remove(struct trie_compact_t *c, const char *key, size_t len, void **data);
+bool trie_compact_walk(trie_t trie, const struct trie_compact_t *c, const struct trie_visit_t *visit);
+
+trie_pos_t trie_compact_root(const struct trie_compact_t *c);
+void trie_compact_view(const struct trie_compact_t *c, trie_pos_t pos, struct trie_view_t *view);
+
+void *trie_compact_get_value(const struct trie_compact_t *c, trie_pos_t pos);
+void trie_compact_set_value(struct trie_compact_t *c, trie_pos_t pos, void *value);
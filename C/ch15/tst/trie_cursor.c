@@ -0,0 +1,495 @@
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include "trie.h"
+#include "trie_int.h"
+
+#define TRIE_CURSOR_MIN 64
+
+// Where the in-order visit of a node stands. A TST node yields its left branch,
+// then its own key, then everything below its mid link and finally its right
+// branch; BEFORE and AFTER are only passed through when entering or leaving it.
+enum trie_stage_t {
+    TRIE_BEFORE,
+    TRIE_IN_LEFT,
+    TRIE_AT_SELF,
+    TRIE_IN_MID,
+    TRIE_IN_RIGHT,
+    TRIE_AFTER
+};
+
+// One node on the cursor's path from the root. The last one may instead be a
+// bucket of a burst trie (a bucket is a leaf, so there is at most one), which
+// the cursor steps through as a sorted list of its keys.
+struct trie_cursor_frame_t {
+    trie_pos_t pos;
+    struct trie_view_t view;
+    int stage;              // a trie_stage_t; stepped by +1/-1
+};
+
+// The cursor: the path down to the current key plus that key, rebuilt in one
+// buffer. Both only grow, so stepping does not allocate once they are big enough.
+struct trie_cursor_data_t {
+    trie_t trie;
+    struct trie_cursor_frame_t *frames;
+    size_t top;
+    size_t cap;
+    char *key;
+    size_t keycap;
+    size_t depth;           // characters spelled by the frames in TRIE_IN_MID
+    size_t floor;           // when not 0, stay below the mid link of frames[floor-1]
+    size_t len;             // length of the key
+    struct trie_bucket_key_t *bucket;   // the keys of the bucket frame, sorted
+    size_t bucketcap;
+    size_t lo, hi;          // the bucket keys in reach, bucket[lo..hi)
+    size_t at;              // on bucket[at-1]; lo before the first and hi+1 after the last
+};
+
+/* Helper function to tell whether a position is a bucket (compact positions are plain
+   numbers, so only a burst trie is checked for the tag) */
+static bool trie_cursor_bucket(const trie_cursor_t cursor, trie_pos_t pos) {
+    return (cursor->trie->burst != 0) && TRIE_TAGGED(pos);
+}
+
+/* Helper function to make room for need bytes of key */
+static bool trie_cursor_reserve(trie_cursor_t cursor, size_t need) {
+    if (need <= cursor->keycap) { return true; }
+
+    size_t cap = cursor->keycap * 2;
+    while (cap < need) { cap *= 2; }
+
+    char *key = (char *)realloc(cursor->key, cap);
+    if (key == NULL) { return false; }
+    cursor->key = key;
+    cursor->keycap = cap;
+    return true;
+}
+
+/* Helper function to spell a node's character and fragment out after the first depth
+   characters of the key */
+static bool trie_cursor_spell(trie_cursor_t cursor, const struct trie_view_t *view) {
+    if (!trie_cursor_reserve(cursor, cursor->depth + view->fraglen + 2)) { return false; }
+    cursor->key[cursor->depth] = view->key;
+    if (view->fraglen > 0) { memcpy(cursor->key + cursor->depth + 1, view->frag, view->fraglen); }
+    return true;
+}
+
+/* Helper function to put a node on the path; invalid positions are skipped */
+static bool trie_cursor_push(trie_cursor_t cursor, trie_pos_t pos, int stage) {
+    if (pos == TRIE_INVALID_POS) { return true; }
+
+    if (cursor->top == cursor->cap) {
+        size_t cap = cursor->cap * 2;
+        struct trie_cursor_frame_t *frames = (struct trie_cursor_frame_t *)realloc(cursor->frames,
+            cap * sizeof(struct trie_cursor_frame_t));
+        if (frames == NULL) { return false; }
+        cursor->frames = frames;
+        cursor->cap = cap;
+    }
+
+    struct trie_cursor_frame_t *frame = &cursor->frames[cursor->top++];
+    frame->pos = pos;
+    frame->stage = stage;
+    if (trie_cursor_bucket(cursor, pos)) {
+        size_t count = trie_bucket_keys(pos, &cursor->bucket, &cursor->bucketcap);
+        if (count == (size_t)-1) { return false; }
+        cursor->lo = 0;
+        cursor->hi = count;
+        cursor->at = (stage == TRIE_BEFORE ? 0 : count + 1);
+        return true;
+    }
+    trie_view(cursor->trie, pos, &frame->view);
+    return true;
+}
+
+/* Helper function to spell the bucket key under the cursor out after the first depth
+   characters of the key */
+static bool trie_cursor_spell_bucket(trie_cursor_t cursor) {
+    const struct trie_bucket_key_t *key = &cursor->bucket[cursor->at-1];
+    if (!trie_cursor_reserve(cursor, cursor->depth + key->len + 1)) { return false; }
+    memcpy(cursor->key + cursor->depth, key->suffix, key->len);
+    cursor->len = cursor->depth + key->len;
+    cursor->key[cursor->len] = '\0';
+    return true;
+}
+
+/* Helper function to forget the current position */
+static void trie_cursor_reset(trie_cursor_t cursor) {
+    cursor->top = 0;
+    cursor->depth = 0;
+    cursor->floor = 0;
+}
+
+/* Move the in-order visit one key forward (dir 1) or backward (dir -1).
+   Returns false, leaving the cursor unpositioned, when it runs off the end. */
+static bool trie_cursor_step(trie_cursor_t cursor, int dir) {
+    while (cursor->top > 0) {
+        struct trie_cursor_frame_t *frame = &cursor->frames[cursor->top-1];
+
+        if (trie_cursor_bucket(cursor, frame->pos)) {
+            cursor->at += dir;
+            if ((cursor->at > cursor->lo) && (cursor->at <= cursor->hi)) {
+                if (!trie_cursor_spell_bucket(cursor)) { goto oom; }
+                return true;
+            }
+            if (cursor->top == cursor->floor) { break; }
+            --cursor->top;
+            continue;
+        }
+
+        if ((frame->stage == TRIE_IN_MID) && (frame->view.mid != TRIE_INVALID_POS)) { cursor->depth -= 1 + frame->view.fraglen; }
+        frame->stage += dir;
+
+        // a prefix query is over once the prefix node itself is left behind
+        if ((cursor->top == cursor->floor) && ((frame->stage < TRIE_AT_SELF) || (frame->stage > TRIE_IN_MID))) {
+            trie_cursor_reset(cursor);
+            return false;
+        }
+
+        switch (frame->stage) {
+            case TRIE_IN_LEFT:
+                if (!trie_cursor_push(cursor, frame->view.left, (dir > 0 ? TRIE_BEFORE : TRIE_AFTER))) { goto oom; }
+                break;
+            case TRIE_AT_SELF:
+                if (frame->view.terminal) {     // we hit a full key!
+                    if (!trie_cursor_spell(cursor, &frame->view)) { goto oom; }
+                    cursor->len = cursor->depth + 1 + frame->view.fraglen;
+                    cursor->key[cursor->len] = '\0';
+                    return true;
+                }
+                break;
+            case TRIE_IN_MID:
+                if (frame->view.mid != TRIE_INVALID_POS) {
+                    if (!trie_cursor_spell(cursor, &frame->view)) { goto oom; }
+                    cursor->depth += 1 + frame->view.fraglen;
+                    if (!trie_cursor_push(cursor, frame->view.mid, (dir > 0 ? TRIE_BEFORE : TRIE_AFTER))) { goto oom; }
+                }
+                break;
+            case TRIE_IN_RIGHT:
+                if (!trie_cursor_push(cursor, frame->view.right, (dir > 0 ? TRIE_BEFORE : TRIE_AFTER))) { goto oom; }
+                break;
+            default:            // done with this node either way
+                --cursor->top;
+                break;
+        }
+    }
+
+    trie_cursor_reset(cursor);
+    return false;
+
+oom:
+    trie_cursor_reset(cursor);
+    return false;
+}
+
+/// Create a cursor over the keys of a trie, in lexicographic order
+trie_cursor_t trie_cursor_new (trie_t trie) {
+    trie_cursor_t cursor = (trie_cursor_t)malloc(sizeof(struct trie_cursor_data_t));
+    if (cursor == NULL) { return NULL; }
+
+    cursor->trie = trie;
+    cursor->top = 0;
+    cursor->cap = TRIE_CURSOR_MIN;
+    cursor->keycap = TRIE_CURSOR_MIN;
+    cursor->depth = 0;
+    cursor->floor = 0;
+    cursor->len = 0;
+    cursor->bucket = NULL;
+    cursor->bucketcap = 0;
+    cursor->frames = (struct trie_cursor_frame_t *)malloc(cursor->cap * sizeof(struct trie_cursor_frame_t));
+    cursor->key = (char *)malloc(cursor->keycap);
+    if ((cursor->frames == NULL) || (cursor->key == NULL)) {
+        trie_cursor_free(cursor);
+        return NULL;
+    }
+
+    return cursor;
+}
+
+/// Free a cursor
+void trie_cursor_free (trie_cursor_t cursor) {
+    free(cursor->frames);
+    free(cursor->key);
+    free(cursor->bucket);
+    free(cursor);
+}
+
+/// Move the cursor to the first key >= key (lower bound)
+/// Returns false, leaving the cursor unpositioned, if there is no such key.
+bool trie_cursor_seek (trie_cursor_t cursor, const char * key) {
+    return trie_cursor_seek_n(cursor, key, (key == NULL ? 0 : strlen(key)));
+}
+
+/// Move the cursor to the first key >= the len bytes at key (lower bound)
+bool trie_cursor_seek_n (trie_cursor_t cursor, const char * key, size_t len) {
+    trie_cursor_reset(cursor);
+    if (len == 0) { return trie_cursor_next(cursor); }
+
+    // fragments may hold 0-bytes (see trie_insert_n), so key is compared by length
+    const char *last = key + len - 1;
+
+    // rebuild the path as if an in-order visit had just passed everything < key
+    trie_pos_t pos = trie_root(cursor->trie);
+    while (pos != TRIE_INVALID_POS) {
+        if (!trie_cursor_push(cursor, pos, TRIE_IN_LEFT)) { goto oom; }
+        if (trie_cursor_bucket(cursor, pos)) {
+            // the first bucket key >= the rest of key is next
+            cursor->at = trie_bucket_lower(cursor->bucket, cursor->hi, key, (size_t)(last - key) + 1);
+            break;
+        }
+
+        struct trie_cursor_frame_t *frame = &cursor->frames[cursor->top-1];
+        if ((unsigned char)*key < frame->view.key) {
+            pos = frame->view.left;             // this node and all after it are > key
+        } else if ((unsigned char)*key > frame->view.key) {
+            frame->stage = TRIE_IN_RIGHT;       // this node and its mid are < key
+            pos = frame->view.right;
+        } else {
+            // past the fragment where key leaves it, this node spells either something
+            // greater (it is next, as below) or something smaller (it goes with its mid,
+            // and the search carries on in the right branch, where everything is greater)
+            size_t left = (size_t)(last - key);
+            size_t common = trie_frag_common(frame->view.frag, (frame->view.fraglen < left ? frame->view.fraglen : left), key + 1);
+            if (common < frame->view.fraglen) {
+                if ((common == left) || ((unsigned char)key[1+common] < (unsigned char)frame->view.frag[common])) { break; }
+                frame->stage = TRIE_IN_RIGHT;
+                pos = frame->view.right;
+                continue;
+            }
+
+            key += common;
+            if (key == last) { break; }   // this very node is next, if it is a key
+
+            frame->stage = TRIE_IN_MID;
+            pos = frame->view.mid;
+            if (pos != TRIE_INVALID_POS) {
+                if (!trie_cursor_spell(cursor, &frame->view)) { goto oom; }
+                cursor->depth += 1 + frame->view.fraglen;
+            }
+            ++key;
+        }
+    }
+
+    return trie_cursor_step(cursor, 1);
+
+oom:
+    trie_cursor_reset(cursor);
+    return false;
+}
+
+/// Move the cursor to the next key
+/// An unpositioned cursor moves to the first key.
+/// Returns false, leaving the cursor unpositioned, past the last key.
+bool trie_cursor_next (trie_cursor_t cursor) {
+    if ((cursor->top == 0) && !trie_cursor_push(cursor, trie_root(cursor->trie), TRIE_BEFORE)) { return false; }
+    return trie_cursor_step(cursor, 1);
+}
+
+/// Move the cursor to the previous key
+/// An unpositioned cursor moves to the last key.
+/// Returns false, leaving the cursor unpositioned, before the first key.
+bool trie_cursor_prev (trie_cursor_t cursor) {
+    if ((cursor->top == 0) && !trie_cursor_push(cursor, trie_root(cursor->trie), TRIE_AFTER)) { return false; }
+    return trie_cursor_step(cursor, -1);
+}
+
+/// Key under the cursor, or NULL if the cursor is unpositioned
+/// The string belongs to the cursor and changes when the cursor moves.
+const char * trie_cursor_key (const trie_cursor_t cursor) {
+    return (cursor->top == 0 ? NULL : cursor->key);
+}
+
+/// Length of the key under the cursor, or 0 if the cursor is unpositioned
+size_t trie_cursor_key_len (const trie_cursor_t cursor) {
+    return (cursor->top == 0 ? 0 : cursor->len);
+}
+
+/// Position of the key under the cursor, or TRIE_INVALID_POS if unpositioned
+trie_pos_t trie_cursor_pos (const trie_cursor_t cursor) {
+    if (cursor->top == 0) { return TRIE_INVALID_POS; }
+    trie_pos_t pos = cursor->frames[cursor->top-1].pos;
+    return (trie_cursor_bucket(cursor, pos) ? cursor->bucket[cursor->at-1].pos : pos);
+}
+
+/* Position the cursor on the first key starting with the len bytes at prefix and keep
+   it inside that subtree: the descent follows the prefix only, so it costs
+   O(|prefix| + log N) and the cursor then never looks at a node outside the prefix
+   node's mid link. */
+static bool trie_cursor_seek_prefix(trie_cursor_t cursor, const char *prefix, size_t len) {
+    trie_cursor_reset(cursor);
+    if (len == 0) { return trie_cursor_next(cursor); }
+
+    const char *last = prefix + len - 1;
+    trie_pos_t pos = trie_root(cursor->trie);
+    while (pos != TRIE_INVALID_POS) {
+        if (trie_cursor_bucket(cursor, pos)) {
+            // the bucket keys starting with the rest of the prefix sort next to each other
+            if (!trie_cursor_push(cursor, pos, TRIE_BEFORE)) { break; }
+            size_t rest = (size_t)(last - prefix) + 1;
+            cursor->lo = trie_bucket_lower(cursor->bucket, cursor->hi, prefix, rest);
+            for (cursor->at = cursor->lo; cursor->at < cursor->hi; ++cursor->at) {
+                const struct trie_bucket_key_t *key = &cursor->bucket[cursor->at];
+                if ((key->len < rest) || (memcmp(key->suffix, prefix, rest) != 0)) { break; }
+            }
+            cursor->hi = cursor->at;
+            cursor->at = cursor->lo;
+            cursor->floor = cursor->top;
+            return trie_cursor_step(cursor, 1);
+        }
+
+        struct trie_view_t view;
+        trie_view(cursor->trie, pos, &view);
+
+        if ((unsigned char)*prefix < view.key) {
+            pos = view.left;
+        } else if ((unsigned char)*prefix > view.key) {
+            pos = view.right;
+        } else {
+            size_t left = (size_t)(last - prefix);
+            size_t common = trie_frag_common(view.frag, (view.fraglen < left ? view.fraglen : left), prefix + 1);
+            if (common == left) {
+                // the prefix node (the prefix may end inside its fragment): its own key
+                // first, then its mid subtree
+                if (!trie_cursor_push(cursor, pos, TRIE_IN_LEFT)) { break; }
+                cursor->floor = cursor->top;
+                return trie_cursor_step(cursor, 1);
+            }
+            if (common < view.fraglen) { break; }      // the prefix leaves the fragment
+
+            if (!trie_cursor_spell(cursor, &view)) { break; }
+            cursor->depth += 1 + view.fraglen;
+            pos = view.mid;
+            prefix += 1 + view.fraglen;
+        }
+    }
+
+    trie_cursor_reset(cursor);
+    return false;
+}
+
+/* Helper function for the key a walk callback gets: the kept copy if there is one */
+static const char *trie_cursor_walk_key(trie_cursor_t cursor) {
+    if (cursor->trie->flags & TRIE_KEEP_KEYS) {
+        return ((struct trie_kept_t *)TRIE_LOAD(cursor->trie, trie_cursor_pos(cursor)->val))->key;
+    }
+    return cursor->key;
+}
+
+/* Helper function to visit every key starting with the len bytes at prefix */
+bool trie_cursor_walk_prefix(trie_t trie, const char *prefix, size_t len, const struct trie_visit_t *visit) {
+    trie_cursor_t cursor = trie_cursor_new(trie);
+    if (cursor == NULL) { return false; }
+
+    bool ret = true;
+    for (bool more = trie_cursor_seek_prefix(cursor, prefix, len); more; more = trie_cursor_next(cursor)) {
+        if (!trie_visit(visit, trie, trie_cursor_pos(cursor), trie_cursor_walk_key(cursor), cursor->len)) {
+            ret = false;
+            break;
+        }
+    }
+
+    trie_cursor_free(cursor);
+    return ret;
+}
+
+/// Visit every key starting with prefix, in lexicographic order
+bool trie_walk_prefix (trie_t trie, const char * prefix, trie_walk_t walkfunc, void * priv) {
+    struct trie_visit_t visit = { walkfunc, NULL, priv };
+    return trie_cursor_walk_prefix(trie, prefix, (prefix == NULL ? 0 : strlen(prefix)), &visit);
+}
+
+/// Visit every key starting with the len bytes at prefix, in lexicographic order,
+/// with its length
+bool trie_walk_prefix_n (trie_t trie, const char * prefix, size_t len, trie_walk_n_t walkfunc, void * priv) {
+    struct trie_visit_t visit = { NULL, walkfunc, priv };
+    return trie_cursor_walk_prefix(trie, prefix, len, &visit);
+}
+
+/* Helper function to tell whether the key under the cursor is still below the hilen
+   bytes at hi (always, for a NULL hi) */
+static bool trie_cursor_below(trie_cursor_t cursor, const char *hi, size_t hilen) {
+    return (hi == NULL) || (trie_key_cmp(cursor->key, cursor->len, hi, hilen) < 0);
+}
+
+/* Helper function to visit every key in [lo, hi) */
+bool trie_cursor_walk_range(trie_t trie, const char *lo, size_t lolen, const char *hi, size_t hilen,
+        const struct trie_visit_t *visit) {
+    trie_cursor_t cursor = trie_cursor_new(trie);
+    if (cursor == NULL) { return false; }
+
+    bool ret = true;
+    for (bool more = trie_cursor_seek_n(cursor, lo, lolen); more && trie_cursor_below(cursor, hi, hilen); more = trie_cursor_next(cursor)) {
+        if (!trie_visit(visit, trie, trie_cursor_pos(cursor), trie_cursor_walk_key(cursor), cursor->len)) { ret = false; break; }
+    }
+
+    trie_cursor_free(cursor);
+    return ret;
+}
+
+/// Visit every key in [lo, hi), in lexicographic order
+bool trie_walk_range (trie_t trie, const char * lo, const char * hi, trie_walk_t walkfunc, void * priv) {
+    struct trie_visit_t visit = { walkfunc, NULL, priv };
+    return trie_cursor_walk_range(trie, lo, (lo == NULL ? 0 : strlen(lo)), hi, (hi == NULL ? 0 : strlen(hi)), &visit);
+}
+
+/// Visit every key in [lo, hi), lo and hi being lolen and hilen bytes, in
+/// lexicographic order, with its length
+bool trie_walk_range_n (trie_t trie, const char * lo, size_t lolen, const char * hi, size_t hilen,
+      trie_walk_n_t walkfunc, void * priv) {
+    struct trie_visit_t visit = { NULL, walkfunc, priv };
+    return trie_cursor_walk_range(trie, lo, lolen, hi, hilen, &visit);
+}
+
+/// Count the keys in [lo, hi)
+size_t trie_count_range (trie_t trie, const char * lo, const char * hi) {
+    return trie_count_range_n(trie, lo, (lo == NULL ? 0 : strlen(lo)), hi, (hi == NULL ? 0 : strlen(hi)));
+}
+
+/// Count the keys in [lo, hi), lo and hi being lolen and hilen bytes
+size_t trie_count_range_n (trie_t trie, const char * lo, size_t lolen, const char * hi, size_t hilen) {
+    trie_cursor_t cursor = trie_cursor_new(trie);
+    if (cursor == NULL) { return 0; }
+
+    size_t count = 0;
+    for (bool more = trie_cursor_seek_n(cursor, lo, lolen); more && trie_cursor_below(cursor, hi, hilen); more = trie_cursor_next(cursor)) {
+        ++count;
+    }
+
+    trie_cursor_free(cursor);
+    return count;
+}
+
+/// Return up to max keys starting with prefix, in lexicographic order
+size_t trie_complete (trie_t trie, const char * prefix, struct trie_match_t * out, size_t max) {
+    return trie_complete_n(trie, prefix, (prefix == NULL ? 0 : strlen(prefix)), out, max);
+}
+
+/// Return up to max keys starting with the len bytes at prefix, in lexicographic order
+size_t trie_complete_n (trie_t trie, const char * prefix, size_t len, struct trie_match_t * out, size_t max) {
+    if (max == 0) { return 0; }
+
+    trie_cursor_t cursor = trie_cursor_new(trie);
+    if (cursor == NULL) { return 0; }
+
+    size_t count = 0;
+    for (bool more = trie_cursor_seek_prefix(cursor, prefix, len); more && (count < max); more = trie_cursor_next(cursor)) {
+        char *key = (char *)malloc(cursor->len + 1);
+        if (key == NULL) { break; }
+        memcpy(key, cursor->key, cursor->len + 1);
+
+        out[count].pos = trie_cursor_pos(cursor);
+        out[count].len = cursor->len;
+        out[count++].key = key;
+    }
+
+    trie_cursor_free(cursor);
+    return count;
+}
+
+/// Free the keys handed out by trie_complete
+void trie_complete_free (struct trie_match_t * out, size_t count) {
+    for (size_t i = 0; i < count; ++i) {
+        free(out[i].key);
+        out[i].key = NULL;
+    }
+}
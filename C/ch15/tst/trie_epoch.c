@@ -0,0 +1,182 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <sched.h>
+#include "trie.h"
+#include "trie_int.h"
+
+// Epoch-based reclamation for TRIE_EPOCH. A reader announces the global epoch it
+// saw when it starts reading, and clears it when done. Whatever the writer unlinks
+// goes into the limbo list of the epoch it was unlinked in. The writer moves the
+// global epoch on only once every reader inside a read section has announced the
+// current one; after two such moves no reader can still be holding anything from
+// the list of the first epoch, so that list is given back. Readers never wait for
+// anything and the writer never waits either, unless it runs out of memory for its
+// lists.
+//
+// Reader slots sit on a list that only grows: a freed slot is handed to the next
+// trie_reader_new, and the slots are only released with the trie.
+
+#define TRIE_EPOCH_LINE 64
+#define TRIE_EPOCH_BATCH 64         // retires between attempts to move the epoch on
+#define TRIE_EPOCH_LISTS 3
+
+// A reader slot: 0 while outside a read section, else the epoch it saw times two
+// plus one. Each one has a cache line to itself, so readers do not slow each other
+struct trie_reader_data_t {
+    _Alignas(TRIE_EPOCH_LINE) atomic_ulong state;
+    atomic_bool used;
+    struct trie_reader_data_t *next;
+    trie_t trie;
+};
+
+// What was retired during one epoch; nodes are tagged by setting the low bit
+struct trie_limbo_t {
+    uintptr_t *items;
+    size_t count;
+    size_t cap;
+};
+
+struct trie_epoch_t {
+    atomic_ulong global;
+    _Atomic(struct trie_reader_data_t *) readers;
+    struct trie_limbo_t limbo[TRIE_EPOCH_LISTS];    // retired in epoch e, in limbo[e % 3]
+    size_t retired;             // since the last attempt to move on
+};
+
+struct trie_epoch_t *trie_epoch_new(void) {
+    struct trie_epoch_t *epoch = (struct trie_epoch_t *)calloc(1, sizeof(struct trie_epoch_t));
+    if (epoch == NULL) { return NULL; }
+
+    atomic_init(&epoch->global, 0);
+    atomic_init(&epoch->readers, NULL);
+    return epoch;
+}
+
+/* Helper function to give back everything in one limbo list */
+static void trie_epoch_empty(trie_t trie, struct trie_limbo_t *limbo) {
+    for (size_t i = 0; i < limbo->count; ++i) {
+        uintptr_t item = limbo->items[i];
+        if (item & 1) {
+            trie_recycle_node(trie, (trie_pos_t)(item & ~(uintptr_t)1));
+        } else {
+            free((void *)item);
+        }
+    }
+    limbo->count = 0;
+}
+
+/* Helper function to move the global epoch on, if every reader inside a read section
+   has seen the current one, giving back the list retired the epoch before: every
+   reader that could have got there before it was unlinked is done by now */
+static bool trie_epoch_advance(trie_t trie) {
+    struct trie_epoch_t *epoch = trie->epoch;
+    unsigned long now = atomic_load_explicit(&epoch->global, memory_order_relaxed);
+
+    // pairs with the fence in trie_read_begin: a reader this scan misses is bound
+    // to see every unlink made before it
+    atomic_thread_fence(memory_order_seq_cst);
+    for (struct trie_reader_data_t *r = atomic_load(&epoch->readers); r != NULL; r = r->next) {
+        unsigned long state = atomic_load(&r->state);
+        if ((state & 1) && ((state >> 1) != now)) { return false; }
+    }
+
+    atomic_store(&epoch->global, now + 1);
+    trie_epoch_empty(trie, &epoch->limbo[(now + TRIE_EPOCH_LISTS - 1) % TRIE_EPOCH_LISTS]);
+    return true;
+}
+
+/* Helper function to wait until nothing retired so far can still be in use */
+static void trie_epoch_synchronize(trie_t trie) {
+    unsigned long until = atomic_load_explicit(&trie->epoch->global, memory_order_relaxed) + 2;
+    while (atomic_load_explicit(&trie->epoch->global, memory_order_relaxed) != until) {
+        if (!trie_epoch_advance(trie)) { sched_yield(); }
+    }
+}
+
+void trie_epoch_retire(trie_t trie, void *mem, bool node) {
+    struct trie_epoch_t *epoch = trie->epoch;
+    struct trie_limbo_t *limbo = &epoch->limbo[atomic_load_explicit(&epoch->global, memory_order_relaxed) % TRIE_EPOCH_LISTS];
+    uintptr_t item = (uintptr_t)mem | (node ? 1 : 0);
+
+    if (limbo->count == limbo->cap) {
+        size_t cap = (limbo->cap == 0 ? TRIE_EPOCH_BATCH : limbo->cap * 2);
+        uintptr_t *items = (uintptr_t *)realloc(limbo->items, cap * sizeof(uintptr_t));
+        if (items == NULL) {
+            // no room to keep it for later, so wait out the readers and give it back now
+            trie_epoch_synchronize(trie);
+            struct trie_limbo_t one = { &item, 1, 1 };
+            trie_epoch_empty(trie, &one);
+            return;
+        }
+        limbo->items = items;
+        limbo->cap = cap;
+    }
+
+    limbo->items[limbo->count++] = item;
+    if (++epoch->retired >= TRIE_EPOCH_BATCH) {
+        epoch->retired = 0;
+        trie_epoch_advance(trie);
+    }
+}
+
+void trie_epoch_free(trie_t trie) {
+    struct trie_epoch_t *epoch = trie->epoch;
+    for (size_t i = 0; i < TRIE_EPOCH_LISTS; ++i) {
+        trie_epoch_empty(trie, &epoch->limbo[i]);
+        free(epoch->limbo[i].items);
+    }
+
+    struct trie_reader_data_t *r = atomic_load(&epoch->readers);
+    while (r != NULL) {
+        struct trie_reader_data_t *next = r->next;
+        free(r);
+        r = next;
+    }
+
+    free(epoch);
+    trie->epoch = NULL;
+}
+
+/// Register a reader of a TRIE_EPOCH trie
+trie_reader_t trie_reader_new (trie_t trie) {
+    struct trie_epoch_t *epoch = trie->epoch;
+    if (epoch == NULL) { return NULL; }
+
+    for (struct trie_reader_data_t *r = atomic_load(&epoch->readers); r != NULL; r = r->next) {
+        bool unused = false;
+        if (atomic_compare_exchange_strong(&r->used, &unused, true)) { return r; }
+    }
+
+    struct trie_reader_data_t *r = (struct trie_reader_data_t *)aligned_alloc(TRIE_EPOCH_LINE,
+        sizeof(struct trie_reader_data_t));
+    if (r == NULL) { return NULL; }
+
+    atomic_init(&r->state, 0);
+    atomic_init(&r->used, true);
+    r->trie = trie;
+    r->next = atomic_load(&epoch->readers);
+    while (!atomic_compare_exchange_weak(&epoch->readers, &r->next, r)) { }
+    return r;
+}
+
+/// Give a reader slot back
+void trie_reader_free (trie_reader_t reader) {
+    atomic_store_explicit(&reader->state, 0, memory_order_release);
+    atomic_store(&reader->used, false);
+}
+
+/// Start a read section
+void trie_read_begin (trie_reader_t reader) {
+    unsigned long now = atomic_load(&reader->trie->epoch->global);
+    atomic_store_explicit(&reader->state, (now << 1) | 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+}
+
+/// End a read section
+void trie_read_end (trie_reader_t reader) {
+    atomic_store_explicit(&reader->state, 0, memory_order_release);
+}
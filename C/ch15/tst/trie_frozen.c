@@ -0,0 +1,633 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "trie.h"
+#include "trie_int.h"
+
+// The frozen layout: one buffer holding a header, the packed nodes, the values
+// and the fragment bytes, linked by indices and offsets only, so it can be copied
+// or written out as it is. Every character level is a run of consecutive nodes in
+// Eytzinger order (the children of the node at i within the level sit at 2i+1 and
+// 2i+2), so a level is searched without a single link, and the levels follow each
+// other breadth first, so the top of the trie stays in a few cache lines. Chains of
+// single-node levels are always folded into fragments, as TRIE_COMPRESS does: laid
+// out breadth first they would cost a cache line per character.
+//
+// The same block is the file format of trie_save: trie_open_mmap maps a file and
+// points the sections into the mapping, with nothing to parse or copy. Numbers are
+// in the byte order of the machine that wrote the file; one of the other order
+// fails the version check.
+
+#define TRIE_FROZEN_MAGIC "TSTFROZ"
+#define TRIE_FROZEN_VERSION 1
+#define TRIE_FROZEN_LEVEL 256
+
+// The start of the buffer
+struct trie_frozen_header_t {
+    char magic[8];
+    uint32_t version;
+    uint32_t top;               // nodes in the first level
+    uint64_t keys;
+    uint64_t nodes;
+    uint64_t fragbytes;
+    uint64_t bytes;             // the whole block, header included
+    uint64_t checksum;          // of everything after the header
+};
+
+// A frozen node: its character, the level below it as a run of nodes, the value
+// of the key ending here and its fragment, stored as a 32-bit length and the bytes
+struct trie_fnode_t {
+    uint32_t mid;               // first node of the level below; 0 for none (0 is the top level)
+    uint32_t val;               // 1 + index of the value of the key ending here; 0 for none
+    uint32_t frag;              // offset of the fragment in the fragment bytes; 0 for none
+    unsigned char key;
+    unsigned char midsize;      // nodes in the level below, minus one
+    uint16_t unused;
+};
+
+_Static_assert(sizeof(struct trie_fnode_t) == 16, "frozen trie nodes must stay 16 bytes");
+
+// The frozen trie: the buffer plus where its sections start
+struct trie_frozen_data_t {
+    const struct trie_frozen_header_t *header;
+    const struct trie_fnode_t *nodes;
+    const uint64_t *vals;
+    const unsigned char *frags;
+    void *buffer;
+    size_t bytes;
+    bool mapped;                // buffer is a mapping from trie_open_mmap, not malloc'd
+};
+
+// One pending level of trie_freeze, to be laid out from start on
+struct trie_freeze_item_t {
+    trie_pos_t pos;
+    uint32_t start;
+};
+
+// The state of trie_freeze
+struct trie_freeze_t {
+    trie_t trie;
+    struct trie_fnode_t *nodes;
+    uint64_t *vals;
+    unsigned char *frags;
+    uint32_t next;              // first node not handed out yet
+    uint32_t nvals;
+    uint32_t nfrags;
+    struct trie_freeze_item_t *queue;
+    size_t head;
+    size_t tail;
+    size_t cap;
+};
+
+/* Helper function to follow the chain of single-node levels below a node without a key
+   of its own, which the frozen trie keeps as one node with a longer fragment whatever
+   the source layout. Returns the last node of the chain, with its view in *end and the
+   length of the whole fragment in *len. When frag is not NULL the fragment is copied
+   there too. */
+static trie_pos_t trie_freeze_chain(trie_t trie, trie_pos_t pos, struct trie_view_t *end, char *frag, size_t *len) {
+    trie_view(trie, pos, end);
+    (*len) = end->fraglen;
+    if ((frag != NULL) && ((*len) > 0)) { memcpy(frag, end->frag, *len); }
+
+    while (!end->terminal && (end->mid != TRIE_INVALID_POS)) {
+        struct trie_view_t below;
+        trie_view(trie, end->mid, &below);
+        if ((below.left != TRIE_INVALID_POS) || (below.right != TRIE_INVALID_POS)) { break; }
+
+        if (frag != NULL) {
+            frag[*len] = (char)below.key;
+            if (below.fraglen > 0) { memcpy(frag + (*len) + 1, below.frag, below.fraglen); }
+        }
+        (*len) += 1 + below.fraglen;
+        pos = end->mid;
+        (*end) = below;
+    }
+    return pos;
+}
+
+/* Helper function to collect the nodes of the level at pos in key order; returns how many */
+static size_t trie_freeze_level(trie_t trie, trie_pos_t pos, trie_pos_t *level) {
+    trie_pos_t stack[TRIE_FROZEN_LEVEL];
+    size_t top = 0, count = 0;
+
+    while ((pos != TRIE_INVALID_POS) || (top > 0)) {
+        struct trie_view_t view;
+        if (pos != TRIE_INVALID_POS) {
+            trie_view(trie, pos, &view);
+            stack[top++] = pos;
+            pos = view.left;
+        } else {
+            pos = stack[--top];
+            trie_view(trie, pos, &view);
+            level[count++] = pos;
+            pos = view.right;
+        }
+    }
+    return count;
+}
+
+/* Helper function to queue the level at pos, laid out from start on */
+static bool trie_freeze_push(struct trie_freeze_t *f, trie_pos_t pos, uint32_t start) {
+    if (f->tail == f->cap) {
+        size_t cap = (f->cap == 0 ? 64 : f->cap * 2);
+        struct trie_freeze_item_t *queue = (struct trie_freeze_item_t *)realloc(f->queue, cap * sizeof(struct trie_freeze_item_t));
+        if (queue == NULL) { return false; }
+        f->queue = queue;
+        f->cap = cap;
+    }
+
+    f->queue[f->tail].pos = pos;
+    f->queue[f->tail++].start = start;
+    return true;
+}
+
+/* Fill in the node at Eytzinger index k of a level of count nodes from level[*next]
+   on, in order (left subtree, the node, right subtree); the recursion follows the
+   implicit tree, at most 9 deep for 256 nodes */
+static bool trie_freeze_place(struct trie_freeze_t *f, trie_pos_t *level, size_t count, size_t *next,
+        uint32_t start, size_t k) {
+    if (k >= count) { return true; }
+    if (!trie_freeze_place(f, level, count, next, start, 2 * k + 1)) { return false; }
+
+    trie_pos_t pos = level[(*next)++];
+    struct trie_view_t view;
+    trie_view(f->trie, pos, &view);
+
+    struct trie_fnode_t *node = &f->nodes[start + k];
+    node->key = view.key;
+    node->unused = 0;
+    node->val = 0;
+    node->frag = 0;
+    node->mid = 0;
+    node->midsize = 0;
+
+    // the key, value and level below are those of the end of the chain
+    size_t len = 0;
+    pos = trie_freeze_chain(f->trie, pos, &view, (char *)f->frags + f->nfrags + sizeof(uint32_t), &len);
+    if (len > 0) {
+        uint32_t len32 = (uint32_t)len;
+        node->frag = f->nfrags;
+        memcpy(f->frags + f->nfrags, &len32, sizeof(len32));
+        f->nfrags += sizeof(len32) + len32;
+    }
+    if (view.terminal) {
+        f->vals[f->nvals++] = (uint64_t)(uintptr_t)trie_get_value(f->trie, pos);
+        node->val = f->nvals;
+    }
+    if (view.mid != TRIE_INVALID_POS) {
+        // the level below gets the next run of nodes, to be filled in when it is dequeued
+        trie_pos_t below[TRIE_FROZEN_LEVEL];
+        size_t size = trie_freeze_level(f->trie, view.mid, below);
+        node->mid = f->next;
+        node->midsize = (unsigned char)(size - 1);
+        if (!trie_freeze_push(f, view.mid, f->next)) { return false; }
+        f->next += size;
+    }
+
+    return trie_freeze_place(f, level, count, next, start, 2 * k + 2);
+}
+
+/* Helper function to tell whether the chain of nodes from pos down to last spells no
+   0-byte; a frozen trie holds C strings only */
+static bool trie_freeze_plain(trie_t trie, trie_pos_t pos, trie_pos_t last) {
+    while (true) {
+        struct trie_view_t view;
+        trie_view(trie, pos, &view);
+        if ((view.key == 0) || ((view.fraglen > 0) && (memchr(view.frag, '\0', view.fraglen) != NULL))) { return false; }
+        if (pos == last) { return true; }
+        pos = view.mid;
+    }
+}
+
+/* Helper function to count the nodes the frozen copy of a trie needs and the bytes
+   their fragments take. False when out of memory or when a key holds a 0-byte */
+static bool trie_freeze_count(trie_t trie, uint64_t *nodes, uint64_t *fragbytes) {
+    struct trie_stack_t stack = { NULL, 0, 0 };
+    bool ok = trie_stack_push(&stack, trie_root(trie), 0);
+
+    while (ok && (stack.top > 0)) {
+        struct trie_view_t view, end;
+        size_t len = 0;
+        trie_pos_t pos = stack.frames[--stack.top].node;
+        trie_view(trie, pos, &view);
+        trie_pos_t last = trie_freeze_chain(trie, pos, &end, NULL, &len);
+        ++(*nodes);
+        if (len > 0) { (*fragbytes) += sizeof(uint32_t) + len; }
+
+        ok = trie_freeze_plain(trie, pos, last)
+            && trie_stack_push(&stack, view.left, 0)
+            && trie_stack_push(&stack, end.mid, 0)
+            && trie_stack_push(&stack, view.right, 0);
+    }
+
+    free(stack.frames);
+    return ok;
+}
+
+/* Helper function to checksum len bytes: a multiply-xor hash over 8 bytes at a time,
+   so checking a big file is bound by reading it */
+uint64_t trie_checksum(const void *buffer, size_t len) {
+    const unsigned char *data = (const unsigned char *)buffer;
+    uint64_t hash = 0x9e3779b97f4a7c15ull ^ len;
+    size_t i = 0;
+
+    for (; i + sizeof(uint64_t) <= len; i += sizeof(uint64_t)) {
+        uint64_t word;
+        memcpy(&word, data + i, sizeof(word));
+        hash = (hash ^ word) * 0x100000001b3ull;
+        hash ^= hash >> 29;
+    }
+    for (; i < len; ++i) { hash = (hash ^ data[i]) * 0x100000001b3ull; }
+    return hash ^ (hash >> 32);
+}
+
+/* Helper function to checksum everything after the header of a block */
+static uint64_t trie_frozen_checksum(const struct trie_frozen_header_t *header) {
+    return trie_checksum(header + 1, header->bytes - sizeof(struct trie_frozen_header_t));
+}
+
+/* Helper function to point a frozen trie at the sections of the block in buffer */
+static void trie_frozen_attach(trie_frozen_t frozen, void *buffer, bool mapped) {
+    const struct trie_frozen_header_t *header = (const struct trie_frozen_header_t *)buffer;
+    frozen->header = header;
+    frozen->nodes = (const struct trie_fnode_t *)(header + 1);
+    frozen->vals = (const uint64_t *)(frozen->nodes + header->nodes);
+    frozen->frags = (const unsigned char *)(frozen->vals + header->keys);
+    frozen->buffer = buffer;
+    frozen->bytes = (size_t)header->bytes;
+    frozen->mapped = mapped;
+}
+
+/* Helper function to copy every key of a walked trie into the trie at priv */
+static bool trie_freeze_copy_key(trie_t trie, trie_pos_t pos, const char *key, size_t len, void *priv) {
+    trie_pos_t copied = TRIE_INVALID_POS;
+    trie_insert_n((trie_t)priv, key, len, trie_get_value(trie, pos), &copied);
+    return (copied != TRIE_INVALID_POS);
+}
+
+/* Helper function to freeze a burst trie by way of a copy of it made of nodes only,
+   so its buckets are left as they are */
+static trie_frozen_t trie_freeze_buckets(const trie_t trie) {
+    trie_t copy = trie_new_flags(TRIE_COMPRESS);
+    if (copy == TRIE_INVALID) { return NULL; }
+
+    trie_frozen_t frozen = NULL;
+    if (trie_walk_n(trie, trie_freeze_copy_key, copy)) { frozen = trie_freeze(copy); }
+    trie_destroy(copy, NULL);
+    return frozen;
+}
+
+/// Freeze a trie into one contiguous read-only block
+trie_frozen_t trie_freeze (const trie_t trie) {
+    if (trie->buckets > 0) { return trie_freeze_buckets(trie); }
+
+    uint64_t nodes = 0, fragbytes = sizeof(uint32_t);   // offset 0 stands for no fragment
+    if (!trie_freeze_count(trie, &nodes, &fragbytes)) { return NULL; }
+    if ((nodes >= UINT32_MAX) || (fragbytes >= UINT32_MAX)) { return NULL; }
+
+    size_t bytes = sizeof(struct trie_frozen_header_t) + nodes * sizeof(struct trie_fnode_t)
+        + trie->size * sizeof(uint64_t) + fragbytes;
+    trie_frozen_t frozen = (trie_frozen_t)malloc(sizeof(struct trie_frozen_data_t));
+    void *buffer = calloc(1, bytes);    // zeroed, so padding checksums the same every time
+    if ((frozen == NULL) || (buffer == NULL)) {
+        free(frozen);
+        free(buffer);
+        return NULL;
+    }
+
+    struct trie_frozen_header_t *header = (struct trie_frozen_header_t *)buffer;
+    memcpy(header->magic, TRIE_FROZEN_MAGIC, sizeof(TRIE_FROZEN_MAGIC));
+    header->version = TRIE_FROZEN_VERSION;
+    header->keys = trie->size;
+    header->nodes = nodes;
+    header->fragbytes = fragbytes;
+    header->bytes = bytes;
+
+    struct trie_freeze_t f = { trie, NULL, NULL, NULL, 0, 0, sizeof(uint32_t), NULL, 0, 0, 0 };
+    f.nodes = (struct trie_fnode_t *)(header + 1);
+    f.vals = (uint64_t *)(f.nodes + nodes);
+    f.frags = (unsigned char *)(f.vals + trie->size);
+
+    // levels are laid out in the order they were queued: breadth first
+    bool ok = true;
+    if (nodes > 0) {
+        trie_pos_t level[TRIE_FROZEN_LEVEL];
+        header->top = (uint32_t)trie_freeze_level(trie, trie_root(trie), level);
+        f.next = header->top;
+        ok = trie_freeze_push(&f, trie_root(trie), 0);
+    }
+    while (ok && (f.head < f.tail)) {
+        struct trie_freeze_item_t item = f.queue[f.head++];
+        trie_pos_t level[TRIE_FROZEN_LEVEL];
+        size_t count = trie_freeze_level(trie, item.pos, level), next = 0;
+        ok = trie_freeze_place(&f, level, count, &next, item.start, 0);
+    }
+    free(f.queue);
+
+    if (!ok) {
+        free(buffer);
+        free(frozen);
+        return NULL;
+    }
+
+    header->checksum = trie_frozen_checksum(header);
+    trie_frozen_attach(frozen, buffer, false);
+    return frozen;
+}
+
+/// Free a frozen trie
+void trie_frozen_free (trie_frozen_t frozen) {
+    if (frozen->mapped) {
+        munmap(frozen->buffer, frozen->bytes);
+    } else {
+        free(frozen->buffer);
+    }
+    free(frozen);
+}
+
+/// Return the number of keys in a frozen trie
+size_t trie_frozen_size (const trie_frozen_t frozen) {
+    return (size_t)frozen->header->keys;
+}
+
+/// Return the size of the block holding a frozen trie, in bytes
+size_t trie_frozen_bytes (const trie_frozen_t frozen) {
+    return frozen->bytes;
+}
+
+/* Helper function to read the fragment of a node: its length, and its bytes in *frag */
+static uint32_t trie_frozen_frag(const trie_frozen_t frozen, const struct trie_fnode_t *node, const char **frag) {
+    uint32_t len = 0;
+    if (node->frag == 0) { return 0; }
+
+    memcpy(&len, frozen->frags + node->frag, sizeof(len));
+    (*frag) = (const char *)frozen->frags + node->frag + sizeof(len);
+    return len;
+}
+
+/* Helper function to search the level of count nodes from base on for c;
+   no links to follow, the children of index i are at 2i+1 and 2i+2 */
+static const struct trie_fnode_t *trie_frozen_level(const trie_frozen_t frozen, uint32_t base, uint32_t count,
+        unsigned char c) {
+    const struct trie_fnode_t *level = frozen->nodes + base;
+    uint32_t i = 0;
+    while (i < count) {
+        if (level[i].key == c) { return &level[i]; }
+        i = 2 * i + 1 + (c > level[i].key);
+    }
+    return NULL;
+}
+
+/* Go down the frozen trie along src. Stops at the node where src ends, or ends inside
+   the fragment of (with partial set); NULL when src leaves the trie. *depth is set to
+   the number of characters above the node. */
+static const struct trie_fnode_t *trie_frozen_descend(const trie_frozen_t frozen, const char *src,
+        bool partial, size_t *depth) {
+    const char *start = src;
+    uint32_t base = 0, count = frozen->header->top;
+
+    while (count > 0) {
+        const struct trie_fnode_t *node = trie_frozen_level(frozen, base, count, (unsigned char)*src);
+        if (node == NULL) { return NULL; }
+
+        const char *frag = NULL;
+        uint32_t len = trie_frozen_frag(frozen, node, &frag);
+        size_t common = (len > 0 ? trie_frag_common(frag, len, src + 1) : 0);
+        if (partial && (src[1+common] == '\0')) { (*depth) = src - start; return node; }
+        if (common < len) { return NULL; }
+
+        src += len;
+        if (src[1] == '\0') { (*depth) = src - len - start; return node; }
+
+        base = node->mid;
+        count = (node->mid == 0 ? 0 : node->midsize + 1u);
+        ++src;
+    }
+    return NULL;
+}
+
+/// Find a key in a frozen trie
+bool trie_frozen_find (const trie_frozen_t frozen, const char * key, void ** val) {
+    if ((key == NULL) || (*key == '\0')) { return false; }
+
+    size_t depth = 0;
+    const struct trie_fnode_t *node = trie_frozen_descend(frozen, key, false, &depth);
+    if ((node == NULL) || (node->val == 0)) { return false; }
+
+    if (val != NULL) { (*val) = (void *)(uintptr_t)frozen->vals[node->val - 1]; }
+    return true;
+}
+
+// One node of an in-order visit of a frozen trie: index i of the level of count
+// nodes at base, whose key starts at depth. A lone frame stands for its node and
+// the levels below it only, not the rest of its level.
+struct trie_frozen_frame_t {
+    uint32_t base;
+    uint32_t count;
+    uint32_t i;
+    bool lone;
+    bool self;                  // the left branch is done, the node itself is next
+    size_t depth;
+};
+
+// The state of a frozen walk: frames plus the key being spelled
+struct trie_frozen_walk_state_t {
+    struct trie_frozen_frame_t *frames;
+    size_t top;
+    size_t cap;
+    char *key;
+    size_t keycap;
+};
+
+/* Helper function to put a frame on the walk; false when out of memory */
+static bool trie_frozen_push(struct trie_frozen_walk_state_t *w, uint32_t base, uint32_t count, uint32_t i,
+        bool lone, size_t depth) {
+    if (w->top == w->cap) {
+        size_t cap = (w->cap == 0 ? 64 : w->cap * 2);
+        struct trie_frozen_frame_t *frames = (struct trie_frozen_frame_t *)realloc(w->frames,
+            cap * sizeof(struct trie_frozen_frame_t));
+        if (frames == NULL) { return false; }
+        w->frames = frames;
+        w->cap = cap;
+    }
+
+    struct trie_frozen_frame_t frame = { base, count, i, lone, lone, depth };
+    w->frames[w->top++] = frame;
+    return true;
+}
+
+/* Visit the keys under the frames on the walk in order. Returns false as soon as
+   walkfunc does, or when out of memory */
+static bool trie_frozen_visit(const trie_frozen_t frozen, struct trie_frozen_walk_state_t *w,
+        trie_frozen_walk_t walkfunc, void *priv) {
+    while (w->top > 0) {
+        struct trie_frozen_frame_t *frame = &w->frames[w->top-1];
+        if (frame->i >= frame->count) { --w->top; continue; }
+
+        if (!frame->self) {
+            frame->self = true;
+            if (!trie_frozen_push(w, frame->base, frame->count, 2 * frame->i + 1, false, frame->depth)) { return false; }
+            continue;
+        }
+
+        // the node itself, then the level below it, then (unless lone) its right branch
+        const struct trie_fnode_t *node = &frozen->nodes[frame->base + frame->i];
+        const char *frag = NULL;
+        uint32_t len = trie_frozen_frag(frozen, node, &frag);
+        size_t depth = frame->depth, end = depth + 1 + len;
+
+        if (frame->lone) {
+            --w->top;
+        } else {
+            frame->i = 2 * frame->i + 2;
+            frame->self = false;
+        }
+
+        if (!trie_reserve_key(&w->key, &w->keycap, end + 1)) { return false; }
+        w->key[depth] = (char)node->key;
+        if (len > 0) { memcpy(w->key + depth + 1, frag, len); }
+
+        if (node->val != 0) {
+            w->key[end] = '\0';
+            if (!walkfunc(w->key, (void *)(uintptr_t)frozen->vals[node->val - 1], priv)) { return false; }
+        }
+        if ((node->mid != 0) && !trie_frozen_push(w, node->mid, node->midsize + 1u, 0, false, end)) { return false; }
+    }
+    return true;
+}
+
+/// Visit every key of a frozen trie starting with prefix, in lexicographic order
+bool trie_frozen_walk_prefix (const trie_frozen_t frozen, const char * prefix,
+      trie_frozen_walk_t walkfunc, void * priv) {
+    struct trie_frozen_walk_state_t w = { NULL, 0, 0, NULL, 0 };
+    bool ok = true;
+
+    if ((prefix == NULL) || (*prefix == '\0')) {
+        ok = (frozen->header->top == 0) || trie_frozen_push(&w, 0, frozen->header->top, 0, false, 0);
+    } else {
+        size_t depth = 0;
+        const struct trie_fnode_t *node = trie_frozen_descend(frozen, prefix, true, &depth);
+        if (node != NULL) {
+            // the characters above the node come straight from the prefix
+            ok = trie_reserve_key(&w.key, &w.keycap, depth + 1)
+                && trie_frozen_push(&w, (uint32_t)(node - frozen->nodes), 1, 0, true, depth);
+            if (ok) { memcpy(w.key, prefix, depth); }
+        }
+    }
+
+    ok = ok && trie_frozen_visit(frozen, &w, walkfunc, priv);
+    free(w.frames);
+    free(w.key);
+    return ok;
+}
+
+/// Visit every key of a frozen trie, in lexicographic order
+bool trie_frozen_walk (const trie_frozen_t frozen, trie_frozen_walk_t walkfunc, void * priv) {
+    return trie_frozen_walk_prefix(frozen, NULL, walkfunc, priv);
+}
+
+/* Helper function to sync the directory holding path, so a file just renamed into it
+   stays there through a crash */
+static bool trie_sync_dir(const char *path) {
+    const char *slash = strrchr(path, '/');
+    size_t len = ((slash == NULL) || (slash == path) ? 1 : (size_t)(slash - path));
+    char *dir = (char *)malloc(len + 1);
+    if (dir == NULL) { return false; }
+    memcpy(dir, (slash == NULL ? "." : path), len);
+    dir[len] = '\0';
+
+    int fd = open(dir, O_RDONLY | O_DIRECTORY);
+    free(dir);
+    if (fd < 0) { return false; }
+    bool ok = (fsync(fd) == 0);
+    return (close(fd) == 0) && ok;
+}
+
+/// Save a trie to a file, for trie_open_mmap
+bool trie_save (const trie_t trie, const char * path) {
+    trie_frozen_t frozen = trie_freeze(trie);
+    if (frozen == NULL) { return false; }
+
+    // written next to the target and renamed over it once on disk, so a crash
+    // leaves either the old file or the new one, never half of one
+    size_t plen = strlen(path);
+    char *tmp = (char *)malloc(plen + sizeof(".tmp"));
+    if (tmp == NULL) { trie_frozen_free(frozen); return false; }
+    memcpy(tmp, path, plen);
+    memcpy(tmp + plen, ".tmp", sizeof(".tmp"));
+
+    bool ok = false;
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd >= 0) {
+        const char *data = (const char *)frozen->buffer;
+        size_t left = frozen->bytes;
+        while (left > 0) {
+            ssize_t done = write(fd, data, left);
+            if ((done < 0) && (errno == EINTR)) { continue; }
+            if (done <= 0) { break; }
+            data += done;
+            left -= (size_t)done;
+        }
+        ok = (left == 0) && (fsync(fd) == 0);
+        ok = (close(fd) == 0) && ok;
+        ok = ok && (rename(tmp, path) == 0);
+        if (!ok) { unlink(tmp); }
+        ok = ok && trie_sync_dir(path);
+    }
+
+    free(tmp);
+    trie_frozen_free(frozen);
+    return ok;
+}
+
+/* Helper function to check that a header describes a well-formed block of bytes bytes */
+static bool trie_frozen_check(const struct trie_frozen_header_t *header, size_t bytes) {
+    if ((memcmp(header->magic, TRIE_FROZEN_MAGIC, sizeof(TRIE_FROZEN_MAGIC)) != 0)
+        || (header->version != TRIE_FROZEN_VERSION) || (header->bytes != bytes)) { return false; }
+    if ((header->nodes >= UINT32_MAX) || (header->keys >= UINT32_MAX) || (header->fragbytes >= UINT32_MAX)
+        || (header->top > header->nodes) || (header->fragbytes < sizeof(uint32_t))) { return false; }
+
+    return sizeof(struct trie_frozen_header_t) + header->nodes * sizeof(struct trie_fnode_t)
+        + header->keys * sizeof(uint64_t) + header->fragbytes == bytes;
+}
+
+/// Open a file written by trie_save as a frozen trie, without reading it in
+trie_frozen_t trie_open_mmap (const char * path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) { return NULL; }
+
+    struct stat st;
+    if ((fstat(fd, &st) != 0) || (st.st_size < (off_t)sizeof(struct trie_frozen_header_t))) {
+        close(fd);
+        return NULL;
+    }
+
+    size_t bytes = (size_t)st.st_size;
+    void *map = mmap(NULL, bytes, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);      // the mapping keeps the file
+    if (map == MAP_FAILED) { return NULL; }
+
+    trie_frozen_t frozen = (trie_frozen_t)malloc(sizeof(struct trie_frozen_data_t));
+    if ((frozen == NULL) || !trie_frozen_check((const struct trie_frozen_header_t *)map, bytes)) {
+        free(frozen);
+        munmap(map, bytes);
+        return NULL;
+    }
+
+    trie_frozen_attach(frozen, map, true);
+    return frozen;
+}
+
+/// Check the checksum of a frozen trie
+bool trie_frozen_verify (const trie_frozen_t frozen) {
+    return trie_frozen_checksum(frozen->header) == frozen->header->checksum;
+}
@@ -0,0 +1,303 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include "trie.h"
+
+// Internal layout of the pointer-based trie, shared by trie.c and the
+// benchmarks. Not part of the public API.
+
+struct trie_arena_t;
+struct trie_compact_t;
+struct trie_epoch_t;
+struct trie_wides_t;
+
+// The structure representing the trie
+struct trie_data_t {
+    trie_pos_t start;
+    unsigned int size;      // number of keys, kept current by insert/remove
+    struct trie_arena_t *arena;     // NULL unless created by trie_new_arena
+    struct trie_compact_t *compact; // NULL unless created by trie_new_compact
+    unsigned int flags;     // TRIE_* flags given to trie_new_flags
+    trie_pos_t *roots;      // TRIE_ROOT*: first-character nodes by byte, then
+                            // (TRIE_ROOT65536) second-character nodes by two bytes
+    trie_log_t log;         // NULL unless trie_log_open attached one
+    struct trie_epoch_t *epoch;     // NULL unless TRIE_EPOCH
+    bool shared;            // set for good once trie_snapshot took a snapshot of it
+                            // or made it: its nodes may then have other owners
+    struct trie_wides_t *wides;     // NULL unless TRIE_WIDE
+    unsigned int burst;     // trie_new_burst: suffixes a bucket holds before it bursts, else 0
+    size_t buckets;         // buckets in the trie
+};
+
+// With TRIE_EPOCH readers run while the writer changes the trie, so every field a
+// reader looks at (the links, terminal, val and the size) is read and written
+// through these: acquire loads and release stores there, plain accesses otherwise.
+// The writer publishes a node only once it is filled in, so a reader that gets to
+// it through a link sees it whole.
+#define TRIE_LOAD(trie, field) \
+    (((trie)->flags & TRIE_EPOCH) ? __atomic_load_n(&(field), __ATOMIC_ACQUIRE) : (field))
+#define TRIE_STORE(trie, field, value) do { \
+    if ((trie)->flags & TRIE_EPOCH) { __atomic_store_n(&(field), (value), __ATOMIC_RELEASE); } \
+    else { (field) = (value); } \
+} while (0)
+
+// Where the second-character nodes start in roots
+#define TRIE_ROOTS_2 256
+
+// A TRIE_COMPRESS fragment: len characters, not NUL-terminated. The count is
+// kept in front of them, as trie_save does, so a node without one only spends
+// the pointer to it
+struct trie_frag_t {
+    unsigned int len;
+    char bytes[];
+};
+
+// A structure representing a trie node
+//
+// With TRIE_COMPRESS a node stands for key followed by the characters of frag,
+// a chain of single-child nodes folded into one: terminal, val, score and mid
+// then belong to the end of the fragment, while left and right still branch on
+// key alone. Without it frag is always NULL.
+//
+// The fields only some modes use share the space of the others: refs counts
+// nothing until the trie is shared, which a TRIE_WIDE trie never is (see
+// trie_snapshot), so 56 bytes hold a node whatever the mode.
+struct trie_node_t {
+    unsigned char key;      // compared as unsigned, so keys sort like strcmp
+    bool terminal;          // a key ends here (val may legitimately be NULL)
+    unsigned char height;   // height within its level's BST, kept current with TRIE_BALANCED
+    trie_score_t score;     // score of the key ending here, 0 when not terminal
+    void *val;              // with TRIE_KEEP_KEYS this is the key's trie_kept_t
+    trie_pos_t left;
+    trie_pos_t right;
+    trie_pos_t mid;
+    struct trie_frag_t *frag;   // owned by the node unless arena-backed
+    trie_score_t maxscore;  // highest score in this node's subtree (own key, left, mid, right)
+    union {
+        unsigned int refs;  // links to it, from this trie and its snapshots; atomic once shared
+        uint32_t wide;      // TRIE_WIDE: which wide node indexes its mid level, 0 for none
+    };
+};
+
+_Static_assert(sizeof(struct trie_node_t) <= 56, "trie nodes must stay within 56 bytes");
+
+/* Helper function for the number of characters in a node's fragment */
+static inline size_t trie_fraglen(const struct trie_node_t *node) {
+    return (node->frag == NULL ? 0 : node->frag->len);
+}
+
+// The per-key record of a TRIE_KEEP_KEYS trie: the value plus a copy of the
+// key (len bytes, then a 0-byte) that stays put until the key is removed. refs
+// counts the nodes holding it, more than one only once a node has been copied
+// away from a snapshot
+struct trie_kept_t {
+    void *val;
+    unsigned int refs;
+    unsigned int len;
+    char key[];
+};
+
+// A burst trie (trie_new_burst) keeps the tails of its keys in buckets (see
+// trie_burst.c): a mid link may lead to one instead of to a level of nodes, and the
+// position of a key kept in one is its entry there. Both are told from nodes by
+// their low bit, which the address of a node never has
+#define TRIE_TAGGED(pos) (((uintptr_t)(pos) & 1) != 0)
+#define TRIE_TAG(ptr) ((trie_pos_t)((uintptr_t)(ptr) | 1))
+#define TRIE_UNTAG(pos) ((void *)((uintptr_t)(pos) & ~(uintptr_t)1))
+
+// One key of a bucket: its value and where its suffix is in the bucket's bytes
+struct trie_entry_t {
+    void *val;
+    uint32_t off;
+    uint32_t len;
+};
+
+// One key of a bucket as the ordered queries list them: its suffix and its position
+struct trie_bucket_key_t {
+    const char *suffix;
+    size_t len;
+    trie_pos_t pos;
+};
+
+// A read-only view of one node, so traversals can run over either the
+// pointer layout or the compact one through plain positions
+struct trie_view_t {
+    trie_pos_t left;
+    trie_pos_t mid;
+    trie_pos_t right;
+    unsigned char key;
+    bool terminal;
+    size_t fraglen;         // characters of frag that follow key (always 0 when compact)
+    const char *frag;
+};
+
+// One pending node of a loop-based traversal, with the length of the key
+// prefix above it
+struct trie_frame_t {
+    trie_pos_t node;
+    size_t depth;
+};
+
+// A growable stack of frames, so traversals never recurse per node
+struct trie_stack_t {
+    struct trie_frame_t *frames;
+    size_t top;
+    size_t cap;
+};
+
+// The function a walk calls for every key: the trie_walk_t of the string walks or
+// the trie_walk_n_t of the _n ones, the other being NULL
+struct trie_visit_t {
+    trie_walk_t walkfunc;
+    trie_walk_n_t walkfunc_n;
+    void *priv;
+};
+
+/* Helper function to hand a key of len bytes to the function of a walk */
+static inline bool trie_visit(const struct trie_visit_t *visit, trie_t trie, trie_pos_t pos,
+        const char *key, size_t len) {
+    if (visit->walkfunc_n != NULL) { return visit->walkfunc_n(trie, pos, key, len, visit->priv); }
+    return visit->walkfunc(trie, pos, key, visit->priv);
+}
+
+/* Helper function to order two keys of alen and blen bytes as bytes (unsigned, like
+   strcmp), a key before the longer ones it starts */
+static inline int trie_key_cmp(const char *a, size_t alen, const char *b, size_t blen) {
+    int cmp = (((alen == 0) || (blen == 0)) ? 0 : memcmp(a, b, (alen < blen ? alen : blen)));
+    if (cmp != 0) { return cmp; }
+    return (alen < blen ? -1 : (alen > blen ? 1 : 0));
+}
+
+/* Helper function to push a frame; NULL nodes are skipped. False when out of memory */
+bool trie_stack_push(struct trie_stack_t *stack, trie_pos_t node, size_t depth);
+
+/* Helper function for the pre-order walks: visit the node of the top frame of stack,
+   its key prefix being in *buf, and push its children. False when the walk function
+   says to stop or when out of memory */
+bool trie_walk_frame(trie_t trie, struct trie_stack_t *stack, char **buf, size_t *cap,
+        const struct trie_visit_t *visit);
+
+/* Helper function to make room for need bytes in a growable key buffer */
+bool trie_reserve_key(char **buf, size_t *cap, size_t need);
+
+/* Helper function to generate a new node instance */
+trie_pos_t trie_new_node(trie_t trie, const char src, void *newval);
+
+/* Helper function to count how many of the len characters of a fragment src starts with
+   (src having at least len bytes) */
+size_t trie_frag_common(const char *frag, size_t len, const char *src);
+
+/* Helper function to read the value of a key node, whatever the layout */
+void *trie_node_value(const trie_t trie, const trie_pos_t node);
+
+// A level of 256 nodes is at most 11 high when AVL-balanced
+#define TRIE_AVL_MAX 16
+
+/* Helper functions for the AVL levels of a TRIE_BALANCED trie: recompute a node's
+   height, and restore the balance of the subtree at node (whose children are
+   balanced), returning its new top. Heights and maxima come out up to date */
+void trie_avl_height(trie_pos_t node);
+trie_pos_t trie_avl_balance(trie_pos_t node);
+
+/* Helper function to recompute the cached maxscore of a node from its own score and
+   its children. Returns true if it changed */
+bool trie_fix_max(trie_pos_t node);
+
+/* Helper function to checksum len bytes, for the trie_save and log formats */
+uint64_t trie_checksum(const void *buffer, size_t len);
+
+/* Helper functions to append a change to the log of a trie: key now has value val,
+   or key was removed. A record that cannot be kept marks the log as failed */
+void trie_log_put(trie_log_t log, const char *key, size_t len, void *val);
+void trie_log_del(trie_log_t log, const char *key, size_t len);
+
+/* Helper function to give node memory back right away; see trie_release_node */
+void trie_recycle_node(trie_t trie, trie_pos_t node);
+
+/* Helper functions for the epoch-based reclamation of a TRIE_EPOCH trie: set it up,
+   hand it a node (node set) or kept key record that was just unlinked, to be given
+   back once no reader can be on it anymore, and give everything back at destroy */
+struct trie_epoch_t *trie_epoch_new(void);
+void trie_epoch_retire(trie_t trie, void *mem, bool node);
+void trie_epoch_free(trie_t trie);
+
+/* Helper functions for TRIE_WIDE (see trie_wide.c): set up and free the wide nodes
+   of a trie, find the node to go on from into the level below owner (NULL for the
+   top level) for character c (the node of c if the level is indexed, else the root
+   of the level's BST), and keep the index current once node was linked into that
+   level, or the node of c unlinked from it */
+struct trie_wides_t *trie_wides_new(void);
+void trie_wides_free(struct trie_wides_t *w);
+trie_pos_t trie_wide_level(const trie_t trie, trie_pos_t owner, unsigned char c);
+void trie_wide_add(trie_t trie, trie_pos_t owner, trie_pos_t node);
+void trie_wide_del(trie_t trie, trie_pos_t owner, unsigned char c);
+
+/* Helper functions for the buckets of a burst trie (see trie_burst.c): find the entry
+   of the len bytes of suffix in a bucket (TRIE_INVALID_POS if it is not there); add
+   them to the bucket at *link, making one if *link is NULL (returns the entry, *created
+   telling whether it is new, or TRIE_INVALID_POS once the bucket burst into a level of
+   nodes for the descent to go on into, or when out of memory); remove the entry at pos
+   from the bucket at *link, clearing *link once it is empty; visit its keys, the key
+   above it being the first depth bytes of *buf (false when the walk function says to
+   stop or when out of memory); free it and its values; burst it into a level of nodes
+   (false when out of memory); list its keys in order into *keys, which grows to fit
+   (how many, or (size_t)-1 when out of memory); and find the first of count listed keys
+   that is not below the len bytes at key */
+trie_pos_t trie_bucket_find(trie_pos_t bucket, const char *suffix, size_t len);
+trie_pos_t trie_bucket_insert(trie_t trie, trie_pos_t *link, const char *suffix, size_t len, bool *created);
+void trie_bucket_remove(trie_t trie, trie_pos_t *link, trie_pos_t pos);
+bool trie_bucket_walk(trie_t trie, trie_pos_t bucket, char **buf, size_t *cap, size_t depth,
+        const struct trie_visit_t *visit);
+void trie_bucket_free(trie_pos_t bucket, trie_free_t freefunc);
+bool trie_bucket_burst(trie_t trie, trie_pos_t *link);
+size_t trie_bucket_keys(trie_pos_t bucket, struct trie_bucket_key_t **keys, size_t *cap);
+size_t trie_bucket_lower(const struct trie_bucket_key_t *keys, size_t count, const char *key, size_t len);
+
+/* Helper functions for the ordered walks, with either kind of walk function (see
+   trie_cursor.c): visit every key starting with the len bytes at prefix; and every key
+   in [lo, hi), lo and hi being lolen and hilen bytes (a NULL hi runs to the end).
+   False when the walk function says to stop or when out of memory */
+bool trie_cursor_walk_prefix(trie_t trie, const char *prefix, size_t len, const struct trie_visit_t *visit);
+bool trie_cursor_walk_range(trie_t trie, const char *lo, size_t lolen, const char *hi, size_t hilen,
+        const struct trie_visit_t *visit);
+
+/* Helper functions for the copy-on-write of a shared trie (see trie_snapshot): make
+   the node at *link this trie's own, copying it if a snapshot still has it (NULL when
+   out of memory), and the same for every node of the trie (false when out of memory) */
+trie_pos_t trie_own(trie_t trie, trie_pos_t *link);
+bool trie_own_all(trie_t trie);
+
+/* Helper function to hand every slab of from's arena over to trie's arena, so what
+   was carved out of them is trie's from now on (from keeps an empty arena) */
+void trie_arena_adopt(trie_t trie, trie_t from);
+
+// A work-stealing pool of worker threads (see trie_pool.c). A task is size bytes,
+// copied in and out; run does one, may queue more with trie_pool_push from the
+// worker running it, and returns false to stop the whole pool.
+struct trie_pool_t;
+typedef bool (*trie_task_t)(struct trie_pool_t *pool, unsigned int worker, void *task, void *priv);
+
+/* Helper functions for the pool: set it up for nthreads workers (the caller being
+   worker 0), queue a task for a worker (false when out of memory), tell whether some
+   worker is out of work, run until no task is left (false if one failed or memory
+   ran out), take back one of the tasks a failed run left in a worker's queue, and
+   free it */
+struct trie_pool_t *trie_pool_new(unsigned int nthreads, size_t size, trie_task_t run, void *priv);
+unsigned int trie_pool_workers(const struct trie_pool_t *pool);
+bool trie_pool_push(struct trie_pool_t *pool, unsigned int worker, const void *task);
+bool trie_pool_hungry(const struct trie_pool_t *pool);
+bool trie_pool_run(struct trie_pool_t *pool);
+bool trie_pool_pop(struct trie_pool_t *pool, unsigned int worker, void *task);
+void trie_pool_free(struct trie_pool_t *pool);
+
+/* Helper function to free a whole subtree of a pointer-layout trie (see trie_destroy);
+   with a pool, parts of it go to other workers as tasks holding a trie_pos_t */
+void trie_free_node(trie_t trie, trie_pos_t node, trie_free_t freefunc,
+        struct trie_pool_t *pool, unsigned int worker);
+
+/* Helper functions to get the top node of a trie and to look at any node of it */
+trie_pos_t trie_root(const trie_t trie);
+void trie_view(const trie_t trie, trie_pos_t pos, struct trie_view_t *view);
@@ -0,0 +1,385 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "trie.h"
+#include "trie_int.h"
+
+// The log file: a header naming the flags of the logged trie, then batches of
+// records, each batch a small header (payload size, record count, checksum of
+// the payload) and the payload. A record is an opcode byte, the key length as a
+// varint, the key bytes and, for TRIE_LOG_PUT, the value as a varint. A batch is
+// written in one go and synced before the next one starts, so only the last one
+// can be torn; replay stops at the first batch that is short or fails its
+// checksum. Replaying a put as an upsert and a missing key's removal as nothing
+// makes replay idempotent, which is what lets compaction skip any coordination
+// between the snapshot and the log. Numbers are in the byte order of the writer.
+
+#define TRIE_LOG_MAGIC "TSTLOG1"
+#define TRIE_LOG_VERSION 1
+#define TRIE_LOG_VARINT 10          // bytes of the longest 64-bit varint
+
+enum { TRIE_LOG_PUT = 1, TRIE_LOG_DEL = 2 };
+
+// The start of the file
+struct trie_log_header_t {
+    char magic[8];
+    uint32_t version;
+    uint32_t flags;             // TRIE_* flags of the logged trie, for trie_recover
+};
+
+// The start of every batch
+struct trie_log_batch_t {
+    uint32_t bytes;             // payload after this header
+    uint32_t records;
+    uint64_t checksum;          // of the payload
+};
+
+// An open log: the file, where its committed batches end, and the batch being
+// filled, with room for its header in front so it is written with one call
+struct trie_log_data_t {
+    trie_t trie;
+    int fd;
+    off_t end;
+    size_t batch;               // records per commit
+    size_t records;             // records in buf
+    char *buf;
+    size_t used;
+    size_t cap;
+    bool failed;                // a record was lost; nothing more is written
+};
+
+/* Helper function to write a varint at out. Returns the bytes written */
+static size_t trie_log_put_varint(unsigned char *out, uint64_t v) {
+    size_t n = 0;
+    while (v >= 0x80) {
+        out[n++] = (unsigned char)(v | 0x80);
+        v >>= 7;
+    }
+    out[n++] = (unsigned char)v;
+    return n;
+}
+
+/* Helper function to read a varint at *p, not past end. False if it runs over */
+static bool trie_log_get_varint(const unsigned char **p, const unsigned char *end, uint64_t *v) {
+    uint64_t value = 0;
+    for (unsigned int shift = 0; (*p < end) && (shift < 64); shift += 7) {
+        unsigned char byte = *(*p)++;
+        value |= (uint64_t)(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            (*v) = value;
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Helper function to write len bytes at offset, whatever write returns in pieces */
+static bool trie_log_write(int fd, const void *buffer, size_t len, off_t offset) {
+    const char *data = (const char *)buffer;
+    while (len > 0) {
+        ssize_t done = pwrite(fd, data, len, offset);
+        if ((done < 0) && (errno == EINTR)) { continue; }
+        if (done <= 0) { return false; }
+        data += done;
+        len -= (size_t)done;
+        offset += done;
+    }
+    return true;
+}
+
+/* Helper function to read a whole file into a fresh buffer (NULL when empty) */
+static bool trie_log_load(int fd, unsigned char **data, size_t *len) {
+    struct stat st;
+    if (fstat(fd, &st) != 0) { return false; }
+
+    (*data) = NULL;
+    (*len) = (size_t)st.st_size;
+    if ((*len) == 0) { return true; }
+
+    (*data) = (unsigned char *)malloc(*len);
+    if ((*data) == NULL) { return false; }
+
+    size_t got = 0;
+    while (got < (*len)) {
+        ssize_t done = pread(fd, (*data) + got, (*len) - got, (off_t)got);
+        if ((done < 0) && (errno == EINTR)) { continue; }
+        if (done <= 0) { break; }
+        got += (size_t)done;
+    }
+    (*len) = got;       // a file cut short meanwhile just ends earlier
+    return true;
+}
+
+/* Helper function to go through the records of one batch payload, applying them to
+   trie unless it is NULL. False if the payload is malformed or a change failed */
+static bool trie_log_apply(trie_t trie, const unsigned char *p, const unsigned char *end, uint32_t records) {
+    for (uint32_t r = 0; r < records; ++r) {
+        uint64_t len = 0, val = 0;
+        if (p == end) { return false; }
+        unsigned char op = *p++;
+        if (((op != TRIE_LOG_PUT) && (op != TRIE_LOG_DEL))
+            || !trie_log_get_varint(&p, end, &len) || (len == 0) || (len > (uint64_t)(end - p))) { return false; }
+
+        // keys are bytes, applied straight from the payload
+        const char *key = (const char *)p;
+        p += len;
+        if ((op == TRIE_LOG_PUT) && !trie_log_get_varint(&p, end, &val)) { return false; }
+        if (trie == NULL) { continue; }
+
+        if (op == TRIE_LOG_PUT) {
+            trie_pos_t pos = TRIE_INVALID_POS;
+            trie_upsert_n(trie, key, (size_t)len, (void *)(uintptr_t)val, NULL, &pos);
+            if (pos == TRIE_INVALID_POS) { return false; }
+        } else {
+            trie_remove_n(trie, key, (size_t)len, NULL);
+        }
+    }
+    return (p == end);
+}
+
+/* Helper function to replay the whole batches of a log file in data, into trie
+   unless it is NULL. Returns where the last whole batch ends; *ok is cleared if
+   a change could not be applied */
+static size_t trie_log_replay(const unsigned char *data, size_t len, trie_t trie, bool *ok) {
+    size_t at = sizeof(struct trie_log_header_t);
+
+    while (len - at >= sizeof(struct trie_log_batch_t)) {
+        struct trie_log_batch_t batch;
+        memcpy(&batch, data + at, sizeof(batch));
+
+        const unsigned char *payload = data + at + sizeof(batch);
+        if ((batch.bytes > len - at - sizeof(batch)) || (batch.records == 0)
+            || (trie_checksum(payload, batch.bytes) != batch.checksum)) { break; }
+
+        // checked through before any of it is applied, so a batch goes in whole or not at all
+        if (!trie_log_apply(NULL, payload, payload + batch.bytes, batch.records)) { break; }
+        if ((trie != NULL) && !trie_log_apply(trie, payload, payload + batch.bytes, batch.records)) {
+            (*ok) = false;
+            break;
+        }
+        at += sizeof(batch) + batch.bytes;
+    }
+
+    return at;
+}
+
+/* Helper function to check the header of a log file in data */
+static bool trie_log_check(const unsigned char *data, size_t len, unsigned int *flags) {
+    struct trie_log_header_t header;
+    if (len < sizeof(header)) { return false; }
+
+    memcpy(&header, data, sizeof(header));
+    if ((memcmp(header.magic, TRIE_LOG_MAGIC, sizeof(TRIE_LOG_MAGIC)) != 0)
+        || (header.version != TRIE_LOG_VERSION)) { return false; }
+    (*flags) = header.flags;
+    return true;
+}
+
+/* Helper function to write out the pending batch and sync it */
+static bool trie_log_commit(trie_log_t log) {
+    if (log->failed) { return false; }
+    if (log->records == 0) { return true; }
+
+    struct trie_log_batch_t batch;
+    batch.bytes = (uint32_t)(log->used - sizeof(batch));
+    batch.records = (uint32_t)log->records;
+    batch.checksum = trie_checksum(log->buf + sizeof(batch), batch.bytes);
+    memcpy(log->buf, &batch, sizeof(batch));
+
+    if (!trie_log_write(log->fd, log->buf, log->used, log->end) || (fdatasync(log->fd) != 0)) {
+        // whatever made it out is cut off again, so later batches are not stranded behind it
+        if (ftruncate(log->fd, log->end) != 0) { /* replay stops at the torn batch anyway */ }
+        log->failed = true;
+        return false;
+    }
+
+    log->end += (off_t)log->used;
+    log->used = sizeof(struct trie_log_batch_t);
+    log->records = 0;
+    return true;
+}
+
+/* Helper function to add a record to the pending batch, committing it once full */
+static void trie_log_append(trie_log_t log, unsigned char op, const char *key, size_t len, void *val) {
+    if (log->failed) { return; }
+
+    // a batch past 4G would overflow its header, so that one is committed early
+    size_t most = 1 + TRIE_LOG_VARINT + len + TRIE_LOG_VARINT;
+    if ((log->used + most > UINT32_MAX) && !trie_log_commit(log)) { return; }
+    if ((log->used + most > UINT32_MAX) || !trie_reserve_key(&log->buf, &log->cap, log->used + most)) {
+        log->failed = true;
+        return;
+    }
+
+    unsigned char *out = (unsigned char *)log->buf + log->used;
+    *out++ = op;
+    out += trie_log_put_varint(out, len);
+    memcpy(out, key, len);
+    out += len;
+    if (op == TRIE_LOG_PUT) { out += trie_log_put_varint(out, (uint64_t)(uintptr_t)val); }
+    log->used = (size_t)(out - (unsigned char *)log->buf);
+
+    if (++log->records >= log->batch) { trie_log_commit(log); }
+}
+
+void trie_log_put(trie_log_t log, const char *key, size_t len, void *val) {
+    trie_log_append(log, TRIE_LOG_PUT, key, len, val);
+}
+
+void trie_log_del(trie_log_t log, const char *key, size_t len) {
+    trie_log_append(log, TRIE_LOG_DEL, key, len, NULL);
+}
+
+/* Helper function for trie_log_open: stop at a key holding a 0-byte */
+static bool trie_log_savable(trie_t trie, trie_pos_t pos, const char *key, size_t len, void *priv) {
+    return (memchr(key, 0, len) == NULL);
+}
+
+/// Attach a redo log at path to a trie
+trie_log_t trie_log_open (trie_t trie, const char * path, size_t batch) {
+    if ((trie->compact != NULL) || !(trie->flags & TRIE_KEEP_KEYS) || (trie->log != NULL)) { return NULL; }
+    // trie_log_compact could never save such a key; trie_insert_key refuses new ones
+    if (!trie_walk_n(trie, trie_log_savable, NULL)) { return NULL; }
+
+    int fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (fd < 0) { return NULL; }
+
+    unsigned char *data = NULL;
+    size_t len = 0;
+    unsigned int flags = 0;
+    bool ok = trie_log_load(fd, &data, &len);
+
+    // an existing log keeps its whole batches; a header torn at creation is redone,
+    // but a file that is something else altogether is left alone
+    size_t end = sizeof(struct trie_log_header_t);
+    if (ok && trie_log_check(data, len, &flags)) {
+        end = trie_log_replay(data, len, NULL, &ok);
+    } else if (ok && (len >= sizeof(struct trie_log_header_t))) {
+        ok = false;
+    }
+    free(data);
+
+    struct trie_log_header_t header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, TRIE_LOG_MAGIC, sizeof(TRIE_LOG_MAGIC));
+    header.version = TRIE_LOG_VERSION;
+    header.flags = trie->flags;
+    ok = ok && trie_log_write(fd, &header, sizeof(header), 0)
+        && (ftruncate(fd, (off_t)end) == 0) && (fsync(fd) == 0);
+
+    trie_log_t log = NULL;
+    if (ok) { log = (trie_log_t)malloc(sizeof(struct trie_log_data_t)); }
+    if (log == NULL) {
+        close(fd);
+        return NULL;
+    }
+
+    log->trie = trie;
+    log->fd = fd;
+    log->end = (off_t)end;
+    log->batch = (batch == 0 ? 1 : batch);
+    log->records = 0;
+    log->buf = NULL;
+    log->used = sizeof(struct trie_log_batch_t);
+    log->cap = 0;
+    log->failed = false;
+    trie->log = log;
+    return log;
+}
+
+/// Write and sync the records not committed yet
+bool trie_log_flush (trie_log_t log) {
+    return trie_log_commit(log);
+}
+
+/// Fold the log into a snapshot
+bool trie_log_compact (trie_log_t log, const char * snapshot) {
+    // a crash before the log is emptied replays it over the new snapshot, so the
+    // pending batch goes out first: otherwise an older committed record (a put)
+    // would undo a newer pending one (its key's removal) that the snapshot holds.
+    // A failed log has lost records anyway; its batch is dropped, since the
+    // snapshot has every change in it and the log starts afresh
+    trie_log_commit(log);
+    if (!trie_save(log->trie, snapshot)) { return false; }
+
+    log->used = sizeof(struct trie_log_batch_t);
+    log->records = 0;
+    if ((ftruncate(log->fd, sizeof(struct trie_log_header_t)) != 0) || (fsync(log->fd) != 0)) {
+        // the old batches still replay correctly under the new snapshot, so carry on after them
+        return false;
+    }
+    log->end = sizeof(struct trie_log_header_t);
+    log->failed = false;
+    return true;
+}
+
+/// Flush the log, detach it from its trie and close it
+bool trie_log_close (trie_log_t log) {
+    bool ok = trie_log_commit(log);
+    log->trie->log = NULL;
+    ok = (close(log->fd) == 0) && ok;
+    free(log->buf);
+    free(log);
+    return ok;
+}
+
+/* Helper function to insert each key of a snapshot, walked in order */
+static bool trie_recover_key(const char *key, void *val, void *priv) {
+    trie_pos_t pos = TRIE_INVALID_POS;
+    trie_insert((trie_t)priv, key, val, &pos);
+    return (pos != TRIE_INVALID_POS);
+}
+
+/* Helper function to load the keys of a snapshot (a missing one is empty) */
+static bool trie_recover_snapshot(trie_t trie, const char *path) {
+    struct stat st;
+    if ((stat(path, &st) != 0) && (errno == ENOENT)) { return true; }
+
+    trie_frozen_t frozen = trie_open_mmap(path);
+    if (frozen == NULL) { return false; }
+
+    bool ok = trie_frozen_verify(frozen) && trie_frozen_walk(frozen, trie_recover_key, trie);
+    trie_frozen_free(frozen);
+    return ok;
+}
+
+/// Rebuild a trie from a trie_save snapshot and the log written since
+trie_t trie_recover (const char * snapshot, const char * log) {
+    unsigned char *data = NULL;
+    size_t len = 0;
+    unsigned int flags = TRIE_KEEP_KEYS;
+
+    if (log != NULL) {
+        int fd = open(log, O_RDONLY);
+        if ((fd < 0) && (errno != ENOENT)) { return TRIE_INVALID; }
+        if (fd >= 0) {
+            bool ok = trie_log_load(fd, &data, &len);
+            close(fd);
+            if (!ok || ((len > 0) && !trie_log_check(data, len, &flags))) {
+                free(data);
+                return TRIE_INVALID;
+            }
+        }
+    }
+
+    trie_t trie = trie_new_flags(flags);
+    bool ok = (trie != TRIE_INVALID);
+    if (ok && (snapshot != NULL)) { ok = trie_recover_snapshot(trie, snapshot); }
+    if (ok && (len > 0)) { trie_log_replay(data, len, trie, &ok); }
+    free(data);
+
+    // the snapshot comes in sorted, which turns levels without TRIE_BALANCED into chains
+    if (ok && !(flags & TRIE_BALANCED)) { ok = trie_rebalance(trie); }
+    if (!ok && (trie != TRIE_INVALID)) {
+        trie_destroy(trie, NULL);
+        return TRIE_INVALID;
+    }
+    return trie;
+}
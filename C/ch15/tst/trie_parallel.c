@@ -0,0 +1,215 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <pthread.h>
+#include "trie.h"
+#include "trie_int.h"
+
+// Walks and teardowns spread over the work-stealing pool of trie_pool.c. Neither
+// knows how big a subtree is before it is done with it, so both start as a single
+// task on the root and split on demand: a worker hands over the oldest frame of its
+// walk (with the key characters above it) or a mid level it was about to free as
+// soon as another worker runs out of work.
+
+#define TRIE_WALK_CHECK 64          // nodes between looks at whether a worker is idle
+
+// A subtree waiting to be walked: the key characters above it are in prefix
+struct trie_pwalk_task_t {
+    trie_pos_t node;
+    size_t depth;
+    char *prefix;
+};
+
+// What one worker of a parallel walk works with, on a cache line of its own
+struct trie_pwalk_worker_t {
+    _Alignas(64) struct trie_stack_t stack;
+    char *buf;
+    size_t cap;
+};
+
+struct trie_pwalk_t {
+    trie_t trie;
+    struct trie_visit_t visit;
+    struct trie_pwalk_worker_t *workers;
+};
+
+/* Helper function to hand the oldest pending frame of a walk over to the pool, with
+   a copy of the key characters above it. False if it stays, for lack of memory */
+static bool trie_pwalk_split(struct trie_pool_t *pool, unsigned int worker, struct trie_frame_t *frame,
+        const char *buf) {
+    struct trie_pwalk_task_t task = { frame->node, frame->depth, NULL };
+    if (frame->depth > 0) {
+        task.prefix = (char *)malloc(frame->depth);
+        if (task.prefix == NULL) { return false; }
+        memcpy(task.prefix, buf, frame->depth);
+    }
+
+    if (trie_pool_push(pool, worker, &task)) { return true; }
+    free(task.prefix);
+    return false;
+}
+
+/* Pool task of trie_walk_parallel: walk one subtree, giving frames away on demand.
+   Frames below bottom are the ones given away */
+static bool trie_pwalk_task(struct trie_pool_t *pool, unsigned int worker, void *task, void *priv) {
+    struct trie_pwalk_t *walk = (struct trie_pwalk_t *)priv;
+    struct trie_pwalk_worker_t *me = &walk->workers[worker];
+    struct trie_pwalk_task_t *t = (struct trie_pwalk_task_t *)task;
+
+    bool ok = trie_reserve_key(&me->buf, &me->cap, t->depth + 1);
+    if (ok && (t->depth > 0)) { memcpy(me->buf, t->prefix, t->depth); }
+    free(t->prefix);
+
+    me->stack.top = 0;
+    ok = ok && trie_stack_push(&me->stack, t->node, t->depth);
+
+    size_t bottom = 0, visits = 0;
+    while (ok && (me->stack.top > bottom)) {
+        if ((++visits % TRIE_WALK_CHECK == 0) && (me->stack.top - bottom > 1) && trie_pool_hungry(pool) &&
+            trie_pwalk_split(pool, worker, &me->stack.frames[bottom], me->buf)) {
+            ++bottom;
+        }
+
+        // frames only come off the top, so those given away are gone for good
+        ok = trie_walk_frame(walk->trie, &me->stack, &me->buf, &me->cap, &walk->visit);
+        if (me->stack.top == bottom) { me->stack.top = bottom = 0; }
+    }
+    return ok;
+}
+
+/// Visit every key in the trie on nthreads threads
+bool trie_walk_parallel (trie_t trie, trie_walk_t walkfunc, void * priv, unsigned int nthreads) {
+    trie_pos_t root = trie_root(trie);
+    if (root == NULL) { return true; }
+    if (nthreads < 2) { return trie_walk(trie, walkfunc, priv); }
+
+    struct trie_pwalk_t walk = { trie, { walkfunc, NULL, priv }, NULL };
+    struct trie_pool_t *pool = trie_pool_new(nthreads, sizeof(struct trie_pwalk_task_t), trie_pwalk_task, &walk);
+    if (pool == NULL) { return false; }
+
+    unsigned int nworkers = trie_pool_workers(pool);
+    walk.workers = (struct trie_pwalk_worker_t *)aligned_alloc(64, nworkers * sizeof(struct trie_pwalk_worker_t));
+    bool ok = (walk.workers != NULL);
+    for (unsigned int w = 0; ok && (w < nworkers); ++w) {
+        struct trie_pwalk_worker_t blank = { { NULL, 0, 0 }, NULL, 0 };
+        walk.workers[w] = blank;
+    }
+
+    struct trie_pwalk_task_t first = { root, 0, NULL };
+    ok = ok && trie_pool_push(pool, 0, &first) && trie_pool_run(pool);
+
+    // a walk that stopped early leaves tasks behind, whose prefixes are still to go
+    struct trie_pwalk_task_t left;
+    for (unsigned int w = 0; w < nworkers; ++w) {
+        while (trie_pool_pop(pool, w, &left)) { free(left.prefix); }
+    }
+
+    for (unsigned int w = 0; (walk.workers != NULL) && (w < nworkers); ++w) {
+        free(walk.workers[w].stack.frames);
+        free(walk.workers[w].buf);
+    }
+    free(walk.workers);
+    trie_pool_free(pool);
+    return ok;
+}
+
+// What a parallel teardown needs to know about the trie going away
+struct trie_pfree_t {
+    trie_t trie;
+    trie_free_t freefunc;
+};
+
+/* Pool task of the parallel teardown: free one subtree, giving levels away on demand */
+static bool trie_pfree_task(struct trie_pool_t *pool, unsigned int worker, void *task, void *priv) {
+    struct trie_pfree_t *pfree = (struct trie_pfree_t *)priv;
+    trie_free_node(pfree->trie, *(trie_pos_t *)task, pfree->freefunc, pool, worker);
+    return true;
+}
+
+/* Helper function for trie_destroy_parallel: free the nodes of a pointer-layout trie
+   over a pool of nthreads, if one can be had, then the rest as trie_destroy does */
+static void trie_destroy_pool(trie_t trie, trie_free_t freefunc, unsigned int nthreads) {
+    struct trie_pfree_t pfree = { trie, freefunc };
+    struct trie_pool_t *pool = NULL;
+
+    if ((trie->compact == NULL) && (trie->arena == NULL) && (trie->start != NULL) && (nthreads > 1)) {
+        pool = trie_pool_new(nthreads, sizeof(trie_pos_t), trie_pfree_task, &pfree);
+    }
+    if (pool != NULL) {
+        // epoch limbo lists are not for several threads at once; nothing reads anymore
+        if (trie->epoch != NULL) { trie_epoch_free(trie); }
+        if (trie_pool_push(pool, 0, &trie->start)) {
+            trie_pool_run(pool);    // its tasks never fail, so every subtree is gone
+            trie->start = NULL;
+        }
+        trie_pool_free(pool);
+    }
+    trie_destroy(trie, freefunc);
+}
+
+// Teardowns still running in the background, for trie_destroy_wait
+static pthread_mutex_t trie_bg_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t trie_bg_done = PTHREAD_COND_INITIALIZER;
+static unsigned int trie_bg_running = 0;
+
+// A teardown handed to a background thread
+struct trie_bg_t {
+    trie_t trie;
+    trie_free_t freefunc;
+    unsigned int nthreads;
+};
+
+static void *trie_bg_thread(void *arg) {
+    struct trie_bg_t bg = *(struct trie_bg_t *)arg;
+    free(arg);
+    trie_destroy_pool(bg.trie, bg.freefunc, bg.nthreads);
+
+    pthread_mutex_lock(&trie_bg_lock);
+    if (--trie_bg_running == 0) { pthread_cond_broadcast(&trie_bg_done); }
+    pthread_mutex_unlock(&trie_bg_lock);
+    return NULL;
+}
+
+/// Free a trie on nthreads threads
+void trie_destroy_parallel (trie_t trie, trie_free_t freefunc, unsigned int nthreads) {
+    trie_destroy_pool(trie, freefunc, nthreads);
+}
+
+/// Free a trie in the background
+bool trie_destroy_background (trie_t trie, trie_free_t freefunc, unsigned int nthreads) {
+    // the log is closed here, so its last records are down before this returns
+    if (trie->log != NULL) { trie_log_close(trie->log); }
+
+    struct trie_bg_t *bg = (struct trie_bg_t *)malloc(sizeof(struct trie_bg_t));
+    pthread_attr_t attr;
+    pthread_t thread;
+    bool started = false;
+
+    if ((bg != NULL) && (pthread_attr_init(&attr) == 0)) {
+        bg->trie = trie;
+        bg->freefunc = freefunc;
+        bg->nthreads = nthreads;
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+        pthread_mutex_lock(&trie_bg_lock);
+        started = (pthread_create(&thread, &attr, trie_bg_thread, bg) == 0);
+        if (started) { ++trie_bg_running; }
+        pthread_mutex_unlock(&trie_bg_lock);
+        pthread_attr_destroy(&attr);
+    }
+
+    if (!started) {
+        free(bg);
+        trie_destroy_pool(trie, freefunc, nthreads);
+    }
+    return started;
+}
+
+/// Wait for every trie_destroy_background to be done
+void trie_destroy_wait (void) {
+    pthread_mutex_lock(&trie_bg_lock);
+    while (trie_bg_running > 0) { pthread_cond_wait(&trie_bg_done, &trie_bg_lock); }
+    pthread_mutex_unlock(&trie_bg_lock);
+}
@@ -0,0 +1,192 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include "trie.h"
+#include "trie_int.h"
+
+// A work-stealing pool for the parallel builds and walks. Every worker has a queue
+// of tasks of its own: it pushes and takes at the tail, so it keeps working on what
+// it just split off (whose keys or nodes are still in its cache), while a worker
+// that runs dry steals from the head of another one's queue, where the oldest and
+// so usually biggest tasks are. The tasks are coarse (a subtree each), so a plain
+// mutex per queue is all the locking there is. The calling thread is worker 0.
+//
+// Work that cannot be split up front (a walk does not know how big a subtree is
+// until it is done with it) is split on demand instead: the worker running it
+// checks trie_pool_hungry now and then and pushes part of what it has left once
+// another worker is out of work.
+
+#define TRIE_POOL_LINE 64
+#define TRIE_POOL_MIN 64
+
+struct trie_queue_t {
+    _Alignas(TRIE_POOL_LINE) pthread_mutex_t lock;
+    char *items;
+    size_t head;                // first task left, in tasks
+    size_t tail;                // one past the last one
+    size_t cap;
+};
+
+struct trie_pool_t {
+    unsigned int nworkers;
+    size_t size;                // bytes per task
+    trie_task_t run;
+    void *priv;
+    struct trie_queue_t *queues;
+    atomic_size_t pending;      // tasks queued or running
+    atomic_uint idle;           // workers looking for a task
+    atomic_bool failed;
+};
+
+// What each thread of trie_pool_run starts with
+struct trie_pool_arg_t {
+    struct trie_pool_t *pool;
+    unsigned int worker;
+};
+
+struct trie_pool_t *trie_pool_new(unsigned int nthreads, size_t size, trie_task_t run, void *priv) {
+    struct trie_pool_t *pool = (struct trie_pool_t *)malloc(sizeof(struct trie_pool_t));
+    if (pool == NULL) { return NULL; }
+
+    pool->nworkers = (nthreads == 0 ? 1 : nthreads);
+    pool->size = size;
+    pool->run = run;
+    pool->priv = priv;
+    atomic_init(&pool->pending, 0);
+    atomic_init(&pool->idle, 0);
+    atomic_init(&pool->failed, false);
+
+    pool->queues = (struct trie_queue_t *)aligned_alloc(TRIE_POOL_LINE, pool->nworkers * sizeof(struct trie_queue_t));
+    if (pool->queues == NULL) { free(pool); return NULL; }
+    for (unsigned int i = 0; i < pool->nworkers; ++i) {
+        pthread_mutex_init(&pool->queues[i].lock, NULL);
+        pool->queues[i].items = NULL;
+        pool->queues[i].head = pool->queues[i].tail = pool->queues[i].cap = 0;
+    }
+    return pool;
+}
+
+void trie_pool_free(struct trie_pool_t *pool) {
+    for (unsigned int i = 0; i < pool->nworkers; ++i) {
+        pthread_mutex_destroy(&pool->queues[i].lock);
+        free(pool->queues[i].items);
+    }
+    free(pool->queues);
+    free(pool);
+}
+
+unsigned int trie_pool_workers(const struct trie_pool_t *pool) {
+    return pool->nworkers;
+}
+
+bool trie_pool_hungry(const struct trie_pool_t *pool) {
+    return (atomic_load_explicit(&pool->idle, memory_order_relaxed) > 0);
+}
+
+bool trie_pool_push(struct trie_pool_t *pool, unsigned int worker, const void *task) {
+    struct trie_queue_t *q = &pool->queues[worker];
+    bool ok = true;
+
+    pthread_mutex_lock(&q->lock);
+    if (q->tail == q->cap) {
+        if (q->head > 0) {      // slide what is left to the front first
+            memmove(q->items, q->items + q->head * pool->size, (q->tail - q->head) * pool->size);
+            q->tail -= q->head;
+            q->head = 0;
+        } else {
+            size_t cap = (q->cap == 0 ? TRIE_POOL_MIN : q->cap * 2);
+            char *items = (char *)realloc(q->items, cap * pool->size);
+            if (items == NULL) {
+                ok = false;
+            } else {
+                q->items = items;
+                q->cap = cap;
+            }
+        }
+    }
+    if (ok) {
+        memcpy(q->items + q->tail++ * pool->size, task, pool->size);
+        atomic_fetch_add(&pool->pending, 1);
+    }
+    pthread_mutex_unlock(&q->lock);
+    return ok;
+}
+
+/* Helper function to take a task off a queue: its tail for the worker it belongs
+   to, its head for a thief. False if it is empty */
+static bool trie_pool_take(struct trie_pool_t *pool, unsigned int from, bool own, void *task) {
+    struct trie_queue_t *q = &pool->queues[from];
+    bool found = false;
+
+    pthread_mutex_lock(&q->lock);
+    if (q->head < q->tail) {
+        size_t at = (own ? --q->tail : q->head++);
+        memcpy(task, q->items + at * pool->size, pool->size);
+        found = true;
+    }
+    pthread_mutex_unlock(&q->lock);
+    return found;
+}
+
+/* Helper function for the loop of one worker: its own tasks, newest first, then
+   whatever it can steal, until no task is left anywhere or one has failed */
+static void trie_pool_work(struct trie_pool_t *pool, unsigned int worker) {
+    void *task = malloc(pool->size);
+    if (task == NULL) { atomic_store(&pool->failed, true); return; }
+    bool idle = false;
+
+    while (!atomic_load_explicit(&pool->failed, memory_order_relaxed)) {
+        bool found = trie_pool_take(pool, worker, true, task);
+        for (unsigned int i = 1; !found && (i < pool->nworkers); ++i) {
+            found = trie_pool_take(pool, (worker + i) % pool->nworkers, false, task);
+        }
+
+        if (!found) {
+            if (atomic_load(&pool->pending) == 0) { break; }
+            if (!idle) { atomic_fetch_add(&pool->idle, 1); idle = true; }
+            sched_yield();
+            continue;
+        }
+        if (idle) { atomic_fetch_sub(&pool->idle, 1); idle = false; }
+
+        if (!pool->run(pool, worker, task, pool->priv)) { atomic_store(&pool->failed, true); }
+        atomic_fetch_sub(&pool->pending, 1);    // after whatever it pushed, so never 0 too early
+    }
+    if (idle) { atomic_fetch_sub(&pool->idle, 1); }
+    free(task);
+}
+
+static void *trie_pool_thread(void *arg) {
+    struct trie_pool_arg_t *a = (struct trie_pool_arg_t *)arg;
+    trie_pool_work(a->pool, a->worker);
+    return NULL;
+}
+
+bool trie_pool_run(struct trie_pool_t *pool) {
+    unsigned int extra = pool->nworkers - 1, started = 0;
+    pthread_t *threads = (pthread_t *)malloc((extra == 0 ? 1 : extra) * sizeof(pthread_t));
+    struct trie_pool_arg_t *args = (struct trie_pool_arg_t *)malloc((extra + 1) * sizeof(struct trie_pool_arg_t));
+
+    // a worker that cannot be started only means the others steal more
+    for (unsigned int i = 0; (threads != NULL) && (args != NULL) && (i < extra); ++i) {
+        args[started].pool = pool;
+        args[started].worker = i + 1;
+        if (pthread_create(&threads[started], NULL, trie_pool_thread, &args[started]) == 0) { ++started; }
+    }
+
+    trie_pool_work(pool, 0);
+    for (unsigned int i = 0; i < started; ++i) { pthread_join(threads[i], NULL); }
+
+    free(threads);
+    free(args);
+    return !atomic_load(&pool->failed);
+}
+
+bool trie_pool_pop(struct trie_pool_t *pool, unsigned int worker, void *task) {
+    return trie_pool_take(pool, worker, true, task);
+}
@@ -0,0 +1,429 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include "trie.h"
+#include "trie_int.h"
+
+// Keys are spread over the shards by their first two bytes (the first one alone
+// for one-character keys), so all the keys starting with the same two bytes live
+// in the same shard. These 65536 groups are scattered over the shards with a
+// multiplicative hash, which keeps the shards even when keys only ever start with
+// a handful of characters. Each shard is an ordinary trie behind its own
+// reader/writer lock, on its own cache line so readers of different shards do not
+// bounce lines between cores.
+//
+// Ordered walks go through the groups in order, each one a range walk over its
+// shard. Writers keep a count of keys per group, which lets a walk skip the empty
+// groups without taking any lock; the total size is not kept in one place, since
+// a counter shared by every writer would be the very line they all fight over.
+
+#define TRIE_SHARD_GROUPS 65536
+#define TRIE_SHARD_LINE 64
+
+// One shard: its lock, on a cache line of its own, and its trie
+struct trie_shard_t {
+    _Alignas(TRIE_SHARD_LINE) pthread_rwlock_t lock;
+    trie_t trie;
+};
+
+struct trie_sharded_data_t {
+    unsigned int nshards;
+    struct trie_shard_t *shards;
+    atomic_uint *groups;        // keys per group, changed under the group's shard lock
+};
+
+/* Helper function to get the group of a key of len bytes (len > 0): a one-byte key
+   goes with the keys whose second byte is 0, which sort right after it */
+static unsigned int trie_shard_group(const char *key, size_t len) {
+    return ((unsigned int)(unsigned char)key[0] << 8) | (len > 1 ? (unsigned char)key[1] : 0);
+}
+
+/* Helper function to get the shard holding a group */
+static struct trie_shard_t *trie_shard_of(const trie_sharded_t sharded, unsigned int group) {
+    uint32_t hash = (uint32_t)group * 2654435761u;
+    return &sharded->shards[(hash >> 16) % sharded->nshards];
+}
+
+/* Helper function to spell the smallest key a group can hold into buf (2 bytes),
+   setting *len, or NULL past the last group */
+static const char *trie_shard_group_start(unsigned int group, char *buf, size_t *len) {
+    if (group >= TRIE_SHARD_GROUPS) { return NULL; }
+    buf[0] = (char)(group >> 8);
+    buf[1] = (char)(group & 0xff);
+    (*len) = ((group & 0xff) == 0 ? 1 : 2);
+    return buf;
+}
+
+/* Helper function for the string entry points: the length of a key, 0 for NULL */
+static size_t trie_shard_key_len(const char *key) {
+    return (key == NULL ? 0 : strlen(key));
+}
+
+/// Create a new empty sharded trie whose shards use the given TRIE_* flags
+trie_sharded_t trie_sharded_new_flags (unsigned int nshards, unsigned int flags) {
+    if (nshards == 0) { return NULL; }
+    if (nshards > TRIE_SHARD_GROUPS) { nshards = TRIE_SHARD_GROUPS; }     // the rest would stay empty
+
+    trie_sharded_t sharded = (trie_sharded_t)malloc(sizeof(struct trie_sharded_data_t));
+    if (sharded == NULL) { return NULL; }
+
+    sharded->nshards = 0;
+    sharded->groups = (atomic_uint *)calloc(TRIE_SHARD_GROUPS, sizeof(atomic_uint));
+    sharded->shards = (struct trie_shard_t *)aligned_alloc(TRIE_SHARD_LINE, nshards * sizeof(struct trie_shard_t));
+    if ((sharded->groups == NULL) || (sharded->shards == NULL)) {
+        trie_sharded_destroy(sharded, NULL);
+        return NULL;
+    }
+
+    for (unsigned int i = 0; i < nshards; ++i) {
+        struct trie_shard_t *shard = &sharded->shards[i];
+        shard->trie = trie_new_flags(flags);
+        if (shard->trie == TRIE_INVALID) { break; }
+        if (pthread_rwlock_init(&shard->lock, NULL) != 0) {
+            trie_destroy(shard->trie, NULL);
+            break;
+        }
+        sharded->nshards = i + 1;
+    }
+
+    if (sharded->nshards < nshards) {
+        trie_sharded_destroy(sharded, NULL);
+        return NULL;
+    }
+    return sharded;
+}
+
+/// Create a new empty sharded trie
+trie_sharded_t trie_sharded_new (unsigned int nshards) {
+    return trie_sharded_new_flags(nshards, 0);
+}
+
+/// Free a sharded trie
+void trie_sharded_destroy (trie_sharded_t sharded, trie_free_t freefunc) {
+    for (unsigned int i = 0; i < sharded->nshards; ++i) {
+        trie_destroy(sharded->shards[i].trie, freefunc);
+        pthread_rwlock_destroy(&sharded->shards[i].lock);
+    }
+    free(sharded->shards);
+    free(sharded->groups);
+    free(sharded);
+}
+
+/// Return the number of keys in a sharded trie
+size_t trie_sharded_size (const trie_sharded_t sharded) {
+    size_t size = 0;
+    for (unsigned int i = 0; i < sharded->nshards; ++i) {
+        struct trie_shard_t *shard = &sharded->shards[i];
+        pthread_rwlock_rdlock(&shard->lock);
+        size += trie_size(shard->trie);
+        pthread_rwlock_unlock(&shard->lock);
+    }
+    return size;
+}
+
+/// Insert or update a key in a sharded trie
+bool trie_sharded_upsert (trie_sharded_t sharded, const char * key, void * newval,
+      void ** oldval) {
+    return trie_sharded_upsert_n(sharded, key, trie_shard_key_len(key), newval, oldval);
+}
+
+/// Insert or update the len bytes at key in a sharded trie
+bool trie_sharded_upsert_n (trie_sharded_t sharded, const char * key, size_t len, void * newval,
+      void ** oldval) {
+    if (oldval != NULL) { (*oldval) = NULL; }
+    if (len == 0) { return false; }
+
+    unsigned int group = trie_shard_group(key, len);
+    struct trie_shard_t *shard = trie_shard_of(sharded, group);
+    pthread_rwlock_wrlock(&shard->lock);
+    bool created = trie_upsert_n(shard->trie, key, len, newval, oldval, NULL);
+    if (created) { atomic_fetch_add_explicit(&sharded->groups[group], 1, memory_order_relaxed); }
+    pthread_rwlock_unlock(&shard->lock);
+    return created;
+}
+
+/// Insert a key in a sharded trie
+bool trie_sharded_insert (trie_sharded_t sharded, const char * key, void * newval) {
+    return trie_sharded_insert_n(sharded, key, trie_shard_key_len(key), newval);
+}
+
+/// Insert the len bytes at key in a sharded trie
+bool trie_sharded_insert_n (trie_sharded_t sharded, const char * key, size_t len, void * newval) {
+    if (len == 0) { return false; }
+
+    unsigned int group = trie_shard_group(key, len);
+    struct trie_shard_t *shard = trie_shard_of(sharded, group);
+    pthread_rwlock_wrlock(&shard->lock);
+    bool created = trie_insert_n(shard->trie, key, len, newval, NULL);
+    if (created) { atomic_fetch_add_explicit(&sharded->groups[group], 1, memory_order_relaxed); }
+    pthread_rwlock_unlock(&shard->lock);
+    return created;
+}
+
+/// Find a key in a sharded trie
+bool trie_sharded_find (const trie_sharded_t sharded, const char * key, void ** val) {
+    return trie_sharded_find_n(sharded, key, trie_shard_key_len(key), val);
+}
+
+/// Find the len bytes at key in a sharded trie
+bool trie_sharded_find_n (const trie_sharded_t sharded, const char * key, size_t len, void ** val) {
+    if (len == 0) { return false; }
+
+    struct trie_shard_t *shard = trie_shard_of(sharded, trie_shard_group(key, len));
+    pthread_rwlock_rdlock(&shard->lock);
+    trie_pos_t pos = trie_find_n(shard->trie, key, len);
+    if ((pos != TRIE_INVALID_POS) && (val != NULL)) { (*val) = trie_get_value(shard->trie, pos); }
+    pthread_rwlock_unlock(&shard->lock);
+    return (pos != TRIE_INVALID_POS);
+}
+
+/// Remove a key from a sharded trie
+bool trie_sharded_remove (trie_sharded_t sharded, const char * key, void ** data) {
+    return trie_sharded_remove_n(sharded, key, trie_shard_key_len(key), data);
+}
+
+/// Remove the len bytes at key from a sharded trie
+bool trie_sharded_remove_n (trie_sharded_t sharded, const char * key, size_t len, void ** data) {
+    if (len == 0) { return false; }
+
+    unsigned int group = trie_shard_group(key, len);
+    struct trie_shard_t *shard = trie_shard_of(sharded, group);
+    pthread_rwlock_wrlock(&shard->lock);
+    bool removed = trie_remove_n(shard->trie, key, len, data);
+    if (removed) { atomic_fetch_sub_explicit(&sharded->groups[group], 1, memory_order_relaxed); }
+    pthread_rwlock_unlock(&shard->lock);
+    return removed;
+}
+
+/// Set the score of a key in a sharded trie
+bool trie_sharded_set_score (trie_sharded_t sharded, const char * key, trie_score_t score) {
+    return trie_sharded_set_score_n(sharded, key, trie_shard_key_len(key), score);
+}
+
+/// Set the score of the len bytes at key in a sharded trie
+bool trie_sharded_set_score_n (trie_sharded_t sharded, const char * key, size_t len, trie_score_t score) {
+    if (len == 0) { return false; }
+
+    struct trie_shard_t *shard = trie_shard_of(sharded, trie_shard_group(key, len));
+    pthread_rwlock_wrlock(&shard->lock);
+    bool ok = trie_set_score_n(shard->trie, key, len, score);
+    pthread_rwlock_unlock(&shard->lock);
+    return ok;
+}
+
+/* Helper function to visit the keys of groups first..last that are in [lo, hi), group
+   by group in order, each under the read lock of its shard */
+static bool trie_sharded_walk_groups(const trie_sharded_t sharded, unsigned int first, unsigned int last,
+        const char *lo, size_t lolen, const char *hi, size_t hilen, const struct trie_visit_t *visit) {
+    char from[2], to[2];
+
+    for (unsigned int group = first; group <= last; ++group) {
+        if (atomic_load_explicit(&sharded->groups[group], memory_order_relaxed) == 0) { continue; }
+
+        // the shard holds other groups too, so the range is narrowed down to this one
+        size_t glolen = 0, ghilen = 0;
+        const char *glo = trie_shard_group_start(group, from, &glolen);
+        const char *ghi = trie_shard_group_start(group + 1, to, &ghilen);
+        if ((lo != NULL) && (trie_key_cmp(lo, lolen, glo, glolen) > 0)) { glo = lo; glolen = lolen; }
+        if ((hi != NULL) && ((ghi == NULL) || (trie_key_cmp(hi, hilen, ghi, ghilen) < 0))) { ghi = hi; ghilen = hilen; }
+
+        struct trie_shard_t *shard = trie_shard_of(sharded, group);
+        pthread_rwlock_rdlock(&shard->lock);
+        bool ret = trie_cursor_walk_range(shard->trie, glo, glolen, ghi, ghilen, visit);
+        pthread_rwlock_unlock(&shard->lock);
+        if (!ret) { return false; }
+    }
+    return true;
+}
+
+/// Visit every key of a sharded trie, in lexicographic order
+bool trie_sharded_walk (const trie_sharded_t sharded, trie_walk_t walkfunc, void * priv) {
+    struct trie_visit_t visit = { walkfunc, NULL, priv };
+    return trie_sharded_walk_groups(sharded, 0, TRIE_SHARD_GROUPS - 1, NULL, 0, NULL, 0, &visit);
+}
+
+/// Visit every key of a sharded trie, in lexicographic order, with its length
+bool trie_sharded_walk_n (const trie_sharded_t sharded, trie_walk_n_t walkfunc, void * priv) {
+    struct trie_visit_t visit = { NULL, walkfunc, priv };
+    return trie_sharded_walk_groups(sharded, 0, TRIE_SHARD_GROUPS - 1, NULL, 0, NULL, 0, &visit);
+}
+
+/* Helper function to visit every key starting with the len bytes at prefix */
+static bool trie_sharded_walk_prefix_visit(const trie_sharded_t sharded, const char *prefix, size_t len,
+        const struct trie_visit_t *visit) {
+    if (len == 0) { return trie_sharded_walk_groups(sharded, 0, TRIE_SHARD_GROUPS - 1, NULL, 0, NULL, 0, visit); }
+
+    unsigned int group = trie_shard_group(prefix, len);
+    if (len == 1) {
+        return trie_sharded_walk_groups(sharded, group, group | 0xff, NULL, 0, NULL, 0, visit);
+    }
+
+    // two bytes or more: every match is in the one group
+    struct trie_shard_t *shard = trie_shard_of(sharded, group);
+    pthread_rwlock_rdlock(&shard->lock);
+    bool ret = trie_cursor_walk_prefix(shard->trie, prefix, len, visit);
+    pthread_rwlock_unlock(&shard->lock);
+    return ret;
+}
+
+/// Visit every key of a sharded trie starting with prefix, in lexicographic order
+bool trie_sharded_walk_prefix (const trie_sharded_t sharded, const char * prefix,
+      trie_walk_t walkfunc, void * priv) {
+    struct trie_visit_t visit = { walkfunc, NULL, priv };
+    return trie_sharded_walk_prefix_visit(sharded, prefix, trie_shard_key_len(prefix), &visit);
+}
+
+/// Visit every key of a sharded trie starting with the len bytes at prefix, in
+/// lexicographic order, with its length
+bool trie_sharded_walk_prefix_n (const trie_sharded_t sharded, const char * prefix, size_t len,
+      trie_walk_n_t walkfunc, void * priv) {
+    struct trie_visit_t visit = { NULL, walkfunc, priv };
+    return trie_sharded_walk_prefix_visit(sharded, prefix, len, &visit);
+}
+
+/* Helper function to visit every key in [lo, hi) */
+static bool trie_sharded_walk_range_visit(const trie_sharded_t sharded, const char *lo, size_t lolen,
+        const char *hi, size_t hilen, const struct trie_visit_t *visit) {
+    unsigned int first = ((lo == NULL) || (lolen == 0) ? 0 : trie_shard_group(lo, lolen));
+    unsigned int last = (hi == NULL ? TRIE_SHARD_GROUPS - 1 : (hilen == 0 ? 0 : trie_shard_group(hi, hilen)));
+    return trie_sharded_walk_groups(sharded, first, last, lo, lolen, hi, hilen, visit);
+}
+
+/// Visit every key of a sharded trie in [lo, hi), in lexicographic order
+bool trie_sharded_walk_range (const trie_sharded_t sharded, const char * lo, const char * hi,
+      trie_walk_t walkfunc, void * priv) {
+    struct trie_visit_t visit = { walkfunc, NULL, priv };
+    return trie_sharded_walk_range_visit(sharded, lo, trie_shard_key_len(lo), hi, trie_shard_key_len(hi), &visit);
+}
+
+/// Visit every key of a sharded trie in [lo, hi), lo and hi being lolen and hilen
+/// bytes, in lexicographic order, with its length
+bool trie_sharded_walk_range_n (const trie_sharded_t sharded, const char * lo, size_t lolen,
+      const char * hi, size_t hilen, trie_walk_n_t walkfunc, void * priv) {
+    struct trie_visit_t visit = { NULL, walkfunc, priv };
+    return trie_sharded_walk_range_visit(sharded, lo, lolen, hi, hilen, &visit);
+}
+
+/// Count the keys of a sharded trie in [lo, hi)
+size_t trie_sharded_count_range (const trie_sharded_t sharded, const char * lo, const char * hi) {
+    return trie_sharded_count_range_n(sharded, lo, trie_shard_key_len(lo), hi, trie_shard_key_len(hi));
+}
+
+/// Count the keys of a sharded trie in [lo, hi), lo and hi being lolen and hilen bytes
+size_t trie_sharded_count_range_n (const trie_sharded_t sharded, const char * lo, size_t lolen,
+      const char * hi, size_t hilen) {
+    // a count does not care about order, so each shard is counted in one go
+    size_t count = 0;
+    for (unsigned int i = 0; i < sharded->nshards; ++i) {
+        struct trie_shard_t *shard = &sharded->shards[i];
+        pthread_rwlock_rdlock(&shard->lock);
+        count += trie_count_range_n(shard->trie, lo, lolen, hi, hilen);
+        pthread_rwlock_unlock(&shard->lock);
+    }
+    return count;
+}
+
+// The matches trie_sharded_complete has collected so far
+struct trie_sharded_complete_t {
+    struct trie_match_t *out;
+    size_t count;
+    size_t max;
+};
+
+/* Helper function to copy out one more match; stops the walk once there are enough */
+static bool trie_sharded_collect(trie_t trie, trie_pos_t pos, const char *key, size_t len, void *priv) {
+    struct trie_sharded_complete_t *c = (struct trie_sharded_complete_t *)priv;
+
+    char *copy = (char *)malloc(len + 1);
+    if (copy == NULL) { return false; }
+    memcpy(copy, key, len);
+    copy[len] = '\0';
+
+    c->out[c->count].pos = TRIE_INVALID_POS;
+    c->out[c->count].len = len;
+    c->out[c->count++].key = copy;
+    return (c->count < c->max);
+}
+
+/// Return up to max keys of a sharded trie starting with prefix, in lexicographic order
+size_t trie_sharded_complete (const trie_sharded_t sharded, const char * prefix,
+      struct trie_match_t * out, size_t max) {
+    return trie_sharded_complete_n(sharded, prefix, trie_shard_key_len(prefix), out, max);
+}
+
+/// Return up to max keys of a sharded trie starting with the len bytes at prefix, in
+/// lexicographic order
+size_t trie_sharded_complete_n (const trie_sharded_t sharded, const char * prefix, size_t len,
+      struct trie_match_t * out, size_t max) {
+    struct trie_sharded_complete_t c = { out, 0, max };
+    if (max > 0) { trie_sharded_walk_prefix_n(sharded, prefix, len, trie_sharded_collect, &c); }
+    return c.count;
+}
+
+// A match one of the shards found for trie_sharded_topk, with its score
+struct trie_sharded_scored_t {
+    trie_score_t score;
+    char *key;
+    size_t len;
+};
+
+/* Helper function to order candidate matches by decreasing score, for qsort */
+static int trie_sharded_by_score(const void *a, const void *b) {
+    trie_score_t sa = ((const struct trie_sharded_scored_t *)a)->score;
+    trie_score_t sb = ((const struct trie_sharded_scored_t *)b)->score;
+    return (sa < sb) - (sa > sb);
+}
+
+/// Return the k highest-scoring keys of a sharded trie starting with prefix
+size_t trie_sharded_topk (const trie_sharded_t sharded, const char * prefix, size_t k,
+      struct trie_match_t * out) {
+    return trie_sharded_topk_n(sharded, prefix, trie_shard_key_len(prefix), k, out);
+}
+
+/// Return the k highest-scoring keys of a sharded trie starting with the len bytes
+/// at prefix
+size_t trie_sharded_topk_n (const trie_sharded_t sharded, const char * prefix, size_t len, size_t k,
+      struct trie_match_t * out) {
+    if (k == 0) { return 0; }
+
+    // two bytes or more pick one shard; otherwise each shard gives its own k best
+    unsigned int first = 0, last = sharded->nshards;
+    if (len > 1) {
+        first = (unsigned int)(trie_shard_of(sharded, trie_shard_group(prefix, len)) - sharded->shards);
+        last = first + 1;
+    }
+
+    struct trie_sharded_scored_t *cand = (struct trie_sharded_scored_t *)malloc(
+        (last - first) * k * sizeof(struct trie_sharded_scored_t));
+    if (cand == NULL) { return 0; }
+
+    size_t count = 0;
+    for (unsigned int i = first; i < last; ++i) {
+        struct trie_shard_t *shard = &sharded->shards[i];
+        pthread_rwlock_rdlock(&shard->lock);
+        size_t found = trie_topk_n(shard->trie, prefix, len, k, out);
+        for (size_t j = 0; j < found; ++j) {
+            cand[count].score = trie_get_score(shard->trie, out[j].pos);
+            cand[count].len = out[j].len;
+            cand[count++].key = out[j].key;
+        }
+        pthread_rwlock_unlock(&shard->lock);
+    }
+
+    qsort(cand, count, sizeof(struct trie_sharded_scored_t), trie_sharded_by_score);
+    for (size_t j = k; j < count; ++j) { free(cand[j].key); }
+    if (count > k) { count = k; }
+    for (size_t j = 0; j < count; ++j) {
+        out[j].pos = TRIE_INVALID_POS;
+        out[j].key = cand[j].key;
+        out[j].len = cand[j].len;
+    }
+
+    free(cand);
+    return count;
+}
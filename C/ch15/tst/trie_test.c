@@ -1,10 +1,13 @@
 #include "trie.h"
+#include "trie_int.h"
 
 #include <CUnit/Basic.h>
 
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdint.h>
+#include <string.h>
+#include <pthread.h>
 
 #define CONCUR 6
 #define MAX_STRING 250
@@ -78,7 +81,61 @@ static void test_insert()
 
 static void test_size()
 {
+   trie_t t = trie_new();
+   CU_ASSERT_PTR_NOT_NULL_FATAL(t);
+
+   CU_ASSERT_EQUAL(trie_size(t), 0);
+
+   // NULL is a valid value and still counts as a key
+   CU_ASSERT_TRUE(trie_insert(t, "null", NULL, NULL));
+   CU_ASSERT_EQUAL(trie_size(t), 1);
+   CU_ASSERT_PTR_NOT_NULL(trie_find(t, "null"));
+
+   // Prefixes and extensions of existing keys are keys of their own
+   CU_ASSERT_TRUE(trie_insert(t, "nu", (void*) 1, NULL));
+   CU_ASSERT_TRUE(trie_insert(t, "nullable", (void*) 2, NULL));
+   CU_ASSERT_FALSE(trie_insert(t, "null", (void*) 3, NULL));
+   CU_ASSERT_EQUAL(trie_size(t), 3);
+
+   // Empty keys are rejected and do not change the count
+   CU_ASSERT_FALSE(trie_insert(t, "", (void*) 4, NULL));
+   CU_ASSERT_EQUAL(trie_size(t), 3);
+
+   CU_ASSERT_TRUE(trie_remove(t, "nullable", NULL));
+   CU_ASSERT_EQUAL(trie_size(t), 2);
+
+   trie_destroy(t, NULL);
+}
+
+static void test_upsert()
+{
+   trie_t t = trie_new();
+   CU_ASSERT_PTR_NOT_NULL_FATAL(t);
+
+   trie_pos_t pos = TRIE_INVALID_POS;
+   void * old = (void*) 0xdead;
+
+   // New key: reported as inserted, no previous value
+   CU_ASSERT_TRUE(trie_upsert(t, "key", (void*) 1, &old, &pos));
+   CU_ASSERT_PTR_NULL(old);
+   CU_ASSERT_PTR_NOT_NULL_FATAL(pos);
+   CU_ASSERT_EQUAL(trie_get_value(t, pos), (void*) 1);
+
+   // Existing key: value replaced, old one handed back, same position
+   trie_pos_t again = TRIE_INVALID_POS;
+   CU_ASSERT_FALSE(trie_upsert(t, "key", (void*) 2, &old, &again));
+   CU_ASSERT_EQUAL(old, (void*) 1);
+   CU_ASSERT_EQUAL(again, pos);
+   CU_ASSERT_EQUAL(trie_get_value(t, trie_find(t, "key")), (void*) 2);
+   CU_ASSERT_EQUAL(trie_size(t), 1);
+
+   // trie_insert reports the existing position without updating it
+   again = TRIE_INVALID_POS;
+   CU_ASSERT_FALSE(trie_insert(t, "key", (void*) 3, &again));
+   CU_ASSERT_EQUAL(again, pos);
+   CU_ASSERT_EQUAL(trie_get_value(t, pos), (void*) 2);
 
+   trie_destroy(t, NULL);
 }
 
 static uintptr_t hash_string (const char * s)
@@ -128,6 +185,126 @@ static void test_insert_random ()
    CU_ASSERT_EQUAL(countfunc_value, count);
 }
 
+static void test_arena ()
+{
+   trie_t t = trie_new_arena(0);
+   CU_ASSERT_PTR_NOT_NULL_FATAL(t);
+
+   enum { KEYS = 2000 };
+   char * keys[KEYS];
+   unsigned int inserted = 0;
+
+   // Enough keys to need several slabs
+   for (unsigned int i=0; i<KEYS; ++i)
+   {
+      char buf[MAX_STRING+1];
+      generate_random_string(buf, 32);
+      keys[i] = malloc(strlen(buf)+1);
+      strcpy(keys[i], buf);
+      if (trie_insert(t, buf, (void*) hash_string(buf), NULL))
+         ++inserted;
+   }
+   CU_ASSERT_EQUAL(trie_size(t), inserted);
+
+   for (unsigned int i=0; i<KEYS; ++i)
+   {
+      trie_pos_t pos = trie_find(t, keys[i]);
+      CU_ASSERT_PTR_NOT_NULL(pos);
+      if (pos)
+      {
+         CU_ASSERT_EQUAL(trie_get_value(t, pos), (void*) hash_string(keys[i]));
+      }
+   }
+
+   // Removed nodes are recycled by the next inserts
+   CU_ASSERT_TRUE(trie_insert(t, "zzzzzzzzzz", (void*) 1, NULL));
+   CU_ASSERT_TRUE(trie_remove(t, "zzzzzzzzzz", NULL));
+   CU_ASSERT_TRUE(trie_insert(t, "zzzzzzzzzy", (void*) 1, NULL));
+   CU_ASSERT_PTR_NULL(trie_find(t, "zzzzzzzzzz"));
+   CU_ASSERT_PTR_NOT_NULL(trie_find(t, "zzzzzzzzzy"));
+   ++inserted;
+
+   // Bulk teardown still hands every live value to freefunc
+   countfunc_value = 0;
+   trie_destroy(t, countfunc_free);
+   CU_ASSERT_EQUAL(countfunc_value, inserted);
+
+   for (unsigned int i=0; i<KEYS; ++i)
+      free(keys[i]);
+}
+
+static bool test_compact_walker (trie_t t, trie_pos_t pos, const char * key,
+      void * priv)
+{
+   uintptr_t * data = (uintptr_t *) priv;
+
+   uintptr_t val = hash_string(key);
+   *data += val;
+   CU_ASSERT_EQUAL(trie_get_value(t, pos), val);
+   CU_ASSERT_EQUAL(trie_find(t, key), pos);
+   return true;
+}
+
+static void test_compact ()
+{
+   trie_t t = trie_new_compact(0);
+   CU_ASSERT_PTR_NOT_NULL_FATAL(t);
+
+   enum { KEYS = 500 };
+   char * keys[KEYS];
+   unsigned int todo = 0;
+   uintptr_t expected = 0;
+
+   // Force the node array to grow a few times
+   while (todo != KEYS)
+   {
+      char buf[MAX_STRING+1];
+      generate_random_string(buf, 12);
+
+      trie_pos_t pos;
+      if (!trie_insert(t, buf, (void*) hash_string(buf), &pos))
+         continue;
+
+      CU_ASSERT_EQUAL(trie_get_value(t, pos), (void*) hash_string(buf));
+      keys[todo] = malloc(strlen(buf)+1);
+      strcpy(keys[todo], buf);
+      expected += hash_string(buf);
+      ++todo;
+   }
+   CU_ASSERT_EQUAL(trie_size(t), KEYS);
+   CU_ASSERT_PTR_NULL(trie_find(t, "0"));
+
+   uintptr_t hash = 0;
+   CU_ASSERT_TRUE(trie_walk(t, test_compact_walker, &hash));
+   CU_ASSERT_EQUAL(hash, expected);
+
+   // Remove in random order; everything left must still be reachable
+   while (todo)
+   {
+      unsigned int p = rand() % todo;
+      void * data = 0;
+      CU_ASSERT_TRUE(trie_remove(t, keys[p], &data));
+      CU_ASSERT_EQUAL((uintptr_t) data, hash_string(keys[p]));
+      CU_ASSERT_FALSE(trie_remove(t, keys[p], NULL));
+      CU_ASSERT_PTR_NULL(trie_find(t, keys[p]));
+
+      --todo;
+      free(keys[p]);
+      keys[p] = keys[todo];
+      CU_ASSERT_EQUAL(trie_size(t), todo);
+
+      for (unsigned int i=0; i<todo; i += 7)
+      {
+         CU_ASSERT_PTR_NOT_NULL(trie_find(t, keys[i]));
+      }
+   }
+
+   // Removed nodes are recycled
+   CU_ASSERT_TRUE(trie_insert(t, "again", (void*) 1, NULL));
+   countfunc_value = 0;
+   trie_destroy(t, countfunc_free);
+   CU_ASSERT_EQUAL(countfunc_value, 1);
+}
 
 static void test_set_get ()
 {
@@ -265,6 +442,2728 @@ static void test_walk ()
    CU_ASSERT_EQUAL(countfunc_value, string_count);
 }
 
+struct kept_keys
+{
+   const char * keys[8];
+   unsigned int count;
+};
+
+static bool test_keep_keys_walker (trie_t t, trie_pos_t pos, const char * key,
+      void * priv)
+{
+   struct kept_keys * kept = (struct kept_keys *) priv;
+   CU_ASSERT_FATAL(kept->count < 8);
+   kept->keys[kept->count++] = key;
+   return true;
+}
+
+static void test_keep_keys ()
+{
+   const unsigned int flags[] = { TRIE_KEEP_KEYS, TRIE_KEEP_KEYS | TRIE_ARENA };
+
+   for (unsigned int loop=0; loop<2; ++loop)
+   {
+      trie_t t = trie_new_flags(flags[loop]);
+      CU_ASSERT_PTR_NOT_NULL_FATAL(t);
+
+      const char * test_strings[] = {"aaa", "aab", "aac", "aacd", "test", "aaaa"};
+      const unsigned int string_count =
+         sizeof(test_strings)/sizeof(test_strings[0]);
+
+      for (unsigned int i=0; i<string_count; ++i)
+      {
+         CU_ASSERT_TRUE(trie_insert(t, test_strings[i],
+                  (void*) hash_string(test_strings[i]), NULL));
+      }
+
+      // The key pointers must outlive the callbacks
+      struct kept_keys kept = { {0}, 0 };
+      CU_ASSERT_TRUE(trie_walk(t, test_keep_keys_walker, &kept));
+      CU_ASSERT_EQUAL(kept.count, string_count);
+
+      for (unsigned int i=0; i<kept.count; ++i)
+      {
+         trie_pos_t pos = trie_find(t, kept.keys[i]);
+         CU_ASSERT_PTR_NOT_NULL(pos);
+         if (pos)
+         {
+            CU_ASSERT_EQUAL(trie_get_value(t, pos), (void*) hash_string(kept.keys[i]));
+         }
+      }
+
+      void * data = 0;
+      CU_ASSERT_TRUE(trie_remove(t, "aacd", &data));
+      CU_ASSERT_EQUAL(data, (void*) hash_string("aacd"));
+
+      countfunc_value = 0;
+      trie_destroy(t, countfunc_free);
+      CU_ASSERT_EQUAL(countfunc_value, string_count - 1);
+   }
+}
+
+static void test_deep_keys ()
+{
+   trie_t t = trie_new();
+   CU_ASSERT_PTR_NOT_NULL_FATAL(t);
+
+   // Keys this long would take one stack frame per character if any of
+   // the operations recursed
+   enum { LEN = 200000 };
+   char * key = malloc(LEN+1);
+   CU_ASSERT_PTR_NOT_NULL_FATAL(key);
+   memset(key, 'k', LEN);
+   key[LEN] = 0;
+
+   CU_ASSERT_TRUE(trie_insert(t, key, (void*) 1, NULL));
+   key[LEN/2] = 'j';
+   CU_ASSERT_TRUE(trie_insert(t, key, (void*) 2, NULL));
+   key[LEN-1] = 0;
+   CU_ASSERT_TRUE(trie_insert(t, key, (void*) 3, NULL));
+
+   CU_ASSERT_PTR_NOT_NULL(trie_find(t, key));
+   uintptr_t count = 3;
+   CU_ASSERT_TRUE(trie_walk(t, test_walk_walker3, (void*) 0x1234));
+   CU_ASSERT_FALSE(trie_walk(t, test_walk_walker2, &count));
+   CU_ASSERT_EQUAL(count, 0);
+
+   CU_ASSERT_TRUE(trie_remove(t, key, NULL));
+   CU_ASSERT_PTR_NULL(trie_find(t, key));
+   CU_ASSERT_EQUAL(trie_size(t), 2);
+
+   countfunc_value = 0;
+   trie_destroy(t, countfunc_free);
+   CU_ASSERT_EQUAL(countfunc_value, 2);
+   free(key);
+}
+
+static int compare_strings (const void * a, const void * b)
+{
+   return strcmp(*(const char * const *) a, *(const char * const *) b);
+}
+
+// Index of the first of the n sorted keys that is >= key (n if none)
+static unsigned int lower_bound (char ** sorted, unsigned int n, const char * key)
+{
+   unsigned int lo = 0, hi = n;
+   while (lo < hi)
+   {
+      unsigned int mid = (lo + hi) / 2;
+      if (strcmp(sorted[mid], key) < 0)
+         lo = mid + 1;
+      else
+         hi = mid;
+   }
+   return lo;
+}
+
+static void test_cursor ()
+{
+   for (unsigned int loop=0; loop<2; ++loop)
+   {
+      trie_t t = (loop ? trie_new_compact(0) : trie_new());
+      CU_ASSERT_PTR_NOT_NULL_FATAL(t);
+
+      // Empty trie: nothing either way
+      trie_cursor_t c = trie_cursor_new(t);
+      CU_ASSERT_PTR_NOT_NULL_FATAL(c);
+      CU_ASSERT_FALSE(trie_cursor_next(c));
+      CU_ASSERT_FALSE(trie_cursor_prev(c));
+      CU_ASSERT_FALSE(trie_cursor_seek(c, "a"));
+      CU_ASSERT_PTR_NULL(trie_cursor_key(c));
+      trie_cursor_free(c);
+
+      enum { KEYS = 300 };
+      char * sorted[KEYS];
+      unsigned int n = 0;
+      while (n < KEYS - 2)
+      {
+         char buf[16];
+         generate_random_string(buf, 6);
+         if (trie_insert(t, buf, (void*) hash_string(buf), NULL))
+         {
+            sorted[n] = malloc(strlen(buf)+1);
+            strcpy(sorted[n++], buf);
+         }
+      }
+      // Bytes above 0x7f sort after ASCII, as with strcmp
+      const char * high[] = { "\xe9t\xe9", "a\xff" };
+      for (unsigned int i=0; i<2; ++i)
+      {
+         CU_ASSERT_TRUE(trie_insert(t, high[i], (void*) hash_string(high[i]), NULL));
+         sorted[n] = malloc(strlen(high[i])+1);
+         strcpy(sorted[n++], high[i]);
+      }
+      qsort(sorted, n, sizeof(sorted[0]), compare_strings);
+
+      c = trie_cursor_new(t);
+      CU_ASSERT_PTR_NOT_NULL_FATAL(c);
+
+      // Forward and backward over everything
+      unsigned int i = 0;
+      while (trie_cursor_next(c))
+      {
+         CU_ASSERT_FATAL(i < n);
+         CU_ASSERT_STRING_EQUAL(trie_cursor_key(c), sorted[i]);
+         CU_ASSERT_EQUAL(trie_cursor_pos(c), trie_find(t, sorted[i]));
+         ++i;
+      }
+      CU_ASSERT_EQUAL(i, n);
+      CU_ASSERT_PTR_NULL(trie_cursor_key(c));
+
+      while (trie_cursor_prev(c))
+      {
+         CU_ASSERT_FATAL(i > 0);
+         --i;
+         CU_ASSERT_STRING_EQUAL(trie_cursor_key(c), sorted[i]);
+      }
+      CU_ASSERT_EQUAL(i, 0);
+
+      // Seek to existing keys, to probes in between and past the end
+      for (unsigned int probe=0; probe<200; ++probe)
+      {
+         char buf[16];
+         if (probe & 1)
+            generate_random_string(buf, 6);
+         else
+            strcpy(buf, sorted[rand() % n]);
+
+         unsigned int lb = lower_bound(sorted, n, buf);
+         CU_ASSERT_EQUAL(trie_cursor_seek(c, buf), lb < n);
+         if (lb == n)
+            continue;
+
+         CU_ASSERT_STRING_EQUAL(trie_cursor_key(c), sorted[lb]);
+         if (lb + 1 < n)
+         {
+            CU_ASSERT_TRUE(trie_cursor_next(c));
+            CU_ASSERT_STRING_EQUAL(trie_cursor_key(c), sorted[lb+1]);
+            CU_ASSERT_TRUE(trie_cursor_prev(c));
+         }
+         if (lb > 0)
+         {
+            CU_ASSERT_TRUE(trie_cursor_prev(c));
+            CU_ASSERT_STRING_EQUAL(trie_cursor_key(c), sorted[lb-1]);
+         }
+      }
+
+      CU_ASSERT_TRUE(trie_cursor_seek(c, ""));
+      CU_ASSERT_STRING_EQUAL(trie_cursor_key(c), sorted[0]);
+      CU_ASSERT_FALSE(trie_cursor_seek(c, "\xff"));
+      CU_ASSERT_TRUE(trie_cursor_prev(c));
+      CU_ASSERT_STRING_EQUAL(trie_cursor_key(c), sorted[n-1]);
+
+      trie_cursor_free(c);
+      for (i=0; i<n; ++i)
+         free(sorted[i]);
+      trie_destroy(t, NULL);
+   }
+}
+
+struct prefix_walk
+{
+   char ** sorted;
+   unsigned int next;
+   unsigned int stop;
+};
+
+static bool prefix_walker (trie_t t, trie_pos_t pos, const char * key, void * priv)
+{
+   struct prefix_walk * w = priv;
+   CU_ASSERT_STRING_EQUAL(key, w->sorted[w->next]);
+   CU_ASSERT_EQUAL(trie_get_value(t, pos), (void*) hash_string(key));
+   ++w->next;
+   return w->next != w->stop;
+}
+
+static void test_prefix ()
+{
+   for (unsigned int loop=0; loop<3; ++loop)
+   {
+      trie_t t = (loop == 0 ? trie_new()
+            : (loop == 1 ? trie_new_compact(0) : trie_new_flags(TRIE_KEEP_KEYS)));
+      CU_ASSERT_PTR_NOT_NULL_FATAL(t);
+
+      enum { KEYS = 500 };
+      char * sorted[KEYS];
+      unsigned int n = 0;
+      while (n < KEYS)
+      {
+         char buf[16];
+         generate_random_string(buf, 7);
+         // a smaller alphabet, so short prefixes have plenty of matches
+         for (char * p = buf; *p; ++p)
+            *p = 'a' + (*p % 4);
+         if (trie_insert(t, buf, (void*) hash_string(buf), NULL))
+         {
+            sorted[n] = malloc(strlen(buf)+1);
+            strcpy(sorted[n++], buf);
+         }
+      }
+      qsort(sorted, n, sizeof(sorted[0]), compare_strings);
+
+      const char * prefixes[] = { "", "a", "b", "ab", "dd", "cab", "e", "abcd", "zz" };
+      for (unsigned int p=0; p<sizeof(prefixes)/sizeof(prefixes[0]); ++p)
+      {
+         const char * prefix = prefixes[p];
+         size_t plen = strlen(prefix);
+         unsigned int first = lower_bound(sorted, n, prefix), last = first;
+         while ((last < n) && (strncmp(sorted[last], prefix, plen) == 0))
+            ++last;
+
+         // every match, then stopping halfway through
+         struct prefix_walk w = { sorted, first, n + 1 };
+         CU_ASSERT_TRUE(trie_walk_prefix(t, prefix, prefix_walker, &w));
+         CU_ASSERT_EQUAL(w.next, last);
+         if (last - first > 1)
+         {
+            w.next = first;
+            w.stop = first + (last - first) / 2;
+            CU_ASSERT_FALSE(trie_walk_prefix(t, prefix, prefix_walker, &w));
+            CU_ASSERT_EQUAL(w.next, w.stop);
+         }
+
+         struct trie_match_t out[10];
+         size_t count = trie_complete(t, prefix, out, 10);
+         CU_ASSERT_EQUAL(count, (last - first < 10 ? last - first : 10));
+         for (size_t i=0; i<count; ++i)
+         {
+            CU_ASSERT_STRING_EQUAL(out[i].key, sorted[first + i]);
+            CU_ASSERT_EQUAL(out[i].pos, trie_find(t, sorted[first + i]));
+         }
+         trie_complete_free(out, count);
+         CU_ASSERT_EQUAL(trie_complete(t, prefix, out, 0), 0);
+      }
+
+      // the prefix itself is a key and comes first
+      unsigned int i = rand() % n;
+      struct trie_match_t one;
+      CU_ASSERT_EQUAL_FATAL(trie_complete(t, sorted[i], &one, 1), 1);
+      CU_ASSERT_STRING_EQUAL(one.key, sorted[i]);
+      trie_complete_free(&one, 1);
+
+      for (i=0; i<n; ++i)
+         free(sorted[i]);
+      trie_destroy(t, NULL);
+   }
+}
+
+static bool range_walker (trie_t t, trie_pos_t pos, const char * key, void * priv)
+{
+   struct prefix_walk * w = priv;
+   CU_ASSERT_STRING_EQUAL(key, w->sorted[w->next]);
+   CU_ASSERT_EQUAL(pos, trie_find(t, key));
+   ++w->next;
+   return w->next != w->stop;
+}
+
+static void test_range ()
+{
+   for (unsigned int loop=0; loop<2; ++loop)
+   {
+      trie_t t = (loop ? trie_new_compact(0) : trie_new_flags(TRIE_KEEP_KEYS));
+      CU_ASSERT_PTR_NOT_NULL_FATAL(t);
+
+      enum { KEYS = 500 };
+      char * sorted[KEYS];
+      unsigned int n = 0;
+      while (n < KEYS)
+      {
+         char buf[16];
+         generate_random_string(buf, 8);
+         if (trie_insert(t, buf, NULL, NULL))
+         {
+            sorted[n] = malloc(strlen(buf)+1);
+            strcpy(sorted[n++], buf);
+         }
+      }
+      qsort(sorted, n, sizeof(sorted[0]), compare_strings);
+
+      for (unsigned int r=0; r<200; ++r)
+      {
+         // bounds are keys, prefixes of keys or strings not in the trie
+         char lo[16], hi[16];
+         generate_random_string(lo, 4);
+         generate_random_string(hi, 4);
+         if (r % 3 == 0)
+            strcpy(lo, sorted[rand() % n]);
+         if (r % 5 == 0)
+            strcpy(hi, sorted[rand() % n]);
+         if (strcmp(lo, hi) > 0)
+         {
+            char swap[16];
+            strcpy(swap, lo);
+            strcpy(lo, hi);
+            strcpy(hi, swap);
+         }
+
+         unsigned int first = lower_bound(sorted, n, lo), last = lower_bound(sorted, n, hi);
+         CU_ASSERT_EQUAL(trie_count_range(t, lo, hi), last - first);
+         CU_ASSERT_EQUAL(trie_count_range(t, hi, lo), 0);
+
+         struct prefix_walk w = { sorted, first, n + 1 };
+         CU_ASSERT_TRUE(trie_walk_range(t, lo, hi, range_walker, &w));
+         CU_ASSERT_EQUAL(w.next, last);
+         if (last - first > 1)
+         {
+            w.next = first;
+            w.stop = first + 1;
+            CU_ASSERT_FALSE(trie_walk_range(t, lo, hi, range_walker, &w));
+            CU_ASSERT_EQUAL(w.next, first + 1);
+         }
+
+         CU_ASSERT_EQUAL(trie_count_range(t, NULL, hi), last);
+         CU_ASSERT_EQUAL(trie_count_range(t, lo, NULL), n - first);
+      }
+      CU_ASSERT_EQUAL(trie_count_range(t, NULL, NULL), n);
+      CU_ASSERT_EQUAL(trie_count_range(t, "", sorted[0]), 0);
+
+      for (unsigned int i=0; i<n; ++i)
+         free(sorted[i]);
+      trie_destroy(t, NULL);
+   }
+}
+
+struct stream_job
+{
+   char ** keys;
+   unsigned int next;
+   unsigned int count;
+};
+
+static bool stream_next (void * priv, const char ** key, void ** val)
+{
+   struct stream_job * job = priv;
+   if (job->next == job->count)
+      return false;
+   *key = job->keys[job->next];
+   *val = (void*) hash_string(job->keys[job->next++]);
+   return true;
+}
+
+static void test_build_sorted ()
+{
+   enum { KEYS = 2000 };
+   char * sorted[KEYS];
+   void * vals[KEYS];
+   unsigned int n = 0;
+   for (unsigned int i=0; i<KEYS; ++i)
+   {
+      char buf[16];
+      generate_random_string(buf, 10);
+      sorted[i] = malloc(strlen(buf)+1);
+      strcpy(sorted[i], buf);
+   }
+   qsort(sorted, KEYS, sizeof(sorted[0]), compare_strings);
+   for (unsigned int i=0; i<KEYS; ++i)
+   {
+      if ((n > 0) && (strcmp(sorted[n-1], sorted[i]) == 0))
+         free(sorted[i]);
+      else
+         sorted[n++] = sorted[i];
+   }
+   for (unsigned int i=0; i<n; ++i)
+      vals[i] = (void*) hash_string(sorted[i]);
+
+   for (unsigned int loop=0; loop<2; ++loop)
+   {
+      trie_t t = TRIE_INVALID;
+      struct stream_job job = { sorted, 0, n };
+      if (loop == 0)
+         t = trie_build_sorted((const char * const *) sorted, vals, n);
+      else
+         t = trie_build_stream(stream_next, &job);
+      CU_ASSERT_PTR_NOT_NULL_FATAL(t);
+      CU_ASSERT_EQUAL(trie_size(t), n);
+
+      // same keys, same order, same values
+      trie_cursor_t c = trie_cursor_new(t);
+      unsigned int i = 0;
+      while (trie_cursor_next(c))
+      {
+         CU_ASSERT_FATAL(i < n);
+         CU_ASSERT_STRING_EQUAL(trie_cursor_key(c), sorted[i]);
+         CU_ASSERT_EQUAL(trie_get_value(t, trie_cursor_pos(c)), vals[i]);
+         ++i;
+      }
+      CU_ASSERT_EQUAL(i, n);
+      trie_cursor_free(c);
+
+      // and an ordinary trie from then on
+      for (i=0; i<n; i+=2)
+         CU_ASSERT_TRUE(trie_remove(t, sorted[i], NULL));
+      for (i=0; i<n; ++i)
+         CU_ASSERT_EQUAL(trie_find(t, sorted[i]) != TRIE_INVALID_POS, (i % 2) == 1);
+      CU_ASSERT_TRUE(trie_insert(t, sorted[0], NULL, NULL));
+      trie_destroy(t, NULL);
+   }
+
+   // empty input is fine, unsorted, duplicate or empty keys are not
+   trie_t t = trie_build_sorted(NULL, NULL, 0);
+   CU_ASSERT_PTR_NOT_NULL_FATAL(t);
+   CU_ASSERT_EQUAL(trie_size(t), 0);
+   trie_destroy(t, NULL);
+
+   const char * unsorted[] = { "abc", "abd", "ab" };
+   const char * dups[] = { "abc", "abc" };
+   const char * empty[] = { "", "a" };
+   CU_ASSERT_PTR_NULL(trie_build_sorted(unsorted, NULL, 3));
+   CU_ASSERT_PTR_NULL(trie_build_sorted(dups, NULL, 2));
+   CU_ASSERT_PTR_NULL(trie_build_sorted(empty, NULL, 2));
+
+   char * bad[] = { "b", "ba", "a" };
+   struct stream_job job = { bad, 0, 3 };
+   CU_ASSERT_PTR_NULL(trie_build_stream(stream_next, &job));
+   job.next = 0;
+   job.count = 2;
+   t = trie_build_stream(stream_next, &job);
+   CU_ASSERT_PTR_NOT_NULL_FATAL(t);
+   CU_ASSERT_EQUAL(trie_size(t), 2);
+   trie_destroy(t, NULL);
+
+   for (unsigned int i=0; i<n; ++i)
+      free(sorted[i]);
+}
+
+static int compare_scores (const void * a, const void * b)
+{
+   trie_score_t x = *(const trie_score_t *) a, y = *(const trie_score_t *) b;
+   return (x < y) - (x > y);
+}
+
+// trie_topk against sorting the scores of every match
+static void check_topk (trie_t t, char ** keys, trie_score_t * scores, bool * present,
+      unsigned int n, const char * prefix, size_t k)
+{
+   size_t plen = strlen(prefix), matches = 0;
+   trie_score_t * expect = malloc(n * sizeof(trie_score_t));
+   for (unsigned int i=0; i<n; ++i)
+   {
+      if (present[i] && (strncmp(keys[i], prefix, plen) == 0))
+         expect[matches++] = scores[i];
+   }
+   qsort(expect, matches, sizeof(trie_score_t), compare_scores);
+
+   struct trie_match_t * out = malloc(k * sizeof(struct trie_match_t));
+   size_t count = trie_topk(t, prefix, k, out);
+   CU_ASSERT_EQUAL(count, (matches < k ? matches : k));
+   for (size_t i=0; i<count; ++i)
+   {
+      CU_ASSERT_EQUAL(strncmp(out[i].key, prefix, plen), 0);
+      CU_ASSERT_EQUAL(out[i].pos, trie_find(t, out[i].key));
+      CU_ASSERT_EQUAL(trie_get_score(t, out[i].pos), expect[i]);
+   }
+   trie_complete_free(out, count);
+   free(out);
+   free(expect);
+}
+
+static void test_topk ()
+{
+   for (unsigned int loop=0; loop<2; ++loop)
+   {
+      trie_t t = (loop ? trie_new_arena(0) : trie_new());
+      CU_ASSERT_PTR_NOT_NULL_FATAL(t);
+
+      enum { KEYS = 1000 };
+      char * keys[KEYS];
+      trie_score_t scores[KEYS];
+      bool present[KEYS];
+      unsigned int n = 0;
+      while (n < KEYS)
+      {
+         char buf[16];
+         generate_random_string(buf, 8);
+         for (char * p = buf; *p; ++p)
+            *p = 'a' + (*p % 5);
+         if (trie_insert(t, buf, NULL, NULL))
+         {
+            keys[n] = malloc(strlen(buf)+1);
+            strcpy(keys[n], buf);
+            present[n] = true;
+            scores[n++] = 0;
+         }
+      }
+
+      // distinct scores, so the expected order is unique
+      for (unsigned int i=0; i<n; ++i)
+      {
+         scores[i] = (trie_score_t) ((i * 7919) % KEYS) + 1;
+         CU_ASSERT_TRUE(trie_set_score(t, keys[i], scores[i]));
+      }
+      CU_ASSERT_FALSE(trie_set_score(t, keys[0], -1));
+      CU_ASSERT_FALSE(trie_set_score(t, "zzzzzzzz", 1));
+
+      const char * prefixes[] = { "", "a", "b", "ab", "eee", "cab", "f" };
+      const unsigned int nprefixes = sizeof(prefixes)/sizeof(prefixes[0]);
+      for (unsigned int p=0; p<nprefixes; ++p)
+      {
+         check_topk(t, keys, scores, present, n, prefixes[p], 1);
+         check_topk(t, keys, scores, present, n, prefixes[p], 10);
+         check_topk(t, keys, scores, present, n, prefixes[p], KEYS);
+      }
+
+      // lower some scores and drop half of the keys: the maxima have to come down too
+      for (unsigned int i=0; i<n; i+=3)
+      {
+         scores[i] /= 4;
+         CU_ASSERT_TRUE(trie_set_score(t, keys[i], scores[i]));
+      }
+      for (unsigned int i=0; i<n; ++i)
+      {
+         if (rand() % 2)
+         {
+            CU_ASSERT_TRUE(trie_remove(t, keys[i], NULL));
+            present[i] = false;
+         }
+      }
+      for (unsigned int p=0; p<nprefixes; ++p)
+      {
+         check_topk(t, keys, scores, present, n, prefixes[p], 10);
+         check_topk(t, keys, scores, present, n, prefixes[p], KEYS);
+      }
+
+      for (unsigned int i=0; i<n; ++i)
+         free(keys[i]);
+      trie_destroy(t, NULL);
+   }
+
+   // the compact layout has no scores
+   trie_t t = trie_new_compact(0);
+   struct trie_match_t out[1];
+   CU_ASSERT_TRUE(trie_insert(t, "key", NULL, NULL));
+   CU_ASSERT_FALSE(trie_set_score(t, "key", 1));
+   CU_ASSERT_EQUAL(trie_topk(t, "", 1, out), 0);
+   trie_destroy(t, NULL);
+}
+
+// Checks one character level (and every level below it) is an AVL tree with the
+// right heights and in order; returns its height
+static unsigned int check_avl_level (trie_pos_t node, int lo, int hi)
+{
+   if (node == NULL)
+      return 0;
+
+   CU_ASSERT((int) node->key > lo);
+   CU_ASSERT((int) node->key < hi);
+   unsigned int l = check_avl_level(node->left, lo, node->key);
+   unsigned int r = check_avl_level(node->right, node->key, hi);
+   CU_ASSERT((l <= r + 1) && (r <= l + 1));
+   CU_ASSERT_EQUAL(node->height, 1 + (l > r ? l : r));
+   check_avl_level(node->mid, -1, 256);
+   return 1 + (l > r ? l : r);
+}
+
+static void test_balanced ()
+{
+   enum { KEYS = 3000 };
+   char * keys[KEYS];
+   trie_score_t scores[KEYS];
+   bool present[KEYS];
+   trie_t t = trie_new_flags(TRIE_BALANCED);
+   CU_ASSERT_PTR_NOT_NULL_FATAL(t);
+
+   // sequential ids make one long chain per level without balancing
+   for (unsigned int i=0; i<KEYS; ++i)
+   {
+      char buf[16];
+      do
+      {
+         if (i < KEYS / 2)
+            sprintf(buf, "%c%c%u", 'A' + (i % 58), 'A' + (i / 58), i);
+         else
+            generate_random_string(buf, 8);
+      } while (!trie_insert(t, buf, (void*) hash_string(buf), NULL));
+      keys[i] = malloc(strlen(buf)+1);
+      strcpy(keys[i], buf);
+      present[i] = true;
+      scores[i] = (trie_score_t) ((i * 7919) % KEYS) + 1;
+   }
+   check_avl_level(t->start, -1, 256);
+   CU_ASSERT(t->start->height <= 9);  // 58 characters: 1.44 * log2(58) at worst
+
+   for (unsigned int i=0; i<KEYS; ++i)
+      CU_ASSERT_TRUE(trie_set_score(t, keys[i], scores[i]));
+
+   // removals in random order keep the levels and the score maxima right
+   for (unsigned int i=0; i<KEYS; ++i)
+   {
+      unsigned int j = rand() % KEYS;
+      if (present[j] && (rand() % 3 != 0))
+      {
+         void * data = NULL;
+         CU_ASSERT_TRUE(trie_remove(t, keys[j], &data));
+         CU_ASSERT_EQUAL(data, (void*) hash_string(keys[j]));
+         present[j] = false;
+      }
+   }
+   check_avl_level(t->start, -1, 256);
+   for (unsigned int i=0; i<KEYS; ++i)
+   {
+      CU_ASSERT_EQUAL(trie_find(t, keys[i]) != TRIE_INVALID_POS, present[i]);
+   }
+   check_topk(t, keys, scores, present, KEYS, "", 20);
+   check_topk(t, keys, scores, present, KEYS, "B", 20);
+   trie_destroy(t, NULL);
+
+   // trie_rebalance on a trie that was filled in order
+   t = trie_new();
+   for (unsigned int i=0; i<KEYS / 2; ++i)
+      CU_ASSERT_TRUE(trie_insert(t, keys[i], NULL, NULL));
+   CU_ASSERT_TRUE(trie_rebalance(t));
+   check_avl_level(t->start, -1, 256);
+   CU_ASSERT(t->start->height <= 6);  // complete: ceil(log2(59))
+   CU_ASSERT_EQUAL(trie_size(t), KEYS / 2);
+   for (unsigned int i=0; i<KEYS / 2; ++i)
+      CU_ASSERT_NOT_EQUAL(trie_find(t, keys[i]), TRIE_INVALID_POS);
+   trie_destroy(t, NULL);
+
+   for (unsigned int i=0; i<KEYS; ++i)
+      free(keys[i]);
+}
+
+static bool count_walker (trie_t t, trie_pos_t pos, const char * key, void * priv)
+{
+   ++*(unsigned int *) priv;
+   return true;
+}
+
+// Every node of the first (and second) level has to be in the dispatch table
+static void check_roots (trie_t t, trie_pos_t node, unsigned int level, unsigned char first,
+      unsigned int * indexed)
+{
+   if (node == NULL)
+      return;
+
+   if (level == 0)
+      CU_ASSERT_EQUAL(t->roots[node->key], node);
+   if ((level == 1) && (t->flags & TRIE_ROOT65536))
+      CU_ASSERT_EQUAL(t->roots[TRIE_ROOTS_2 + (first << 8) + node->key], node);
+   ++indexed[level];
+
+   check_roots(t, node->left, level, first, indexed);
+   check_roots(t, node->right, level, first, indexed);
+   if (level == 0)
+      check_roots(t, node->mid, 1, node->key, indexed);
+}
+
+static void test_dispatch ()
+{
+   const unsigned int modes[] = { TRIE_ROOT256, TRIE_ROOT65536,
+      TRIE_ROOT65536 | TRIE_BALANCED | TRIE_KEEP_KEYS };
+   for (unsigned int m=0; m<3; ++m)
+   {
+      trie_t t = trie_new_flags(modes[m]);
+      CU_ASSERT_PTR_NOT_NULL_FATAL(t);
+
+      enum { KEYS = 2000 };
+      char * keys[KEYS];
+      for (unsigned int i=0; i<KEYS; ++i)
+      {
+         // plenty of one and two character keys, which end at indexed nodes
+         char buf[16];
+         generate_random_string(buf, (i % 4 == 0) ? 3 : 8);
+         keys[i] = malloc(strlen(buf)+1);
+         strcpy(keys[i], buf);
+      }
+
+      for (unsigned int round=0; round<4; ++round)
+      {
+         for (unsigned int i=0; i<KEYS; ++i)
+         {
+            unsigned int j = rand() % KEYS;
+            bool there = (trie_find(t, keys[j]) != TRIE_INVALID_POS);
+            if (rand() % 3 == 0)
+            {
+               CU_ASSERT_EQUAL(trie_remove(t, keys[j], NULL), there);
+            }
+            else
+            {
+               trie_pos_t pos = TRIE_INVALID_POS;
+               CU_ASSERT_EQUAL(trie_insert(t, keys[j], (void*) hash_string(keys[j]), &pos), !there);
+               CU_ASSERT_EQUAL(pos, trie_find(t, keys[j]));
+            }
+         }
+
+         // the trie itself stays a plain TST underneath
+         unsigned int indexed[2] = { 0, 0 };
+         check_roots(t, t->start, 0, 0, indexed);
+         unsigned int slots = 0;
+         for (unsigned int c=0; c<256; ++c)
+            slots += (t->roots[c] != NULL);
+         CU_ASSERT_EQUAL(slots, indexed[0]);
+         if (modes[m] & TRIE_ROOT65536)
+         {
+            slots = 0;
+            for (unsigned int c=0; c<65536; ++c)
+               slots += (t->roots[TRIE_ROOTS_2 + c] != NULL);
+            CU_ASSERT_EQUAL(slots, indexed[1]);
+         }
+
+         for (unsigned int i=0; i<KEYS; ++i)
+         {
+            trie_pos_t pos = trie_find(t, keys[i]);
+            if (pos != TRIE_INVALID_POS)
+               CU_ASSERT_EQUAL(trie_get_value(t, pos), (void*) hash_string(keys[i]));
+         }
+         unsigned int walked = 0;
+         trie_walk(t, count_walker, &walked);
+         CU_ASSERT_EQUAL(walked, trie_size(t));
+         CU_ASSERT_EQUAL(trie_count_range(t, NULL, NULL), trie_size(t));
+      }
+
+      // emptied out, every entry is gone again
+      for (unsigned int i=0; i<KEYS; ++i)
+         trie_remove(t, keys[i], NULL);
+      CU_ASSERT_EQUAL(trie_size(t), 0);
+      unsigned int slots = 0;
+      for (unsigned int c=0; c<TRIE_ROOTS_2 + ((modes[m] & TRIE_ROOT65536) ? 65536 : 0); ++c)
+         slots += (t->roots[c] != NULL);
+      CU_ASSERT_EQUAL(slots, 0);
+
+      for (unsigned int i=0; i<KEYS; ++i)
+         free(keys[i]);
+      trie_destroy(t, NULL);
+   }
+}
+
+// Every key trie_walk hands out has to lead back to its position
+static bool found_walker (trie_t t, trie_pos_t pos, const char * key, void * priv)
+{
+   CU_ASSERT_EQUAL(trie_find(t, key), pos);
+   ++*(unsigned int *) priv;
+   return true;
+}
+
+// Paths out of a few shared segments plus a random tail, so fragments get split
+// at every depth and keys end inside each other's fragments
+static void generate_path (char * buf)
+{
+   static const char * segments[] = { "/usr", "/usr/local", "/var/lib", "/home/",
+      "/lib", "share", "/", "x" };
+   buf[0] = '\0';
+   unsigned int parts = 1 + rand() % 4;
+   for (unsigned int i=0; i<parts; ++i)
+      strcat(buf, segments[rand() % 8]);
+   if (rand() % 2)
+   {
+      char tail[16];
+      generate_random_string(tail, 6);
+      strcat(buf, tail);
+   }
+}
+
+// Every node without a key of its own has to branch: a level below it that is a
+// single node would have been merged into it (first-level nodes excepted under
+// TRIE_ROOT65536). Returns the number of nodes.
+static unsigned int check_compressed (trie_t t, trie_pos_t node, unsigned int level)
+{
+   if (node == NULL)
+      return 0;
+
+   for (unsigned int i=0; i<trie_fraglen(node); ++i)
+      CU_ASSERT(node->frag->bytes[i] != '\0');
+   if (!node->terminal)
+   {
+      CU_ASSERT_PTR_NOT_NULL_FATAL(node->mid);
+      if ((level > 0) || !(t->flags & TRIE_ROOT65536))
+         CU_ASSERT((node->mid->left != NULL) || (node->mid->right != NULL));
+   }
+   return 1 + check_compressed(t, node->left, level) + check_compressed(t, node->right, level)
+      + check_compressed(t, node->mid, level + 1);
+}
+
+static void test_compress ()
+{
+   const unsigned int modes[] = { TRIE_COMPRESS, TRIE_COMPRESS | TRIE_BALANCED | TRIE_KEEP_KEYS,
+      TRIE_COMPRESS | TRIE_ROOT65536, TRIE_COMPRESS | TRIE_ARENA | TRIE_ROOT256 };
+   enum { KEYS = 2000 };
+   char * keys[KEYS];
+   bool present[KEYS];
+   trie_score_t scores[KEYS];
+
+   // distinct keys, sorted, so the expected walk is just the present ones in order
+   unsigned int n = 0;
+   for (unsigned int i=0; i<KEYS; ++i)
+   {
+      char buf[128];
+      generate_path(buf);
+      keys[n] = malloc(strlen(buf)+1);
+      strcpy(keys[n++], buf);
+   }
+   qsort(keys, n, sizeof(char *), compare_strings);
+   unsigned int distinct = 0;
+   for (unsigned int i=0; i<n; ++i)
+   {
+      if ((distinct > 0) && (strcmp(keys[distinct-1], keys[i]) == 0))
+         free(keys[i]);
+      else
+         keys[distinct++] = keys[i];
+   }
+   n = distinct;
+
+   for (unsigned int m=0; m<4; ++m)
+   {
+      trie_t t = trie_new_flags(modes[m]);
+      CU_ASSERT_PTR_NOT_NULL_FATAL(t);
+      memset(present, 0, sizeof(present));
+      unsigned int size = 0;
+
+      for (unsigned int round=0; round<4; ++round)
+      {
+         for (unsigned int i=0; i<n; ++i)
+         {
+            unsigned int j = rand() % n;
+            if (rand() % 3 == 0)
+            {
+               CU_ASSERT_EQUAL(trie_remove(t, keys[j], NULL), present[j]);
+               size -= present[j];
+               present[j] = false;
+            }
+            else
+            {
+               trie_pos_t pos = TRIE_INVALID_POS;
+               CU_ASSERT_EQUAL(trie_insert(t, keys[j], (void*) hash_string(keys[j]), &pos), !present[j]);
+               CU_ASSERT_EQUAL(pos, trie_find(t, keys[j]));
+               size += !present[j];
+               present[j] = true;
+               scores[j] = (trie_score_t) (rand() % 1000);
+               CU_ASSERT(trie_set_score(t, keys[j], scores[j]));
+            }
+         }
+         CU_ASSERT_EQUAL(trie_size(t), size);
+         if (round == 2)
+            CU_ASSERT(trie_rebalance(t));
+
+         // at most a split and a new node per key, plus the pinned first-level nodes
+         unsigned int nodes = check_compressed(t, t->start, 0);
+         CU_ASSERT(nodes <= 2 * size + ((modes[m] & TRIE_ROOT65536) ? 256 : 0));
+
+         char * sorted[KEYS];
+         unsigned int count = 0;
+         for (unsigned int i=0; i<n; ++i)
+         {
+            trie_pos_t pos = trie_find(t, keys[i]);
+            CU_ASSERT_EQUAL(pos != TRIE_INVALID_POS, present[i]);
+            if (present[i])
+            {
+               CU_ASSERT_EQUAL(trie_get_value(t, pos), (void*) hash_string(keys[i]));
+               sorted[count++] = keys[i];
+            }
+         }
+
+         unsigned int walked = 0;
+         CU_ASSERT(trie_walk(t, found_walker, &walked));
+         CU_ASSERT_EQUAL(walked, count);
+
+         // lower bounds and prefixes landing inside fragments, on both sides of them
+         trie_cursor_t cursor = trie_cursor_new(t);
+         CU_ASSERT_PTR_NOT_NULL_FATAL(cursor);
+         for (unsigned int probe=0; probe<200; ++probe)
+         {
+            char buf[128];
+            strcpy(buf, keys[rand() % n]);
+            size_t len = strlen(buf);
+            if (rand() % 2)
+               buf[rand() % len] += (rand() % 2 ? 1 : -1);
+            if (rand() % 2)
+               buf[1 + rand() % len] = '\0';
+
+            unsigned int lb = lower_bound(sorted, count, buf);
+            if (lb == count)
+            {
+               CU_ASSERT_FALSE(trie_cursor_seek(cursor, buf));
+            }
+            else
+            {
+               CU_ASSERT_FATAL(trie_cursor_seek(cursor, buf));
+               CU_ASSERT_STRING_EQUAL(trie_cursor_key(cursor), sorted[lb]);
+               if (lb > 0)
+               {
+                  CU_ASSERT(trie_cursor_prev(cursor));
+                  CU_ASSERT_STRING_EQUAL(trie_cursor_key(cursor), sorted[lb-1]);
+               }
+            }
+
+            size_t plen = strlen(buf);
+            unsigned int matches = 0;
+            while ((lb + matches < count) && (strncmp(sorted[lb + matches], buf, plen) == 0))
+               ++matches;
+            struct prefix_walk pw = { sorted + lb, 0, matches + 1 };
+            CU_ASSERT(trie_walk_prefix(t, buf, prefix_walker, &pw));
+            CU_ASSERT_EQUAL(pw.next, matches);
+            CU_ASSERT_EQUAL(trie_count_range(t, buf, NULL), count - lb);
+
+            struct trie_match_t out[4];
+            size_t got = trie_complete(t, buf, out, 4);
+            CU_ASSERT_EQUAL(got, (matches < 4 ? matches : 4));
+            for (size_t i=0; i<got; ++i)
+               CU_ASSERT_STRING_EQUAL(out[i].key, sorted[lb + i]);
+            trie_complete_free(out, got);
+
+            check_topk(t, keys, scores, present, n, buf, 5);
+         }
+         trie_cursor_free(cursor);
+      }
+
+      // emptied out, nothing is left over
+      for (unsigned int i=0; i<n; ++i)
+         CU_ASSERT_EQUAL(trie_remove(t, keys[i], NULL), present[i]);
+      CU_ASSERT_EQUAL(trie_size(t), 0);
+      CU_ASSERT_PTR_NULL(t->start);
+      trie_destroy(t, NULL);
+   }
+
+   for (unsigned int i=0; i<n; ++i)
+      free(keys[i]);
+}
+
+static bool frozen_walker (const char * key, void * val, void * priv)
+{
+   struct prefix_walk * w = priv;
+   CU_ASSERT_STRING_EQUAL(key, w->sorted[w->next]);
+   CU_ASSERT_EQUAL(val, (void*) hash_string(key));
+   ++w->next;
+   return w->next != w->stop;
+}
+
+static void test_freeze ()
+{
+   enum { KEYS = 3000 };
+   char * keys[KEYS];
+   unsigned int n = 0;
+   for (unsigned int i=0; i<KEYS; ++i)
+   {
+      char buf[128];
+      if (i % 2)
+         generate_path(buf);
+      else
+         generate_random_string(buf, 12);
+      keys[n] = malloc(strlen(buf)+1);
+      strcpy(keys[n++], buf);
+   }
+   qsort(keys, n, sizeof(char *), compare_strings);
+   unsigned int distinct = 0;
+   for (unsigned int i=0; i<n; ++i)
+   {
+      if ((distinct > 0) && (strcmp(keys[distinct-1], keys[i]) == 0))
+         free(keys[i]);
+      else
+         keys[distinct++] = keys[i];
+   }
+   n = distinct;
+
+   for (unsigned int m=0; m<4; ++m)
+   {
+      trie_t t = (m == 3 ? trie_new_compact(0) :
+         trie_new_flags(m == 0 ? 0 : (m == 1 ? TRIE_COMPRESS : TRIE_BALANCED | TRIE_KEEP_KEYS)));
+      CU_ASSERT_PTR_NOT_NULL_FATAL(t);
+
+      // an empty trie freezes too
+      trie_frozen_t f = trie_freeze(t);
+      CU_ASSERT_PTR_NOT_NULL_FATAL(f);
+      CU_ASSERT_EQUAL(trie_frozen_size(f), 0);
+      CU_ASSERT_FALSE(trie_frozen_find(f, keys[0], NULL));
+      CU_ASSERT(trie_frozen_walk(f, frozen_walker, NULL));
+      trie_frozen_free(f);
+
+      // every other key, so half of the lookups miss
+      char * sorted[KEYS];
+      unsigned int count = 0;
+      for (unsigned int i=0; i<n; i+=2)
+      {
+         CU_ASSERT(trie_insert(t, keys[i], (void*) hash_string(keys[i]), NULL));
+         sorted[count++] = keys[i];
+      }
+
+      f = trie_freeze(t);
+      CU_ASSERT_PTR_NOT_NULL_FATAL(f);
+
+      // the frozen copy does not see later changes
+      for (unsigned int i=0; i<n; i+=4)
+         trie_remove(t, keys[i], NULL);
+      trie_destroy(t, NULL);
+
+      CU_ASSERT_EQUAL(trie_frozen_size(f), count);
+      for (unsigned int i=0; i<n; ++i)
+      {
+         void * val = NULL;
+         CU_ASSERT_EQUAL(trie_frozen_find(f, keys[i], &val), (i % 2 == 0));
+         if (i % 2 == 0)
+            CU_ASSERT_EQUAL(val, (void*) hash_string(keys[i]));
+      }
+      CU_ASSERT_FALSE(trie_frozen_find(f, "", NULL));
+
+      struct prefix_walk w = { sorted, 0, count };
+      CU_ASSERT_FALSE(trie_frozen_walk(f, frozen_walker, &w));
+      CU_ASSERT_EQUAL(w.next, count);
+
+      for (unsigned int probe=0; probe<500; ++probe)
+      {
+         char buf[128];
+         strcpy(buf, keys[rand() % n]);
+         buf[1 + rand() % strlen(buf)] = '\0';
+
+         unsigned int lb = lower_bound(sorted, count, buf), matches = 0;
+         while ((lb + matches < count) && (strncmp(sorted[lb + matches], buf, strlen(buf)) == 0))
+            ++matches;
+         struct prefix_walk pw = { sorted + lb, 0, matches + 1 };
+         CU_ASSERT(trie_frozen_walk_prefix(f, buf, frozen_walker, &pw));
+         CU_ASSERT_EQUAL(pw.next, matches);
+      }
+      trie_frozen_free(f);
+   }
+
+   for (unsigned int i=0; i<n; ++i)
+      free(keys[i]);
+}
+
+// Overwrite one byte of a file, at offset from its start (or from its end when negative)
+static void poke_file (const char * path, long offset, int value)
+{
+   FILE * file = fopen(path, "r+b");
+   CU_ASSERT_PTR_NOT_NULL_FATAL(file);
+   fseek(file, offset, (offset < 0 ? SEEK_END : SEEK_SET));
+   fputc(value, file);
+   fclose(file);
+}
+
+// Copy a file, whole
+static void copy_file (const char * from, const char * to)
+{
+   char buf[4096];
+   size_t got;
+   FILE * in = fopen(from, "rb"), * out = fopen(to, "wb");
+   CU_ASSERT_PTR_NOT_NULL_FATAL(in);
+   CU_ASSERT_PTR_NOT_NULL_FATAL(out);
+   while ((got = fread(buf, 1, sizeof(buf), in)) > 0)
+      fwrite(buf, 1, got, out);
+   fclose(in);
+   fclose(out);
+}
+
+static void test_save ()
+{
+   const char * path = "trie_test.snapshot";
+   enum { KEYS = 2000 };
+   char * keys[KEYS];
+   trie_t t = trie_new_flags(TRIE_COMPRESS);
+   CU_ASSERT_PTR_NOT_NULL_FATAL(t);
+   unsigned int n = 0;
+   for (unsigned int i=0; i<KEYS; ++i)
+   {
+      char buf[128];
+      generate_path(buf);
+      if (trie_insert(t, buf, (void*) hash_string(buf), NULL))
+      {
+         keys[n] = malloc(strlen(buf)+1);
+         strcpy(keys[n++], buf);
+      }
+   }
+   qsort(keys, n, sizeof(char *), compare_strings);
+
+   CU_ASSERT_FATAL(trie_save(t, path));
+   trie_frozen_t f = trie_open_mmap(path);
+   CU_ASSERT_PTR_NOT_NULL_FATAL(f);
+   CU_ASSERT(trie_frozen_verify(f));
+   CU_ASSERT_EQUAL(trie_frozen_size(f), n);
+
+   // saving again replaces the file, while the old mapping still sees the old one
+   CU_ASSERT(trie_remove(t, keys[0], NULL));
+   CU_ASSERT(trie_save(t, path));
+   trie_frozen_t g = trie_open_mmap(path);
+   CU_ASSERT_PTR_NOT_NULL_FATAL(g);
+   CU_ASSERT_EQUAL(trie_frozen_size(g), n - 1);
+   CU_ASSERT_FALSE(trie_frozen_find(g, keys[0], NULL));
+   CU_ASSERT(trie_frozen_find(f, keys[0], NULL));
+
+   for (unsigned int i=0; i<n; ++i)
+   {
+      void * val = NULL;
+      CU_ASSERT(trie_frozen_find(f, keys[i], &val));
+      CU_ASSERT_EQUAL(val, (void*) hash_string(keys[i]));
+   }
+   struct prefix_walk w = { keys, 0, n + 1 };
+   CU_ASSERT(trie_frozen_walk(f, frozen_walker, &w));
+   CU_ASSERT_EQUAL(w.next, n);
+   trie_frozen_free(f);
+   trie_frozen_free(g);
+
+   // damage is caught by the header check, or by the checksum
+   poke_file(path, -1, 0x55);
+   f = trie_open_mmap(path);
+   CU_ASSERT_PTR_NOT_NULL_FATAL(f);
+   CU_ASSERT_FALSE(trie_frozen_verify(f));
+   trie_frozen_free(f);
+
+   poke_file(path, 0, 'X');
+   CU_ASSERT_PTR_NULL(trie_open_mmap(path));
+
+   FILE * file = fopen(path, "wb");
+   CU_ASSERT_PTR_NOT_NULL_FATAL(file);
+   fputs("TSTFROZ", file);
+   fclose(file);
+   CU_ASSERT_PTR_NULL(trie_open_mmap(path));
+
+   remove(path);
+   CU_ASSERT_PTR_NULL(trie_open_mmap(path));
+   CU_ASSERT_FALSE(trie_save(t, "no/such/directory/trie.snapshot"));
+
+   // an empty trie round-trips too
+   trie_destroy(t, NULL);
+   t = trie_new();
+   CU_ASSERT(trie_save(t, path));
+   f = trie_open_mmap(path);
+   CU_ASSERT_PTR_NOT_NULL_FATAL(f);
+   CU_ASSERT_EQUAL(trie_frozen_size(f), 0);
+   CU_ASSERT(trie_frozen_verify(f));
+   trie_frozen_free(f);
+   remove(path);
+
+   trie_destroy(t, NULL);
+   for (unsigned int i=0; i<n; ++i)
+      free(keys[i]);
+}
+
+static bool matching_walker (trie_t trie, trie_pos_t pos, const char * key, void * priv)
+{
+   trie_pos_t other = trie_find((trie_t) priv, key);
+   return (other != TRIE_INVALID_POS)
+      && (trie_get_value((trie_t) priv, other) == trie_get_value(trie, pos));
+}
+
+static long file_size (const char * path)
+{
+   FILE * file = fopen(path, "rb");
+   CU_ASSERT_PTR_NOT_NULL_FATAL(file);
+   fseek(file, 0, SEEK_END);
+   long size = ftell(file);
+   fclose(file);
+   return size;
+}
+
+static void test_log ()
+{
+   const char * snapshot = "trie_test.snapshot";
+   const char * logpath = "trie_test.log";
+   remove(snapshot);
+   remove(logpath);
+
+   // only a trie that keeps its keys can be logged
+   trie_t t = trie_new();
+   CU_ASSERT_PTR_NULL(trie_log_open(t, logpath, 16));
+   trie_destroy(t, NULL);
+
+   t = trie_new_flags(TRIE_KEEP_KEYS | TRIE_COMPRESS);
+   trie_t shadow = trie_new();
+   CU_ASSERT_PTR_NOT_NULL_FATAL(t);
+   CU_ASSERT_PTR_NOT_NULL_FATAL(shadow);
+   trie_log_t log = trie_log_open(t, logpath, 16);
+   CU_ASSERT_PTR_NOT_NULL_FATAL(log);
+   CU_ASSERT_PTR_NULL(trie_log_open(t, logpath, 16));
+
+   // every kind of change, with a compaction half way through
+   for (unsigned int round=0; round<2; ++round)
+   {
+      for (unsigned int i=0; i<3000; ++i)
+      {
+         char buf[128];
+         generate_path(buf);
+         trie_pos_t pos = TRIE_INVALID_POS;
+         uintptr_t val = hash_string(buf) + i;
+         switch (rand() % 4)
+         {
+            case 0:
+               trie_insert(t, buf, (void*) val, NULL);
+               trie_insert(shadow, buf, (void*) val, NULL);
+               break;
+            case 1:
+               trie_upsert(t, buf, (void*) val, NULL, NULL);
+               trie_upsert(shadow, buf, (void*) val, NULL, NULL);
+               break;
+            case 2:
+               if (trie_insert(t, buf, NULL, &pos) || (pos != TRIE_INVALID_POS))
+                  trie_set_value(t, pos, (void*) val);
+               trie_upsert(shadow, buf, (void*) val, NULL, NULL);
+               break;
+            default:
+               CU_ASSERT_EQUAL(trie_remove(t, buf, NULL), trie_remove(shadow, buf, NULL));
+               break;
+         }
+      }
+      if (round == 0)
+         CU_ASSERT(trie_log_compact(log, snapshot));
+   }
+   CU_ASSERT(trie_log_flush(log));
+   CU_ASSERT_EQUAL(trie_size(t), trie_size(shadow));
+
+   trie_t r = trie_recover(snapshot, logpath);
+   CU_ASSERT_PTR_NOT_NULL_FATAL(r);
+   CU_ASSERT_EQUAL(trie_size(r), trie_size(shadow));
+   CU_ASSERT(trie_walk(r, matching_walker, shadow));
+   CU_ASSERT(trie_walk(shadow, matching_walker, r));
+   trie_destroy(r, NULL);
+
+   // a batch torn by a crash is skipped, and cut off when the log is opened again
+   CU_ASSERT(trie_log_close(log));
+   long size = file_size(logpath);
+   FILE * file = fopen(logpath, "ab");
+   CU_ASSERT_PTR_NOT_NULL_FATAL(file);
+   fputs("torn batch", file);
+   fclose(file);
+   r = trie_recover(snapshot, logpath);
+   CU_ASSERT_PTR_NOT_NULL_FATAL(r);
+   CU_ASSERT_EQUAL(trie_size(r), trie_size(shadow));
+   CU_ASSERT(trie_walk(r, matching_walker, shadow));
+
+   log = trie_log_open(r, logpath, 1);
+   CU_ASSERT_PTR_NOT_NULL_FATAL(log);
+   CU_ASSERT_EQUAL(file_size(logpath), size);
+   CU_ASSERT(trie_insert(r, "recovered", (void*) 7, NULL));
+   CU_ASSERT(file_size(logpath) > size);
+   trie_destroy(r, NULL);      // closes the log too
+   r = trie_recover(snapshot, logpath);
+   CU_ASSERT_PTR_NOT_NULL_FATAL(r);
+   CU_ASSERT_EQUAL(trie_size(r), trie_size(shadow) + 1);
+   trie_destroy(r, NULL);
+
+   // missing files are empty, damaged ones are refused
+   r = trie_recover("no/such/snapshot", NULL);
+   CU_ASSERT_PTR_NOT_NULL_FATAL(r);
+   CU_ASSERT_EQUAL(trie_size(r), 0);
+   trie_destroy(r, NULL);
+   poke_file(logpath, 0, 'X');
+   CU_ASSERT_PTR_NULL(trie_recover(snapshot, logpath));
+   poke_file(snapshot, -1, 0x55);
+   CU_ASSERT_PTR_NULL(trie_recover(snapshot, NULL));
+
+   remove(snapshot);
+   remove(logpath);
+   trie_destroy(t, NULL);
+   trie_destroy(shadow, NULL);
+
+   // a crash in the middle of a compaction replays the old log over the new snapshot:
+   // a removal still pending when it started must not be undone by the older put
+   const char * oldlog = "trie_test.oldlog";
+   t = trie_new_flags(TRIE_KEEP_KEYS);
+   log = trie_log_open(t, logpath, 2);
+   CU_ASSERT_PTR_NOT_NULL_FATAL(log);
+   CU_ASSERT(trie_insert(t, "k", (void*) 1, NULL));
+   CU_ASSERT(trie_insert(t, "x", (void*) 2, NULL));      // commits the batch
+   CU_ASSERT(trie_remove(t, "k", NULL));                  // still pending
+   CU_ASSERT_FALSE(trie_log_compact(log, "no/such/snapshot"));
+   copy_file(logpath, oldlog);       // the log as a compaction leaves it before emptying it
+   CU_ASSERT(trie_log_compact(log, snapshot));
+   r = trie_recover(snapshot, oldlog);
+   CU_ASSERT_PTR_NOT_NULL_FATAL(r);
+   CU_ASSERT_EQUAL(trie_find(r, "k"), TRIE_INVALID_POS);
+   CU_ASSERT_EQUAL(trie_size(r), 1);
+   trie_destroy(r, NULL);
+   trie_destroy(t, NULL);
+   remove(snapshot);
+   remove(logpath);
+   remove(oldlog);
+
+   // trie_save cannot keep a key holding a 0-byte, so a logged trie never takes one in
+   t = trie_new_flags(TRIE_KEEP_KEYS);
+   CU_ASSERT(trie_insert_n(t, "a\0b", 3, NULL, NULL));
+   CU_ASSERT_PTR_NULL(trie_log_open(t, logpath, 1));
+   CU_ASSERT(trie_remove_n(t, "a\0b", 3, NULL));
+   log = trie_log_open(t, logpath, 1);
+   CU_ASSERT_PTR_NOT_NULL_FATAL(log);
+   CU_ASSERT_FALSE(trie_insert_n(t, "a\0b", 3, NULL, NULL));
+   CU_ASSERT_FALSE(trie_upsert_n(t, "a\0b", 3, NULL, NULL, NULL));
+   CU_ASSERT(trie_insert_n(t, "ab", 2, (void*) 3, NULL));
+   CU_ASSERT_EQUAL(trie_size(t), 1);
+   CU_ASSERT(trie_log_compact(log, snapshot));
+   r = trie_recover(snapshot, logpath);
+   CU_ASSERT_PTR_NOT_NULL_FATAL(r);
+   CU_ASSERT_EQUAL(trie_size(r), 1);
+   trie_destroy(r, NULL);
+   trie_destroy(t, NULL);
+   remove(snapshot);
+   remove(logpath);
+}
+
+struct sharded_job
+{
+   trie_sharded_t s;
+   struct sharded_job * all;
+   char ** keys;
+   unsigned int count;
+   unsigned int found;
+};
+
+// Inserts its own keys while looking up the keys of every other job
+static void * sharded_worker (void * arg)
+{
+   struct sharded_job * job = arg;
+   for (unsigned int i=0; i<job->count; ++i)
+   {
+      trie_sharded_insert(job->s, job->keys[i], (void*) hash_string(job->keys[i]));
+      void * val = NULL;
+      if (trie_sharded_find(job->s, job->keys[i], &val) && (val == (void*) hash_string(job->keys[i])))
+         ++job->found;
+      trie_sharded_find(job->s, job->all[i % CONCUR].keys[i], NULL);
+   }
+   return NULL;
+}
+
+struct sharded_order
+{
+   trie_t shadow;
+   char last[MAX_STRING+1];
+   unsigned int count;
+   bool ok;
+};
+
+static bool sharded_walker (trie_t t, trie_pos_t pos, const char * key, void * priv)
+{
+   struct sharded_order * order = priv;
+   trie_pos_t other = trie_find(order->shadow, key);
+   if ((order->count > 0) && (strcmp(order->last, key) >= 0))
+      order->ok = false;
+   if ((other == TRIE_INVALID_POS) || (trie_get_value(order->shadow, other) != trie_get_value(t, pos)))
+      order->ok = false;
+   strcpy(order->last, key);
+   ++order->count;
+   return true;
+}
+
+static void test_sharded ()
+{
+   enum { PER_JOB = 2000 };
+   CU_ASSERT_PTR_NULL(trie_sharded_new(0));
+
+   trie_sharded_t s = trie_sharded_new(7);
+   CU_ASSERT_PTR_NOT_NULL_FATAL(s);
+   trie_t shadow = trie_new();
+
+   // every thread inserts and finds its own keys, all at once
+   pthread_t threads[CONCUR];
+   struct sharded_job jobs[CONCUR];
+   for (unsigned int j=0; j<CONCUR; ++j)
+   {
+      jobs[j].s = s;
+      jobs[j].all = jobs;
+      jobs[j].count = PER_JOB;
+      jobs[j].found = 0;
+      jobs[j].keys = malloc(PER_JOB * sizeof(char *));
+      CU_ASSERT_PTR_NOT_NULL_FATAL(jobs[j].keys);
+      for (unsigned int i=0; i<PER_JOB; ++i)
+      {
+         char buf[MAX_STRING+1];
+         generate_random_string(buf, 12);
+         jobs[j].keys[i] = malloc(strlen(buf)+1);
+         CU_ASSERT_PTR_NOT_NULL_FATAL(jobs[j].keys[i]);
+         strcpy(jobs[j].keys[i], buf);
+         trie_insert(shadow, buf, (void*) hash_string(buf), NULL);
+      }
+   }
+   for (unsigned int j=0; j<CONCUR; ++j)
+      CU_ASSERT_EQUAL_FATAL(pthread_create(&threads[j], NULL, sharded_worker, &jobs[j]), 0);
+   for (unsigned int j=0; j<CONCUR; ++j)
+   {
+      pthread_join(threads[j], NULL);
+      CU_ASSERT_EQUAL(jobs[j].found, PER_JOB);
+   }
+   CU_ASSERT_EQUAL(trie_sharded_size(s), trie_size(shadow));
+   CU_ASSERT_FALSE(trie_sharded_insert(s, jobs[0].keys[0], NULL));
+   CU_ASSERT_FALSE(trie_sharded_insert(s, "", NULL));
+   CU_ASSERT_FALSE(trie_sharded_find(s, "", NULL));
+
+   // the walk is ordered across the shards and sees every key once
+   struct sharded_order order = { shadow, "", 0, true };
+   CU_ASSERT(trie_sharded_walk(s, sharded_walker, &order));
+   CU_ASSERT(order.ok);
+   CU_ASSERT_EQUAL(order.count, trie_size(shadow));
+
+   // one-character keys and prefixes of one, two and three characters
+   trie_sharded_insert(s, "a", (void*) hash_string("a"));
+   trie_insert(shadow, "a", (void*) hash_string("a"), NULL);
+   const char * prefixes[] = { "a", "b", "ab", "abc", "zz" };
+   for (unsigned int p=0; p<sizeof(prefixes)/sizeof(prefixes[0]); ++p)
+   {
+      struct sharded_order sorder = { shadow, "", 0, true };
+      unsigned int expected = 0;
+      CU_ASSERT(trie_sharded_walk_prefix(s, prefixes[p], sharded_walker, &sorder));
+      trie_walk_prefix(shadow, prefixes[p], count_walker, &expected);
+      CU_ASSERT(sorder.ok);
+      CU_ASSERT_EQUAL(sorder.count, expected);
+
+      struct trie_match_t mine[20], theirs[20];
+      size_t n = trie_sharded_complete(s, prefixes[p], mine, 20);
+      CU_ASSERT_EQUAL(n, trie_complete(shadow, prefixes[p], theirs, 20));
+      for (size_t i=0; i<n; ++i)
+         CU_ASSERT_STRING_EQUAL(mine[i].key, theirs[i].key);
+      trie_complete_free(mine, n);
+      trie_complete_free(theirs, n);
+   }
+
+   // ranges that start and end inside groups, and open ones
+   const char * bounds[][2] = { { "b", "d" }, { "bq", "cfx" }, { NULL, "c" }, { "x", NULL }, { "m", "m" } };
+   for (unsigned int r=0; r<sizeof(bounds)/sizeof(bounds[0]); ++r)
+   {
+      struct sharded_order rorder = { shadow, "", 0, true };
+      CU_ASSERT(trie_sharded_walk_range(s, bounds[r][0], bounds[r][1], sharded_walker, &rorder));
+      CU_ASSERT(rorder.ok);
+      CU_ASSERT_EQUAL(rorder.count, trie_count_range(shadow, bounds[r][0], bounds[r][1]));
+      CU_ASSERT_EQUAL(trie_sharded_count_range(s, bounds[r][0], bounds[r][1]), rorder.count);
+   }
+
+   // the best scores come out of whichever shard holds them
+   for (unsigned int i=0; i<PER_JOB; ++i)
+   {
+      CU_ASSERT(trie_sharded_set_score(s, jobs[i % CONCUR].keys[i], (trie_score_t) i));
+      trie_set_score(shadow, jobs[i % CONCUR].keys[i], (trie_score_t) i);
+   }
+   struct trie_match_t best[5], expected[5];
+   CU_ASSERT_EQUAL_FATAL(trie_sharded_topk(s, "", 5, best), 5);
+   CU_ASSERT_EQUAL_FATAL(trie_topk(shadow, "", 5, expected), 5);
+   for (unsigned int i=0; i<5; ++i)
+      CU_ASSERT_STRING_EQUAL(best[i].key, expected[i].key);
+   trie_complete_free(best, 5);
+   trie_complete_free(expected, 5);
+
+   // half the keys are removed concurrently
+   for (unsigned int j=0; j<CONCUR; ++j)
+   {
+      for (unsigned int i=0; i<PER_JOB/2; ++i)
+      {
+         void * data = NULL;
+         bool mine = trie_remove(shadow, jobs[j].keys[i], &data);
+         void * other = NULL;
+         CU_ASSERT_EQUAL(trie_sharded_remove(s, jobs[j].keys[i], &other), mine);
+         if (mine)
+            CU_ASSERT_EQUAL(other, data);
+      }
+   }
+   CU_ASSERT_EQUAL(trie_sharded_size(s), trie_size(shadow));
+   struct sharded_order after = { shadow, "", 0, true };
+   CU_ASSERT(trie_sharded_walk(s, sharded_walker, &after));
+   CU_ASSERT(after.ok);
+   CU_ASSERT_EQUAL(after.count, trie_size(shadow));
+
+   countfunc_value = 0;
+   trie_sharded_destroy(s, countfunc_free);
+   CU_ASSERT_EQUAL(countfunc_value, trie_size(shadow));
+   trie_destroy(shadow, NULL);
+   for (unsigned int j=0; j<CONCUR; ++j)
+   {
+      for (unsigned int i=0; i<PER_JOB; ++i)
+         free(jobs[j].keys[i]);
+      free(jobs[j].keys);
+   }
+}
+
+struct epoch_job
+{
+   trie_t t;
+   trie_t stable;              // keys the writer never touches, read-only
+   char ** keys;
+   unsigned int count;
+   char ** churn;              // keys the writer keeps inserting and removing
+   unsigned int nchurn;
+   volatile bool * stop;
+   unsigned int missed;
+   unsigned int rounds;
+   unsigned int torn;          // churned keys found without the value they are inserted with
+};
+
+static bool stable_walker (trie_t t, trie_pos_t pos, const char * key, void * priv)
+{
+   struct epoch_job * job = priv;
+   trie_pos_t other = trie_find(job->stable, key);
+   if (other != TRIE_INVALID_POS)
+   {
+      if (trie_get_value(t, pos) != trie_get_value(job->stable, other))
+         ++job->missed;
+      ++job->rounds;
+   }
+   return true;
+}
+
+// Looks up the stable keys and walks the trie while the writer churns around them
+static void * epoch_reader (void * arg)
+{
+   struct epoch_job * job = arg;
+   trie_reader_t reader = trie_reader_new(job->t);
+   if (reader == NULL)
+   {
+      job->missed = job->count;
+      return NULL;
+   }
+
+   unsigned int walks = 0;
+   while (!__atomic_load_n(job->stop, __ATOMIC_ACQUIRE) || (walks == 0))
+   {
+      trie_read_begin(reader);
+      for (unsigned int i=0; i<job->count; ++i)
+      {
+         trie_pos_t pos = trie_find(job->t, job->keys[i]);
+         if ((pos == TRIE_INVALID_POS) || (trie_get_value(job->t, pos) != (void*) hash_string(job->keys[i])))
+            ++job->missed;
+      }
+      for (unsigned int i=0; i<job->nchurn * 50; ++i)
+      {
+         const char * key = job->churn[i % job->nchurn];
+         trie_pos_t pos = trie_find(job->t, key);
+         if ((pos != TRIE_INVALID_POS) && (trie_get_value(job->t, pos) != (void*) hash_string(key)))
+            ++job->torn;
+      }
+      job->rounds = 0;
+      trie_walk(job->t, stable_walker, job);
+      if (job->rounds != trie_size(job->stable))
+         ++job->missed;
+      trie_read_end(reader);
+      ++walks;
+   }
+
+   trie_reader_free(reader);
+   return NULL;
+}
+
+static void test_epoch ()
+{
+   enum { STABLE = 1000, CHURNED = 32, CHURN = 20000 };
+
+   // only flags that change one link at a time go with TRIE_EPOCH
+   CU_ASSERT_PTR_NULL(trie_new_flags(TRIE_EPOCH | TRIE_BALANCED));
+   CU_ASSERT_PTR_NULL(trie_new_flags(TRIE_EPOCH | TRIE_COMPRESS));
+   CU_ASSERT_PTR_NULL(trie_new_flags(TRIE_EPOCH | TRIE_ROOT256));
+   trie_t plain = trie_new();
+   CU_ASSERT_PTR_NULL(trie_reader_new(plain));
+   trie_destroy(plain, NULL);
+
+   // on its own, an epoch trie behaves like any other, dead branches and all
+   const unsigned int flags[] = { TRIE_EPOCH, TRIE_EPOCH | TRIE_KEEP_KEYS, TRIE_EPOCH | TRIE_ARENA };
+   for (unsigned int f=0; f<sizeof(flags)/sizeof(flags[0]); ++f)
+   {
+      trie_t t = trie_new_flags(flags[f]);
+      trie_t shadow = trie_new();
+      CU_ASSERT_PTR_NOT_NULL_FATAL(t);
+      for (unsigned int i=0; i<CHURN; ++i)
+      {
+         char buf[MAX_STRING+1];
+         generate_random_string(buf, 6);
+         if (rand() % 3 == 0)
+         {
+            void * mine = NULL, * theirs = NULL;
+            CU_ASSERT_EQUAL(trie_remove(t, buf, &mine), trie_remove(shadow, buf, &theirs));
+            CU_ASSERT_EQUAL(mine, theirs);
+         }
+         else
+         {
+            CU_ASSERT_EQUAL(trie_insert(t, buf, (void*) hash_string(buf), NULL),
+                  trie_insert(shadow, buf, (void*) hash_string(buf), NULL));
+         }
+      }
+      CU_ASSERT_EQUAL(trie_size(t), trie_size(shadow));
+      CU_ASSERT(trie_walk(t, matching_walker, shadow));
+      CU_ASSERT(trie_walk(shadow, matching_walker, t));
+      CU_ASSERT_EQUAL(trie_count_range(t, "d", "q"), trie_count_range(shadow, "d", "q"));
+      CU_ASSERT_EQUAL(trie_count_range(t, NULL, NULL), trie_size(shadow));
+      trie_destroy(t, NULL);
+      trie_destroy(shadow, NULL);
+   }
+
+   // readers keep finding the keys nobody touches while the writer churns next to them,
+   // and find every churned key they see with its value, never without
+   char ** keys = malloc(STABLE * sizeof(char *));
+   char ** churn = malloc(CHURNED * sizeof(char *));
+   trie_t stable = trie_new();
+   CU_ASSERT_PTR_NOT_NULL_FATAL(keys);
+   CU_ASSERT_PTR_NOT_NULL_FATAL(churn);
+   for (unsigned int i=0; i<STABLE + CHURNED; ++i)
+   {
+      // the churned keys end in a capital, so the random ones below never hit them
+      char buf[MAX_STRING+1];
+      do
+      {
+         generate_random_string(buf, 7);
+         if (i >= STABLE)
+            strcat(buf, "A");
+      }
+      while (trie_find(stable, buf) != TRIE_INVALID_POS);
+      char * copy = malloc(strlen(buf)+1);
+      CU_ASSERT_PTR_NOT_NULL_FATAL(copy);
+      strcpy(copy, buf);
+      trie_insert(stable, buf, (void*) hash_string(buf), NULL);
+      if (i < STABLE)
+         keys[i] = copy;
+      else
+         churn[i - STABLE] = copy;
+   }
+   for (unsigned int i=0; i<CHURNED; ++i)
+      trie_remove(stable, churn[i], NULL);
+
+   for (unsigned int f=0; f<2; ++f)
+   {
+      trie_t t = trie_new_flags(f == 0 ? TRIE_EPOCH | TRIE_KEEP_KEYS : TRIE_EPOCH);
+      CU_ASSERT_PTR_NOT_NULL_FATAL(t);
+      for (unsigned int i=0; i<STABLE; ++i)
+         trie_insert(t, keys[i], (void*) hash_string(keys[i]), NULL);
+
+      volatile bool stop = false;
+      pthread_t threads[CONCUR];
+      struct epoch_job jobs[CONCUR];
+      for (unsigned int j=0; j<CONCUR; ++j)
+      {
+         jobs[j] = (struct epoch_job) { t, stable, keys, STABLE, churn, CHURNED, &stop, 0, 0, 0 };
+         CU_ASSERT_EQUAL_FATAL(pthread_create(&threads[j], NULL, epoch_reader, &jobs[j]), 0);
+      }
+      for (unsigned int i=0; i<CHURN * 5; ++i)
+      {
+         char buf[MAX_STRING+1];
+         generate_random_string(buf, 7);
+         if (trie_find(stable, buf) != TRIE_INVALID_POS)
+            continue;
+         if (!trie_remove(t, buf, NULL))
+            trie_insert(t, buf, (void*) (uintptr_t) i, NULL);
+
+         for (unsigned int k=0; k<8; ++k)
+         {
+            const char * key = churn[rand() % CHURNED];
+            if (!trie_remove(t, key, NULL))
+               trie_insert(t, key, (void*) hash_string(key), NULL);
+         }
+      }
+      __atomic_store_n(&stop, true, __ATOMIC_RELEASE);
+      for (unsigned int j=0; j<CONCUR; ++j)
+      {
+         pthread_join(threads[j], NULL);
+         CU_ASSERT_EQUAL(jobs[j].missed, 0);
+         CU_ASSERT_EQUAL(jobs[j].torn, 0);
+      }
+      trie_destroy(t, NULL);
+   }
+
+   for (unsigned int i=0; i<STABLE; ++i)
+      free(keys[i]);
+   for (unsigned int i=0; i<CHURNED; ++i)
+      free(churn[i]);
+   free(keys);
+   free(churn);
+   trie_destroy(stable, NULL);
+}
+
+static bool copy_walker (trie_t trie, trie_pos_t pos, const char * key, void * priv)
+{
+   trie_insert((trie_t) priv, key, trie_get_value(trie, pos), NULL);
+   trie_set_score((trie_t) priv, key, trie_get_score(trie, pos));
+   return true;
+}
+
+static bool same_walker (trie_t trie, trie_pos_t pos, const char * key, void * priv)
+{
+   trie_pos_t other = trie_find((trie_t) priv, key);
+   return (other != TRIE_INVALID_POS)
+      && (trie_get_value((trie_t) priv, other) == trie_get_value(trie, pos))
+      && (trie_get_score((trie_t) priv, other) == trie_get_score(trie, pos));
+}
+
+// A trie holds the same keys, values and scores as a plain copy of it
+static bool same_trie (trie_t t, trie_t copy)
+{
+   return (trie_size(t) == trie_size(copy))
+      && trie_walk(t, same_walker, copy) && trie_walk(copy, same_walker, t);
+}
+
+struct snapshot_job
+{
+   trie_t snap;
+   trie_t copy;
+   volatile bool * stop;
+   unsigned int missed;
+};
+
+// Walks a snapshot over and over while the trie it came from changes, then frees it
+static void * snapshot_reader (void * arg)
+{
+   struct snapshot_job * job = arg;
+   unsigned int walks = 0;
+   while (!__atomic_load_n(job->stop, __ATOMIC_ACQUIRE) || (walks == 0))
+   {
+      if (!same_trie(job->snap, job->copy))
+         ++job->missed;
+      ++walks;
+   }
+   trie_destroy(job->snap, NULL);
+   return NULL;
+}
+
+static void test_snapshot ()
+{
+   enum { KEYS = 3000, ROUNDS = 8, CHURN = 2000 };
+
+   // tries whose nodes are pointed at from elsewhere, or hold their values, cannot share nodes
+   unsigned int refused[] = { 0, TRIE_KEEP_KEYS | TRIE_ROOT256, TRIE_KEEP_KEYS | TRIE_WIDE,
+                              TRIE_KEEP_KEYS | TRIE_EPOCH, TRIE_KEEP_KEYS | TRIE_ARENA };
+   for (unsigned int f=0; f<sizeof(refused) / sizeof(refused[0]); ++f)
+   {
+      trie_t t = trie_new_flags(refused[f]);
+      CU_ASSERT_PTR_NOT_NULL_FATAL(t);
+      CU_ASSERT_PTR_NULL(trie_snapshot(t));
+      trie_destroy(t, NULL);
+   }
+   trie_t compact = trie_new_compact(0);
+   CU_ASSERT_PTR_NULL(trie_snapshot(compact));
+   trie_destroy(compact, NULL);
+
+   // every snapshot keeps what the trie held when it was taken, through inserts,
+   // removes, value and score changes and a rebalance of the trie, which itself
+   // ends up as a plain trie given the same changes does
+   unsigned int modes[] = { TRIE_KEEP_KEYS, TRIE_KEEP_KEYS | TRIE_BALANCED, TRIE_KEEP_KEYS | TRIE_COMPRESS,
+                            TRIE_KEEP_KEYS | TRIE_BALANCED | TRIE_COMPRESS };
+   for (unsigned int m=0; m<sizeof(modes) / sizeof(modes[0]); ++m)
+   {
+      trie_t t = trie_new_flags(modes[m]);
+      trie_t mirror = trie_new();
+      trie_t snaps[ROUNDS], copies[ROUNDS];
+      CU_ASSERT_PTR_NOT_NULL_FATAL(t);
+      for (unsigned int r=0; r<ROUNDS; ++r)
+      {
+         snaps[r] = trie_snapshot(t);
+         copies[r] = trie_new();
+         CU_ASSERT_PTR_NOT_NULL_FATAL(snaps[r]);
+         trie_walk(t, copy_walker, copies[r]);
+         CU_ASSERT(same_trie(snaps[r], copies[r]));
+
+         for (unsigned int i=0; i<CHURN; ++i)
+         {
+            char buf[MAX_STRING+1];
+            generate_random_string(buf, 5);
+            trie_pos_t pos = trie_find(t, buf);
+            switch (rand() % 4)
+            {
+               case 0:
+                  trie_remove(t, buf, NULL);
+                  trie_remove(mirror, buf, NULL);
+                  break;
+               case 1:
+                  if (pos != TRIE_INVALID_POS)
+                  {
+                     trie_set_value(t, pos, (void*) (uintptr_t) (i + r));
+                     trie_set_value(mirror, trie_find(mirror, buf), (void*) (uintptr_t) (i + r));
+                  }
+                  break;
+               case 2:
+               {
+                  trie_score_t score = (trie_score_t) (rand() % 100);
+                  trie_set_score(t, buf, score);
+                  trie_set_score(mirror, buf, score);
+                  break;
+               }
+               default:
+                  trie_upsert(t, buf, (void*) hash_string(buf), NULL, NULL);
+                  trie_upsert(mirror, buf, (void*) hash_string(buf), NULL, NULL);
+            }
+         }
+         if (r == ROUNDS / 2)
+            CU_ASSERT(trie_rebalance(t));
+         CU_ASSERT(same_trie(t, mirror));
+      }
+      for (unsigned int r=0; r<ROUNDS; ++r)
+         CU_ASSERT(same_trie(snaps[r], copies[r]));
+
+      // a snapshot is a trie like any other: it can be changed, and snapshotted,
+      // without the others seeing it
+      trie_t fork = trie_snapshot(snaps[0]);
+      CU_ASSERT_PTR_NOT_NULL_FATAL(fork);
+      trie_insert(snaps[0], "snapshot", NULL, NULL);
+      CU_ASSERT_EQUAL(trie_size(snaps[0]), trie_size(copies[0]) + 1);
+      CU_ASSERT(same_trie(fork, copies[0]));
+      CU_ASSERT(same_trie(t, mirror));
+      CU_ASSERT_EQUAL(trie_count_range(snaps[ROUNDS-1], "d", "q"), trie_count_range(copies[ROUNDS-1], "d", "q"));
+      trie_destroy(fork, NULL);
+
+      // the trie goes first, and the snapshots still hold up, destroyed in any order
+      trie_destroy(t, NULL);
+      for (unsigned int r=0; r<ROUNDS; r+=2)
+      {
+         CU_ASSERT(same_trie(snaps[ROUNDS-1-r], copies[ROUNDS-1-r]));
+         trie_destroy(snaps[ROUNDS-1-r], NULL);
+         trie_destroy(copies[ROUNDS-1-r], NULL);
+      }
+      for (unsigned int r=1; r<ROUNDS; r+=2)
+      {
+         if (r != ROUNDS-1)    // snaps[0] was changed above
+            CU_ASSERT(same_trie(snaps[ROUNDS-1-r], copies[ROUNDS-1-r]));
+         trie_destroy(snaps[ROUNDS-1-r], NULL);
+         trie_destroy(copies[ROUNDS-1-r], NULL);
+      }
+      trie_destroy(mirror, NULL);
+   }
+
+   // freefunc gets each value once, from the last trie holding it
+   trie_t t = trie_new_flags(TRIE_KEEP_KEYS);
+   char buf[MAX_STRING+1];
+   for (unsigned int i=0; i<KEYS; ++i)
+   {
+      sprintf(buf, "key%u", i);
+      trie_insert(t, buf, NULL, NULL);
+   }
+   trie_t snap = trie_snapshot(t);
+   CU_ASSERT_PTR_NOT_NULL_FATAL(snap);
+   for (unsigned int i=0; i<KEYS; i+=3)
+   {
+      sprintf(buf, "key%u", i);
+      CU_ASSERT(trie_remove(t, buf, NULL));
+      sprintf(buf, "key%u", i+1);
+      CU_ASSERT_FALSE(trie_upsert(t, buf, NULL, NULL, NULL));
+      sprintf(buf, "new%u", i);
+      CU_ASSERT(trie_insert(t, buf, NULL, NULL));
+   }
+   countfunc_value = 0;
+   trie_destroy(t, countfunc_free);
+   CU_ASSERT_EQUAL(countfunc_value, 2 * KEYS / 3);     // the upserted and new keys
+   countfunc_value = 0;
+   CU_ASSERT_EQUAL(trie_size(snap), KEYS);
+   trie_destroy(snap, countfunc_free);
+   CU_ASSERT_EQUAL(countfunc_value, KEYS);
+
+   // snapshots are walked on other threads, and freed there, while the trie changes
+   t = trie_new_flags(TRIE_KEEP_KEYS);
+   CU_ASSERT_PTR_NOT_NULL_FATAL(t);
+   volatile bool stop = false;
+   pthread_t threads[CONCUR];
+   struct snapshot_job jobs[CONCUR];
+   for (unsigned int j=0; j<CONCUR; ++j)
+   {
+      for (unsigned int i=0; i<KEYS / CONCUR; ++i)
+      {
+         generate_random_string(buf, 7);
+         trie_upsert(t, buf, (void*) (uintptr_t) (i + j), NULL, NULL);
+      }
+      jobs[j] = (struct snapshot_job) { trie_snapshot(t), trie_new(), &stop, 0 };
+      CU_ASSERT_PTR_NOT_NULL_FATAL(jobs[j].snap);
+      trie_walk(t, copy_walker, jobs[j].copy);
+      CU_ASSERT_EQUAL_FATAL(pthread_create(&threads[j], NULL, snapshot_reader, &jobs[j]), 0);
+   }
+   for (unsigned int i=0; i<CHURN * 10; ++i)
+   {
+      generate_random_string(buf, 7);
+      if (!trie_remove(t, buf, NULL))
+         trie_insert(t, buf, (void*) (uintptr_t) i, NULL);
+   }
+   __atomic_store_n(&stop, true, __ATOMIC_RELEASE);
+   for (unsigned int j=0; j<CONCUR; ++j)
+   {
+      pthread_join(threads[j], NULL);
+      CU_ASSERT_EQUAL(jobs[j].missed, 0);
+      trie_destroy(jobs[j].copy, NULL);
+   }
+   trie_destroy(t, NULL);
+}
+
+// Two tries are laid out node for node the same
+static bool same_shape (trie_pos_t a, trie_pos_t b)
+{
+   if ((a == NULL) || (b == NULL))
+      return (a == b);
+   return (a->key == b->key) && (a->terminal == b->terminal)
+      && same_shape(a->left, b->left) && same_shape(a->mid, b->mid) && same_shape(a->right, b->right);
+}
+
+static void test_build_parallel ()
+{
+   enum { KEYS = 30000 };
+   char ** keys = malloc(KEYS * sizeof(char *));
+   void ** vals = malloc(KEYS * sizeof(void *));
+   CU_ASSERT_PTR_NOT_NULL_FATAL(keys);
+   CU_ASSERT_PTR_NOT_NULL_FATAL(vals);
+
+   // random keys with repeats, two thirds of them under one long prefix so the
+   // work has to be split below it
+   for (unsigned int i=0; i<KEYS; ++i)
+   {
+      char buf[MAX_STRING+1];
+      if (i % 3 == 0)
+         generate_random_string(buf, 4);
+      else
+      {
+         strcpy(buf, "http://");
+         generate_random_string(buf + 7, 6);
+      }
+      keys[i] = malloc(strlen(buf)+1);
+      CU_ASSERT_PTR_NOT_NULL_FATAL(keys[i]);
+      strcpy(keys[i], buf);
+      vals[i] = (void*) (uintptr_t) i;
+   }
+
+   const unsigned int threads[] = { 0, 1, 2, CONCUR };
+   for (unsigned int loop=0; loop<sizeof(threads)/sizeof(threads[0]); ++loop)
+   {
+      trie_t shadow = trie_new();
+      for (unsigned int i=0; i<KEYS; ++i)
+         trie_insert(shadow, keys[i], vals[i], NULL);
+      trie_t t = trie_build_parallel((const char * const *) keys, vals, KEYS, threads[loop]);
+      CU_ASSERT_PTR_NOT_NULL_FATAL(t);
+      CU_ASSERT(same_trie(t, shadow));     // first values win, as with trie_insert
+
+      // and an ordinary trie from then on
+      for (unsigned int i=0; i<KEYS; i+=2)
+      {
+         CU_ASSERT_EQUAL(trie_remove(t, keys[i], NULL), trie_find(shadow, keys[i]) != TRIE_INVALID_POS);
+         trie_remove(shadow, keys[i], NULL);
+      }
+      CU_ASSERT(same_trie(t, shadow));
+      trie_destroy(t, NULL);
+      trie_destroy(shadow, NULL);
+   }
+
+   // sorted input comes out exactly as trie_build_sorted lays it out
+   qsort(keys, KEYS, sizeof(keys[0]), compare_strings);
+   unsigned int n = 0;
+   for (unsigned int i=0; i<KEYS; ++i)
+   {
+      if ((n > 0) && (strcmp(keys[n-1], keys[i]) == 0))
+         free(keys[i]);
+      else
+         keys[n++] = keys[i];
+   }
+   trie_t sorted = trie_build_sorted((const char * const *) keys, NULL, n);
+   trie_t t = trie_build_parallel((const char * const *) keys, NULL, n, CONCUR);
+   CU_ASSERT_PTR_NOT_NULL_FATAL(sorted);
+   CU_ASSERT_PTR_NOT_NULL_FATAL(t);
+   CU_ASSERT_EQUAL(trie_size(t), n);
+   CU_ASSERT(same_shape(t->start, sorted->start));
+   trie_destroy(sorted, NULL);
+   trie_destroy(t, NULL);
+
+   // empty input is fine, empty keys are not
+   t = trie_build_parallel(NULL, NULL, 0, CONCUR);
+   CU_ASSERT_PTR_NOT_NULL_FATAL(t);
+   CU_ASSERT_EQUAL(trie_size(t), 0);
+   trie_destroy(t, NULL);
+   const char * empty[] = { "a", "" };
+   CU_ASSERT_PTR_NULL(trie_build_parallel(empty, NULL, 2, CONCUR));
+
+   for (unsigned int i=0; i<n; ++i)
+      free(keys[i]);
+   free(keys);
+   free(vals);
+}
+
+// What a parallel walk saw: how many keys, and a sum over keys and values that
+// any key missing, repeated or with the wrong value would throw off
+struct walk_sum
+{
+   unsigned long count;
+   uintptr_t sum;
+};
+
+static bool sum_walker (trie_t t, trie_pos_t pos, const char * key, void * priv)
+{
+   struct walk_sum * ws = (struct walk_sum *) priv;
+   __atomic_add_fetch(&ws->count, 1, __ATOMIC_RELAXED);
+   __atomic_add_fetch(&ws->sum, hash_string(key) * 31 + (uintptr_t) trie_get_value(t, pos), __ATOMIC_RELAXED);
+   return true;
+}
+
+static bool stop_walker (trie_t t, trie_pos_t pos, const char * key, void * priv)
+{
+   return __atomic_add_fetch((unsigned long *) priv, 1, __ATOMIC_RELAXED) < 1000;
+}
+
+static unsigned long atomic_free_value = 0;
+
+static void atomic_free (void * data)
+{
+   __atomic_add_fetch(&atomic_free_value, 1, __ATOMIC_RELAXED);
+}
+
+static void test_walk_parallel ()
+{
+   enum { KEYS = 20000 };
+   trie_t tries[] = { trie_new(), trie_new_flags(TRIE_KEEP_KEYS), trie_new_flags(TRIE_COMPRESS),
+      trie_new_arena(0), trie_new_compact(0) };
+   const unsigned int count = sizeof(tries)/sizeof(tries[0]);
+
+   for (unsigned int loop=0; loop<count; ++loop)
+   {
+      trie_t t = tries[loop];
+      CU_ASSERT_PTR_NOT_NULL_FATAL(t);
+
+      struct walk_sum ws = { 0, 0 };
+      CU_ASSERT(trie_walk_parallel(t, sum_walker, &ws, CONCUR));
+      CU_ASSERT_EQUAL(ws.count, 0);
+
+      // short keys, and a long run under one prefix so the walk has to be split deep down
+      for (unsigned int i=0; i<KEYS; ++i)
+      {
+         char buf[MAX_STRING+1];
+         if (i % 2 == 0)
+            generate_random_string(buf, 5);
+         else
+         {
+            strcpy(buf, "prefix/");
+            generate_random_string(buf + 7, 1 + i % 40);
+         }
+         trie_insert(t, buf, (void*) hash_string(buf), NULL);
+      }
+
+      struct walk_sum serial = { 0, 0 };
+      CU_ASSERT(trie_walk(t, sum_walker, &serial));
+      CU_ASSERT_EQUAL(serial.count, trie_size(t));
+
+      const unsigned int threads[] = { 0, 1, 2, CONCUR };
+      for (unsigned int n=0; n<sizeof(threads)/sizeof(threads[0]); ++n)
+      {
+         ws.count = ws.sum = 0;
+         CU_ASSERT(trie_walk_parallel(t, sum_walker, &ws, threads[n]));
+         CU_ASSERT_EQUAL(ws.count, serial.count);
+         CU_ASSERT_EQUAL(ws.sum, serial.sum);
+      }
+
+      // a walker saying stop stops every thread, if not at once
+      unsigned long seen = 0;
+      CU_ASSERT_FALSE(trie_walk_parallel(t, stop_walker, &seen, CONCUR));
+      CU_ASSERT(seen >= 1000);
+      CU_ASSERT(seen < serial.count);
+
+      // the first two go in the background, one with a snapshot still holding on to it
+      atomic_free_value = 0;
+      trie_t snap = (loop == 1 ? trie_snapshot(t) : TRIE_INVALID);
+      if (loop < 2)
+         trie_destroy_background(t, atomic_free, CONCUR);
+      else
+         trie_destroy_parallel(t, atomic_free, CONCUR);
+      trie_destroy_wait();
+      CU_ASSERT_EQUAL(atomic_free_value, (snap == TRIE_INVALID ? serial.count : 0));
+
+      if (snap != TRIE_INVALID)
+      {
+         ws.count = ws.sum = 0;
+         CU_ASSERT(trie_walk_parallel(snap, sum_walker, &ws, CONCUR));
+         CU_ASSERT_EQUAL(ws.sum, serial.sum);
+         trie_destroy_parallel(snap, atomic_free, CONCUR);
+         CU_ASSERT_EQUAL(atomic_free_value, serial.count);
+      }
+   }
+}
+
+static char * dup_string (const char * s)
+{
+   char * copy = malloc(strlen(s)+1);
+   CU_ASSERT_PTR_NOT_NULL_FATAL(copy);
+   return strcpy(copy, s);
+}
+
+static void test_find_batch ()
+{
+   enum { KEYS = 5000, BATCH = 3 * KEYS };
+   const unsigned int flags[] = { 0, TRIE_ROOT256, TRIE_ROOT65536 | TRIE_COMPRESS, TRIE_COMPRESS,
+      TRIE_EPOCH, TRIE_ARENA | TRIE_BALANCED };
+   char ** keys = malloc(BATCH * sizeof(char *));
+   trie_pos_t * out = malloc(BATCH * sizeof(trie_pos_t));
+   CU_ASSERT_PTR_NOT_NULL_FATAL(keys);
+   CU_ASSERT_PTR_NOT_NULL_FATAL(out);
+
+   // keys in the trie, their prefixes and longer keys past them, misses, empty and NULL keys
+   for (unsigned int i=0; i<KEYS; ++i)
+   {
+      char buf[MAX_STRING+1];
+      generate_random_string(buf, 2 + i % 30);
+      keys[i] = dup_string(buf);
+      keys[KEYS + i] = dup_string(buf);
+      keys[KEYS + i][strlen(buf) / 2] = '\0';
+      strcat(buf, (i % 2 ? "x" : "-tail"));
+      keys[2*KEYS + i] = dup_string(buf);
+   }
+   free(keys[KEYS + 7]);
+   keys[KEYS + 7] = NULL;
+
+   for (unsigned int loop=0; loop<=sizeof(flags)/sizeof(flags[0]); ++loop)
+   {
+      trie_t t = (loop == 0 ? trie_new_compact(0) : trie_new_flags(flags[loop-1]));
+      CU_ASSERT_PTR_NOT_NULL_FATAL(t);
+      CU_ASSERT_EQUAL(trie_find_batch(t, (const char * const *) keys, BATCH, out), 0);
+
+      for (unsigned int i=0; i<KEYS; i+=2)
+         trie_insert(t, keys[i], (void*) hash_string(keys[i]), NULL);
+
+      // every batch size, down to none and fewer keys than lookups in flight
+      const size_t sizes[] = { 0, 1, 5, 17, BATCH };
+      for (unsigned int n=0; n<sizeof(sizes)/sizeof(sizes[0]); ++n)
+      {
+         memset(out, 0xff, BATCH * sizeof(trie_pos_t));
+         size_t found = 0, hits = trie_find_batch(t, (const char * const *) keys, sizes[n], out);
+         for (size_t i=0; i<sizes[n]; ++i)
+         {
+            trie_pos_t pos = (keys[i] == NULL ? TRIE_INVALID_POS : trie_find(t, keys[i]));
+            CU_ASSERT(out[i] == pos);
+            found += (pos != TRIE_INVALID_POS);
+         }
+         CU_ASSERT_EQUAL(hits, found);
+      }
+      CU_ASSERT(trie_find_batch(t, (const char * const *) keys, KEYS, out) >= KEYS/2);
+      trie_destroy(t, NULL);
+   }
+
+   for (unsigned int i=0; i<BATCH; ++i)
+      free(keys[i]);
+   free(keys);
+   free(out);
+}
+
+// Every key of keys[0..n) is in t exactly when it is in shadow
+static bool same_finds (trie_t t, trie_t shadow, char ** keys, unsigned int n)
+{
+   bool same = true;
+   for (unsigned int i=0; i<n; ++i)
+   {
+      trie_pos_t a = trie_find(t, keys[i]), b = trie_find(shadow, keys[i]);
+      if ((a == TRIE_INVALID_POS) != (b == TRIE_INVALID_POS))
+         same = false;
+      else if ((a != TRIE_INVALID_POS) && (trie_get_value(t, a) != trie_get_value(shadow, b)))
+         same = false;
+   }
+   return same;
+}
+
+static void test_wide ()
+{
+   enum { KEYS = 6000 };
+   const unsigned int flags[] = { TRIE_WIDE, TRIE_WIDE | TRIE_BALANCED, TRIE_WIDE | TRIE_COMPRESS,
+      TRIE_WIDE | TRIE_ROOT256 | TRIE_KEEP_KEYS, TRIE_WIDE | TRIE_ARENA | TRIE_COMPRESS | TRIE_BALANCED };
+   char ** keys = malloc(KEYS * sizeof(char *));
+   CU_ASSERT_PTR_NOT_NULL_FATAL(keys);
+
+   CU_ASSERT_PTR_NULL(trie_new_flags(TRIE_WIDE | TRIE_EPOCH));
+
+   // levels of every size: up to 64 second characters under each first one, so some
+   // levels outgrow 32 slots and come back under as keys go
+   for (unsigned int i=0; i<KEYS; ++i)
+   {
+      char buf[MAX_STRING+1];
+      buf[0] = 'a' + (rand() % 20);
+      buf[1] = '0' + (rand() % 64);
+      generate_random_string(buf + 2, 2 + (i % 4));
+      keys[i] = dup_string(buf);
+   }
+
+   for (unsigned int loop=0; loop<sizeof(flags)/sizeof(flags[0]); ++loop)
+   {
+      trie_t t = trie_new_flags(flags[loop]);
+      trie_t shadow = trie_new();
+      CU_ASSERT_PTR_NOT_NULL_FATAL(t);
+
+      for (unsigned int i=0; i<KEYS; ++i)
+      {
+         void * val = (void*) (uintptr_t) i;
+         CU_ASSERT_EQUAL(trie_insert(t, keys[i], val, NULL), trie_insert(shadow, keys[i], val, NULL));
+      }
+      CU_ASSERT_EQUAL(trie_size(t), trie_size(shadow));
+      CU_ASSERT(same_finds(t, shadow, keys, KEYS));
+      CU_ASSERT(same_trie(t, shadow));
+
+      // take most keys out again, in rounds, and put some back
+      for (unsigned int round=0; round<4; ++round)
+      {
+         for (unsigned int i=round; i<KEYS; i+=(round == 3 ? 1 : 3))
+         {
+            CU_ASSERT_EQUAL(trie_remove(t, keys[i], NULL), trie_remove(shadow, keys[i], NULL));
+         }
+         CU_ASSERT(same_finds(t, shadow, keys, KEYS));
+         for (unsigned int i=round; i<KEYS; i+=7)
+         {
+            void * val = (void*) (uintptr_t) (i + round);
+            trie_insert(t, keys[i], val, NULL);
+            trie_insert(shadow, keys[i], val, NULL);
+         }
+         CU_ASSERT(same_finds(t, shadow, keys, KEYS));
+         CU_ASSERT_EQUAL(trie_size(t), trie_size(shadow));
+      }
+
+      trie_pos_t * out = malloc(KEYS * sizeof(trie_pos_t));
+      CU_ASSERT_PTR_NOT_NULL_FATAL(out);
+      size_t found = trie_find_batch(t, (const char * const *) keys, KEYS, out);
+      for (unsigned int i=0; i<KEYS; ++i)
+         CU_ASSERT(out[i] == trie_find(t, keys[i]));
+      CU_ASSERT(found > 0);
+      free(out);
+
+      for (unsigned int i=0; i<KEYS; ++i)
+         trie_remove(t, keys[i], NULL);
+      CU_ASSERT_EQUAL(trie_size(t), 0);
+      CU_ASSERT_PTR_NULL(t->start);
+      trie_destroy(t, NULL);
+      trie_destroy(shadow, NULL);
+   }
+
+   for (unsigned int i=0; i<KEYS; ++i)
+      free(keys[i]);
+   free(keys);
+}
+
+// Cursors, prefix completion and ranges see the same keys, in the same order, in
+// a trie as in a plain copy of it
+static bool same_order (trie_t t, trie_t shadow, char ** keys, unsigned int n)
+{
+   bool same = true;
+   trie_cursor_t a = trie_cursor_new(t), b = trie_cursor_new(shadow);
+   if ((a == NULL) || (b == NULL))
+      return false;
+
+   for (int dir=0; dir<2; ++dir)
+   {
+      bool more;
+      do {
+         more = (dir == 0 ? trie_cursor_next(a) : trie_cursor_prev(a));
+         same = same && (more == (dir == 0 ? trie_cursor_next(b) : trie_cursor_prev(b)));
+         if (more && same)
+            same = (strcmp(trie_cursor_key(a), trie_cursor_key(b)) == 0)
+               && (trie_get_value(t, trie_cursor_pos(a)) == trie_get_value(shadow, trie_cursor_pos(b)));
+      } while (more && same);
+   }
+
+   for (unsigned int i=0; same && (i<n); i+=37)
+   {
+      char buf[MAX_STRING+1];
+      strcpy(buf, keys[i]);
+      buf[1 + (i % strlen(buf))] = '\0';
+
+      bool more = trie_cursor_seek(a, buf);
+      same = (more == trie_cursor_seek(b, buf))
+         && (!more || (strcmp(trie_cursor_key(a), trie_cursor_key(b)) == 0));
+      same = same && (trie_count_range(t, buf, keys[i]) == trie_count_range(shadow, buf, keys[i]));
+
+      struct trie_match_t ma[20], mb[20];
+      size_t ca = trie_complete(t, buf, ma, 20), cb = trie_complete(shadow, buf, mb, 20);
+      same = same && (ca == cb);
+      for (size_t j=0; same && (j<ca); ++j)
+         same = (strcmp(ma[j].key, mb[j].key) == 0) && (trie_get_value(t, ma[j].pos) == (trie_get_value(shadow, mb[j].pos)));
+      trie_complete_free(ma, ca);
+      trie_complete_free(mb, cb);
+
+      ca = trie_topk(t, buf, 20, ma);
+      cb = trie_topk(shadow, buf, 20, mb);
+      same = same && (ca == cb);
+      for (size_t j=0; same && (j<ca); ++j)
+         same = (strncmp(ma[j].key, buf, strlen(buf)) == 0) && (trie_find(t, ma[j].key) == ma[j].pos);
+      trie_complete_free(ma, ca);
+      trie_complete_free(mb, cb);
+   }
+
+   trie_cursor_free(a);
+   trie_cursor_free(b);
+   return same;
+}
+
+static void test_burst ()
+{
+   enum { KEYS = 6000 };
+   const size_t thresholds[] = { 1, 4, 0, 500 };
+   char ** keys = malloc(KEYS * sizeof(char *));
+   CU_ASSERT_PTR_NOT_NULL_FATAL(keys);
+
+   // few first characters, so the top levels burst, and keys that are prefixes of
+   // others, so bursts leave keys ending on their nodes
+   for (unsigned int i=0; i<KEYS; ++i)
+   {
+      char buf[MAX_STRING+1];
+      if ((i % 5 == 4) && (strlen(keys[i-1]) > 2))
+      {
+         strcpy(buf, keys[i-1]);
+         buf[strlen(buf) - 1] = '\0';
+      } else {
+         buf[0] = 'a' + (rand() % 4);
+         generate_random_string(buf + 1, 2 + (i % 12));
+      }
+      keys[i] = dup_string(buf);
+   }
+
+   for (unsigned int loop=0; loop<sizeof(thresholds)/sizeof(thresholds[0]); ++loop)
+   {
+      trie_t t = trie_new_burst(thresholds[loop]);
+      trie_t shadow = trie_new();
+      CU_ASSERT_PTR_NOT_NULL_FATAL(t);
+
+      for (unsigned int i=0; i<KEYS; ++i)
+      {
+         void * val = (void*) (uintptr_t) i;
+         CU_ASSERT_EQUAL(trie_insert(t, keys[i], val, NULL), trie_insert(shadow, keys[i], val, NULL));
+      }
+      CU_ASSERT(t->buckets > 0);
+      CU_ASSERT_EQUAL(trie_size(t), trie_size(shadow));
+      CU_ASSERT(same_finds(t, shadow, keys, KEYS));
+      CU_ASSERT(same_trie(t, shadow));
+
+      // values in a bucket change in place
+      void * old = NULL;
+      trie_pos_t pos = TRIE_INVALID_POS;
+      CU_ASSERT_FALSE(trie_upsert(t, keys[0], (void*) (uintptr_t) 77, &old, &pos));
+      CU_ASSERT(old == trie_get_value(shadow, trie_find(shadow, keys[0])));
+      CU_ASSERT(trie_get_value(t, pos) == (void*) (uintptr_t) 77);
+      trie_set_value(t, pos, old);
+
+      for (unsigned int round=0; round<3; ++round)
+      {
+         for (unsigned int i=round; i<KEYS; i+=(round == 2 ? 1 : 3))
+         {
+            void * a = NULL, * b = NULL;
+            CU_ASSERT_EQUAL(trie_remove(t, keys[i], &a), trie_remove(shadow, keys[i], &b));
+            CU_ASSERT(a == b);
+         }
+         CU_ASSERT(same_finds(t, shadow, keys, KEYS));
+         for (unsigned int i=round; i<KEYS; i+=5)
+         {
+            void * val = (void*) (uintptr_t) (i + round);
+            trie_insert(t, keys[i], val, NULL);
+            trie_insert(shadow, keys[i], val, NULL);
+         }
+         CU_ASSERT(same_finds(t, shadow, keys, KEYS));
+         CU_ASSERT(same_trie(t, shadow));
+         CU_ASSERT_EQUAL(trie_size(t), trie_size(shadow));
+      }
+
+      trie_pos_t * out = malloc(KEYS * sizeof(trie_pos_t));
+      CU_ASSERT_PTR_NOT_NULL_FATAL(out);
+      trie_find_batch(t, (const char * const *) keys, KEYS, out);
+      for (unsigned int i=0; i<KEYS; ++i)
+         CU_ASSERT(out[i] == trie_find(t, keys[i]));
+      free(out);
+
+      // the ordered queries step through the buckets, leaving them be
+      size_t buckets = t->buckets;
+      CU_ASSERT_EQUAL(trie_count_range(t, NULL, NULL), trie_size(shadow));
+      CU_ASSERT(same_order(t, shadow, keys, KEYS));
+      trie_frozen_t f = trie_freeze(t);
+      CU_ASSERT_PTR_NOT_NULL_FATAL(f);
+      CU_ASSERT_EQUAL(trie_frozen_size(f), trie_size(shadow));
+      for (unsigned int i=0; i<KEYS; i+=11)
+      {
+         void * val = NULL;
+         trie_pos_t other = trie_find(shadow, keys[i]);
+         CU_ASSERT_EQUAL(trie_frozen_find(f, keys[i], &val), other != TRIE_INVALID_POS);
+         if (other != TRIE_INVALID_POS)
+            CU_ASSERT(val == trie_get_value(shadow, other));
+      }
+      trie_frozen_free(f);
+      CU_ASSERT_EQUAL(t->buckets, buckets);
+      CU_ASSERT(same_finds(t, shadow, keys, KEYS));
+      for (unsigned int i=0; i<KEYS; ++i)
+      {
+         void * val = (void*) (uintptr_t) i;
+         CU_ASSERT_EQUAL(trie_insert(t, keys[i], val, NULL), trie_insert(shadow, keys[i], val, NULL));
+      }
+      CU_ASSERT(same_finds(t, shadow, keys, KEYS));
+      CU_ASSERT(same_trie(t, shadow));
+
+      // a score needs a node, so the buckets on the key's path burst
+      struct trie_match_t top[1];
+      CU_ASSERT_TRUE(trie_set_score(t, keys[1], 5));
+      CU_ASSERT_EQUAL(trie_topk(t, "", 1, top), 1);
+      CU_ASSERT_STRING_EQUAL(top[0].key, keys[1]);
+      trie_complete_free(top, 1);
+
+      countfunc_value = 0;
+      unsigned int size = trie_size(t);
+      for (unsigned int i=1; i<KEYS; i+=2)
+      {
+         // out of the buckets and back in
+         if (trie_remove(t, keys[i], NULL))
+            trie_insert(t, keys[i], NULL, NULL);
+      }
+      CU_ASSERT(t->buckets > 0);
+      CU_ASSERT_EQUAL(trie_size(t), size);
+      trie_destroy(t, countfunc_free);
+      CU_ASSERT_EQUAL(countfunc_value, size);
+      trie_destroy(shadow, NULL);
+   }
+
+   // emptied out, a burst trie goes back to nothing
+   trie_t t = trie_new_burst(3);
+   for (unsigned int i=0; i<KEYS; ++i)
+      trie_insert(t, keys[i], NULL, NULL);
+   for (unsigned int i=0; i<KEYS; ++i)
+      trie_remove(t, keys[i], NULL);
+   CU_ASSERT_EQUAL(trie_size(t), 0);
+   CU_ASSERT_EQUAL(t->buckets, 0);
+   CU_ASSERT_PTR_NULL(t->start);
+   trie_destroy(t, NULL);
+
+   for (unsigned int i=0; i<KEYS; ++i)
+      free(keys[i]);
+   free(keys);
+}
+
+/* Spell out len bytes of key in hex, for a string trie to shadow a binary one */
+static void hex_key (const char * key, size_t len, char * out)
+{
+   for (size_t i=0; i<len; ++i)
+      sprintf(out + 2*i, "%02x", (unsigned char) key[i]);
+   out[2*len] = '\0';
+}
+
+static bool hex_walker (trie_t trie, trie_pos_t pos, const char * key, size_t len, void * priv)
+{
+   char hex[2*MAX_STRING+1];
+   trie_t shadow = (trie_t) priv;
+   ++countfunc_value;
+   hex_key(key, len, hex);
+   trie_pos_t other = trie_find(shadow, hex);
+   return (key[len] == '\0') && (other != TRIE_INVALID_POS)
+      && (trie_get_value(trie, pos) == trie_get_value(shadow, other));
+}
+
+static void test_binary_keys ()
+{
+   enum { KEYS = 4000 };
+   const char alphabet[] = { '\0', '\1', 'a', 'b', (char) 0xff };
+   char (* keys)[MAX_STRING] = calloc(KEYS, sizeof(*keys));    // a 0 after each, for the string API
+   size_t * lens = malloc(KEYS * sizeof(size_t));
+   CU_ASSERT_PTR_NOT_NULL_FATAL(keys);
+   CU_ASSERT_PTR_NOT_NULL_FATAL(lens);
+
+   // few distinct bytes, so keys share prefixes, end inside each other and hold 0-bytes
+   // anywhere, first and last byte included
+   for (unsigned int i=0; i<KEYS; ++i)
+   {
+      lens[i] = 1 + (rand() % 12);
+      for (size_t j=0; j<lens[i]; ++j)
+         keys[i][j] = alphabet[rand() % sizeof(alphabet)];
+   }
+
+   for (unsigned int loop=0; loop<9; ++loop)
+   {
+      const unsigned int flags[] = { 0, TRIE_COMPRESS, TRIE_ROOT65536 | TRIE_COMPRESS, TRIE_KEEP_KEYS,
+         TRIE_BALANCED, TRIE_WIDE, TRIE_ROOT256 | TRIE_WIDE };
+      trie_t t = (loop < 7 ? trie_new_flags(flags[loop]) : (loop == 7 ? trie_new_compact(0) : trie_new_burst(4)));
+      trie_t shadow = trie_new();
+      CU_ASSERT_PTR_NOT_NULL_FATAL(t);
+
+      for (unsigned int i=0; i<KEYS; ++i)
+      {
+         char hex[2*MAX_STRING+1];
+         void * val = (void*) (uintptr_t) i;
+         hex_key(keys[i], lens[i], hex);
+         CU_ASSERT_EQUAL(trie_insert_n(t, keys[i], lens[i], val, NULL), trie_insert(shadow, hex, val, NULL));
+      }
+      CU_ASSERT_EQUAL(trie_size(t), trie_size(shadow));
+      CU_ASSERT_FALSE(trie_insert_n(t, "", 0, NULL, NULL));
+
+      countfunc_value = 0;
+      CU_ASSERT(trie_walk_n(t, hex_walker, shadow));
+      CU_ASSERT_EQUAL(countfunc_value, trie_size(shadow));
+
+      // the keys starting with a 0-byte and an 'a' come through whole, and only those
+      unsigned int count = 0;
+      CU_ASSERT(trie_walk_prefix(shadow, "0061", count_walker, &count));
+      countfunc_value = 0;
+      CU_ASSERT(trie_walk_prefix_n(t, "\0a", 2, hex_walker, shadow));
+      CU_ASSERT_EQUAL(countfunc_value, count);
+
+      // upserts and removals by length; the string API only ever sees the bytes before a 0
+      for (unsigned int i=0; i<KEYS; i+=3)
+      {
+         char hex[2*MAX_STRING+1];
+         void * a = NULL, * b = NULL;
+         hex_key(keys[i], lens[i], hex);
+         if (i % 2)
+         {
+            CU_ASSERT_EQUAL(trie_remove_n(t, keys[i], lens[i], &a), trie_remove(shadow, hex, &b));
+         } else {
+            void * val = (void*) (uintptr_t) (i + 1);
+            CU_ASSERT_EQUAL(trie_upsert_n(t, keys[i], lens[i], val, &a, NULL), trie_upsert(shadow, hex, val, &b, NULL));
+         }
+         CU_ASSERT(a == b);
+      }
+      for (unsigned int i=0; i<KEYS; ++i)
+      {
+         char hex[2*MAX_STRING+1];
+         hex_key(keys[i], lens[i], hex);
+         trie_pos_t pos = trie_find_n(t, keys[i], lens[i]), other = trie_find(shadow, hex);
+         CU_ASSERT_EQUAL(pos == TRIE_INVALID_POS, other == TRIE_INVALID_POS);
+         if (pos != TRIE_INVALID_POS)
+            CU_ASSERT(trie_get_value(t, pos) == trie_get_value(shadow, other));
+         CU_ASSERT(trie_find(t, keys[i]) == trie_find_n(t, keys[i], strlen(keys[i])));
+      }
+      countfunc_value = 0;
+      CU_ASSERT(trie_walk_n(t, hex_walker, shadow));
+      CU_ASSERT_EQUAL(countfunc_value, trie_size(shadow));
+
+      // "xy" and "xy\0" are two keys
+      CU_ASSERT_TRUE(trie_insert(t, "xy", (void*) 1, NULL));
+      CU_ASSERT_TRUE(trie_insert_n(t, "xy\0", 3, (void*) 2, NULL));
+      CU_ASSERT(trie_get_value(t, trie_find(t, "xy")) == (void*) 1);
+      CU_ASSERT(trie_get_value(t, trie_find_n(t, "xy\0", 3)) == (void*) 2);
+      CU_ASSERT_TRUE(trie_remove(t, "xy", NULL));
+      CU_ASSERT(trie_find_n(t, "xy\0", 3) != TRIE_INVALID_POS);
+      CU_ASSERT(trie_remove_n(t, "xy\0", 3, NULL));
+
+      // the ordered queries hand back whole keys, in byte order (which hex keeps)
+      trie_cursor_t a = trie_cursor_new(t), b = trie_cursor_new(shadow);
+      CU_ASSERT_PTR_NOT_NULL_FATAL(a);
+      CU_ASSERT_PTR_NOT_NULL_FATAL(b);
+      CU_ASSERT_EQUAL(trie_cursor_key_len(a), 0);
+      for (bool more = trie_cursor_next(a); more; more = trie_cursor_next(a))
+      {
+         char hex[2*MAX_STRING+1];
+         hex_key(trie_cursor_key(a), trie_cursor_key_len(a), hex);
+         CU_ASSERT_FATAL(trie_cursor_next(b));
+         CU_ASSERT_STRING_EQUAL(hex, trie_cursor_key(b));
+      }
+      CU_ASSERT_FALSE(trie_cursor_next(b));
+      for (unsigned int i=0; i<KEYS; i+=41)
+      {
+         char lo[2*MAX_STRING+1], hi[2*MAX_STRING+1];
+         unsigned int j = (i * 7) % KEYS;
+         hex_key(keys[i], lens[i], lo);
+         hex_key(keys[j], lens[j], hi);
+         CU_ASSERT_EQUAL(trie_count_range_n(t, keys[i], lens[i], keys[j], lens[j]), trie_count_range(shadow, lo, hi));
+         CU_ASSERT_FATAL(trie_cursor_seek_n(a, keys[i], lens[i]) && trie_cursor_seek(b, lo));
+         hex_key(trie_cursor_key(a), trie_cursor_key_len(a), hi);
+         CU_ASSERT_STRING_EQUAL(hi, trie_cursor_key(b));
+      }
+      trie_cursor_free(a);
+      trie_cursor_free(b);
+
+      // "q", "q\0" and "q\0b" are three keys to every one of them
+      const char * qs[] = { "q", "q\0", "q\0b" };
+      const char * hexqs[] = { "71", "7100", "710062" };
+      for (unsigned int i=0; i<3; ++i)
+      {
+         CU_ASSERT_TRUE(trie_insert_n(t, qs[i], i + 1, (void*) (uintptr_t) i, NULL));
+         trie_insert(shadow, hexqs[i], (void*) (uintptr_t) i, NULL);
+      }
+      a = trie_cursor_new(t);
+      CU_ASSERT_PTR_NOT_NULL_FATAL(a);
+      CU_ASSERT_TRUE(trie_cursor_seek_n(a, "q", 1));
+      for (unsigned int i=0; i<3; ++i)
+      {
+         CU_ASSERT_EQUAL(trie_cursor_key_len(a), i + 1);
+         CU_ASSERT(memcmp(trie_cursor_key(a), qs[i], i + 1) == 0);
+         CU_ASSERT(trie_get_value(t, trie_cursor_pos(a)) == (void*) (uintptr_t) i);
+         trie_cursor_next(a);
+      }
+      CU_ASSERT_TRUE(trie_cursor_seek_n(a, "q\0a", 3));
+      CU_ASSERT_EQUAL(trie_cursor_key_len(a), 3);
+      trie_cursor_free(a);
+
+      struct trie_match_t out[4];
+      size_t found = trie_complete_n(t, "q", 1, out, 4);
+      CU_ASSERT_EQUAL(found, 3);
+      for (size_t i=0; i<found; ++i)
+         CU_ASSERT((out[i].len == i + 1) && (memcmp(out[i].key, qs[i], i + 1) == 0));
+      trie_complete_free(out, found);
+      CU_ASSERT_EQUAL(trie_complete(t, "q", out, 4), 3);
+      trie_complete_free(out, 3);
+      if (loop != 7)
+      {
+         CU_ASSERT_TRUE(trie_set_score_n(t, "q\0b", 3, 2));
+         found = trie_topk_n(t, "q\0", 2, 4, out);
+         CU_ASSERT_EQUAL(found, 2);
+         CU_ASSERT((found > 0) && (out[0].len == 3) && (memcmp(out[0].key, "q\0b", 3) == 0));
+         trie_complete_free(out, found);
+      }
+
+      countfunc_value = 0;
+      CU_ASSERT(trie_walk_range_n(t, "q\0", 2, "q\0c", 3, hex_walker, shadow));
+      CU_ASSERT_EQUAL(countfunc_value, 2);
+      CU_ASSERT_EQUAL(trie_count_range_n(t, "q\0", 2, "q\0c", 3), 2);
+      CU_ASSERT_EQUAL(trie_count_range(t, "q", "r"), 3);
+      unsigned int all = 0;
+      CU_ASSERT(trie_walk_prefix(t, NULL, count_walker, &all));
+      CU_ASSERT_EQUAL(all, trie_size(t));
+
+      // a frozen trie holds C strings only
+      CU_ASSERT_PTR_NULL(trie_freeze(t));
+      trie_destroy(t, NULL);
+      trie_destroy(shadow, NULL);
+   }
+
+   // binary keys go through the log as they are
+   const char * logpath = "trie_test.log";
+   remove(logpath);
+   trie_t t = trie_new_flags(TRIE_KEEP_KEYS);
+   trie_log_t log = trie_log_open(t, logpath, 16);
+   CU_ASSERT_PTR_NOT_NULL_FATAL(log);
+   for (unsigned int i=0; i<KEYS; ++i)
+      trie_upsert_n(t, keys[i], lens[i], (void*) (uintptr_t) i, NULL, NULL);
+   for (unsigned int i=0; i<KEYS; i+=2)
+      trie_remove_n(t, keys[i], lens[i], NULL);
+   CU_ASSERT(trie_log_close(log));
+   trie_t r = trie_recover(NULL, logpath);
+   CU_ASSERT_PTR_NOT_NULL_FATAL(r);
+   CU_ASSERT_EQUAL(trie_size(r), trie_size(t));
+   for (unsigned int i=0; i<KEYS; ++i)
+   {
+      trie_pos_t pos = trie_find_n(r, keys[i], lens[i]);
+      CU_ASSERT_EQUAL(pos == TRIE_INVALID_POS, trie_find_n(t, keys[i], lens[i]) == TRIE_INVALID_POS);
+      if (pos != TRIE_INVALID_POS)
+         CU_ASSERT(trie_get_value(r, pos) == trie_get_value(t, trie_find_n(t, keys[i], lens[i])));
+   }
+   trie_destroy(r, NULL);
+   trie_destroy(t, NULL);
+   remove(logpath);
+
+   // and through a sharded trie, grouped by their first two bytes, 0-bytes included
+   trie_sharded_t sharded = trie_sharded_new(7);
+   trie_t shadow = trie_new();
+   CU_ASSERT_PTR_NOT_NULL_FATAL(sharded);
+   for (unsigned int i=0; i<KEYS; ++i)
+   {
+      char hex[2*MAX_STRING+1];
+      hex_key(keys[i], lens[i], hex);
+      CU_ASSERT_EQUAL(trie_sharded_insert_n(sharded, keys[i], lens[i], (void*) (uintptr_t) i),
+         trie_insert(shadow, hex, (void*) (uintptr_t) i, NULL));
+   }
+   for (unsigned int i=0; i<KEYS; i+=5)
+   {
+      char hex[2*MAX_STRING+1];
+      void * a = NULL, * b = NULL;
+      hex_key(keys[i], lens[i], hex);
+      CU_ASSERT_EQUAL(trie_sharded_remove_n(sharded, keys[i], lens[i], &a), trie_remove(shadow, hex, &b));
+      CU_ASSERT(a == b);
+   }
+   CU_ASSERT_EQUAL(trie_sharded_size(sharded), trie_size(shadow));
+   countfunc_value = 0;
+   CU_ASSERT(trie_sharded_walk_n(sharded, hex_walker, shadow));
+   CU_ASSERT_EQUAL(countfunc_value, trie_size(shadow));
+
+   unsigned int count = 0;
+   CU_ASSERT(trie_walk_prefix(shadow, "00", count_walker, &count));
+   countfunc_value = 0;
+   CU_ASSERT(trie_sharded_walk_prefix_n(sharded, "\0", 1, hex_walker, shadow));
+   CU_ASSERT_EQUAL(countfunc_value, count);
+   count = 0;
+   CU_ASSERT(trie_walk_range(shadow, "6100", "62", count_walker, &count));
+   countfunc_value = 0;
+   CU_ASSERT(trie_sharded_walk_range_n(sharded, "a\0", 2, "b", 1, hex_walker, shadow));
+   CU_ASSERT_EQUAL(countfunc_value, count);
+   CU_ASSERT_EQUAL(trie_sharded_count_range_n(sharded, "a\0", 2, "b", 1), count);
+
+   unsigned int kept = KEYS;
+   for (unsigned int i=0; i<KEYS; ++i)
+   {
+      char hex[2*MAX_STRING+1];
+      void * val = NULL;
+      hex_key(keys[i], lens[i], hex);
+      bool found = trie_sharded_find_n(sharded, keys[i], lens[i], &val);
+      CU_ASSERT_EQUAL(found, trie_find(shadow, hex) != TRIE_INVALID_POS);
+      if (found)
+      {
+         CU_ASSERT_FALSE(trie_sharded_upsert_n(sharded, keys[i], lens[i], val, &val));
+         kept = i;
+      }
+   }
+   CU_ASSERT_FATAL(kept < KEYS);
+   CU_ASSERT_TRUE(trie_sharded_set_score_n(sharded, keys[kept], lens[kept], 3));
+   struct trie_match_t out[2];
+   CU_ASSERT_EQUAL(trie_sharded_topk_n(sharded, keys[kept], lens[kept], 1, out), 1);
+   CU_ASSERT((out[0].len == lens[kept]) && (memcmp(out[0].key, keys[kept], lens[kept]) == 0));
+   trie_complete_free(out, 1);
+   CU_ASSERT_EQUAL(trie_sharded_complete_n(sharded, keys[kept], lens[kept], out, 1), 1);
+   CU_ASSERT((out[0].len == lens[kept]) && (memcmp(out[0].key, keys[kept], lens[kept]) == 0));
+   trie_complete_free(out, 1);
+   trie_sharded_destroy(sharded, NULL);
+   trie_destroy(shadow, NULL);
+
+   free(keys);
+   free(lens);
+}
+
 static void test_remove_fixed ()
 {
    trie_t t = trie_new();
@@ -444,7 +3343,7 @@ static void test_remove ()
       trie_t t = trie_new();
       CU_ASSERT_PTR_NOT_NULL(t);
 
-      char * test_strings[10];
+      char * test_strings[100];
       const unsigned int string_count =
          sizeof(test_strings)/sizeof(test_strings[0]);
 
@@ -563,8 +3462,33 @@ int main()
     || (NULL == CU_add_test(pSuite, "trie_insert", test_insert))
     || (NULL == CU_add_test(pSuite, "trie_find", test_find))
     || (NULL == CU_add_test(pSuite, "trie_size", test_size))
+    || (NULL == CU_add_test(pSuite, "trie_upsert", test_upsert))
     || (NULL == CU_add_test(pSuite, "trie_insert_random", test_insert_random))
+    || (NULL == CU_add_test(pSuite, "trie_arena", test_arena))
+    || (NULL == CU_add_test(pSuite, "trie_compact", test_compact))
     || (NULL == CU_add_test(pSuite, "trie_walk", test_walk))
+    || (NULL == CU_add_test(pSuite, "trie_keep_keys", test_keep_keys))
+    || (NULL == CU_add_test(pSuite, "trie_deep_keys", test_deep_keys))
+    || (NULL == CU_add_test(pSuite, "trie_cursor", test_cursor))
+    || (NULL == CU_add_test(pSuite, "trie_prefix", test_prefix))
+    || (NULL == CU_add_test(pSuite, "trie_topk", test_topk))
+    || (NULL == CU_add_test(pSuite, "trie_range", test_range))
+    || (NULL == CU_add_test(pSuite, "trie_build_sorted", test_build_sorted))
+    || (NULL == CU_add_test(pSuite, "trie_balanced", test_balanced))
+    || (NULL == CU_add_test(pSuite, "trie_dispatch", test_dispatch))
+    || (NULL == CU_add_test(pSuite, "trie_compress", test_compress))
+    || (NULL == CU_add_test(pSuite, "trie_freeze", test_freeze))
+    || (NULL == CU_add_test(pSuite, "trie_save", test_save))
+    || (NULL == CU_add_test(pSuite, "trie_log", test_log))
+    || (NULL == CU_add_test(pSuite, "trie_sharded", test_sharded))
+    || (NULL == CU_add_test(pSuite, "trie_epoch", test_epoch))
+    || (NULL == CU_add_test(pSuite, "trie_snapshot", test_snapshot))
+    || (NULL == CU_add_test(pSuite, "trie_build_parallel", test_build_parallel))
+    || (NULL == CU_add_test(pSuite, "trie_walk_parallel", test_walk_parallel))
+    || (NULL == CU_add_test(pSuite, "trie_find_batch", test_find_batch))
+    || (NULL == CU_add_test(pSuite, "trie_wide", test_wide))
+    || (NULL == CU_add_test(pSuite, "trie_burst", test_burst))
+    || (NULL == CU_add_test(pSuite, "trie_binary_keys", test_binary_keys))
     || (NULL == CU_add_test(pSuite, "trie_remove_fixed", test_remove_fixed))
     || (NULL == CU_add_test(pSuite, "trie_remove_sebtest", test_remove_sebtest))
     || (NULL == CU_add_test(pSuite, "trie_remove_sebtest_two", test_remove_sebtest_two))
@@ -0,0 +1,243 @@
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include "trie.h"
+#include "trie_int.h"
+
+#define TRIE_TOPK_MIN 64
+
+// One entry of the best-first queue: either a whole subtree, ranked by the
+// best score anywhere in it, or just the key ending at node, ranked by its own
+// score. prefix is the trie_prefix_t of the characters above node. A subtree
+// may also be a bucket of a burst trie, whose keys all score 0.
+struct trie_topk_item_t {
+    trie_score_t score;
+    trie_pos_t node;
+    uint32_t prefix;
+    bool own;
+};
+
+// The key characters above a queued node, as a chain of one node per level
+// (its character and fragment) shared by all the items below it. depth counts
+// the characters up to the end of node. Entry 0 is the empty prefix.
+struct trie_prefix_t {
+    uint32_t parent;
+    uint32_t depth;
+    trie_pos_t node;
+};
+
+// The search state: a binary max-heap of items plus the prefix chains
+struct trie_topk_t {
+    struct trie_topk_item_t *heap;
+    size_t size;
+    size_t cap;
+    struct trie_prefix_t *prefixes;
+    uint32_t used;
+    uint32_t pcap;
+    struct trie_bucket_key_t *keys;     // the keys of a bucket, as it is opened up
+    size_t kcap;
+};
+
+/* Helper function to order two queue items; a key wins a tie with a subtree
+   so results come out as soon as nothing can beat them */
+static bool trie_topk_before(const struct trie_topk_item_t *a, const struct trie_topk_item_t *b) {
+    if (a->score != b->score) { return a->score > b->score; }
+    return a->own && !b->own;
+}
+
+/* Helper function to queue a subtree (or the key of a node, with own set) */
+static bool trie_topk_push(struct trie_topk_t *q, trie_pos_t node, uint32_t prefix, bool own) {
+    if (node == NULL) { return true; }
+
+    if (q->size == q->cap) {
+        size_t cap = (q->cap == 0 ? TRIE_TOPK_MIN : q->cap * 2);
+        struct trie_topk_item_t *heap = (struct trie_topk_item_t *)realloc(q->heap, cap * sizeof(struct trie_topk_item_t));
+        if (heap == NULL) { return false; }
+        q->heap = heap;
+        q->cap = cap;
+    }
+
+    trie_score_t score = (TRIE_TAGGED(node) ? 0 : (own ? node->score : node->maxscore));
+    struct trie_topk_item_t item = { score, node, prefix, own };
+    size_t i = q->size++;
+    while (i > 0) {
+        size_t up = (i - 1) / 2;
+        if (!trie_topk_before(&item, &q->heap[up])) { break; }
+        q->heap[i] = q->heap[up];
+        i = up;
+    }
+    q->heap[i] = item;
+    return true;
+}
+
+/* Helper function to take the best item off the queue */
+static struct trie_topk_item_t trie_topk_pop(struct trie_topk_t *q) {
+    struct trie_topk_item_t top = q->heap[0];
+    struct trie_topk_item_t last = q->heap[--q->size];
+
+    size_t i = 0;
+    while (true) {
+        size_t child = 2 * i + 1;
+        if (child >= q->size) { break; }
+        if ((child + 1 < q->size) && trie_topk_before(&q->heap[child+1], &q->heap[child])) { ++child; }
+        if (!trie_topk_before(&q->heap[child], &last)) { break; }
+        q->heap[i] = q->heap[child];
+        i = child;
+    }
+    if (q->size > 0) { q->heap[i] = last; }
+    return top;
+}
+
+/* Helper function to extend a prefix chain by the characters of one node. Returns
+   the new entry, or 0 when out of memory (the empty prefix never needs adding) */
+static uint32_t trie_topk_prefix(struct trie_topk_t *q, uint32_t parent, trie_pos_t node) {
+    if (q->used == q->pcap) {
+        uint32_t cap = q->pcap * 2;
+        struct trie_prefix_t *prefixes = (struct trie_prefix_t *)realloc(q->prefixes, cap * sizeof(struct trie_prefix_t));
+        if (prefixes == NULL) { return 0; }
+        q->prefixes = prefixes;
+        q->pcap = cap;
+    }
+
+    q->prefixes[q->used].parent = parent;
+    q->prefixes[q->used].depth = q->prefixes[parent].depth + 1 + trie_fraglen(node);
+    q->prefixes[q->used].node = node;
+    return q->used++;
+}
+
+/* Helper function to copy the character and fragment of a node into key, ending at end */
+static void trie_topk_spell(char *key, size_t end, trie_pos_t node) {
+    size_t at = end - 1 - trie_fraglen(node);
+    key[at] = (char)node->key;
+    if (node->frag != NULL) { memcpy(key + at + 1, node->frag->bytes, node->frag->len); }
+}
+
+/* Helper function to spell out a key: the characters of a prefix chain, then those
+   of last (when not NULL), then the len bytes at tail */
+static char *trie_topk_key(const struct trie_topk_t *q, uint32_t prefix, trie_pos_t last, const char *tail, size_t len) {
+    size_t depth = q->prefixes[prefix].depth + (last == NULL ? 0 : 1 + trie_fraglen(last));
+    char *key = (char *)malloc(depth + len + 1);
+    if (key == NULL) { return NULL; }
+
+    if (last != NULL) { trie_topk_spell(key, depth, last); }
+    if (len > 0) { memcpy(key + depth, tail, len); }
+    key[depth + len] = '\0';
+    for (; prefix != 0; prefix = q->prefixes[prefix].parent) {
+        trie_topk_spell(key, q->prefixes[prefix].depth, q->prefixes[prefix].node);
+    }
+    return key;
+}
+
+/* Helper function to store the keys of a bucket under a prefix chain that start with the
+   len bytes at rest in out[*count..k). They all score 0, so once a bucket is reached
+   nothing left can beat them and they go in any order. False when out of memory */
+static bool trie_topk_bucket(struct trie_topk_t *q, uint32_t prefix, trie_pos_t bucket, const char *rest,
+        size_t len, struct trie_match_t *out, size_t *count, size_t k) {
+    size_t n = trie_bucket_keys(bucket, &q->keys, &q->kcap);
+    if (n == (size_t)-1) { return false; }
+
+    for (size_t i = trie_bucket_lower(q->keys, n, rest, len); (i < n) && ((*count) < k); ++i) {
+        const struct trie_bucket_key_t *bk = &q->keys[i];
+        if ((bk->len < len) || (memcmp(bk->suffix, rest, len) != 0)) { break; }
+
+        char *key = trie_topk_key(q, prefix, NULL, bk->suffix, bk->len);
+        if (key == NULL) { return false; }
+        out[*count].pos = bk->pos;
+        out[*count].len = q->prefixes[prefix].depth + bk->len;
+        out[(*count)++].key = key;
+    }
+    return true;
+}
+
+/// Return the k highest-scoring keys starting with prefix
+size_t trie_topk (trie_t trie, const char * prefix, size_t k, struct trie_match_t * out) {
+    return trie_topk_n(trie, prefix, (prefix == NULL ? 0 : strlen(prefix)), k, out);
+}
+
+/// Return the k highest-scoring keys starting with the len bytes at prefix
+size_t trie_topk_n (trie_t trie, const char * prefix, size_t len, size_t k, struct trie_match_t * out) {
+    if ((k == 0) || (trie->compact != NULL)) { return 0; }
+
+    struct trie_topk_t q = { NULL, 0, 0, NULL, 1, TRIE_TOPK_MIN, NULL, 0 };
+    q.prefixes = (struct trie_prefix_t *)malloc(q.pcap * sizeof(struct trie_prefix_t));
+    if (q.prefixes == NULL) { return 0; }
+    q.prefixes[0].parent = 0;
+    q.prefixes[0].depth = 0;
+    q.prefixes[0].node = NULL;
+
+    // go down to the node of the last prefix character, like trie_find does
+    bool ok = true;
+    size_t count = 0;
+    if (len == 0) {
+        ok = trie_topk_push(&q, trie->start, 0, false);
+    } else {
+        // fragments may hold 0-bytes (see trie_insert_n), so prefix is compared by length
+        const char *last = prefix + len - 1;
+        uint32_t chain = 0;
+        trie_pos_t head = trie->start;
+        while (head != NULL) {
+            if (TRIE_TAGGED(head)) {
+                // the prefix ends in a bucket: its matches are the keys there that start
+                // with the rest of it
+                ok = trie_topk_bucket(&q, chain, head, prefix, (size_t)(last - prefix) + 1, out, &count, k);
+                break;
+            }
+            if ((unsigned char)*prefix < head->key) {
+                head = head->left;
+            } else if ((unsigned char)*prefix > head->key) {
+                head = head->right;
+            } else {
+                size_t left = (size_t)(last - prefix), fraglen = trie_fraglen(head);
+                size_t common = (fraglen == 0 ? 0 : trie_frag_common(head->frag->bytes, (fraglen < left ? fraglen : left), prefix + 1));
+                if (common == left) {
+                    // the prefix itself (or a key it starts), then whatever continues it
+                    ok = (!head->terminal || trie_topk_push(&q, head, chain, true));
+                    if (ok && (head->mid != NULL)) {
+                        chain = trie_topk_prefix(&q, chain, head);
+                        ok = (chain != 0) && trie_topk_push(&q, head->mid, chain, false);
+                    }
+                    break;
+                }
+                if (common < fraglen) { break; }     // the prefix leaves the fragment
+
+                chain = trie_topk_prefix(&q, chain, head);
+                if (chain == 0) { ok = false; break; }
+                prefix += 1 + fraglen;
+                head = head->mid;
+            }
+        }
+    }
+
+    // best first: a subtree is only opened up while it may still beat what is left
+    while (ok && (count < k) && (q.size > 0)) {
+        struct trie_topk_item_t item = trie_topk_pop(&q);
+        trie_pos_t node = item.node;
+
+        if (TRIE_TAGGED(node)) {
+            ok = trie_topk_bucket(&q, item.prefix, node, "", 0, out, &count, k);
+            continue;
+        }
+        if (item.own) {
+            char *key = trie_topk_key(&q, item.prefix, node, NULL, 0);
+            if (key == NULL) { break; }
+            out[count].pos = node;
+            out[count].len = q.prefixes[item.prefix].depth + 1 + trie_fraglen(node);
+            out[count++].key = key;
+            continue;
+        }
+
+        ok = trie_topk_push(&q, node->left, item.prefix, false)
+            && trie_topk_push(&q, node->right, item.prefix, false)
+            && (!node->terminal || trie_topk_push(&q, node, item.prefix, true));
+        if (ok && (node->mid != NULL)) {
+            uint32_t chain = trie_topk_prefix(&q, item.prefix, node);
+            ok = (chain != 0) && trie_topk_push(&q, node->mid, chain, false);
+        }
+    }
+
+    free(q.heap);
+    free(q.prefixes);
+    free(q.keys);
+    return count;
+}
@@ -0,0 +1,258 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <string.h>
+#include "trie.h"
+#include "trie_int.h"
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#include <immintrin.h>
+#define TRIE_WIDE_X86 1
+#endif
+
+// Wide nodes for TRIE_WIDE, after the Node16/Node32 of adaptive radix trees. A
+// character level of TRIE_WIDE_MIN to TRIE_WIDE_MAX nodes gets an index next to its
+// BST: the characters of the level, sorted, in one 32-byte block, and the nodes
+// holding them in the same order. A lookup entering the level compares its character
+// with the whole block at once (one AVX2 compare, or two SSE2 ones when the CPU has
+// no AVX2; a plain loop off x86) and goes straight to the node, instead of hopping
+// down the BST one cache miss at a time. Everything else (walks, cursors, inserts of
+// new characters, removes) still goes through the BST, which stays the real thing:
+// the index only has to follow which nodes a level holds, and since nodes never
+// move once allocated, rotations and successor splices do not change it.
+//
+// The index of the level below a node hangs off the node as a 32-bit number into a
+// table, in the four bytes a node had to spare; the top level's is in the table
+// header. A level grows from 16 slots to 32 and shrinks back with some slack, and
+// loses its index when it drops under TRIE_WIDE_DROP nodes, so that a level going
+// back and forth across one size does not reallocate every time. A level too big
+// for 32 slots is marked full, so that inserts into it do not count it again.
+
+#define TRIE_WIDE_MIN 4             // nodes a level needs to get an index
+#define TRIE_WIDE_DROP 3            // under this many it loses it
+#define TRIE_WIDE_SMALL 16
+#define TRIE_WIDE_MAX 32
+#define TRIE_WIDE_SHRINK 12         // a 32-slot index shrinks back once this small
+#define TRIE_WIDE_FULL UINT32_MAX   // in a node: too many nodes below for an index
+
+// One wide node: the sorted characters of a level (slots past count are unused) and
+// the nodes holding them, cap of them
+struct trie_wide_t {
+    _Alignas(32) unsigned char keys[TRIE_WIDE_MAX];
+    unsigned char count;
+    unsigned char cap;
+    trie_pos_t nodes[];
+};
+
+// Every wide node of a trie, by number; a number given back is handed out again
+struct trie_wides_t {
+    struct trie_wide_t **table;     // entry n-1 for number n
+    uint32_t used;
+    uint32_t cap;
+    uint32_t *spare;                // numbers given back
+    uint32_t nspare;
+    uint32_t top;                   // the top level's, as in a node
+    bool avx2;
+};
+
+struct trie_wides_t *trie_wides_new(void) {
+    struct trie_wides_t *w = (struct trie_wides_t *)calloc(1, sizeof(struct trie_wides_t));
+    if (w == NULL) { return NULL; }
+
+#ifdef TRIE_WIDE_X86
+    __builtin_cpu_init();
+    w->avx2 = __builtin_cpu_supports("avx2");
+#endif
+    return w;
+}
+
+void trie_wides_free(struct trie_wides_t *w) {
+    for (uint32_t i = 0; i < w->used; ++i) { free(w->table[i]); }
+    free(w->table);
+    free(w->spare);
+    free(w);
+}
+
+/* Helper function to get at the number of the index over the level below owner */
+static uint32_t *trie_wide_slot(trie_t trie, trie_pos_t owner) {
+    return (owner == NULL ? &trie->wides->top : &owner->wide);
+}
+
+#ifdef TRIE_WIDE_X86
+__attribute__((target("avx2")))
+static unsigned int trie_wide_match_avx2(const struct trie_wide_t *wide, unsigned char c) {
+    __m256i keys = _mm256_load_si256((const __m256i *)wide->keys);
+    return (unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(keys, _mm256_set1_epi8((char)c)));
+}
+
+static unsigned int trie_wide_match_sse2(const struct trie_wide_t *wide, unsigned char c) {
+    __m128i needle = _mm_set1_epi8((char)c);
+    unsigned int mask = (unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_load_si128((const __m128i *)wide->keys), needle));
+    if (wide->count > 16) {
+        mask |= (unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_load_si128((const __m128i *)(wide->keys + 16)), needle)) << 16;
+    }
+    return mask;
+}
+#endif
+
+/* Helper function to find the slot of c in a wide node; count when it is not there */
+static unsigned int trie_wide_search(const struct trie_wides_t *w, const struct trie_wide_t *wide, unsigned char c) {
+#ifdef TRIE_WIDE_X86
+    unsigned int mask = (w->avx2 ? trie_wide_match_avx2(wide, c) : trie_wide_match_sse2(wide, c));
+    mask &= (wide->count == 32 ? ~0u : (1u << wide->count) - 1);
+    return (mask == 0 ? wide->count : (unsigned int)__builtin_ctz(mask));
+#else
+    unsigned int i = 0;
+    while ((i < wide->count) && (wide->keys[i] < c)) { ++i; }
+    return ((i < wide->count) && (wide->keys[i] == c) ? i : wide->count);
+#endif
+}
+
+trie_pos_t trie_wide_level(const trie_t trie, trie_pos_t owner, unsigned char c) {
+    struct trie_wides_t *w = trie->wides;
+    uint32_t number = (owner == NULL ? w->top : owner->wide);
+    if ((number == 0) || (number == TRIE_WIDE_FULL)) { return (owner == NULL ? trie->start : owner->mid); }
+
+    const struct trie_wide_t *wide = w->table[number - 1];
+    unsigned int i = trie_wide_search(w, wide, c);
+    return (i < wide->count ? wide->nodes[i] : NULL);
+}
+
+/* Helper function to collect up to limit nodes of the level rooted at level, in no
+   particular order. Returns how many it found */
+static size_t trie_wide_gather(trie_pos_t level, trie_pos_t *nodes, size_t limit) {
+    trie_pos_t stack[TRIE_WIDE_MAX + 3];
+    size_t top = 0, count = 0;
+
+    if (level != NULL) { stack[top++] = level; }
+    while ((top > 0) && (count < limit)) {
+        trie_pos_t node = stack[--top];
+        nodes[count++] = node;
+        if (node->left != NULL) { stack[top++] = node->left; }
+        if (node->right != NULL) { stack[top++] = node->right; }
+    }
+    return count;
+}
+
+/* Helper function to let go of the index in *slot, leaving it set to number */
+static void trie_wide_drop(struct trie_wides_t *w, uint32_t *slot, uint32_t number) {
+    uint32_t old = (*slot);
+    (*slot) = number;
+    if ((old == 0) || (old == TRIE_WIDE_FULL)) { return; }
+
+    free(w->table[old - 1]);
+    w->table[old - 1] = NULL;
+    w->spare[w->nspare++] = old;    // spare has room for every number handed out
+}
+
+/* Helper function to give a level of count nodes (count <= TRIE_WIDE_MAX) a fresh
+   index in *slot; without memory for it the level simply has none */
+static void trie_wide_build(struct trie_wides_t *w, uint32_t *slot, trie_pos_t *nodes, size_t count) {
+    uint32_t number = 0;
+    if (w->nspare > 0) {
+        number = w->spare[--w->nspare];
+    } else {
+        if (w->used == w->cap) {
+            uint32_t cap = (w->cap == 0 ? 64 : w->cap * 2);
+            struct trie_wide_t **table = (struct trie_wide_t **)realloc(w->table, cap * sizeof(struct trie_wide_t *));
+            if (table == NULL) { return; }
+            w->table = table;
+            uint32_t *spare = (uint32_t *)realloc(w->spare, cap * sizeof(uint32_t));
+            if (spare == NULL) { return; }
+            w->spare = spare;
+            w->cap = cap;
+        }
+        w->table[w->used] = NULL;
+        number = ++w->used;
+    }
+
+    unsigned char cap = (count > TRIE_WIDE_SMALL ? TRIE_WIDE_MAX : TRIE_WIDE_SMALL);
+    struct trie_wide_t *wide = (struct trie_wide_t *)aligned_alloc(32,
+        (offsetof(struct trie_wide_t, nodes) + cap * sizeof(trie_pos_t) + 31) / 32 * 32);
+    if (wide == NULL) { w->spare[w->nspare++] = number; return; }
+
+    // insertion sort: a level is at most TRIE_WIDE_MAX nodes here
+    memset(wide->keys, 0, sizeof(wide->keys));
+    for (size_t i = 0; i < count; ++i) {
+        size_t j = i;
+        while ((j > 0) && (wide->keys[j-1] > nodes[i]->key)) {
+            wide->keys[j] = wide->keys[j-1];
+            wide->nodes[j] = wide->nodes[j-1];
+            --j;
+        }
+        wide->keys[j] = nodes[i]->key;
+        wide->nodes[j] = nodes[i];
+    }
+    wide->count = (unsigned char)count;
+    wide->cap = cap;
+
+    w->table[number - 1] = wide;
+    (*slot) = number;
+}
+
+/* Helper function to index the level below owner afresh, as it is in its BST */
+static void trie_wide_rescan(trie_t trie, trie_pos_t owner, uint32_t *slot) {
+    trie_pos_t nodes[TRIE_WIDE_MAX + 1];
+    size_t count = trie_wide_gather(owner == NULL ? trie->start : owner->mid, nodes, TRIE_WIDE_MAX + 1);
+
+    if (count > TRIE_WIDE_MAX) {
+        trie_wide_drop(trie->wides, slot, TRIE_WIDE_FULL);
+    } else if (count >= TRIE_WIDE_MIN) {
+        trie_wide_drop(trie->wides, slot, 0);
+        trie_wide_build(trie->wides, slot, nodes, count);
+    } else {
+        trie_wide_drop(trie->wides, slot, 0);
+    }
+}
+
+void trie_wide_add(trie_t trie, trie_pos_t owner, trie_pos_t node) {
+    struct trie_wides_t *w = trie->wides;
+    uint32_t *slot = trie_wide_slot(trie, owner);
+    if ((*slot) == TRIE_WIDE_FULL) { return; }
+    if ((*slot) == 0) {
+        // only worth a look once there may be enough of them
+        trie_pos_t nodes[TRIE_WIDE_MIN];
+        if (trie_wide_gather(owner == NULL ? trie->start : owner->mid, nodes, TRIE_WIDE_MIN) == TRIE_WIDE_MIN) {
+            trie_wide_rescan(trie, owner, slot);
+        }
+        return;
+    }
+
+    struct trie_wide_t *wide = w->table[(*slot) - 1];
+    if (wide->count == TRIE_WIDE_MAX) { trie_wide_drop(w, slot, TRIE_WIDE_FULL); return; }
+    if (wide->count == wide->cap) { trie_wide_rescan(trie, owner, slot); return; }    // grows to 32
+
+    size_t i = wide->count;
+    while ((i > 0) && (wide->keys[i-1] > node->key)) {
+        wide->keys[i] = wide->keys[i-1];
+        wide->nodes[i] = wide->nodes[i-1];
+        --i;
+    }
+    wide->keys[i] = node->key;
+    wide->nodes[i] = node;
+    ++wide->count;
+}
+
+void trie_wide_del(trie_t trie, trie_pos_t owner, unsigned char c) {
+    struct trie_wides_t *w = trie->wides;
+    uint32_t *slot = trie_wide_slot(trie, owner);
+    if ((*slot) == 0) { return; }
+    if ((*slot) == TRIE_WIDE_FULL) { trie_wide_rescan(trie, owner, slot); return; }
+
+    struct trie_wide_t *wide = w->table[(*slot) - 1];
+    unsigned int i = trie_wide_search(w, wide, c);
+    if (i == wide->count) { return; }
+
+    --wide->count;
+    memmove(wide->keys + i, wide->keys + i + 1, wide->count - i);
+    memmove(wide->nodes + i, wide->nodes + i + 1, (wide->count - i) * sizeof(trie_pos_t));
+    wide->keys[wide->count] = 0;
+
+    if (wide->count < TRIE_WIDE_DROP) {
+        trie_wide_drop(w, slot, 0);
+    } else if ((wide->cap == TRIE_WIDE_MAX) && (wide->count <= TRIE_WIDE_SHRINK)) {
+        trie_wide_rescan(trie, owner, slot);
+    }
+}